@@ -241,6 +241,7 @@ class Bank():
                     print(f'{cli} sent {msg}', file=sys.stderr, flush=True)
                     netloc = urlparse(json.loads(msg)['url']).netloc
                     try:
+                        netloc = self.match_site(netloc)
                         username, password = self.get_credentials(netloc)
                     except Exception as e:
                         print(
@@ -360,6 +361,12 @@ class Bank():
 
         server_changes = defaultdict(lambda: (None, -1),
                                      check_resp.json()['updates'])
+        # Changes the vault has since the last contact that cur_changes does
+        # not hold, such as adds, updates and deletions made before a restart
+        for site, change in self.local_changes(
+                self._vault.get_last_contact_time()).items():
+            if change[1] > self.cur_changes[site][1]:
+                self.cur_changes[site] = change
         server_updates = {}
         local_updates = {}
 
@@ -374,16 +381,16 @@ class Bank():
             else:
                 server_updates[key] = self.cur_changes[key]
 
-        for site, (new_creds, _time) in local_updates.items():
-            try:
-                self.vault_lock.acquire()
-                self._vault.delete_value(site)
-            except:
-                pass
-            if new_creds != None:
-                self._vault.add_encrypted_value(0, site, b64decode(new_creds),
-                                                _time)
-            self.vault_lock.release()
+        with self.vault_lock, self._vault.transaction():
+            for site, (new_creds, _time) in local_updates.items():
+                try:
+                    self._vault.delete_value(site, _time)
+                except:
+                    pass
+                if new_creds != None:
+                    self._vault.add_encrypted_value(0, site,
+                                                    b64decode(new_creds),
+                                                    _time)
 
         for site in server_updates.keys():
             value, time = server_updates[site]
@@ -556,7 +563,7 @@ class Bank():
         cur_time = get_time()
         try:
             self.vault_lock.acquire()
-            self._vault.delete_value(website)
+            self._vault.delete_value(website, cur_time)
         except Exception as e:
             self.vault_lock.release()
             print(f'delete_credential Error "{e}" of type {type(e)}',
@@ -584,6 +591,29 @@ class Bank():
             return Bank.decode_credentials(data)
         return (None, None)
 
+    # Returns {site: (encrypted value or None if deleted, time)} for the
+    # sites changed in the vault at or after since
+    def local_changes(self, since):
+        changes = {}
+        with self.vault_lock:
+            for site, m_time, _, deleted in self._vault.keys_modified_since(
+                    since):
+                if deleted:
+                    changes[site] = (None, m_time)
+                else:
+                    changes[site] = (self._vault.get_encrypted_value(site)[1],
+                                     m_time)
+        return changes
+
+    # Returns the key holding the credentials for a site, which may be saved
+    # under a parent domain of it
+    def match_site(self, website):
+        self.vault_lock.acquire()
+        try:
+            return self._vault.match_domain(website)
+        finally:
+            self.vault_lock.release()
+
     def get_keys(self):
         self.vault_lock.acquire()
         v_keys = self._vault.get_vault_keys()
@@ -0,0 +1,166 @@
+/**
+   bench_map.c - Microbenchmark for the vault key map
+
+   Built with `make bench` from the application directory, and run as
+
+   ./testing/bench_map
+
+   The benchmark includes vault_map.c directly so it is built with the same
+   optimizations as the benchmark. For each size from 100 to a million keys,
+   a map is filled from empty with add_entry, each key is looked up with
+   get_info, as many absent keys are looked up, and all keys are then removed
+   with delete_entry. The map is then filled again, each key is found as a
+   prefix through the ordered index, which the first find builds outside of
+   the timing, and the map is freed with delete_map, as closing a vault does.
+   Times are the fastest of BENCH_RUNS, per key, and the memory taken by the
+   full map, before the index is built, is also given per key.
+ */
+#include "../vault_map.c"
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_RUNS 3
+#define MAX_KEYS 1000000
+#define BENCH_OPS 6
+
+double bench_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+   function bench_fill
+
+   Adds the first count keys to the map.
+
+   Returns zero, or one if a key could not be added
+ */
+int bench_fill(struct vault_map* map, char (*keys)[32], uint32_t count) {
+  for (uint32_t i = 0; i < count; ++i) {
+    struct key_info info = {0, i, 1};
+    if (add_entry(map, keys[i], &info)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+   function bench_map
+
+   Times each operation on a map of count keys, taken from keys, and stores
+   the fastest per key times in times, in the order of the columns printed.
+   The bytes per key taken by the full map are stored in memory.
+
+   Returns zero, or one if the map did not behave as expected
+ */
+int bench_map(char (*keys)[32], char (*absent)[32], uint32_t count,
+              double* times, double* memory) {
+  for (int i = 0; i < BENCH_OPS; ++i) {
+    times[i] = -1;
+  }
+  for (int run = 0; run < BENCH_RUNS; ++run) {
+    struct vault_map* map = init_map(0);
+    if (map == NULL) {
+      return 1;
+    }
+
+    double start = bench_now();
+    if (bench_fill(map, keys, count)) {
+      return 1;
+    }
+    double added = bench_now();
+    for (uint32_t i = 0; i < count; ++i) {
+      const struct key_info* info = get_info(map, keys[i]);
+      if (info == NULL || info->inode_loc != i) {
+        return 1;
+      }
+    }
+    double hits = bench_now();
+    for (uint32_t i = 0; i < count; ++i) {
+      if (get_info(map, absent[i]) != NULL) {
+        return 1;
+      }
+    }
+    double misses = bench_now();
+
+    size_t bytes = sizeof(struct vault_map) + map->size * sizeof(struct bucket);
+    for (struct chunk* chunk = map->chunks; chunk; chunk = chunk->next) {
+      bytes += chunk->size;
+    }
+    *memory = (double)bytes / count;
+
+    for (uint32_t i = 0; i < count; ++i) {
+      delete_entry(map, keys[i]);
+    }
+    double deleted = bench_now();
+    if (num_keys(map) != 0 || bench_fill(map, keys, count)) {
+      return 1;
+    }
+    uint32_t first;
+    uint32_t found;
+    if (find_prefix(map, keys[0], &first, &found)) {
+      return 1;
+    }
+    double refilled = bench_now();
+    for (uint32_t i = 0; i < count; ++i) {
+      if (find_prefix(map, keys[i], &first, &found) || found != 1 ||
+          strcmp(ordered_key(map, first, ORDER_KEY, NULL), keys[i])) {
+        return 1;
+      }
+    }
+    double prefixes = bench_now();
+    delete_map(map);
+    double freed = bench_now();
+
+    double taken[BENCH_OPS] = {added - start, hits - added, misses - hits,
+                               deleted - misses, prefixes - refilled,
+                               freed - prefixes};
+    for (int i = 0; i < BENCH_OPS; ++i) {
+      taken[i] /= count;
+      times[i] = times[i] < 0 || taken[i] < times[i] ? taken[i] : times[i];
+    }
+  }
+  return 0;
+}
+
+int main() {
+  if (sodium_init() < 0) {
+    fputs("Could not initialize libsodium\n", stderr);
+    return 1;
+  }
+
+  char(*keys)[32] = malloc(sizeof(*keys) * MAX_KEYS);
+  char(*absent)[32] = malloc(sizeof(*absent) * MAX_KEYS);
+  if (keys == NULL || absent == NULL) {
+    fputs("Could not allocate the keys\n", stderr);
+    return 1;
+  }
+  for (uint32_t i = 0; i < MAX_KEYS; ++i) {
+    snprintf(keys[i], sizeof(*keys), "https://site%u.example.com", i);
+    snprintf(absent[i], sizeof(*absent), "https://other%u.example.com", i);
+  }
+
+  printf("%8s %13s %13s %13s %13s %13s %13s %10s\n", "keys", "add_entry",
+         "get_info hit", "get_info miss", "delete_entry", "find_prefix",
+         "delete_map", "bytes/key");
+  for (uint32_t count = 100; count <= MAX_KEYS; count *= 10) {
+    double times[BENCH_OPS];
+    double memory;
+    if (bench_map(keys, absent, count, times, &memory)) {
+      fputs("The map lost or mixed up keys\n", stderr);
+      return 1;
+    }
+    printf("%8u", count);
+    for (int i = 0; i < BENCH_OPS; ++i) {
+      printf(" %10.1f ns", times[i] * 1e9);
+    }
+    printf(" %10.1f\n", memory);
+  }
+
+  free(keys);
+  free(absent);
+  return 0;
+}
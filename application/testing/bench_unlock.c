@@ -0,0 +1,155 @@
+/**
+   bench_unlock.c - Benchmark for unlocking vaults as their loc field grows
+
+   Built with `make bench` from the application directory, and run as
+
+   ./testing/bench_unlock
+
+   The benchmark includes vault.c directly, after wrapping the file reads it
+   makes in macros that count them, so that it can time the steps of
+   open_vault that follow the password key derivation, which takes the same
+   time whatever the size of the vault. For each number of keys a vault is
+   filled in a transaction and closed, leaving a key map snapshot, and opened
+   once. The file is then verified, the key map built from the loc field and
+   the key map loaded from the snapshot, each the fastest of BENCH_RUNS. The
+   reads building the key map takes with pread are also counted, which stay
+   the same as the loc field grows since it is read in one go.
+ */
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static int reads = 0;
+
+#define read(...) (reads++, read(__VA_ARGS__))
+#define pread(...) (reads++, pread(__VA_ARGS__))
+
+#include "../vault.c"
+
+#include <time.h>
+
+#define BENCH_RUNS 5
+#define BENCH_STEPS 3
+#define MAX_KEYS 102400
+
+double bench_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+   function bench_steps
+
+   Times the fastest of BENCH_RUNS of each step of unlocking the open vault,
+   verifying it, building its key map from the loc field and loading the key
+   map from the snapshot, storing them in times in that order. The vault is
+   expected to have been made readable and writable by the caller.
+
+   Returns zero, or one if any step failed
+ */
+int bench_steps(struct vault_info* info, double* times) {
+  for (int i = 0; i < BENCH_STEPS; ++i) {
+    times[i] = -1;
+  }
+  for (int run = 0; run < BENCH_RUNS; ++run) {
+    double taken[BENCH_STEPS];
+    for (int step = 1; step < BENCH_STEPS; ++step) {
+      delete_map(info->key_info);
+      info->key_info = NULL;
+      internal_tree_free(info);
+
+      double start = bench_now();
+      if (internal_verify_file(info)) {
+        return 1;
+      }
+      double verified = bench_now();
+      int result = step == 1 ? internal_create_key_map(info)
+                             : internal_load_snapshot(info);
+      if (result) {
+        return 1;
+      }
+      taken[0] = verified - start;
+      taken[step] = bench_now() - verified;
+    }
+    for (int i = 0; i < BENCH_STEPS; ++i) {
+      times[i] = times[i] < 0 || taken[i] < times[i] ? taken[i] : times[i];
+    }
+  }
+  return 0;
+}
+
+/**
+   function bench_reads
+
+   Counts the reads building the key map of the open vault from the loc field
+   makes when reading with pread. The vault is expected to have been made
+   readable and writable by the caller.
+
+   Returns the number of reads, or a negative number if the build failed
+ */
+int bench_reads(struct vault_info* info) {
+  uint64_t map_len = info->data_end + internal_tree_size(info) + HASH_SIZE;
+  info->read_mode = READ_PREAD;
+  internal_unmap_file(info);
+  delete_map(info->key_info);
+  reads = 0;
+  int result = internal_create_key_map(info);
+  int made = reads;
+  info->read_mode = READ_MMAP;
+  internal_map_file(info, map_len);
+  return result ? -1 : made;
+}
+
+int main() {
+  char directory[] = "/tmp/bench_unlockXXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    fputs("Could not make a temporary directory\n", stderr);
+    return 1;
+  }
+
+  printf("%8s %8s %12s %12s %12s %12s\n", "keys", "slots", "verify",
+         "build map", "load map", "build reads");
+  char key[32];
+  char pathname[64];
+  for (uint32_t count = 100; count <= MAX_KEYS; count *= 4) {
+    struct vault_info* info = init_vault();
+    int failed = info == NULL ||
+                 create_vault(directory, "unlock", "password", info) ||
+                 vault_begin(info);
+    for (uint32_t i = 0; i < count && !failed; ++i) {
+      snprintf(key, sizeof(key), "https://site%u.example.com", i);
+      failed = add_key(info, 1, key, "value", i, 5);
+    }
+    failed = failed || vault_commit(info) || close_vault(info) ||
+             open_vault(directory, "unlock", "password", info);
+    if (failed) {
+      fputs("Could not fill the vault\n", stderr);
+      return 1;
+    }
+
+    sodium_mprotect_readwrite(info);
+    double times[BENCH_STEPS];
+    int made = bench_reads(info);
+    if (made < 0 || bench_steps(info, times) ||
+        num_keys(info->key_info) != count) {
+      fputs("The vault did not unlock\n", stderr);
+      return 1;
+    }
+    printf("%8u %8u", count, info->loc_len);
+    for (int i = 0; i < BENCH_STEPS; ++i) {
+      printf(" %9.3f ms", times[i] * 1e3);
+    }
+    printf(" %12d\n", made);
+    sodium_mprotect_noaccess(info);
+
+    close_vault(info);
+    release_vault(info);
+    snprintf(pathname, sizeof(pathname), "%s/unlock.vault", directory);
+    unlink(pathname);
+  }
+
+  rmdir(directory);
+  return 0;
+}
@@ -0,0 +1,119 @@
+/**
+   bench_vault.c - Benchmarks for the vault library
+
+   Built with `make bench` from the application directory, and run as
+
+   ./testing/bench_vault [megabytes]
+
+   The benchmark includes vault.c directly so that it can time the internal
+   functions on their own, without the password key derivation that dominates
+   the public calls. A vault of about the given size (32 MB by default) is
+   built in a temporary directory and then verified the way open_vault does
+   it, with each integrity and verify mode, as the number of workers grows.
+   Speedups are against a single worker.
+
+   Serial Merkle vaults only check the tree, header and loc field at open,
+   with the rest deferred to reads, so that line shows the lazy cost instead.
+ */
+#include "../vault.c"
+
+#include <time.h>
+
+#define BENCH_RUNS 5
+
+double bench_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+   function bench_verify
+
+   Times the fastest of BENCH_RUNS verifications of the open vault with the
+   given verify mode and number of workers. The vault is expected to have
+   been made readable and writable by the caller.
+
+   Returns the time taken in seconds, or a negative number if the vault did
+   not verify
+ */
+double bench_verify(struct vault_info* info, uint8_t verify, uint32_t workers) {
+  double best = -1;
+  uint8_t mode_byte;
+  info->workers = workers;
+  for (int run = 0; run < BENCH_RUNS; ++run) {
+    if (pwrite(info->user_fd, &verify, 1, 3) != 1) {
+      return -1;
+    }
+    internal_seal_file(info);
+    internal_tree_free(info);
+
+    double start = bench_now();
+    if (internal_verify_file(info)) {
+      return -1;
+    }
+    double taken = bench_now() - start;
+    best = best < 0 || taken < best ? taken : best;
+  }
+
+  if (pread(info->user_fd, &mode_byte, 1, 3) != 1 || mode_byte != verify) {
+    return -1;
+  }
+  return best;
+}
+
+int main(int argc, char** argv) {
+  uint32_t megabytes = argc > 1 ? atoi(argv[1]) : 32;
+  char directory[] = "/tmp/bench_vaultXXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    fputs("Could not make a temporary directory\n", stderr);
+    return 1;
+  }
+
+  struct vault_info* info = init_vault();
+  if (info == NULL || create_vault(directory, "bench", "password", info)) {
+    fputs("Could not create the vault\n", stderr);
+    return 1;
+  }
+
+  char key[32];
+  char value[DATA_SIZE];
+  memset(value, 'x', DATA_SIZE);
+  uint32_t entries = megabytes * 1024 * 1024 / DATA_SIZE;
+  for (uint32_t i = 0; i < entries; ++i) {
+    snprintf(key, sizeof(key), "key%u", i);
+    if (add_key(info, 1, key, value, i, DATA_SIZE)) {
+      fputs("Could not add a key\n", stderr);
+      return 1;
+    }
+  }
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  uint8_t modes[2] = {INTEGRITY_INCREMENTAL, INTEGRITY_MERKLE};
+  const char* names[2] = {"incremental", "merkle"};
+  for (int m = 0; m < 2; ++m) {
+    set_integrity_mode(info, modes[m]);
+    sodium_mprotect_readwrite(info);
+    printf("%-12s %.1f MB serial            %.4f s\n", names[m],
+           (info->data_end + internal_tree_size(info)) / (1024.0 * 1024.0),
+           bench_verify(info, VERIFY_SERIAL, 1));
+
+    double single = 0;
+    for (uint32_t workers = 1; workers <= MAX_WORKERS && workers <= cores;
+         workers *= 2) {
+      double taken = bench_verify(info, VERIFY_PARALLEL, workers);
+      single = workers == 1 ? taken : single;
+      printf("%-12s parallel %2u workers %.4f s (%.2fx)\n", names[m], workers,
+             taken, single / taken);
+    }
+    sodium_mprotect_noaccess(info);
+  }
+
+  char pathname[64];
+  snprintf(pathname, sizeof(pathname), "%s/bench.vault", directory);
+  close_vault(info);
+  release_vault(info);
+  unlink(pathname);
+  rmdir(directory);
+  return 0;
+}
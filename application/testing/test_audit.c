@@ -0,0 +1,184 @@
+/**
+   test_audit.c - Correctness and time budget test for the vault audit
+
+   Built and run with `make test` from the application directory.
+
+   The test includes vault.c directly and fills a vault with AUDIT_KEYS
+   credentials laid out as the application stores them, along with some
+   passwords stored on their own and a value of another type. Every
+   REUSE_STRIDE-th credential shares one of REUSE_GROUPS passwords, and the
+   rest are strong and unique except for a few known weak ones. The audit
+   must report exactly those, group the shared passwords by the first of
+   their keys in key order, and finish within AUDIT_BUDGET seconds with the
+   values decrypted across the workers.
+ */
+#include "../vault.c"
+
+#include <time.h>
+
+#define AUDIT_KEYS 10000
+#define REUSE_STRIDE 10
+#define REUSE_GROUPS 3
+#define AUDIT_BUDGET 1.0
+
+// Passwords each failing the checks given alongside them
+const char* weak_passwords[] = {"short1A!", "Ab1!", "asdfghjk12", "aaaa1AAAA2",
+                                "qwerty12Q!", "1234567890"};
+const uint8_t weak_flags[] = {
+    AUDIT_NOT_INTERLEAVED,
+    AUDIT_SHORT | AUDIT_NOT_INTERLEAVED,
+    AUDIT_FEW_CLASSES | AUDIT_NOT_INTERLEAVED | AUDIT_KEYBOARD,
+    AUDIT_REPEATED,
+    AUDIT_NOT_INTERLEAVED | AUDIT_KEYBOARD,
+    AUDIT_FEW_CLASSES | AUDIT_NOT_INTERLEAVED | AUDIT_KEYBOARD};
+#define NUM_WEAK (sizeof(weak_flags) / sizeof(uint8_t))
+
+double test_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+   function make_credential
+
+   Lays out username and password in value as the application does, with the
+   length of the username first.
+
+   Returns the length of the value
+ */
+uint32_t make_credential(char* value, const char* username,
+                         const char* password) {
+  int32_t user_len = strlen(username);
+  memcpy(value, &user_len, sizeof(int32_t));
+  memcpy(value + sizeof(int32_t), username, user_len);
+  memcpy(value + sizeof(int32_t) + user_len, password, strlen(password));
+  return sizeof(int32_t) + user_len + strlen(password);
+}
+
+/**
+   function check_results
+
+   Checks the findings of the audit against what the vault was filled with.
+
+   Returns zero, or one if any finding or total was wrong
+ */
+int check_results(struct audit_result* results, uint32_t found,
+                  struct audit_report* report) {
+  uint32_t reused = (AUDIT_KEYS + REUSE_STRIDE - 1) / REUSE_STRIDE;
+  if (report->audited != AUDIT_KEYS + NUM_WEAK || report->skipped != 1 ||
+      report->weak != NUM_WEAK || report->reused != reused ||
+      report->groups != REUSE_GROUPS || found != reused + NUM_WEAK) {
+    fprintf(stderr, "Audit found %u, %u audited %u weak %u reused %u groups\n",
+            found, report->audited, report->weak, report->reused,
+            report->groups);
+    return 1;
+  }
+
+  uint32_t weak_seen = 0;
+  for (uint32_t i = 0; i < found; ++i) {
+    uint32_t number;
+    if (sscanf(results[i].key, "site%u", &number) == 1) {
+      // Keys sort as text, so the groups are numbered by their first keys
+      uint32_t expected = number / REUSE_STRIDE % REUSE_GROUPS;
+      if (number % REUSE_STRIDE != 0 || results[i].weaknesses != 0 ||
+          results[i].score != AUDIT_CHECKS ||
+          results[i].group != (expected == 0   ? 1
+                               : expected == 1 ? 2
+                                               : 3)) {
+        fprintf(stderr, "Wrong finding for %s\n", results[i].key);
+        return 1;
+      }
+    } else if (sscanf(results[i].key, "weak%u", &number) == 1 &&
+               number < NUM_WEAK) {
+      uint8_t failed = 0;
+      for (uint8_t flag = AUDIT_SHORT; flag <= AUDIT_KEYBOARD; flag <<= 1) {
+        failed += (weak_flags[number] & flag) != 0;
+      }
+      if (results[i].weaknesses != weak_flags[number] ||
+          results[i].score != AUDIT_CHECKS - failed || results[i].group != 0) {
+        fprintf(stderr, "%s failed checks %u\n", results[i].key,
+                results[i].weaknesses);
+        return 1;
+      }
+      weak_seen++;
+    }
+    if (i > 0 && strcmp(results[i - 1].key, results[i].key) >= 0) {
+      fputs("Findings are not in key order\n", stderr);
+      return 1;
+    }
+  }
+  return weak_seen != NUM_WEAK;
+}
+
+int main() {
+  char directory[] = "/tmp/test_auditXXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    fputs("Could not make a temporary directory\n", stderr);
+    return 1;
+  }
+
+  struct vault_info* info = init_vault();
+  if (info == NULL || create_vault(directory, "audit", "password", info)) {
+    fputs("Could not create the vault\n", stderr);
+    return 1;
+  }
+
+  char key[32];
+  char username[32];
+  char password[32];
+  char value[DATA_SIZE];
+  const char* shared[REUSE_GROUPS] = {"Sh4red-pass9word", "An0ther-sh4red7",
+                                      "Thi7rd-sha3re"};
+  int failed = vault_begin(info);
+  for (uint32_t i = 0; i < AUDIT_KEYS && !failed; ++i) {
+    snprintf(key, sizeof(key), "site%u", i);
+    snprintf(username, sizeof(username), "user%u", i);
+    snprintf(password, sizeof(password), "P4ss-w0rd-%u-x%u", i, i * 7);
+    const char* chosen = i % REUSE_STRIDE == 0
+                             ? shared[i / REUSE_STRIDE % REUSE_GROUPS]
+                             : password;
+    uint32_t len = make_credential(value, username, chosen);
+    failed = add_key(info, TYPE_CREDENTIAL, key, value, i, len);
+  }
+  for (uint32_t i = 0; i < NUM_WEAK && !failed; ++i) {
+    snprintf(key, sizeof(key), "weak%u", i);
+    failed = add_key(info, TYPE_PASSWORD, key, weak_passwords[i], i,
+                     strlen(weak_passwords[i]) + 1);
+  }
+  failed = failed || add_key(info, 2, "other", "aaaa", 0, 4) ||
+           vault_commit(info);
+
+  struct audit_result* results =
+      malloc(sizeof(struct audit_result) * (AUDIT_KEYS + NUM_WEAK));
+  struct audit_report report;
+  uint32_t found = 0;
+  double taken[2] = {0, 0};
+  for (int mode = 0; mode < 2 && !failed; ++mode) {
+    // The second audit runs on a Merkle vault, which checks the file first
+    failed = mode == 1 && set_integrity_mode(info, INTEGRITY_MERKLE);
+    double start = test_now();
+    failed = failed || results == NULL ||
+             audit_vault(info, results, AUDIT_KEYS + NUM_WEAK, &found,
+                         &report) ||
+             check_results(results, found, &report);
+    taken[mode] = test_now() - start;
+  }
+
+  close_vault(info);
+  release_vault(info);
+  free(results);
+  char pathname[64];
+  snprintf(pathname, sizeof(pathname), "%s/audit.vault", directory);
+  unlink(pathname);
+  rmdir(directory);
+
+  printf("Audit of %d passwords: %.3f s incremental, %.3f s merkle\n",
+         AUDIT_KEYS + (int)NUM_WEAK, taken[0], taken[1]);
+  if (failed || taken[0] > AUDIT_BUDGET || taken[1] > AUDIT_BUDGET) {
+    fputs("FAILED: the audit was wrong or went over its budget\n", stderr);
+    return 1;
+  }
+  puts("PASSED");
+  return 0;
+}
@@ -0,0 +1,134 @@
+/**
+   test_cipher.c - Tamper test of the AEAD cipher suites
+
+   Built and run with `make test` from the application directory.
+
+   The test makes a vault with CIPHER_XCHACHA, and with CIPHER_AESGCM when the
+   CPU has hardware AES, and flips a single byte of an entry in turn: the
+   type and key, which the tag covers as associated data, and the encrypted
+   value. As a blob from the server, each flipped entry must be refused by
+   add_encrypted_value, while the untouched one is taken. Flipped in the
+   file, the key must neither open nor be handed out by get_encrypted_value.
+ */
+#include <unistd.h>
+
+#include "../vault.c"
+
+// The bytes flipped, from the start of an entry with a key of KEY_LEN
+#define KEY_LEN 7
+#define NUM_FLIPS 3
+static const uint32_t flips[NUM_FLIPS] = {
+    ENTRY_HEADER_SIZE - 1, ENTRY_HEADER_SIZE, ENTRY_HEADER_SIZE + KEY_LEN};
+static const char* flip_names[NUM_FLIPS] = {"type", "key", "value"};
+
+/**
+   function flip_in_file
+
+   Flips the byte at offset into the entry of the key, in the file of the
+   open vault.
+
+   Returns zero, or one if the byte could not be flipped
+ */
+int flip_in_file(struct vault_info* info, const char* key, uint32_t offset) {
+  sodium_mprotect_readonly(info);
+  const struct key_info* current_info = get_info(info->key_info, key);
+  int failed = current_info == NULL;
+  if (!failed) {
+    const uint32_t* loc_data =
+        LOC_SLOT(info, info->locs,
+                 (current_info->inode_loc - HEADER_SIZE) / info->loc_size);
+    uint64_t at = internal_slot_loc(info, loc_data) + offset;
+    uint8_t byte;
+    failed = pread(info->user_fd, &byte, 1, at) != 1;
+    byte ^= 0x01;
+    failed = failed || pwrite(info->user_fd, &byte, 1, at) != 1;
+  }
+  sodium_mprotect_noaccess(info);
+  return failed;
+}
+
+/**
+   function test_suite
+
+   Makes a vault with the given cipher suite and tampers with its entries.
+
+   Returns zero, or one if a tampered entry was accepted
+ */
+int test_suite(struct vault_info* info, char* directory, const char* pathname,
+               uint8_t suite) {
+  char blob[MAX_ENTRY_SIZE];
+  char flipped[MAX_ENTRY_SIZE];
+  char key[KEY_LEN + 1];
+  int len;
+  uint8_t type;
+  int failed = set_cipher_suite(info, suite) ||
+               create_vault(directory, "cipher", "password", info) ||
+               add_key(info, TYPE_PASSWORD, "blobkey", "value", 1, 5) ||
+               get_encrypted_value(info, "blobkey", blob, &len, &type) ||
+               delete_key(info, "blobkey");
+
+  // A flipped blob is refused whole, and the untouched one still taken
+  for (int i = 0; i < NUM_FLIPS && !failed; ++i) {
+    memcpy(flipped, blob, len);
+    flipped[flips[i]] ^= 0x01;
+    int result =
+        add_encrypted_value(info, "blobkey", flipped, len, TYPE_PASSWORD, 2);
+    if (result != VE_FILE) {
+      fprintf(stderr, "Blob with a flipped %s byte gave %d in suite %d\n",
+              flip_names[i], result, suite);
+      failed = 1;
+    }
+  }
+  failed = failed ||
+           add_encrypted_value(info, "blobkey", blob, len, TYPE_PASSWORD, 2);
+
+  for (int i = 0; i < NUM_FLIPS && !failed; ++i) {
+    snprintf(key, sizeof(key), "tamper%d", i);
+    failed = add_key(info, TYPE_PASSWORD, key, "value", 1, 5) ||
+             flip_in_file(info, key, flips[i]);
+    int opened = failed ? VE_CRYPTOERR : open_key(info, key);
+    int got = failed ? VE_CRYPTOERR
+                     : get_encrypted_value(info, key, blob, &len, &type);
+    if (!failed && (opened != VE_CRYPTOERR || got != VE_CRYPTOERR)) {
+      fprintf(stderr, "Entry with a flipped %s byte gave %d and %d in suite "
+              "%d\n", flip_names[i], opened, got, suite);
+      failed = 1;
+    }
+  }
+
+  close_vault(info);
+  unlink(pathname);
+  return failed;
+}
+
+int main() {
+  char directory[] = "/tmp/test_cipherXXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    fputs("Could not make a temporary directory\n", stderr);
+    return 1;
+  }
+  char pathname[64];
+  snprintf(pathname, sizeof(pathname), "%s/cipher.vault", directory);
+
+  struct vault_info* info = init_vault();
+  if (info == NULL) {
+    fputs("Could not make the vault info\n", stderr);
+    return 1;
+  }
+
+  int failed = test_suite(info, directory, pathname, CIPHER_XCHACHA);
+  if (crypto_aead_aes256gcm_is_available()) {
+    failed = test_suite(info, directory, pathname, CIPHER_AESGCM) || failed;
+  } else {
+    puts("No hardware AES, skipping CIPHER_AESGCM");
+  }
+
+  release_vault(info);
+  rmdir(directory);
+  if (failed) {
+    fputs("FAILED: a tampered entry was accepted\n", stderr);
+    return 1;
+  }
+  puts("PASSED");
+  return 0;
+}
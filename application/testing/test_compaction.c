@@ -0,0 +1,159 @@
+/**
+   test_compaction.c - Add latency regression test for background compaction
+
+   Built and run with `make test` from the application directory.
+
+   The test fills a vault with large entries, replaces them all to leave half
+   of the file as garbage, and then times adding keys, first with nothing else
+   going on and then while a background compaction rewrites the file. The
+   99th percentile add latency while compacting must stay close to the one
+   without, as the thread only reads the old file and the adds only wait on it
+   for the short swap at the end. The time a compaction blocks a caller for
+   when run in the foreground is printed for comparison.
+ */
+#include "../vault.c"
+
+#include <time.h>
+
+// Entries of DATA_SIZE bytes written, and then replaced, before timing adds
+#define FILL_KEYS 2000
+// Adds timed with and without a compaction running
+#define SAMPLES 1000
+// The loc field is sized for the filled keys plus all the timed adds
+#define FILL_PERCENT 25
+// How much the 99th percentile may grow while compacting, with an allowance
+// in seconds for timer and scheduling noise on very fast adds
+#define LATENCY_FACTOR 2.0
+#define LATENCY_SLACK 0.0005
+
+double test_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int compare_times(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+/**
+   function time_add
+
+   Adds the key numbered next with a short value and records how long it took.
+
+   Returns VE_SUCCESS or the error from add_key
+ */
+int time_add(struct vault_info* info, uint32_t next, double* taken) {
+  char key[32];
+  snprintf(key, sizeof(key), "added%u", next);
+  double start = test_now();
+  int result = add_key(info, 1, key, "value", next, 5);
+  *taken = test_now() - start;
+  return result;
+}
+
+/**
+   function percentile
+
+   Sorts the count times and returns the given percentile of them
+ */
+double percentile(double* times, int count, int percent) {
+  qsort(times, count, sizeof(double), compare_times);
+  return times[(count - 1) * percent / 100];
+}
+
+int main() {
+  char directory[] = "/tmp/test_vaultXXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    fputs("Could not make a temporary directory\n", stderr);
+    return 1;
+  }
+
+  struct vault_info* info = init_vault();
+  if (info == NULL ||
+      create_vault(directory, "compaction", "password", info) ||
+      set_compaction_policy(info, 0, FILL_PERCENT)) {
+    fputs("Could not create the vault\n", stderr);
+    return 1;
+  }
+
+  char key[32];
+  char value[DATA_SIZE];
+  memset(value, 'x', DATA_SIZE);
+  int failed = 0;
+  for (uint32_t i = 0; i < FILL_KEYS && !failed; ++i) {
+    snprintf(key, sizeof(key), "key%u", i);
+    failed = add_key(info, 1, key, value, i, DATA_SIZE);
+  }
+  // Sizes the loc field for everything added below before replacing entries
+  failed = failed || compact_vault(info);
+  for (uint32_t i = 0; i < FILL_KEYS && !failed; ++i) {
+    snprintf(key, sizeof(key), "key%u", i);
+    failed = update_key(info, 1, key, value, i, DATA_SIZE);
+  }
+  if (failed) {
+    fputs("Could not fill the vault\n", stderr);
+    return 1;
+  }
+
+  uint32_t next = 0;
+  double idle[SAMPLES];
+  for (int i = 0; i < SAMPLES && !failed; ++i) {
+    failed = time_add(info, next++, &idle[i]);
+  }
+
+  // The adds run until the compaction is installed, starting another one if
+  // it finished before enough of them were timed
+  double busy[SAMPLES];
+  int timed = 0;
+  int compactions = 0;
+  struct vault_stats stats = {0};
+  failed = failed || set_background_compaction(info, 1);
+  while (timed < SAMPLES && !failed) {
+    failed = compact_vault(info) || get_vault_stats(info, &stats);
+    compactions++;
+    while (stats.compacting && timed < SAMPLES && !failed) {
+      failed = time_add(info, next++, &busy[timed++]) ||
+               get_vault_stats(info, &stats);
+    }
+  }
+  while (stats.compacting && !failed) {
+    failed = get_vault_stats(info, &stats);
+  }
+
+  failed = failed || set_background_compaction(info, 0);
+  double start = test_now();
+  failed = failed || compact_vault(info);
+  double foreground = test_now() - start;
+
+  failed = failed || close_vault(info) ||
+           open_vault(directory, "compaction", "password", info) ||
+           num_vault_keys(info) != FILL_KEYS + next;
+  close_vault(info);
+  release_vault(info);
+
+  char pathname[64];
+  snprintf(pathname, sizeof(pathname), "%s/compaction.vault", directory);
+  unlink(pathname);
+  rmdir(directory);
+
+  if (failed) {
+    fputs("FAILED: the vault could not be compacted while in use\n", stderr);
+    return 1;
+  }
+
+  double idle_p99 = percentile(idle, SAMPLES, 99);
+  double busy_p99 = percentile(busy, SAMPLES, 99);
+  printf("p99 add latency: %.1f us idle, %.1f us over %d background "
+         "compactions\n",
+         idle_p99 * 1e6, busy_p99 * 1e6, compactions);
+  printf("Foreground compaction blocked for %.1f ms\n", foreground * 1e3);
+
+  if (busy_p99 > idle_p99 * LATENCY_FACTOR + LATENCY_SLACK) {
+    fputs("FAILED: adds were slowed down by background compaction\n", stderr);
+    return 1;
+  }
+  puts("PASSED");
+  return 0;
+}
@@ -0,0 +1,524 @@
+/**
+   test_index.c - Correctness test for the ordered indexes of the key map
+
+   Built and run with `make test` from the application directory.
+
+   The test includes vault.c directly and fills a vault with a few domains,
+   whose order in each index is known. The keys in a range, with a prefix and
+   with a suffix must come back in order and within their bounds, with the
+   number of matches set even when fewer buffers were given. The indexes are
+   built by the first query and kept sorted from then on, so the queries are
+   made again after keys are added and deleted, and once more after the
+   vault is opened again from its file.
+
+   A cursor paging through the keys must list each of them once, in order,
+   through a compaction between pages. Keys added ahead of a cursor must be
+   listed and keys added behind it not, keys deleted ahead of it must be
+   skipped, and deleting the last key it returned must not lose its place.
+
+   The changes at or after a time must come in order of time and then of
+   key, with deletions marked and at the time they were made, and a key
+   added again after it was deleted must only be listed as added. The
+   deletions must still be listed after the vault is opened again.
+
+   The keys of each type must be counted as keys are added, deleted and
+   change type, and after the vault is opened again, and a cursor over one
+   type must list only its keys, in order, across the same changes.
+ */
+#include "../vault.c"
+
+// Most keys any query in the test matches
+#define MAX_MATCHES 16
+
+// Keys the vault starts with, and their types and times
+const char* fixture_keys[] = {"alpha.com",       "beta.com",
+                              "login.alpha.com", "mail.alpha.com",
+                              "alphabet.org",    "zeta.net",
+                              "beta.org"};
+const uint8_t fixture_types[] = {TYPE_CREDENTIAL, TYPE_PASSWORD,
+                                 TYPE_CREDENTIAL, TYPE_PASSWORD,
+                                 TYPE_CREDENTIAL, TYPE_CREDENTIAL,
+                                 TYPE_PASSWORD};
+const uint64_t fixture_times[] = {10, 20, 30, 30, 40, 50, 60};
+#define NUM_FIXTURES (sizeof(fixture_times) / sizeof(uint64_t))
+
+char storage[MAX_MATCHES][BOX_KEY_SIZE];
+char* results[MAX_MATCHES];
+
+/**
+   function fill_vault
+
+   Creates the vault and adds the fixture keys to it.
+
+   Returns zero, or one if the vault could not be made
+ */
+int fill_vault(struct vault_info* info, char* directory) {
+  int failed = create_vault(directory, "index", "password", info);
+  for (uint32_t i = 0; i < NUM_FIXTURES && !failed; ++i) {
+    failed = add_key(info, fixture_types[i], fixture_keys[i], "value",
+                     fixture_times[i], 5);
+  }
+  return failed;
+}
+
+/**
+   function expect_keys
+
+   Checks that a query returned the expected keys, in order, and that it
+   counted them all.
+
+   Returns zero, or one if the keys differ
+ */
+int expect_keys(const char* query, int result, uint32_t num_results,
+                const char** expected, uint32_t num_expected) {
+  int failed = result != VE_SUCCESS || num_results != num_expected;
+  for (uint32_t i = 0; i < num_expected && !failed; ++i) {
+    failed = strcmp(results[i], expected[i]) != 0;
+  }
+  if (failed) {
+    fprintf(stderr, "Query %s returned %d with %u keys:", query, result,
+            num_results);
+    for (uint32_t i = 0; i < num_results && i < MAX_MATCHES; ++i) {
+      fprintf(stderr, " %s", results[i]);
+    }
+    fputc('\n', stderr);
+  }
+  return failed;
+}
+
+/**
+   function check_range
+
+   Lists the keys from first up to last, either of which may be NULL.
+
+   Returns zero, or one if they are not the expected keys
+ */
+int check_range(struct vault_info* info, const char* first, const char* last,
+                const char** expected, uint32_t num_expected) {
+  uint32_t num_results = 0;
+  int result = get_keys_in_range(info, first, last, results, MAX_MATCHES,
+                                 &num_results);
+  char query[2 * BOX_KEY_SIZE + 16];
+  snprintf(query, sizeof(query), "range [%s, %s)", first ? first : "",
+           last ? last : "");
+  return expect_keys(query, result, num_results, expected, num_expected);
+}
+
+/**
+   function check_prefix
+
+   Lists the keys starting with prefix.
+
+   Returns zero, or one if they are not the expected keys
+ */
+int check_prefix(struct vault_info* info, const char* prefix,
+                 const char** expected, uint32_t num_expected) {
+  uint32_t num_results = 0;
+  int result = get_keys_with_prefix(info, prefix, results, MAX_MATCHES,
+                                    &num_results);
+  char query[BOX_KEY_SIZE + 16];
+  snprintf(query, sizeof(query), "prefix %s", prefix);
+  return expect_keys(query, result, num_results, expected, num_expected);
+}
+
+/**
+   function check_suffix
+
+   Lists the keys ending with suffix, which come in the order of their text
+   read backwards.
+
+   Returns zero, or one if they are not the expected keys
+ */
+int check_suffix(struct vault_info* info, const char* suffix,
+                 const char** expected, uint32_t num_expected) {
+  uint32_t num_results = 0;
+  int result = get_keys_with_suffix(info, suffix, results, MAX_MATCHES,
+                                    &num_results);
+  char query[BOX_KEY_SIZE + 16];
+  snprintf(query, sizeof(query), "suffix %s", suffix);
+  return expect_keys(query, result, num_results, expected, num_expected);
+}
+
+/**
+   function check_domain
+
+   Looks up the key a site is filled in from.
+
+   Returns zero, or one if the key found is not expected, or a key was found
+   when expected is NULL
+ */
+int check_domain(struct vault_info* info, const char* domain,
+                 const char* expected) {
+  char found[BOX_KEY_SIZE] = {0};
+  int result = match_domain_key(info, domain, found);
+  int failed = expected == NULL ? result != VE_KEYEXIST
+                                : result || strcmp(found, expected) != 0;
+  if (failed) {
+    fprintf(stderr, "Domain %s matched %s with %d\n", domain, found, result);
+  }
+  return failed;
+}
+
+/**
+   function test_queries
+
+   Runs the range, prefix, suffix and domain queries on the fixture keys,
+   and again after keys are added and deleted and after opening the vault
+   again.
+
+   Returns zero, or one if any query returned the wrong keys
+ */
+int test_queries(struct vault_info* info, char* directory,
+                 const char* pathname) {
+  if (fill_vault(info, directory)) {
+    fputs("Could not fill the vault\n", stderr);
+    return 1;
+  }
+
+  const char* sorted[] = {"alpha.com",      "alphabet.org", "beta.com",
+                          "beta.org",       "login.alpha.com",
+                          "mail.alpha.com", "zeta.net"};
+  const char* alpha_suffix[] = {"alpha.com", "mail.alpha.com",
+                                "login.alpha.com"};
+  const char* com_suffix[] = {"alpha.com", "mail.alpha.com",
+                              "login.alpha.com", "beta.com"};
+  int failed = check_range(info, NULL, NULL, sorted, 7);
+  failed = check_range(info, "beta.com", "mail.alpha.com", sorted + 2, 3) ||
+           failed;
+  failed = check_range(info, NULL, "beta.com", sorted, 2) || failed;
+  failed = check_range(info, "mail", NULL, sorted + 5, 2) || failed;
+  failed = check_range(info, "zz", NULL, NULL, 0) || failed;
+  failed = check_range(info, "beta.org", "beta.org", NULL, 0) || failed;
+  failed = check_prefix(info, "alpha", sorted, 2) || failed;
+  failed = check_prefix(info, "beta.", sorted + 2, 2) || failed;
+  failed = check_prefix(info, "q", NULL, 0) || failed;
+  failed = check_suffix(info, "alpha.com", alpha_suffix, 3) || failed;
+  failed = check_suffix(info, ".alpha.com", alpha_suffix + 1, 2) || failed;
+  failed = check_suffix(info, ".com", com_suffix, 4) || failed;
+  failed = check_suffix(info, ".io", NULL, 0) || failed;
+  failed = check_domain(info, "www.login.alpha.com", "login.alpha.com") ||
+           failed;
+  failed = check_domain(info, "shop.alpha.com", "alpha.com") || failed;
+  failed = check_domain(info, "www.unknown.com", NULL) || failed;
+
+  // Fewer buffers than matches still counts every match
+  uint32_t num_results = 0;
+  int result = get_keys_in_range(info, NULL, NULL, results, 2, &num_results);
+  if (result || num_results != 7 || strcmp(results[0], sorted[0]) ||
+      strcmp(results[1], sorted[1])) {
+    fprintf(stderr, "Range into 2 buffers returned %d with %u keys\n", result,
+            num_results);
+    failed = 1;
+  }
+
+  // The indexes are kept sorted as keys come and go
+  const char* changed[] = {"alpha.com", "beta.com",        "beta.net",
+                           "beta.org",  "login.alpha.com", "zeta.net"};
+  const char* changed_com[] = {"alpha.com", "login.alpha.com", "beta.com"};
+  failed = add_key(info, TYPE_CREDENTIAL, "beta.net", "value", 70, 5) ||
+           delete_key(info, "alphabet.org") ||
+           delete_key(info, "mail.alpha.com") || failed;
+  failed = check_range(info, NULL, NULL, changed, 6) || failed;
+  failed = check_prefix(info, "alpha", changed, 1) || failed;
+  failed = check_prefix(info, "beta.", changed + 1, 3) || failed;
+  failed = check_suffix(info, ".com", changed_com, 3) || failed;
+  failed = check_domain(info, "www.mail.alpha.com", "alpha.com") || failed;
+
+  // And are built again from the file when the vault is opened
+  failed = close_vault(info) ||
+           open_vault(directory, "index", "password", info) || failed;
+  failed = check_range(info, NULL, NULL, changed, 6) || failed;
+  failed = check_suffix(info, ".com", changed_com, 3) || failed;
+
+  close_vault(info);
+  unlink(pathname);
+  return failed;
+}
+
+/**
+   function expect_page
+
+   Reads the next page of up to max_entries keys from a cursor and checks
+   that it holds the expected keys, in order, with their types and times.
+
+   Returns zero, or one if the page differs
+ */
+int expect_page(struct vault_info* info, struct vault_cursor* cursor,
+                uint32_t max_entries, const char** expected,
+                uint32_t num_expected) {
+  struct vault_entry entries[MAX_MATCHES];
+  uint32_t num_entries = 0;
+  int result = cursor_next(info, cursor, entries, max_entries, &num_entries);
+  int failed = result != VE_SUCCESS || num_entries != num_expected;
+  for (uint32_t i = 0; i < num_expected && !failed; ++i) {
+    const struct vault_entry* entry = entries + i;
+    failed = strcmp(entry->key, expected[i]) != 0 ||
+             entry->key_len != strlen(expected[i]) || entry->deleted ||
+             entry->m_time != last_modified_time(info, expected[i]);
+  }
+  if (failed) {
+    fprintf(stderr, "Cursor page returned %d with %u keys:", result,
+            num_entries);
+    for (uint32_t i = 0; i < num_entries && !result; ++i) {
+      fprintf(stderr, " %s", entries[i].key);
+    }
+    fputc('\n', stderr);
+  }
+  return failed;
+}
+
+/**
+   function test_cursor
+
+   Pages through the fixture keys with a cursor, and then through the keys
+   while they change between pages.
+
+   Returns zero, or one if a page held the wrong keys
+ */
+int test_cursor(struct vault_info* info, char* directory,
+                const char* pathname) {
+  struct vault_cursor* cursor = NULL;
+  if (fill_vault(info, directory) || open_cursor(info, NULL, &cursor)) {
+    fputs("Could not open a cursor\n", stderr);
+    return 1;
+  }
+
+  // A compaction between pages moves every entry but not the cursor
+  const char* sorted[] = {"alpha.com",      "alphabet.org", "beta.com",
+                          "beta.org",       "login.alpha.com",
+                          "mail.alpha.com", "zeta.net"};
+  int failed = expect_page(info, cursor, 3, sorted, 3);
+  failed = compact_vault(info) || failed;
+  failed = expect_page(info, cursor, 3, sorted + 3, 3) || failed;
+  failed = expect_page(info, cursor, 3, sorted + 6, 1) || failed;
+  failed = expect_page(info, cursor, 3, NULL, 0) || failed;
+  close_cursor(cursor);
+
+  // Changes behind the cursor are not seen, and those ahead of it are
+  const char* changed[] = {"beta.org", "kappa.io", "login.alpha.com",
+                           "zeta.net"};
+  failed = open_cursor(info, "b", &cursor) || failed;
+  failed = expect_page(info, cursor, 1, sorted + 2, 1) || failed;
+  failed = add_key(info, TYPE_CREDENTIAL, "aardvark.io", "value", 70, 5) ||
+           add_key(info, TYPE_CREDENTIAL, "kappa.io", "value", 80, 5) ||
+           delete_key(info, "beta.com") ||
+           delete_key(info, "mail.alpha.com") || failed;
+  failed = expect_page(info, cursor, MAX_MATCHES, changed, 4) || failed;
+  failed = expect_page(info, cursor, MAX_MATCHES, NULL, 0) || failed;
+  close_cursor(cursor);
+
+  // A cursor can start at a key to resume a listing
+  failed = open_cursor(info, "kappa.io", &cursor) || failed;
+  failed = expect_page(info, cursor, MAX_MATCHES, changed + 1, 3) || failed;
+  close_cursor(cursor);
+
+  close_vault(info);
+  unlink(pathname);
+  return failed;
+}
+
+/**
+   function expect_changes
+
+   Lists the changes at or after since and checks them against the expected
+   keys and times, with a deleted key given by a leading '-'.
+
+   Returns zero, or one if the changes differ
+ */
+int expect_changes(struct vault_info* info, uint64_t since,
+                   const char** expected, const uint64_t* times,
+                   uint32_t num_expected) {
+  struct vault_entry entries[MAX_MATCHES];
+  uint32_t num_changes = 0;
+  int result =
+      keys_modified_since(info, since, entries, MAX_MATCHES, &num_changes);
+  int failed = result != VE_SUCCESS || num_changes != num_expected;
+  for (uint32_t i = 0; i < num_expected && !failed; ++i) {
+    uint8_t deleted = expected[i][0] == '-';
+    failed = strcmp(entries[i].key, expected[i] + deleted) != 0 ||
+             entries[i].deleted != deleted || entries[i].m_time != times[i];
+  }
+  if (failed) {
+    fprintf(stderr, "Changes since %lu returned %d with %u keys:",
+            (unsigned long)since, result, num_changes);
+    for (uint32_t i = 0; i < num_changes && i < MAX_MATCHES && !result; ++i) {
+      fprintf(stderr, " %s%s@%lu", entries[i].deleted ? "-" : "",
+              entries[i].key, (unsigned long)entries[i].m_time);
+    }
+    fputc('\n', stderr);
+  }
+  return failed;
+}
+
+/**
+   function test_changes
+
+   Lists the changes to the fixture keys from a few times, and again after
+   keys are updated, deleted and added again.
+
+   Returns zero, or one if the wrong changes were listed
+ */
+int test_changes(struct vault_info* info, char* directory,
+                 const char* pathname) {
+  if (fill_vault(info, directory)) {
+    fputs("Could not fill the vault\n", stderr);
+    return 1;
+  }
+
+  const char* by_time[] = {"alpha.com",      "beta.com", "login.alpha.com",
+                           "mail.alpha.com", "alphabet.org", "zeta.net",
+                           "beta.org"};
+  int failed = expect_changes(info, 0, by_time, fixture_times, 7);
+  failed = expect_changes(info, 30, by_time + 2, fixture_times + 2, 5) ||
+           failed;
+  failed = expect_changes(info, 31, by_time + 4, fixture_times + 4, 3) ||
+           failed;
+  failed = expect_changes(info, 61, NULL, NULL, 0) || failed;
+
+  // Fewer entries than changes still counts every change
+  struct vault_entry entries[2];
+  uint32_t num_changes = 0;
+  int result = keys_modified_since(info, 0, entries, 2, &num_changes);
+  if (result || num_changes != 7 || strcmp(entries[1].key, by_time[1])) {
+    fprintf(stderr, "Changes into 2 entries returned %d with %u keys\n",
+            result, num_changes);
+    failed = 1;
+  }
+
+  // Deletions sort among the other changes, and one is dropped once its key
+  // is added again
+  failed = delete_key_at(info, "beta.com", 45) ||
+           delete_key_at(info, "login.alpha.com", 50) ||
+           update_key(info, TYPE_CREDENTIAL, "alpha.com", "new", 55, 3) ||
+           failed;
+  const char* deleted[] = {"-beta.com", "-login.alpha.com", "zeta.net",
+                           "alpha.com", "beta.org"};
+  const uint64_t deleted_times[] = {45, 50, 50, 55, 60};
+  failed = expect_changes(info, 45, deleted, deleted_times, 5) || failed;
+
+  const char* added[] = {"alphabet.org", "-login.alpha.com", "zeta.net",
+                         "alpha.com",    "beta.org",         "beta.com"};
+  const uint64_t added_times[] = {40, 50, 50, 55, 60, 65};
+  failed = add_key(info, TYPE_PASSWORD, "beta.com", "value", 65, 5) || failed;
+  failed = expect_changes(info, 40, added, added_times, 6) || failed;
+
+  // Tombstones are kept in the key map snapshot, both when it is written
+  // again and when the one the vault was opened with is kept
+  for (int reopen = 0; reopen < 2; ++reopen) {
+    failed = close_vault(info) ||
+             open_vault(directory, "index", "password", info) || failed;
+    failed = expect_changes(info, 40, added, added_times, 6) || failed;
+  }
+
+  close_vault(info);
+  unlink(pathname);
+  return failed;
+}
+
+/**
+   function expect_counts
+
+   Checks how many keys of each type the vault counts.
+
+   Returns zero, or one if a count differs
+ */
+int expect_counts(struct vault_info* info, uint32_t credentials,
+                  uint32_t passwords) {
+  uint32_t counts[3] = {0, 0, 0};
+  int failed = count_keys_of_type(info, TYPE_CREDENTIAL, &counts[0]) ||
+               count_keys_of_type(info, TYPE_PASSWORD, &counts[1]) ||
+               count_keys_of_type(info, 2, &counts[2]) ||
+               counts[0] != credentials || counts[1] != passwords ||
+               counts[2] != 0;
+  if (failed) {
+    fprintf(stderr, "Counted %u credentials and %u passwords\n", counts[0],
+            counts[1]);
+  }
+  return failed;
+}
+
+/**
+   function test_types
+
+   Counts and lists the keys of each type of the fixture keys, and again as
+   keys are added, deleted and updated to another type, and after opening
+   the vault again.
+
+   Returns zero, or one if a count or listing was wrong
+ */
+int test_types(struct vault_info* info, char* directory,
+               const char* pathname) {
+  struct vault_cursor* cursor = NULL;
+  if (fill_vault(info, directory) ||
+      open_type_cursor(info, TYPE_PASSWORD, NULL, &cursor)) {
+    fputs("Could not open a type cursor\n", stderr);
+    return 1;
+  }
+
+  const char* passwords[] = {"beta.com", "beta.org", "kappa.io", "zeta.net"};
+  const char* credentials[] = {"alpha.com", "alphabet.org", "lambda.io",
+                               "login.alpha.com"};
+  int failed = expect_counts(info, 4, 3);
+  failed = expect_page(info, cursor, 2, passwords, 2) || failed;
+  failed = add_key(info, TYPE_PASSWORD, "kappa.io", "value", 70, 5) ||
+           add_key(info, TYPE_PASSWORD, "aaa.io", "value", 70, 5) ||
+           add_key(info, TYPE_CREDENTIAL, "lambda.io", "value", 70, 5) ||
+           delete_key(info, "mail.alpha.com") || failed;
+  failed = expect_counts(info, 5, 4) || failed;
+  failed = expect_page(info, cursor, MAX_MATCHES, passwords + 2, 1) || failed;
+  failed = expect_page(info, cursor, MAX_MATCHES, NULL, 0) || failed;
+  close_cursor(cursor);
+
+  // A key updated to another type moves between the listings
+  failed = update_key(info, TYPE_PASSWORD, "zeta.net", "value", 80, 5) ||
+           delete_key(info, "aaa.io") || failed;
+  failed = expect_counts(info, 4, 4) || failed;
+  failed = open_type_cursor(info, TYPE_CREDENTIAL, NULL, &cursor) || failed;
+  failed = expect_page(info, cursor, MAX_MATCHES, credentials, 4) || failed;
+  close_cursor(cursor);
+
+  failed = close_vault(info) ||
+           open_vault(directory, "index", "password", info) || failed;
+  failed = expect_counts(info, 4, 4) || failed;
+  failed = open_type_cursor(info, TYPE_PASSWORD, "b", &cursor) || failed;
+  failed = expect_page(info, cursor, MAX_MATCHES, passwords, 4) || failed;
+  close_cursor(cursor);
+
+  close_vault(info);
+  unlink(pathname);
+  return failed;
+}
+
+int main() {
+  char directory[] = "/tmp/test_indexXXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    fputs("Could not make a temporary directory\n", stderr);
+    return 1;
+  }
+  char pathname[64];
+  snprintf(pathname, sizeof(pathname), "%s/index.vault", directory);
+  for (uint32_t i = 0; i < MAX_MATCHES; ++i) {
+    results[i] = storage[i];
+  }
+
+  struct vault_info* info = init_vault();
+  if (info == NULL) {
+    fputs("Could not make the vault info\n", stderr);
+    return 1;
+  }
+
+  int failed = test_queries(info, directory, pathname);
+  failed = test_cursor(info, directory, pathname) || failed;
+  failed = test_changes(info, directory, pathname) || failed;
+  failed = test_types(info, directory, pathname) || failed;
+
+  release_vault(info);
+  rmdir(directory);
+  if (failed) {
+    fputs("FAILED: an ordered query or cursor returned the wrong keys\n",
+          stderr);
+    return 1;
+  }
+  puts("PASSED");
+  return 0;
+}
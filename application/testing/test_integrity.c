@@ -0,0 +1,542 @@
+/**
+   test_integrity.c - Tamper and recovery tests for the integrity modes
+
+   Built and run with `make test` from the application directory.
+
+   The test includes vault.c directly and rolls an entry back in the file
+   while the vault is closed: a key is updated, and the bytes its entry had
+   before the update are written over the new one, which still decrypts
+   under the master key. An incremental vault must then refuse to open.
+   A Merkle vault only checks segments as they are read, so it opens, but
+   the key must not open, and must stay that way after an unrelated add
+   and after a transaction touching more ranges than MAX_DIRTY_RANGES,
+   which rebuilds the whole tree, as neither may take the rolled back
+   segment into the tree. With the entry in the last segment, which the add
+   appends to, the add itself must fail. A background compaction, which
+   copies segments without checking them, must not start either.
+
+   pwrite and pwritev are also wrapped so that a write can be made to fail.
+   An add or delete whose write fails must leave the vault as it was, so
+   that later writes seal the file as it is and it opens again with the key
+   of the failed add missing and the key of the failed delete intact. An add
+   whose seal fails after its entry is written must keep the key instead.
+   Upgrading a vault sealed with a whole file hash must leave it as it was
+   when the new file cannot be written.
+   A vault closed with a key map snapshot must also open again after a plain
+   add, which writes its entry where the snapshot was. init_map is wrapped as
+   well, so that rebuilding the key map after a
+   compaction can fail, which must leave the vault closed and whole.
+ */
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "../vault_map.h"
+
+// Writes left before one fails, or -1 for none to fail
+int writes_left = -1;
+
+int test_write_fails() {
+  if (writes_left == 0) {
+    writes_left = -1;
+    return 1;
+  }
+  writes_left -= writes_left > 0;
+  return 0;
+}
+
+#define pwrite(...) (test_write_fails() ? -1 : pwrite(__VA_ARGS__))
+#define pwritev(...) (test_write_fails() ? -1 : pwritev(__VA_ARGS__))
+
+// Maps left to make before one fails, or -1 for none to fail
+int maps_left = -1;
+
+int test_map_fails() {
+  if (maps_left == 0) {
+    maps_left = -1;
+    return 1;
+  }
+  maps_left -= maps_left > 0;
+  return 0;
+}
+
+#define init_map(size) (test_map_fails() ? NULL : init_map(size))
+
+#include "../vault.c"
+
+// Keys added before the one rolled back, and after it unless it is to be in
+// the last segment of the file
+#define FILLER_KEYS 200
+#define FILLER_SIZE 100
+// Keys deleted by the transaction, each marking ranges of leaves of its own,
+// from the first half of the fillers so none is near the rolled back entry
+#define SCATTERED_DELETES (2 * MAX_DIRTY_RANGES)
+
+/**
+   function entry_span
+
+   Places where the entry of key starts in the file and how long it is.
+
+   Returns zero, or one if the key is not in the vault
+ */
+int entry_span(struct vault_info* info, const char* key, uint64_t* start,
+               uint32_t* len) {
+  sodium_mprotect_readonly(info);
+  const struct key_info* current = get_info(info->key_info, key);
+  if (current != NULL) {
+    const uint32_t* loc_data =
+        LOC_SLOT(info, info->locs,
+                 (current->inode_loc - HEADER_SIZE) / info->loc_size);
+    *start = internal_slot_loc(info, loc_data);
+    *len = internal_entry_size(info->cipher, loc_data[2], loc_data[3]);
+  }
+  sodium_mprotect_noaccess(info);
+  return current == NULL;
+}
+
+/**
+   function add_fillers
+
+   Adds FILLER_KEYS keys numbered from first, each on its own.
+
+   Returns VE_SUCCESS or the error from add_key
+ */
+int add_fillers(struct vault_info* info, uint32_t first) {
+  char key[32];
+  char value[FILLER_SIZE];
+  memset(value, 'f', FILLER_SIZE);
+  int result = VE_SUCCESS;
+  for (uint32_t i = first; i < first + FILLER_KEYS && !result; ++i) {
+    snprintf(key, sizeof(key), "filler%u", i);
+    result = add_key(info, TYPE_PASSWORD, key, value, i, FILLER_SIZE);
+  }
+  return result;
+}
+
+/**
+   function roll_back
+
+   Makes a vault in the given integrity mode, updates the key "victim" in it,
+   followed by more keys unless last is set, and closes it, and then writes
+   the entry the key had before the update over the one it has now.
+
+   Returns zero, or one if the vault could not be made or changed
+ */
+int roll_back(struct vault_info* info, char* directory, const char* pathname,
+              uint8_t mode, int last) {
+  uint64_t old_start, new_start;
+  uint32_t old_len, new_len;
+  if (create_vault(directory, "tamper", "password", info) ||
+      set_integrity_mode(info, mode) || add_fillers(info, 0) ||
+      add_key(info, TYPE_PASSWORD, "victim", "old value", 0, 9) ||
+      entry_span(info, "victim", &old_start, &old_len)) {
+    return 1;
+  }
+
+  // A compaction renames a new file over the vault, so it is opened each time
+  uint8_t old_entry[MAX_ENTRY_SIZE];
+  int fd = open(pathname, O_RDONLY);
+  if (fd < 0 || pread(fd, old_entry, old_len, old_start) != old_len) {
+    return 1;
+  }
+  close(fd);
+
+  // Compacting leaves room in the loc field, so the adds after do not move
+  // the entries again
+  if (compact_vault(info) ||
+      update_key(info, TYPE_PASSWORD, "victim", "new value", 1, 9) ||
+      (!last && add_fillers(info, FILLER_KEYS)) ||
+      entry_span(info, "victim", &new_start, &new_len) || new_len != old_len ||
+      close_vault(info)) {
+    return 1;
+  }
+  fd = open(pathname, O_WRONLY);
+  int failed = fd < 0 || pwrite(fd, old_entry, old_len, new_start) != old_len;
+  close(fd);
+  return failed;
+}
+
+/**
+   function rolled_back
+
+   Returns whether the key "victim" opens to the value it had before it was
+   updated, or to anything at all
+ */
+int rolled_back(struct vault_info* info) {
+  char value[DATA_SIZE + 1];
+  int len;
+  char type;
+  return open_key(info, "victim") == VE_SUCCESS &&
+         place_open_value(info, value, &len, &type) == VE_SUCCESS;
+}
+
+/**
+   function test_incremental
+
+   The rolled back entry is no longer in the mac sealed by the trailer, so
+   the vault must not open.
+
+   Returns zero, or one if the vault opened
+ */
+int test_incremental(struct vault_info* info, char* directory,
+                     const char* pathname) {
+  if (roll_back(info, directory, pathname, INTEGRITY_INCREMENTAL, 0)) {
+    fputs("Could not roll back the incremental vault\n", stderr);
+    return 1;
+  }
+
+  int result = open_vault(directory, "tamper", "password", info);
+  close_vault(info);
+  unlink(pathname);
+  if (result != VE_FILE) {
+    fprintf(stderr, "Rolled back incremental vault opened with %d\n", result);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+   function test_merkle
+
+   The rolled back entry no longer matches its leaf, so it must fail to open
+   however the tree is rehashed afterwards, and the vault must not verify
+   or open the key once it is closed and opened again. An add appending to
+   the segment of the entry, when it is the last, must fail instead.
+
+   Returns zero, or one if the key opened at any point
+ */
+int test_merkle(struct vault_info* info, char* directory, const char* pathname,
+                int last) {
+  if (roll_back(info, directory, pathname, INTEGRITY_MERKLE, last) ||
+      open_vault(directory, "tamper", "password", info)) {
+    fputs("Could not roll back the Merkle vault\n", stderr);
+    return 1;
+  }
+
+  // An add only rehashes the segments it wrote to
+  int failed = rolled_back(info);
+  int added = add_key(info, TYPE_PASSWORD, "unrelated", "value", 2, 5);
+  failed = failed || (added == VE_SUCCESS) == last || rolled_back(info);
+  if (failed) {
+    fputs("Rolled back entry opened after an unrelated add\n", stderr);
+  }
+
+  // Deleting keys all over the file rebuilds every leaf on commit
+  char key[32];
+  int result = failed ? VE_FILE : vault_begin(info);
+  for (uint32_t i = 0; i < SCATTERED_DELETES && !result; ++i) {
+    snprintf(key, sizeof(key), "filler%u",
+             i * FILLER_KEYS / 2 / SCATTERED_DELETES);
+    result = delete_key(info, key);
+  }
+  if (!failed && (result || vault_commit(info) != VE_FILE)) {
+    fputs("Transaction over the rolled back entry was committed\n", stderr);
+    failed = 1;
+  }
+  if (!failed && rolled_back(info)) {
+    fputs("Rolled back entry opened after a rebuild\n", stderr);
+    failed = 1;
+  }
+  close_vault(info);
+
+  if (!failed && open_vault(directory, "tamper", "password", info) == 0 &&
+      rolled_back(info)) {
+    fputs("Rolled back entry opened after opening again\n", stderr);
+    failed = 1;
+  }
+  close_vault(info);
+  unlink(pathname);
+  return failed;
+}
+
+/**
+   function test_background
+
+   A background compaction would copy the rolled back entry into the new file
+   and build the tree of that file over it, so it must refuse to start, and
+   the key must not open before or after the vault is opened again.
+
+   Returns zero, or one if the compaction started or the key opened
+ */
+int test_background(struct vault_info* info, char* directory,
+                    const char* pathname) {
+  if (roll_back(info, directory, pathname, INTEGRITY_MERKLE, 0) ||
+      open_vault(directory, "tamper", "password", info)) {
+    fputs("Could not roll back the Merkle vault\n", stderr);
+    return 1;
+  }
+
+  set_background_compaction(info, 1);
+  int result = compact_vault(info);
+  int failed = result != VE_FILE || rolled_back(info);
+  set_background_compaction(info, 0);
+  close_vault(info);
+  failed = failed || (open_vault(directory, "tamper", "password", info) == 0 &&
+                      rolled_back(info));
+  if (failed) {
+    fprintf(stderr, "Background compaction of a rolled back entry gave %d\n",
+            result);
+  }
+  close_vault(info);
+  unlink(pathname);
+  return failed;
+}
+
+/**
+   function test_failed_writes
+
+   Makes a vault in the given integrity mode, and fails each of the writes
+   an add and a delete make in turn, checking that the keys are as they were
+   afterwards, and again once the vault is opened from the file.
+
+   Returns zero, or one if a failed write changed the vault or broke the file
+ */
+int test_failed_writes(struct vault_info* info, char* directory,
+                       const char* pathname, uint8_t mode) {
+  int failed = create_vault(directory, "failed", "password", info) ||
+               set_integrity_mode(info, mode) || add_fillers(info, 0);
+  char key[32];
+  for (int attempt = 0; attempt < 2 && !failed; ++attempt) {
+    snprintf(key, sizeof(key), "failed%d", attempt);
+    writes_left = attempt;
+    failed = add_key(info, TYPE_PASSWORD, key, "value", 0, 5) == VE_SUCCESS;
+    writes_left = attempt;
+    failed = failed || delete_key(info, "filler1") == VE_SUCCESS;
+    writes_left = -1;
+    snprintf(key, sizeof(key), "after%d", attempt);
+    failed = failed || add_key(info, TYPE_PASSWORD, key, "value", 0, 5);
+  }
+  failed = failed || close_vault(info) ||
+           open_vault(directory, "failed", "password", info) ||
+           open_key(info, "failed0") != VE_KEYEXIST ||
+           open_key(info, "failed1") != VE_KEYEXIST ||
+           open_key(info, "after0") || open_key(info, "after1") ||
+           open_key(info, "filler1");
+  if (failed) {
+    fprintf(stderr, "Failed write changed the vault in mode %d\n", mode);
+  }
+  writes_left = -1;
+  close_vault(info);
+  unlink(pathname);
+  return failed;
+}
+
+/**
+   function test_failed_seal
+
+   Makes a Merkle vault, which seals after writing, and fails the first write
+   of the seal after an add, once its entry and slot are in the file. The key
+   must then stay in the vault, so that adding it again is refused rather
+   than giving it a second slot, and the next add seals the file over it.
+
+   Returns zero, or one if the key was lost or given a second slot
+ */
+int test_failed_seal(struct vault_info* info, char* directory,
+                     const char* pathname) {
+  int failed = create_vault(directory, "failed", "password", info) ||
+               set_integrity_mode(info, INTEGRITY_MERKLE) ||
+               add_fillers(info, 0);
+  writes_left = 2;
+  int result = failed ? VE_IOERR
+                      : add_key(info, TYPE_PASSWORD, "sealed", "value", 0, 5);
+  writes_left = -1;
+  failed = failed || result != VE_IOERR ||
+           add_key(info, TYPE_PASSWORD, "sealed", "value", 0, 5) !=
+               VE_KEYEXIST ||
+           add_key(info, TYPE_PASSWORD, "after", "value", 0, 5) ||
+           close_vault(info) ||
+           open_vault(directory, "failed", "password", info) ||
+           open_key(info, "sealed") || open_key(info, "after");
+  if (!failed) {
+    sodium_mprotect_readonly(info);
+    failed = info->live_slots != FILLER_KEYS + 2;
+    sodium_mprotect_noaccess(info);
+  }
+  if (failed) {
+    fprintf(stderr, "Add with a failed seal gave %d\n", result);
+  }
+  close_vault(info);
+  unlink(pathname);
+  return failed;
+}
+
+/**
+   function file_mode
+
+   Reads the integrity mode byte from the header of the vault at pathname.
+
+   Returns the mode, or -1 if it could not be read
+ */
+int file_mode(const char* pathname) {
+  uint8_t mode;
+  int fd = open(pathname, O_RDONLY);
+  int result = fd >= 0 && pread(fd, &mode, 1, 1) == 1 ? mode : -1;
+  if (fd >= 0) {
+    close(fd);
+  }
+  return result;
+}
+
+/**
+   function test_upgrade
+
+   Makes a vault and seals it with a whole file hash, as older vaults were,
+   and opens it with the condense that upgrades it failing, which must leave
+   the vault open with the whole file hash and the file as it was. The next
+   open must then move it to the incremental mac.
+
+   Returns zero, or one if the failed upgrade changed the file or lost a key
+ */
+int test_upgrade(struct vault_info* info, char* directory,
+                 const char* pathname) {
+  uint8_t mode = INTEGRITY_FILE;
+  int failed = create_vault(directory, "failed", "password", info) ||
+               add_fillers(info, 0);
+  if (!failed) {
+    sodium_mprotect_readwrite(info);
+    info->integrity = INTEGRITY_FILE;
+    failed = pwrite(info->user_fd, &mode, 1, 1) != 1 ||
+             internal_seal_file(info);
+    sodium_mprotect_noaccess(info);
+  }
+  failed = failed || close_vault(info);
+
+  writes_left = 0;
+  int result = failed ? VE_IOERR
+                      : open_vault(directory, "failed", "password", info);
+  writes_left = -1;
+  if (!failed && !result) {
+    sodium_mprotect_readonly(info);
+    failed = info->integrity != INTEGRITY_FILE;
+    sodium_mprotect_noaccess(info);
+  }
+  failed = failed || result || open_key(info, "filler1") ||
+           add_key(info, TYPE_PASSWORD, "during", "value", 0, 5) ||
+           close_vault(info) || file_mode(pathname) != INTEGRITY_FILE;
+
+  result = failed ? VE_IOERR
+                  : open_vault(directory, "failed", "password", info);
+  failed = failed || result || open_key(info, "filler1") ||
+           open_key(info, "during") || close_vault(info) ||
+           file_mode(pathname) != INTEGRITY_INCREMENTAL ||
+           open_vault(directory, "failed", "password", info) ||
+           open_key(info, "during");
+  if (failed) {
+    fprintf(stderr, "Upgrading a whole file hash gave %d\n", result);
+  }
+  writes_left = -1;
+  close_vault(info);
+  unlink(pathname);
+  return failed;
+}
+
+/**
+   function test_snapshot
+
+   Closes a vault in the given integrity mode so that it keeps a snapshot of
+   its key map, opens it from the snapshot, adds a key on its own and closes
+   it again, after which it must open with both the old and new keys.
+
+   Returns zero, or one if the vault did not open again or lost a key
+ */
+int test_snapshot(struct vault_info* info, char* directory,
+                  const char* pathname, uint8_t mode) {
+  int failed = create_vault(directory, "snapshot", "password", info) ||
+               set_integrity_mode(info, mode) || add_fillers(info, 0) ||
+               close_vault(info) ||
+               open_vault(directory, "snapshot", "password", info);
+  if (!failed) {
+    sodium_mprotect_readonly(info);
+    failed = info->snapshot_len == 0;
+    sodium_mprotect_noaccess(info);
+  }
+  failed = failed || add_key(info, TYPE_PASSWORD, "added", "value", 0, 5) ||
+           close_vault(info);
+  int result = failed ? VE_SUCCESS
+                      : open_vault(directory, "snapshot", "password", info);
+  failed = failed || result || open_key(info, "added") ||
+           open_key(info, "filler1");
+  if (failed) {
+    fprintf(stderr, "Add after opening from a snapshot in mode %d gave %d\n",
+            mode, result);
+  }
+  close_vault(info);
+  unlink(pathname);
+  return failed;
+}
+
+/**
+   function test_failed_map
+
+   Compacts a vault with the key map failing to be made for the new file,
+   which must close the vault, and then opens it again.
+
+   Returns zero, or one if the vault stayed open or lost a key
+ */
+int test_failed_map(struct vault_info* info, char* directory,
+                    const char* pathname) {
+  int failed = create_vault(directory, "failed", "password", info) ||
+               add_fillers(info, 0);
+  maps_left = 0;
+  int result = failed ? VE_SUCCESS : compact_vault(info);
+  maps_left = -1;
+  failed = failed || result != VE_MEMERR ||
+           open_key(info, "filler1") != VE_VCLOSE ||
+           close_vault(info) != VE_VCLOSE ||
+           open_vault(directory, "failed", "password", info) ||
+           open_key(info, "filler1");
+  if (failed) {
+    fprintf(stderr, "Compaction without a key map gave %d\n", result);
+  }
+  close_vault(info);
+  unlink(pathname);
+  return failed;
+}
+
+int main() {
+  char directory[] = "/tmp/test_integrityXXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    fputs("Could not make a temporary directory\n", stderr);
+    return 1;
+  }
+  char pathname[64];
+  char failed_path[64];
+  char snapshot_path[64];
+  snprintf(pathname, sizeof(pathname), "%s/tamper.vault", directory);
+  snprintf(failed_path, sizeof(failed_path), "%s/failed.vault", directory);
+  snprintf(snapshot_path, sizeof(snapshot_path), "%s/snapshot.vault",
+           directory);
+
+  struct vault_info* info = init_vault();
+  if (info == NULL) {
+    fputs("Could not make the vault info\n", stderr);
+    return 1;
+  }
+
+  int failed = test_incremental(info, directory, pathname);
+  failed = test_merkle(info, directory, pathname, 0) || failed;
+  failed = test_merkle(info, directory, pathname, 1) || failed;
+  failed = test_background(info, directory, pathname) || failed;
+  failed = test_failed_writes(info, directory, failed_path,
+                              INTEGRITY_INCREMENTAL) ||
+           failed;
+  failed =
+      test_failed_writes(info, directory, failed_path, INTEGRITY_MERKLE) ||
+      failed;
+  failed = test_failed_seal(info, directory, failed_path) || failed;
+  failed = test_upgrade(info, directory, failed_path) || failed;
+  failed = test_failed_map(info, directory, failed_path) || failed;
+  failed = test_snapshot(info, directory, snapshot_path,
+                         INTEGRITY_INCREMENTAL) ||
+           failed;
+  failed =
+      test_snapshot(info, directory, snapshot_path, INTEGRITY_MERKLE) || failed;
+
+  release_vault(info);
+  rmdir(directory);
+  if (failed) {
+    fputs("FAILED: a tampered file was accepted or a vault broken\n", stderr);
+    return 1;
+  }
+  puts("PASSED");
+  return 0;
+}
@@ -0,0 +1,273 @@
+/**
+   test_rekey.c - Test of rotating the master key with rekey_vault
+
+   Built and run with `make test` from the application directory.
+
+   The test fills a vault using CIPHER_SECRETBOX with NUM_KEYS values of
+   varied length, deletes some of them, and rekeys it into CIPHER_XCHACHA,
+   first on one worker and then on every core, printing the throughput of
+   each, which includes hashing the password to check it. After every rekey
+   the master key must have changed and every value must still open to what
+   was stored. fdatasync is wrapped so that a rekey can be made to fail at
+   its second checkpoint, and the XChaCha20 encrypt call so that the entries
+   a rekey seals can be counted: the next rekey must pick up from the first
+   checkpoint and seal fewer entries than the vault has, while a rekey after
+   the vault changed must start over. The vault is then moved to
+   INTEGRITY_MERKLE and rekeyed back into CIPHER_SECRETBOX, and has to stay
+   Merkle, before it is opened again from the file and checked once more.
+ */
+#include <sodium.h>
+#include <unistd.h>
+
+// fdatasync calls left before one fails, or -1 for none to fail
+int syncs_left = -1;
+uint64_t seals = 0;
+
+int test_sync_fails() {
+  if (syncs_left == 0) {
+    syncs_left = -1;
+    return 1;
+  }
+  syncs_left -= syncs_left > 0;
+  return 0;
+}
+
+#define fdatasync(fd) (test_sync_fails() ? -1 : fdatasync(fd))
+#define crypto_aead_xchacha20poly1305_ietf_encrypt(...) \
+  (__atomic_add_fetch(&seals, 1, __ATOMIC_RELAXED),     \
+   crypto_aead_xchacha20poly1305_ietf_encrypt(__VA_ARGS__))
+
+#include "../vault.c"
+
+#include <time.h>
+
+// Values of 1 KB to 3 KB, so the entries span a few checkpoints
+#define NUM_KEYS 20000
+#define MIN_VALUE 1024
+// Every this many keys are deleted before rekeying
+#define DELETE_STRIDE 10
+
+double test_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+   function fill_value
+
+   Fills value with the bytes stored for the key numbered number.
+
+   Returns the length of the value
+ */
+uint32_t fill_value(char* value, uint32_t number) {
+  uint32_t len = MIN_VALUE + number * 7919 % (2 * MIN_VALUE);
+  memset(value, 'a' + number % 26, len);
+  memcpy(value, &number, sizeof(uint32_t));
+  return len;
+}
+
+/**
+   function check_values
+
+   Opens every key left in the vault and checks that its value is the one
+   stored, and that the deleted keys are gone.
+
+   Returns zero, or one if a value is missing or wrong
+ */
+int check_values(struct vault_info* info) {
+  char key[32];
+  char expected[DATA_SIZE];
+  char value[DATA_SIZE + 1];
+  for (uint32_t i = 0; i < NUM_KEYS; ++i) {
+    snprintf(key, sizeof(key), "key%u", i);
+    if (i % DELETE_STRIDE == 0) {
+      if (open_key(info, key) != VE_KEYEXIST) {
+        fprintf(stderr, "Deleted %s is back\n", key);
+        return 1;
+      }
+      continue;
+    }
+
+    int len;
+    char type;
+    uint32_t expected_len = fill_value(expected, i);
+    if (open_key(info, key) || place_open_value(info, value, &len, &type) ||
+        (uint32_t)len != expected_len || memcmp(value, expected, len) != 0) {
+      fprintf(stderr, "Wrong value for %s\n", key);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+   function rekey_checked
+
+   Rekeys the vault into the given cipher suite, checking that the master
+   key changed and that every value is still there, and places the time the
+   rekey took in taken.
+
+   Returns zero, or one if the rekey failed or lost a value
+ */
+int rekey_checked(struct vault_info* info, uint8_t suite, double* taken) {
+  uint8_t master[MASTER_KEY_SIZE];
+  sodium_mprotect_readonly(info);
+  memcpy(master, info->decrypted_master, MASTER_KEY_SIZE);
+  sodium_mprotect_noaccess(info);
+
+  double start = test_now();
+  int result = rekey_vault(info, "password", suite);
+  *taken = test_now() - start;
+  if (result) {
+    fprintf(stderr, "Rekey failed with %d\n", result);
+    return 1;
+  }
+
+  uint8_t cipher;
+  sodium_mprotect_readonly(info);
+  int changed = memcmp(master, info->decrypted_master, MASTER_KEY_SIZE) != 0;
+  sodium_mprotect_noaccess(info);
+  sodium_memzero(master, MASTER_KEY_SIZE);
+  if (!changed || get_cipher_suite(info, &cipher) || cipher != suite) {
+    fputs("The master key or cipher suite did not change\n", stderr);
+    return 1;
+  }
+  return check_values(info);
+}
+
+/**
+   function interrupted_rekey
+
+   Rekeys the vault into CIPHER_XCHACHA with its second checkpoint failing,
+   which must leave the new file behind.
+
+   Returns zero, or one if the rekey did not fail as it should have
+ */
+int interrupted_rekey(struct vault_info* info, const char* rekey_path) {
+  // Each checkpoint syncs the entries and then itself
+  syncs_left = 2;
+  int result = rekey_vault(info, "password", CIPHER_XCHACHA);
+  syncs_left = -1;
+  if (result != VE_IOERR || access(rekey_path, F_OK) != 0) {
+    fprintf(stderr, "Interrupted rekey returned %d\n", result);
+    return 1;
+  }
+  return 0;
+}
+
+int main() {
+  char directory[] = "/tmp/test_rekeyXXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    fputs("Could not make a temporary directory\n", stderr);
+    return 1;
+  }
+  char pathname[64];
+  char rekey_path[sizeof(pathname) + 6];
+  snprintf(pathname, sizeof(pathname), "%s/rekey.vault", directory);
+  snprintf(rekey_path, sizeof(rekey_path), "%s.rekey", pathname);
+
+  struct vault_info* info = init_vault();
+  if (info == NULL || set_cipher_suite(info, CIPHER_SECRETBOX) ||
+      set_value_cache(info, 0, 0) ||
+      create_vault(directory, "rekey", "password", info)) {
+    fputs("Could not create the vault\n", stderr);
+    return 1;
+  }
+
+  char key[32];
+  char value[DATA_SIZE];
+  uint64_t bytes = 0;
+  int failed = vault_begin(info);
+  for (uint32_t i = 0; i < NUM_KEYS && !failed; ++i) {
+    snprintf(key, sizeof(key), "key%u", i);
+    uint32_t len = fill_value(value, i);
+    bytes += i % DELETE_STRIDE ? len : 0;
+    failed = add_key(info, TYPE_PASSWORD, key, value, i, len);
+  }
+  for (uint32_t i = 0; i < NUM_KEYS && !failed; i += DELETE_STRIDE) {
+    snprintf(key, sizeof(key), "key%u", i);
+    failed = delete_key(info, key);
+  }
+  failed = failed || vault_commit(info);
+  if (failed) {
+    fputs("Could not fill the vault\n", stderr);
+    return 1;
+  }
+
+  // Rekeying with the wrong password or inside a transaction is refused
+  failed = rekey_vault(info, "wrong", CIPHER_XCHACHA) != VE_WRONGPASS ||
+           vault_begin(info) ||
+           rekey_vault(info, "password", CIPHER_XCHACHA) != VE_PARAMERR ||
+           vault_abort(info);
+
+  double taken[2] = {0, 0};
+  uint32_t cores = sysconf(_SC_NPROCESSORS_ONLN);
+  cores = cores > MAX_WORKERS ? MAX_WORKERS : cores < 1 ? 1 : cores;
+  failed = failed || set_worker_count(info, 1) ||
+           rekey_checked(info, CIPHER_XCHACHA, &taken[0]) ||
+           set_worker_count(info, cores) ||
+           rekey_checked(info, CIPHER_XCHACHA, &taken[1]);
+
+  // The rekey picks up from the first checkpoint after the second failed
+  uint32_t entries = NUM_KEYS - NUM_KEYS / DELETE_STRIDE;
+  uint64_t resumed_seals = 0;
+  double ignored;
+  if (!failed) {
+    failed = interrupted_rekey(info, rekey_path);
+    seals = 0;
+    failed = failed || rekey_checked(info, CIPHER_XCHACHA, &ignored) ||
+             access(rekey_path, F_OK) == 0;
+    resumed_seals = seals;
+    if (!failed && (resumed_seals == 0 || resumed_seals >= entries)) {
+      fprintf(stderr, "Resumed rekey sealed %lu of %u entries\n",
+              (unsigned long)resumed_seals, entries);
+      failed = 1;
+    }
+  }
+
+  // A vault changed since the checkpoint is rekeyed from the start
+  if (!failed) {
+    failed = interrupted_rekey(info, rekey_path) ||
+             update_key(info, TYPE_PASSWORD, "key1", value,
+                        1, fill_value(value, 1));
+    seals = 0;
+    failed = failed || rekey_checked(info, CIPHER_XCHACHA, &ignored);
+    if (!failed && seals != entries) {
+      fprintf(stderr, "Rekey of a changed vault sealed %lu of %u entries\n",
+              (unsigned long)seals, entries);
+      failed = 1;
+    }
+  }
+
+  // Merkle vaults stay Merkle, and the file opens again afterwards
+  failed = failed || set_integrity_mode(info, INTEGRITY_MERKLE) ||
+           rekey_checked(info, CIPHER_SECRETBOX, &ignored);
+  if (!failed) {
+    sodium_mprotect_readonly(info);
+    failed = info->integrity != INTEGRITY_MERKLE;
+    sodium_mprotect_noaccess(info);
+  }
+  failed = failed || close_vault(info) ||
+           open_vault(directory, "rekey", "password", info) ||
+           check_values(info);
+
+  close_vault(info);
+  release_vault(info);
+  unlink(pathname);
+  unlink(rekey_path);
+  rmdir(directory);
+
+  printf("Rekey of %u entries, %.1f MB: %.0f MB/s on 1 worker, "
+         "%.0f MB/s on %u\n",
+         entries, bytes / 1e6, bytes / 1e6 / taken[0], bytes / 1e6 / taken[1],
+         cores);
+  printf("Resumed rekey sealed %lu of %u entries\n",
+         (unsigned long)resumed_seals, entries);
+  if (failed) {
+    fputs("FAILED: a rekey lost a value or did not resume\n", stderr);
+    return 1;
+  }
+  puts("PASSED");
+  return 0;
+}
@@ -0,0 +1,198 @@
+/**
+   test_scale.c - Large vault test for the 64-bit offsets of the file format
+
+   Built with `make scale` from the application directory, and run as
+
+   ./testing/test_scale [gigabytes]
+
+   The test fills a vault with values of DATA_SIZE bytes until its data
+   section holds the given number of gigabytes, DEFAULT_GIGABYTES by default,
+   which takes the file past 4 GB so that the later entries are only found
+   through the high half of their offsets. The vault is closed and opened
+   again, every UPDATE_STRIDE-th key is replaced, the vault is compacted, and
+   it is opened once more with every value read back and checked. The vault
+   is read with pread, as the pages of a mapped file count towards the
+   resident set, and the peak resident set of the whole run must stay within
+   MEMORY_BASE and MEMORY_PER_KEY for each key, so that memory follows the
+   number of keys rather than the size of the file. As the file is written
+   several times over, the test is not part of `make test`.
+ */
+#include "../vault.c"
+
+#include <sys/resource.h>
+#include <time.h>
+
+#define DEFAULT_GIGABYTES 5
+// Keys are numbered with a fixed width so every entry is the same size
+#define KEY_FORMAT "key%08u"
+#define KEY_LEN 11
+// Keys added or replaced in each transaction
+#define BATCH_KEYS 4096
+// Every this many keys are replaced once the vault has been opened again
+#define UPDATE_STRIDE 8
+// Peak resident set allowed, which includes the 256 MB taken by hashing the
+// password on each open, and the loc field and key map for each key
+#define MEMORY_BASE (320 << 20)
+#define MEMORY_PER_KEY 512
+
+double test_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+   function fill_value
+
+   Fills value with the DATA_SIZE bytes stored for the key numbered number
+   the version-th time it is written.
+ */
+void fill_value(char* value, uint32_t number, uint32_t version) {
+  memset(value, 'a' + (number + version) % 26, DATA_SIZE);
+  memcpy(value, &number, sizeof(uint32_t));
+  memcpy(value + sizeof(uint32_t), &version, sizeof(uint32_t));
+}
+
+/**
+   function write_keys
+
+   Writes every stride-th of the first count keys with the given version, in
+   transactions of BATCH_KEYS, adding them for the first version and
+   replacing them afterwards.
+
+   Returns VE_SUCCESS or the first error from writing a key
+ */
+int write_keys(struct vault_info* info, uint32_t count, uint32_t stride,
+               uint32_t version) {
+  char key[32];
+  char value[DATA_SIZE];
+  int result = VE_SUCCESS;
+  for (uint32_t i = 0; i < count && !result; i += stride) {
+    if ((i / stride) % BATCH_KEYS == 0) {
+      result = vault_begin(info);
+    }
+    snprintf(key, sizeof(key), KEY_FORMAT, i);
+    fill_value(value, i, version);
+    if (!result) {
+      result = version == 0
+                   ? add_key(info, 1, key, value, i, DATA_SIZE)
+                   : update_key(info, 1, key, value, i, DATA_SIZE);
+    }
+    if (!result && ((i / stride) % BATCH_KEYS == BATCH_KEYS - 1 ||
+                    i + stride >= count)) {
+      result = vault_commit(info);
+    }
+  }
+  return result;
+}
+
+/**
+   function check_values
+
+   Reads back the value of each of the first count keys, which are expected
+   to be at the first version, or the second for every stride-th key.
+
+   Returns zero, or one if a value could not be read or was wrong
+ */
+int check_values(struct vault_info* info, uint32_t count, uint32_t stride) {
+  char key[32];
+  char expected[DATA_SIZE];
+  char value[DATA_SIZE];
+  for (uint32_t i = 0; i < count; ++i) {
+    snprintf(key, sizeof(key), KEY_FORMAT, i);
+    fill_value(expected, i, i % stride == 0);
+    int len = 0;
+    char type = 0;
+    if (open_key(info, key) || place_open_value(info, value, &len, &type) ||
+        len != DATA_SIZE || memcmp(value, expected, DATA_SIZE) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  uint64_t gigabytes = argc > 1 ? strtoull(argv[1], NULL, 10)
+                                : DEFAULT_GIGABYTES;
+
+  char directory[] = "/tmp/test_scaleXXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    fputs("Could not make a temporary directory\n", stderr);
+    return 1;
+  }
+
+  struct vault_info* info = init_vault();
+  uint8_t cipher = CIPHER_SECRETBOX;
+  if (info == NULL || set_read_mode(info, READ_PREAD) ||
+      create_vault(directory, "scale", "password", info) ||
+      get_cipher_suite(info, &cipher)) {
+    fputs("Could not create the vault\n", stderr);
+    return 1;
+  }
+  // The size of the entries depends on the cipher suite the vault was given
+  uint32_t count =
+      (gigabytes << 30) / internal_entry_size(cipher, KEY_LEN, DATA_SIZE) + 1;
+
+  double times[5];
+  struct vault_stats filled = {0};
+  struct vault_stats compacted = {0};
+  double start = test_now();
+  int failed = write_keys(info, count, 1, 0) ||
+               get_vault_stats(info, &filled) || close_vault(info);
+  times[0] = test_now() - start;
+
+  start = test_now();
+  failed = failed || open_vault(directory, "scale", "password", info) ||
+           num_vault_keys(info) != count;
+  times[1] = test_now() - start;
+
+  start = test_now();
+  failed = failed || write_keys(info, count, UPDATE_STRIDE, 1);
+  times[2] = test_now() - start;
+
+  start = test_now();
+  failed = failed || compact_vault(info) ||
+           get_vault_stats(info, &compacted) || compacted.dead_bytes != 0 ||
+           close_vault(info);
+  times[3] = test_now() - start;
+
+  start = test_now();
+  failed = failed || open_vault(directory, "scale", "password", info) ||
+           check_values(info, count, UPDATE_STRIDE);
+  times[4] = test_now() - start;
+  close_vault(info);
+  release_vault(info);
+
+  char pathname[64];
+  snprintf(pathname, sizeof(pathname), "%s/scale.vault", directory);
+  unlink(pathname);
+  rmdir(directory);
+
+  if (failed) {
+    fputs("FAILED: the large vault lost or mixed up values\n", stderr);
+    return 1;
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  uint64_t peak = (uint64_t)usage.ru_maxrss * 1024;
+  uint64_t budget = MEMORY_BASE + (uint64_t)count * MEMORY_PER_KEY;
+  printf("%u keys, %.2f GB filled, %.2f GB compacted\n", count,
+         filled.file_bytes / 1e9, compacted.file_bytes / 1e9);
+  printf("fill %.1f s, open %.1f s, update %.1f s, compact %.1f s, "
+         "open and check %.1f s\n",
+         times[0], times[1], times[2], times[3], times[4]);
+  printf("Peak resident set %.1f MB of a %.1f MB budget\n", peak / 1e6,
+         budget / 1e6);
+
+  if (compacted.file_bytes < (gigabytes << 30)) {
+    fputs("FAILED: the vault did not keep its size\n", stderr);
+    return 1;
+  }
+  if (peak > budget) {
+    fputs("FAILED: memory grew past the budget\n", stderr);
+    return 1;
+  }
+  puts("PASSED");
+  return 0;
+}
@@ -0,0 +1,355 @@
+/**
+   test_syscalls.c - Syscall budget regression test for the vault library
+
+   Built and run with `make test` from the application directory.
+
+   The test includes vault.c directly, after wrapping the file related calls
+   it makes in macros that count them, and then checks that appending a key
+   stays within a fixed number of syscalls. Appends must also never move the
+   file offset, as all of their I/O is positioned. A write transaction that
+   adds and updates many keys is also checked to write them all out at once
+   on commit, with only the wipes of the old values written one at a time.
+   Opening keys in turn is checked to be served by the value cache without
+   reading the file, and deleted or expired values to be dropped from it.
+   Opening many keys in one batch is checked to make the vault readable once
+   and to read the entries, which are close together, in a few large reads.
+ */
+#include <fcntl.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int syscalls = 0;
+static int seeks = 0;
+static int unprotects = 0;
+
+#define read(...) (syscalls++, read(__VA_ARGS__))
+#define write(...) (syscalls++, write(__VA_ARGS__))
+#define pread(...) (syscalls++, pread(__VA_ARGS__))
+#define pwrite(...) (syscalls++, pwrite(__VA_ARGS__))
+#define pwritev(...) (syscalls++, pwritev(__VA_ARGS__))
+#define lseek(...) (syscalls++, seeks++, lseek(__VA_ARGS__))
+#define mmap(...) (syscalls++, mmap(__VA_ARGS__))
+#define munmap(...) (syscalls++, munmap(__VA_ARGS__))
+#define ftruncate(...) (syscalls++, ftruncate(__VA_ARGS__))
+#define fdatasync(...) (syscalls++, fdatasync(__VA_ARGS__))
+#define sodium_mprotect_readwrite(...) \
+  (unprotects++, sodium_mprotect_readwrite(__VA_ARGS__))
+
+#include "../vault.c"
+
+// Most syscalls a single append may make, including remapping the file
+#define APPEND_SYSCALL_BUDGET 4
+// Most syscalls a single append may make reading with pread, which adds a
+// read of the header, as free slots are found from memory
+#define APPEND_PREAD_BUDGET 3
+// Most syscalls an append may make on average with the file mapped
+#define APPEND_AVERAGE_BUDGET 2.5
+// Appends measured per mode, kept below INITIAL_SIZE so none condense
+#define APPENDS 80
+// Keys added before, and then updated and added in, the measured transaction,
+// together kept below INITIAL_SIZE so the transaction does not condense
+#define TXN_KEYS 30
+#define TXN_UPDATES 20
+#define TXN_ADDS 40
+// Most syscalls a transaction may make besides one wipe per update: the
+// entries, the loc slots, the trailer, a sync and remapping the file, both
+// when the entries being updated are first read past the mapping and after
+#define TXN_SYSCALL_BUDGET 8
+// Merkle vaults also read back the new segments past the mapping to hash them
+#define TXN_MERKLE_READS 4
+// Keys opened in turn, fewer than the cache holds, and the opens made
+#define CACHE_KEYS 4
+#define CACHE_OPENS 100
+// Seconds cached values live for, and microseconds waited for them to expire
+#define CACHE_TTL 1
+#define CACHE_WAIT 1100000
+// Keys opened in one batch, and the most syscalls the batch may make reading
+// them with pread, as they are read BATCH_READ_SIZE bytes at a time
+#define BATCH_KEYS 1000
+#define BATCH_SYSCALL_BUDGET 4
+
+/**
+   function test_appends
+
+   Creates a vault with the given read and integrity modes, appends APPENDS
+   keys to it and checks each one against the budget.
+
+   Returns the average number of syscalls per append, or a negative number
+   if any append failed or went over the budget
+ */
+double test_appends(const char* directory, const char* username,
+                    uint8_t read_mode, uint8_t integrity, int budget) {
+  struct vault_info* info = init_vault();
+  set_read_mode(info, read_mode);
+  if (create_vault((char*)directory, (char*)username, "password", info) ||
+      set_integrity_mode(info, integrity)) {
+    fputs("Could not create the vault\n", stderr);
+    return -1;
+  }
+
+  char key[32];
+  int total = 0;
+  for (int i = 0; i < APPENDS; ++i) {
+    snprintf(key, sizeof(key), "key%d", i);
+    syscalls = 0;
+    seeks = 0;
+    if (add_key(info, 1, key, "value", i, 5)) {
+      fprintf(stderr, "Could not add %s\n", key);
+      return -1;
+    }
+
+    if (syscalls > budget || seeks > 0) {
+      fprintf(stderr, "Append %d made %d syscalls and %d seeks\n", i, syscalls,
+              seeks);
+      return -1;
+    }
+    total += syscalls;
+  }
+
+  close_vault(info);
+  release_vault(info);
+  return (double)total / APPENDS;
+}
+
+/**
+   function test_transaction
+
+   Creates a vault with the given integrity mode and TXN_KEYS keys, and then
+   updates TXN_UPDATES of them and adds TXN_ADDS more in a single transaction.
+
+   Returns the number of syscalls the transaction made, or a negative number
+   if any step failed or the transaction went over the budget
+ */
+int test_transaction(const char* directory, const char* username,
+                     uint8_t integrity) {
+  struct vault_info* info = init_vault();
+  if (create_vault((char*)directory, (char*)username, "password", info) ||
+      set_integrity_mode(info, integrity)) {
+    fputs("Could not create the vault\n", stderr);
+    return -1;
+  }
+
+  char key[32];
+  for (int i = 0; i < TXN_KEYS; ++i) {
+    snprintf(key, sizeof(key), "key%d", i);
+    if (add_key(info, 1, key, "value", i, 5)) {
+      fprintf(stderr, "Could not add %s\n", key);
+      return -1;
+    }
+  }
+
+  syscalls = 0;
+  seeks = 0;
+  int failed = vault_begin(info);
+  for (int i = 0; i < TXN_UPDATES && !failed; ++i) {
+    snprintf(key, sizeof(key), "key%d", i);
+    failed = update_key(info, 1, key, "updated", i, 7);
+  }
+  for (int i = TXN_KEYS; i < TXN_KEYS + TXN_ADDS && !failed; ++i) {
+    snprintf(key, sizeof(key), "key%d", i);
+    failed = add_key(info, 1, key, "value", i, 5);
+  }
+  failed = failed || vault_commit(info);
+
+  int made = syscalls;
+  int budget = TXN_UPDATES + TXN_SYSCALL_BUDGET +
+               (integrity == INTEGRITY_MERKLE ? TXN_MERKLE_READS : 0);
+  if (failed || made > budget || seeks > 0) {
+    fprintf(stderr, "Transaction failed or made %d syscalls and %d seeks\n",
+            made, seeks);
+    made = -1;
+  }
+
+  close_vault(info);
+  if (made >= 0 && (open_vault((char*)directory, (char*)username, "password",
+                               info) ||
+                    num_vault_keys(info) != TXN_KEYS + TXN_ADDS ||
+                    open_key(info, "key0") || open_key(info, "key69"))) {
+    fputs("Transaction was not kept after reopening\n", stderr);
+    made = -1;
+  }
+  close_vault(info);
+  release_vault(info);
+  return made;
+}
+
+/**
+   function test_cache
+
+   Creates a vault read with pread, adds CACHE_KEYS keys and opens them in
+   turn CACHE_OPENS times, which after the first open of each must not touch
+   the file. A deleted key must not be served from the cache, and the other
+   values must be decrypted again once they expire.
+
+   Returns the number of syscalls made by the opens served by the cache, or
+   a negative number if any step failed or the cache did not behave
+ */
+int test_cache(const char* directory, const char* username) {
+  struct vault_info* info = init_vault();
+  set_read_mode(info, READ_PREAD);
+  set_value_cache(info, DEFAULT_CACHE_VALUES, CACHE_TTL);
+  if (create_vault((char*)directory, (char*)username, "password", info)) {
+    fputs("Could not create the vault\n", stderr);
+    return -1;
+  }
+
+  char key[32];
+  char value[DATA_SIZE + 1];
+  int len;
+  char type;
+  int failed = 0;
+  for (int i = 0; i < CACHE_KEYS && !failed; ++i) {
+    snprintf(key, sizeof(key), "key%d", i);
+    failed = add_key(info, 1, key, key, i, strlen(key) + 1);
+  }
+
+  int made = 0;
+  for (int i = 0; i < CACHE_OPENS && !failed; ++i) {
+    snprintf(key, sizeof(key), "key%d", i % CACHE_KEYS);
+    syscalls = 0;
+    failed = open_key(info, key) ||
+             place_open_value(info, value, &len, &type) ||
+             strcmp(value, key) != 0;
+    made += i < CACHE_KEYS ? 0 : syscalls;
+  }
+
+  struct cache_stats stats;
+  failed = failed || get_cache_stats(info, &stats) ||
+           stats.misses != CACHE_KEYS ||
+           stats.hits != CACHE_OPENS - CACHE_KEYS ||
+           stats.cached != CACHE_KEYS;
+
+  failed = failed || delete_key(info, "key0") ||
+           open_key(info, "key0") != VE_KEYEXIST ||
+           get_cache_stats(info, &stats) || stats.cached != CACHE_KEYS - 1;
+
+  usleep(CACHE_WAIT);
+  failed = failed || expire_cached_values(info) ||
+           get_cache_stats(info, &stats) || stats.cached != 0 ||
+           open_key(info, "key1") || get_cache_stats(info, &stats) ||
+           stats.misses != CACHE_KEYS + 1;
+
+  if (failed || made > 0) {
+    fprintf(stderr, "Cache failed or its hits made %d syscalls\n", made);
+    made = -1;
+  }
+  close_vault(info);
+  release_vault(info);
+  return made;
+}
+
+/**
+   function test_batch
+
+   Creates a vault read with pread, adds BATCH_KEYS keys in a transaction and
+   opens all of them, along with a key that does not exist, with open_keys in
+   the reverse of the order they were added.
+
+   Returns the number of syscalls the batch made, or a negative number if
+   any value was wrong or the batch went over the budget
+ */
+int test_batch(const char* directory, const char* username) {
+  struct vault_info* info = init_vault();
+  set_read_mode(info, READ_PREAD);
+  if (create_vault((char*)directory, (char*)username, "password", info)) {
+    fputs("Could not create the vault\n", stderr);
+    return -1;
+  }
+
+  char(*keys)[32] = malloc(sizeof(*keys) * (BATCH_KEYS + 1));
+  const char** batch = malloc(sizeof(char*) * (BATCH_KEYS + 1));
+  struct vault_value* values =
+      malloc(sizeof(struct vault_value) * (BATCH_KEYS + 1));
+  int failed = keys == NULL || batch == NULL || values == NULL ||
+               vault_begin(info);
+  for (int i = 0; i < BATCH_KEYS && !failed; ++i) {
+    snprintf(keys[i], sizeof(*keys), "key%d", i);
+    failed = add_key(info, 1, keys[i], keys[i], i, strlen(keys[i]) + 1);
+    batch[BATCH_KEYS - 1 - i] = keys[i];
+  }
+  failed = failed || vault_commit(info);
+  batch[BATCH_KEYS] = "missing";
+
+  uint64_t needed = 0;
+  char* buffer = NULL;
+  failed = failed ||
+           open_keys(info, batch, BATCH_KEYS + 1, NULL, 0, values, &needed) !=
+               VE_NOSPACE ||
+           (buffer = alloc_secure_buffer(needed)) == NULL;
+
+  syscalls = 0;
+  unprotects = 0;
+  failed = failed || open_keys(info, batch, BATCH_KEYS + 1, buffer, needed,
+                               values, &needed) != VE_KEYEXIST;
+  int made = syscalls;
+  int made_unprotects = unprotects;
+  for (int i = 0; i < BATCH_KEYS && !failed; ++i) {
+    failed = values[i].result != VE_SUCCESS || values[i].type != 1 ||
+             strcmp(buffer + values[i].offset, batch[i]) != 0;
+  }
+  failed = failed || values[BATCH_KEYS].result != VE_KEYEXIST;
+
+  if (failed || made > BATCH_SYSCALL_BUDGET || made_unprotects != 1) {
+    fprintf(stderr, "Batch failed or made %d syscalls and %d unprotects\n",
+            made, made_unprotects);
+    made = -1;
+  }
+  if (buffer != NULL) {
+    free_secure_buffer(buffer);
+  }
+  variadic_free(3, keys, batch, values);
+  close_vault(info);
+  release_vault(info);
+  return made;
+}
+
+int main() {
+  char directory[] = "/tmp/test_vaultXXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    fputs("Could not make a temporary directory\n", stderr);
+    return 1;
+  }
+
+  double mapped = test_appends(directory, "mapped", READ_MMAP,
+                               INTEGRITY_INCREMENTAL, APPEND_SYSCALL_BUDGET);
+  double unmapped = test_appends(directory, "unmapped", READ_PREAD,
+                                 INTEGRITY_INCREMENTAL, APPEND_PREAD_BUDGET);
+  printf("Syscalls per append: %.2f mapped, %.2f with pread\n", mapped,
+         unmapped);
+
+  int incremental = test_transaction(directory, "incremental",
+                                     INTEGRITY_INCREMENTAL);
+  int merkle = test_transaction(directory, "merkle", INTEGRITY_MERKLE);
+  printf("Syscalls per transaction of %d changes: %d incremental, %d merkle\n",
+         TXN_UPDATES * 2 + TXN_ADDS, incremental, merkle);
+
+  int cached = test_cache(directory, "cached");
+  printf("Syscalls per open served by the value cache: %.2f\n",
+         cached < 0 ? -1.0 : (double)cached / (CACHE_OPENS - CACHE_KEYS));
+
+  int batched = test_batch(directory, "batched");
+  printf("Syscalls opening %d keys in one batch: %d\n", BATCH_KEYS, batched);
+
+  char pathname[64];
+  const char* usernames[6] = {"mapped", "unmapped", "incremental", "merkle",
+                              "cached", "batched"};
+  for (int i = 0; i < 6; ++i) {
+    snprintf(pathname, sizeof(pathname), "%s/%s.vault", directory,
+             usernames[i]);
+    unlink(pathname);
+  }
+  rmdir(directory);
+
+  if (mapped < 0 || unmapped < 0 || mapped > APPEND_AVERAGE_BUDGET ||
+      incremental < 0 || merkle < 0 || cached < 0 || batched < 0) {
+    fputs("FAILED: writes went over the syscall budget\n", stderr);
+    return 1;
+  }
+  puts("PASSED");
+  return 0;
+}
@@ -85,7 +85,7 @@ class TestVault(Vault_intf):
             self.current_vault[key] = (value, TestVault.__get_current_time())
             return True
 
-    def delete_value(self, key):
+    def delete_value(self, key, m_time=None):
         if self.current_vault is None:
             return False
         else:
@@ -4,14 +4,18 @@
 // C libraries
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sodium.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 /**
@@ -41,14 +45,99 @@
    LENGTH | STATE1 | LOC1 | KEY_LEN1 | VAL_LEN1 | STATE2 | LOC2 | KEY_LEN2 | ...
       4       4       4        4          4         4       4        4
 
+   From version 2 of the format, each loc slot is followed by a key directory
+   holding a copy of the start of its entry, so that the key map can be built
+   from the loc field alone, read in one go, without reading every entry. The
+   slots are DIR_LOC_SIZE bytes, with any space after the key left as zeros.
+
+   STATE | LOC | KEY_LEN | VAL_LEN | MTIME | TYPE | KEY  | ZEROS
+     4      4       4         4        8      1    KLEN
+
+   From version 3, each slot ends with the high half of where its entry
+   starts, so that the file can grow past 4 GB. The slots are WIDE_LOC_SIZE
+   bytes. A vault in an older format is condensed into the current one before
+   it grows past 4 GB, as its slots only hold the low half.
+
+   STATE | LOC | KEY_LEN | VAL_LEN | MTIME | TYPE | KEY  | ZEROS | LOC_HIGH
+     4      4       4         4        8      1    KLEN              4
+
    Finally in the file comes the key value pairs, the actual data being stored.
    If the entry is deleted, the E_VAL field should be wiped with zeros.
 
    MTIME | TYPE | KEY | E_VAL | VAL_MAC | VAL_NONCE | HASH
      8      1     KLEN   VLEN     16         24        32
 
-   Finally at the end of the file is a hash of the entire file, keyed with the
-   master key to prevent tampering.
+   The third byte of the version field selects the cipher suite the values
+   are encrypted with. CIPHER_SECRETBOX, which every vault made before the
+   byte was used has, seals the value with XSalsa20-Poly1305 and then hashes
+   the whole entry with the master key as above. The AEAD suites,
+   CIPHER_XCHACHA and CIPHER_AESGCM, authenticate the type and key as
+   associated data while encrypting the value, so their entries have no hash
+   and are checked in the same pass that decrypts them. The time is left out
+   of the associated data as it is replaced when an entry comes back from
+   the server, and is covered by the trailer instead. AES-256-GCM has a
+   96-bit nonce, and is only chosen on CPUs with hardware AES, so a vault
+   using it cannot be opened on a machine without.
+
+   MTIME | TYPE | KEY | E_VAL | VAL_MAC | VAL_NONCE
+     8      1     KLEN   VLEN     16       24 or 12
+
+   Finally at the end of the file is a trailer, keyed with the master key to
+   prevent tampering. The second byte of the version field selects how the
+   trailer is computed, and the fourth byte whether the file is verified by
+   one thread or split across a pool of workers when it is opened.
+
+   With INTEGRITY_FILE, the trailer is a keyed hash of the entire file, and has
+   to be recomputed from scratch after every change.
+
+   With INTEGRITY_INCREMENTAL, the file is split into regions: every loc slot,
+   every entry in the data section (deleted or not), and any bytes between
+   entries. Each region gets a keyed hash bound to its kind and position, and
+   the hashes are XORed together into a running mac. A change to a region
+   removes its old hash and adds its new one, so a write only costs as much as
+   the bytes it changed. The trailer is then
+
+   GENERATION | TAG
+        8        24
+
+   where the generation is bumped on every write, and the tag is a keyed hash
+   of the generation, the end of the data section, the header and the mac.
+   Binding the generation and header into the tag stops regions from different
+   versions of the file from being mixed together.
+
+   With INTEGRITY_MERKLE, the file up to the end of the data section is split
+   into SEGMENT_SIZE segments, which are the leaves of a keyed Merkle tree.
+   The tree is stored after the data section, one level after another starting
+   from the leaves, followed by where the data section ends.
+
+   PAIRS | LEAVES | LEVEL1 | ... | ROOT | DATA_END | GENERATION | TAG
+             32*N    32*N/2          32       8           8        24
+
+   The trailer is the same as for incremental vaults with the root in place of
+   the mac. A write only rehashes the segments it touched and the nodes above
+   them, and opening the vault checks the tree and the segments holding the
+   header and loc data. The other segments are checked the first time an entry
+   in them is read, so single entries can be trusted without reading the file.
+
+   Incremental and Merkle vaults may also hold a snapshot of the key map right
+   before the trailer, written when the vault is closed so that the next open
+   can load the map as it was instead of building it again. Its length is in
+   the four bytes of the header after the verify mode, zero if there is none.
+   The snapshot is encrypted with a key derived from the master key, which
+   also authenticates it, and is left out of the mac and tree.
+
+   PAIRS | TREE | NONCE | SNAPSHOT_MAC | SNAPSHOT | GENERATION | TAG
+                   24         16
+
+   It only holds for the file it was written with, so it records the
+   generation and mac or root of that file, along with the loc field length,
+   end of the data section and slot counts, followed by an image of the map
+   and one of the tombstones of deleted keys, which are not in the file.
+   The first write after the vault is opened drops the snapshot again.
+
+   GENERATION | DATA_END | LIVE_BYTES | LOC_LEN | LIVE | DEAD | MAP_LEN | MAC
+        8          8           8           4       4      4       4       32
+   | MAP | TOMBSTONES
  */
 
 /**
@@ -61,6 +150,66 @@ struct vault_box {
   char value[DATA_SIZE];
 };
 
+/**
+   cached_value - a box kept in the value cache, with when it was decrypted
+   in milliseconds, for its time to live, and the tick it was last used at,
+   for picking the least recently used one to replace
+ */
+struct cached_value {
+  struct vault_box box;
+  uint64_t opened_at;
+  uint64_t used_at;
+};
+
+// 96-bit nonce for AES-256-GCM, stored in place of the XChaCha20 one
+#define GCM_NONCE_SIZE 12
+
+// Largest entry a loc slot can describe, which is with CIPHER_SECRETBOX
+#define MAX_ENTRY_SIZE                                                  \
+  (ENTRY_HEADER_SIZE + BOX_KEY_SIZE + DATA_SIZE + MAC_SIZE + NONCE_SIZE + \
+   HASH_SIZE)
+
+// Loc slot at index of the loc field locs, laid out like the vault's
+#define LOC_SLOT(info, locs, index) \
+  ((locs) + (size_t)(index) * ((info)->loc_size / 4))
+// Word of a slot of WIDE_LOC_SIZE bytes with the high half of its offset
+#define LOC_HIGH_WORD (DIR_LOC_SIZE / 4)
+// Most slots a loc field may have, so that it stays below 4 GB along with
+// the offsets of the slots, which is how the key map refers to them
+#define MAX_LOC_LEN(info) ((UINT32_MAX - HEADER_SIZE) / (info)->loc_size)
+
+// Where the length of the key map snapshot is kept in the header
+#define SNAPSHOT_LEN_AT 4
+// Bytes of the snapshot before the map, and of the box around it
+#define SNAPSHOT_FIELDS_SIZE (3 * 8 + 4 * 4 + HASH_SIZE)
+#define SNAPSHOT_BOX_SIZE (NONCE_SIZE + MAC_SIZE)
+// Largest map and tombstone images written to a snapshot, so the snapshot
+// and its plain text fit in memory together with 32-bit lengths
+#define MAX_SNAPSHOT_MAP_SIZE (1 << 30)
+
+// Most bytes of a mapped file hashed with a single call
+#define HASH_MAPPED_SIZE (1 << 30)
+// Most bytes a batch of opened keys reads at once, and the most unwanted
+// bytes between two entries it reads through rather than reading separately
+#define BATCH_READ_SIZE (256 * 1024)
+#define BATCH_READ_GAP 4096
+// Bytes of the new file a condense gathers before writing them
+#define CONDENSE_BUFFER_SIZE (64 * 1024)
+// Fewest garbage bytes that trigger a compaction, so small vaults are left be
+#define COMPACT_MIN_GARBAGE (64 * 1024)
+// Most bytes of the new file a rekey seals between two writes, and how many
+// of those batches it writes between two checkpoints
+#define REKEY_BATCH_SIZE (1024 * 1024)
+#define REKEY_SYNC_BATCHES 16
+// Entries done, the mac of them and the tag of both, kept by a rekey where
+// the trailer of its new file goes
+#define REKEY_CHECKPOINT_SIZE (8 + 2 * HASH_SIZE)
+
+// Number of separate ranges of a Merkle tree that are updated on each seal
+#define MAX_DIRTY_RANGES 8
+// Enough levels for a tree with 2^32 leaves
+#define MAX_TREE_LEVELS 33
+
 /**
    vault_info - struct to hold info of the currently open vault
 
@@ -81,7 +230,64 @@ struct vault_info {
   uint8_t decrypted_master[MASTER_KEY_SIZE];
   crypto_generichash_state hash_state;
   struct vault_box current_box;
+
+  struct cached_value* cache;  // Recently opened boxes, in secure memory
+  uint32_t cache_capacity;     // Boxes the cache holds, zero when off
+  uint32_t cache_ttl;          // Seconds a box is kept, zero for no limit
+  uint64_t cache_tick;         // Counts uses, to find the least recent box
+  uint64_t cache_hits;         // Opens served from the cache
+  uint64_t cache_misses;       // Opens that had to decrypt
+
   struct vault_map* key_info;
+  struct vault_map* tombstones;  // Times keys were deleted, kept in snapshots
+
+  uint8_t integrity;            // INTEGRITY_ mode from the header
+  uint8_t cipher;               // CIPHER_ suite the file is sealed with
+  uint8_t new_cipher;           // Suite asked for new vaults
+  uint64_t generation;          // Seals of the file since it was created
+  uint64_t data_end;            // Where the data section ends
+  uint8_t file_mac[HASH_SIZE];  // Running mac of incremental vaults
+  uint8_t* tree;                // Merkle tree, leaves first
+  uint8_t* leaf_checked;        // Bit per leaf checked since open
+  uint32_t tree_leaves;         // Leaves the tree has
+  uint64_t tree_written_at;     // Data end the tree was last written at
+  uint32_t num_dirty;           // Ranges written since the last seal
+  uint8_t verify;               // VERIFY_ mode from the header
+  uint32_t workers;             // Threads verification is spread across
+  // First and last leaf of each range written since the last seal
+  uint32_t dirty_leaves[MAX_DIRTY_RANGES][2];
+
+  uint8_t read_mode;  // READ_MMAP or READ_PREAD
+  uint8_t* map;       // File mapped read only up to the trailer, or NULL
+  uint64_t map_len;   // Bytes mapped
+
+  uint32_t* locs;      // Copy of the loc field
+  uint32_t loc_len;    // Slots in the loc field
+  uint32_t loc_size;   // Bytes per slot, set by the format version
+  uint32_t next_free;  // Lowest slot that may be unused
+
+  int in_txn;                // Whether a write transaction is open
+  uint64_t txn_start;        // Data end when the transaction began
+  uint8_t* txn_data;         // Entries appended since then
+  uint32_t txn_len;          // Bytes of txn_data used
+  uint32_t txn_cap;          // Bytes txn_data holds
+  uint64_t (*txn_wipes)[2];  // Start and length of each value to wipe
+  uint32_t num_wipes;        // Wipes queued
+  uint32_t wipes_cap;        // Wipes txn_wipes holds
+  uint32_t txn_loc_first;    // First loc slot changed, or UINT32_MAX
+  uint32_t txn_loc_last;     // Last loc slot changed
+
+  uint32_t live_slots;              // Active slots
+  uint32_t dead_slots;              // Deleted slots
+  uint64_t live_bytes;              // Bytes taken by active entries
+  uint32_t snapshot_len;            // Snapshot bytes, while it matches the file
+  uint8_t garbage_percent;          // Garbage that triggers a compaction
+  uint8_t fill_percent;             // Active share a compaction leaves
+  uint8_t background;               // Whether compactions run on a thread
+  struct compact_job* compact_job;  // Compaction running, or NULL
+
+  // Kept so that the file can be replaced by a condensed copy
+  char pathname[MAX_PATH_LEN + MAX_USER_SIZE + 10];
 };
 
 const char* filename_pattern = "%s/%s.vault";
@@ -151,6 +357,15 @@ void variadic_free(int count, ...) {
 #define STATE_ACTIVE ((1 << 16) | 1)
 #define STATE_DELETED 1
 
+// Kinds of regions that are hashed into the incremental file mac
+#define REGION_LOC 1
+#define REGION_ENTRY 2
+#define REGION_GAP 3
+#define REGION_SEGMENT 4
+#define REGION_NODE 5
+#define REGION_SNAPSHOT 6  // Only used to derive the snapshot key
+#define REGION_REKEY 7     // Only used to tag the checkpoints of a rekey
+
 int max_value_size() { return DATA_SIZE; }
 
 /**
@@ -166,15 +381,111 @@ int max_value_size() { return DATA_SIZE; }
    writable, and most do not change these upon return.
  */
 
+/**
+   functions internal_map_file and internal_unmap_file
+
+   Map the first len bytes of the file read only, replacing any earlier
+   mapping, or remove the mapping. Writes still go through the file
+   descriptor, and are seen through a shared mapping straight away. A mapping
+   must be removed before the file is made shorter than it, as touching bytes
+   past the end of the file is fatal. If the file cannot be mapped, or the
+   read mode is READ_PREAD, reads fall back to pread.
+ */
+void internal_unmap_file(struct vault_info* info) {
+  if (info->map != NULL) {
+    munmap(info->map, info->map_len);
+  }
+  info->map = NULL;
+  info->map_len = 0;
+}
+
+void internal_map_file(struct vault_info* info, uint64_t len) {
+  if (info->map != NULL && info->map_len == len) {
+    return;
+  }
+
+  internal_unmap_file(info);
+  if (info->read_mode != READ_MMAP || len == 0) {
+    return;
+  }
+
+  void* map = mmap(NULL, len, PROT_READ, MAP_SHARED, info->user_fd, 0);
+  if (map == MAP_FAILED) {
+    FPUTS("Could not map file, falling back to pread\n", stderr);
+    return;
+  }
+  info->map = map;
+  info->map_len = len;
+}
+
+/**
+   function internal_update_map
+
+   Called after the end of the file moves to len. A file that got shorter is
+   always mapped again, but a file that grew is only mapped again once the
+   part past the mapping is more than a quarter of the mapping, so that
+   appends do not remap the file every time. Bytes past the mapping are read
+   with pread until then.
+ */
+void internal_update_map(struct vault_info* info, uint64_t len) {
+  if (info->map != NULL && len >= info->map_len &&
+      len - info->map_len <= info->map_len / 4) {
+    return;
+  }
+  internal_map_file(info, len);
+}
+
+/**
+   function internal_read_at
+
+   Reads len bytes at offset in the file. If the bytes are inside the
+   mapping, a pointer to them in the mapping is returned and nothing is
+   copied. Otherwise they are read into buffer with pread, which must then
+   hold at least len bytes, and buffer is returned. Passing a NULL buffer only
+   returns bytes that are mapped. Bytes appended during a write transaction
+   are returned from the transaction buffer, as they are not in the file yet.
+   Reading entries appended past the mapping maps the file again up to the
+   end of the data section first, as the loc field can make up most of the
+   mapping and keep appends from growing it for a long time.
+
+   Returns a pointer to the bytes
+   NULL if they could not be read
+ */
+const uint8_t* internal_read_at(struct vault_info* info, uint64_t offset,
+                                uint32_t len, uint8_t* buffer) {
+  if (info->txn_len > 0 && offset >= info->txn_start) {
+    offset -= info->txn_start;
+    if (offset > info->txn_len || len > info->txn_len - offset) {
+      return NULL;
+    }
+    return info->txn_data + offset;
+  }
+
+  uint64_t data_end = info->txn_len > 0 ? info->txn_start : info->data_end;
+  if (info->map != NULL && offset + len > info->map_len &&
+      offset <= data_end && len <= data_end - offset) {
+    internal_map_file(info, data_end);
+  }
+  if (info->map != NULL && offset <= info->map_len &&
+      len <= info->map_len - offset) {
+    return info->map + offset;
+  }
+
+  if (buffer == NULL || pread(info->user_fd, buffer, len, offset) != len) {
+    return NULL;
+  }
+  return buffer;
+}
+
 /**
    function internal_hash_file
 
-   Hashes the file_size-HASH_SIZE bytes of the file. As the hash is keyed with
+   Hashes the first bytes_to_hash bytes of the file. As the hash is keyed with
    the master key, the hash ensures the integrity of the vault file at rest.
    The file hash is placed in the hash parameter, expected to be HASH_SIZE
-   bytes in size. The offset passed in is the number of bytes at the end of
-   the file to not add into the hash, which can be useful to hash all of the
-   file with the exception of the appended hash.
+   bytes in size. Passing the end of the data section hashes all of the file
+   with the exception of the appended trailer. Mapped bytes are hashed in
+   place, up to HASH_MAPPED_SIZE at a time, and the rest read 1 KB at a time.
 
    Returns VE_SUCCESS if the hash was successful.
    VE_CRYPTOERR if any part of the hashing itself fails
@@ -182,22 +493,35 @@ int max_value_size() { return DATA_SIZE; }
  */
 
 int internal_hash_file(struct vault_info* info, uint8_t* hash,
-                       uint32_t off_end) {
-  int file_size = lseek(info->user_fd, 0, SEEK_END);
-  if (file_size < 0) {
-    return VE_IOERR;
-  }
-  uint32_t bytes_to_hash = file_size - off_end;
+                       uint64_t bytes_to_hash) {
   uint8_t buffer[1024];
-  if (lseek(info->user_fd, 0, SEEK_SET) < 0) {
-    return VE_IOERR;
-  }
-
   if (crypto_generichash_init(&info->hash_state, info->decrypted_master,
                               MASTER_KEY_SIZE, HASH_SIZE) < 0) {
     return VE_CRYPTOERR;
   }
 
+  // A mapped file is hashed in place in a few large calls
+  uint64_t offset = 0;
+  while (bytes_to_hash > 0) {
+    uint32_t amount_at_once = bytes_to_hash > HASH_MAPPED_SIZE
+                                  ? HASH_MAPPED_SIZE
+                                  : bytes_to_hash;
+    const uint8_t* mapped =
+        internal_read_at(info, offset, amount_at_once, NULL);
+    if (mapped == NULL) {
+      break;
+    }
+    if (crypto_generichash_update(&info->hash_state, mapped, amount_at_once) <
+        0) {
+      return VE_CRYPTOERR;
+    }
+    offset += amount_at_once;
+    bytes_to_hash -= amount_at_once;
+  }
+
+  if (bytes_to_hash > 0 && lseek(info->user_fd, offset, SEEK_SET) < 0) {
+    return VE_IOERR;
+  }
   while (bytes_to_hash > 0) {
     uint32_t amount_at_once = bytes_to_hash > 1024 ? 1024 : bytes_to_hash;
     if (read(info->user_fd, &buffer, amount_at_once) < 0) {
@@ -221,1344 +545,6054 @@ int internal_hash_file(struct vault_info* info, uint8_t* hash,
 }
 
 /**
-   function internal_append_key
+   function internal_entry_size
 
-   Attempts to append a key-value pair to the end of the vault file and
-   place relevant location data for the entry. As the vault is append-only,
-   the first free loc data field can be found and used to represent the
-   data that is appended to the file.
+   Returns the number of bytes an entry with the given key and value lengths
+   takes up in the data section of a file using the given cipher suite.
+ */
+uint32_t internal_entry_size(uint8_t cipher, uint32_t key_len,
+                             uint32_t val_len) {
+  uint32_t tail = cipher == CIPHER_SECRETBOX ? NONCE_SIZE + HASH_SIZE
+                  : cipher == CIPHER_AESGCM  ? GCM_NONCE_SIZE
+                                             : NONCE_SIZE;
+  return ENTRY_HEADER_SIZE + key_len + val_len + MAC_SIZE + tail;
+}
 
-   In the case that there are no free location data fields, the function
-   returns without appending the key. The internal_condense_file function
-   can then be used to remove any deleted entries from the file and double
-   the location data size, after which this function can be called again.
+/**
+   function internal_check_cipher
 
-   As this is an internal function, assumes the parameters have already been
-   checked by the caller and that the info field has been made writable.
+   Checks that values encrypted with the given cipher suite can be read and
+   written here. libsodium only offers AES-256-GCM on CPUs with hardware AES
+   and carryless multiplication, so a vault made with it elsewhere cannot be
+   opened on a CPU without them.
 
-   Returns VE_SUCCESS if the key-value pair was appeneded
-   VE_CRYPTOERR if the value cannot be encrypted
-   VE_IOERR if the data cannot be written to the file
-   VE_NOSPACE if there is no more space in the loc data field
+   Returns VE_SUCCESS if the suite can be used
+   VE_FILE if the suite is unknown
+   VE_CRYPTOERR if the suite needs hardware this CPU does not have
  */
-int internal_append_key(struct vault_info* info, uint8_t type, const char* key,
-                        const char* value, uint64_t m_time, uint32_t val_len) {
-  LSEEK(info->user_fd, HEADER_SIZE - 4, SEEK_SET, info);
-  uint32_t loc_len;
-  READ(info->user_fd, &loc_len, 4, info);
-  uint32_t loc_data[LOC_SIZE / sizeof(uint32_t)];
+int internal_check_cipher(uint8_t cipher) {
+  if (cipher != CIPHER_SECRETBOX && cipher != CIPHER_XCHACHA &&
+      cipher != CIPHER_AESGCM) {
+    FPUTS("Unknown cipher suite\n", stderr);
+    return VE_FILE;
+  }
+  if (cipher == CIPHER_AESGCM && !crypto_aead_aes256gcm_is_available()) {
+    FPUTS("AES-256-GCM is not supported on this CPU\n", stderr);
+    return VE_CRYPTOERR;
+  }
+  return VE_SUCCESS;
+}
 
-  for (uint32_t next_loc = 0; next_loc < loc_len; ++next_loc) {
-    READ(info->user_fd, &loc_data, LOC_SIZE, info);
-    if (loc_data[0]) {
-      continue;
-    }
+/**
+   function internal_pick_cipher
 
-    uint32_t file_loc = lseek(info->user_fd, -1 * HASH_SIZE, SEEK_END);
-    uint32_t key_len = strlen(key);
-    uint32_t inode_loc = HEADER_SIZE + next_loc * LOC_SIZE;
+   Returns the cipher suite to use for a suite given as CIPHER_AUTO, which is
+   AES-256-GCM on CPUs with hardware AES and XChaCha20-Poly1305 otherwise, or
+   the suite itself for any other.
+ */
+uint8_t internal_pick_cipher(uint8_t suite) {
+  return suite != CIPHER_AUTO                  ? suite
+         : crypto_aead_aes256gcm_is_available() ? CIPHER_AESGCM
+                                                : CIPHER_XCHACHA;
+}
 
-    int input_len = ENTRY_HEADER_SIZE + key_len + val_len + MAC_SIZE +
-                    NONCE_SIZE + HASH_SIZE;
-    uint8_t* to_write_data = malloc(input_len);
-    *((uint64_t*)to_write_data) = m_time;
-    to_write_data[ENTRY_HEADER_SIZE - 1] = type;
-    strncpy((char*)to_write_data + ENTRY_HEADER_SIZE, key, key_len);
+/**
+   functions internal_slot_loc and internal_set_slot_loc
 
-    uint8_t* val_nonce = to_write_data + input_len - NONCE_SIZE - HASH_SIZE;
-    randombytes_buf(val_nonce, NONCE_SIZE);
+   Get and set where in the file the entry of a loc slot starts. Slots of
+   WIDE_LOC_SIZE bytes keep the high half of the offset after the key
+   directory, while the slots of older formats only hold the low half.
+ */
+uint64_t internal_slot_loc(const struct vault_info* info,
+                           const uint32_t* loc_data) {
+  uint64_t high = info->loc_size == WIDE_LOC_SIZE ? loc_data[LOC_HIGH_WORD] : 0;
+  return high << 32 | loc_data[1];
+}
 
-    if (crypto_secretbox_easy(to_write_data + ENTRY_HEADER_SIZE + key_len,
-                              (uint8_t*)value, val_len, val_nonce,
-                              (uint8_t*)&info->decrypted_master) < 0) {
-      FPUTS("Could not encrypt value for key value pair\n", stderr);
-      free(to_write_data);
-      sodium_mprotect_noaccess(info);
-      return VE_CRYPTOERR;
-    }
+void internal_set_slot_loc(const struct vault_info* info, uint32_t* loc_data,
+                           uint64_t file_loc) {
+  loc_data[1] = (uint32_t)file_loc;
+  if (info->loc_size == WIDE_LOC_SIZE) {
+    loc_data[LOC_HIGH_WORD] = file_loc >> 32;
+  }
+}
 
-    if (crypto_generichash(to_write_data + input_len - HASH_SIZE, HASH_SIZE,
-                           to_write_data, input_len - HASH_SIZE,
-                           info->decrypted_master, MASTER_KEY_SIZE) < 0) {
-      FPUTS("Could not generate entry hash\n", stderr);
-      free(to_write_data);
-      sodium_mprotect_noaccess(info);
-      return VE_CRYPTOERR;
-    }
+/**
+   Worker functions
 
-    if (write(info->user_fd, to_write_data, input_len) < 0) {
-      FPUTS("Could not write key-value pair to disk\n", stderr);
-      free(to_write_data);
-      sodium_mprotect_noaccess(info);
-      return VE_IOERR;
-    }
+   Work that is spread across several cores, such as verifying a large vault,
+   is described by a worker_job. A job is a number of items to be worked on,
+   numbered from zero, and a function to call for each item. Each worker
+   claims the next item that has not been claimed yet until none are left, so
+   items that take longer do not hold up the rest of the job. The first error
+   returned for any item stops all of the workers.
 
-    loc_data[0] = STATE_ACTIVE;
-    loc_data[1] = file_loc;
-    loc_data[2] = key_len;
-    loc_data[3] = val_len;
-    lseek(info->user_fd, inode_loc, SEEK_SET);
+   The work function is given the number of the worker calling it, which is
+   below MAX_WORKERS, so results can be gathered per worker without locking.
+ */
+struct worker_job {
+  struct vault_info* info;
+  int (*work)(struct worker_job* job, uint32_t worker, uint32_t item);
+  void* data;
+  uint32_t num_items;
+  uint32_t next_item;
+  int result;
+};
 
-    if (write(info->user_fd, loc_data, LOC_SIZE) < 0) {
-      FPUTS("Could not write inode pair to disk\n", stderr);
-      free(to_write_data);
-      sodium_mprotect_noaccess(info);
-      return VE_IOERR;
-    }
+struct worker_arg {
+  struct worker_job* job;
+  uint32_t worker;
+};
 
-    uint8_t file_hash[HASH_SIZE];
-    internal_hash_file(info, (uint8_t*)&file_hash, 0);
-    lseek(info->user_fd, 0, SEEK_END);
-    if (write(info->user_fd, (uint8_t*)&file_hash, HASH_SIZE) < 0) {
-      FPUTS("Could not write hash to disk\n", stderr);
-      free(to_write_data);
-      sodium_mprotect_noaccess(info);
-      return VE_IOERR;
+void* internal_worker_main(void* arg) {
+  struct worker_job* job = ((struct worker_arg*)arg)->job;
+  uint32_t worker = ((struct worker_arg*)arg)->worker;
+  while (__atomic_load_n(&job->result, __ATOMIC_RELAXED) == VE_SUCCESS) {
+    uint32_t item = __atomic_fetch_add(&job->next_item, 1, __ATOMIC_RELAXED);
+    if (item >= job->num_items) {
+      break;
     }
 
-    struct key_info* current_info = malloc(sizeof(struct key_info));
-    current_info->inode_loc = inode_loc;
-    current_info->m_time = m_time;
-    current_info->type = type;
-
-    add_entry(info->key_info, key, current_info);
-    free(to_write_data);
-    sodium_mprotect_noaccess(info);
-
-    FPUTS("Added key\n", stderr);
-    return VE_SUCCESS;
+    int result = job->work(job, worker, item);
+    if (result) {
+      int expected = VE_SUCCESS;
+      __atomic_compare_exchange_n(&job->result, &expected, result, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
   }
-
-  sodium_mprotect_noaccess(info);
-  return VE_NOSPACE;
+  return NULL;
 }
 
 /**
-   function internal_append_encrypted
+   function internal_run_workers
 
-   Like internal_append_key, this function is used to append an entry to the
-   vault if there is space available in the loc data. The main difference is
-   this function takes an entire entry that has the encrypted value and hash
-   at the end and adds it to the vault. The hash at the end if verified to be
-   correct, and the entry is only appended if it is. This function allows the
-   entries to be sent to and from the server without the server being able to
-   decrypt the values, but preventing tampering using the keyed hash.
+   Runs a job on up to the given number of workers, one of which is the
+   calling thread, and waits for all of them to finish. If a thread cannot be
+   started the job is finished by the workers that did start, so a job run on
+   one worker never starts a thread at all.
 
-   The actual checking of the hash is in the function add_encrypted_value,
-   which may call this function more than once if there is no space.
+   Returns VE_SUCCESS if every item was worked on successfully
+   Otherwise the first error returned by the work function
+ */
+int internal_run_workers(struct worker_job* job, uint32_t workers) {
+  pthread_t threads[MAX_WORKERS];
+  struct worker_arg args[MAX_WORKERS];
+  if (workers > job->num_items) {
+    workers = job->num_items;
+  }
+  if (workers > MAX_WORKERS) {
+    workers = MAX_WORKERS;
+  }
+
+  uint32_t started = 1;
+  while (started < workers) {
+    args[started].job = job;
+    args[started].worker = started;
+    if (pthread_create(&threads[started], NULL, internal_worker_main,
+                       &args[started])) {
+      break;
+    }
+    started++;
+  }
 
-   Returns VE_SUCCESS if the entry was validated and added.
-   VE_IOERR if there were issues writing to or reading from disk
-   VE_CRYPTORR if the new entry hash could not be generated
-   VE_NOSPACE if none of the loc entries are open
+  args[0].job = job;
+  args[0].worker = 0;
+  internal_worker_main(&args[0]);
 
+  for (uint32_t i = 1; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  return job->result;
+}
+
+/**
+   functions internal_mac_begin and internal_mac_end
+
+   Hash a single region of the file and toggle it in or out of the running
+   file mac. The region hash is keyed with the master key and bound to the
+   kind of region and the index it is at, so regions cannot be moved around
+   the file. Between the two calls, the contents of the region are added to
+   the hash state with crypto_generichash_update. internal_region_begin does
+   the same on a separate hash state, for workers hashing regions at once.
+
+   As XOR is its own inverse, hashing the old contents of a region before a
+   write removes them from the mac, and hashing the new contents afterwards
+   adds them back. This keeps the cost of a write proportional to the number
+   of bytes that it changed.
+
+   Returns VE_SUCCESS if the region was hashed
+   VE_CRYPTOERR if the hashing fails
  */
-int internal_append_encrypted(struct vault_info* info, uint8_t type,
-                              const char* key, const char* entry, int len,
-                              uint64_t m_time) {
-  LSEEK(info->user_fd, HEADER_SIZE - 4, SEEK_SET, info);
-  uint32_t loc_len;
-  READ(info->user_fd, &loc_len, 4, info);
-  uint32_t loc_data[LOC_SIZE / sizeof(uint32_t)];
+int internal_region_begin(struct vault_info* info,
+                          crypto_generichash_state* state, uint8_t kind,
+                          uint64_t index) {
+  if (crypto_generichash_init(state, info->decrypted_master, MASTER_KEY_SIZE,
+                              HASH_SIZE) < 0 ||
+      crypto_generichash_update(state, &kind, 1) < 0 ||
+      crypto_generichash_update(state, (uint8_t*)&index, sizeof(uint64_t)) <
+          0) {
+    return VE_CRYPTOERR;
+  }
+  return VE_SUCCESS;
+}
 
-  for (uint32_t next_loc = 0; next_loc < loc_len; ++next_loc) {
-    READ(info->user_fd, &loc_data, LOC_SIZE, info);
-    if (loc_data[0]) {
-      continue;
-    }
+int internal_mac_begin(struct vault_info* info, uint8_t kind, uint64_t index) {
+  return internal_region_begin(info, &info->hash_state, kind, index);
+}
 
-    uint32_t file_loc = lseek(info->user_fd, -1 * HASH_SIZE, SEEK_END);
-    uint32_t key_len = strlen(key);
-    uint32_t val_len =
-        len - ENTRY_HEADER_SIZE - MAC_SIZE - NONCE_SIZE - HASH_SIZE - key_len;
-    uint32_t inode_loc = HEADER_SIZE + next_loc * LOC_SIZE;
+int internal_mac_end(struct vault_info* info) {
+  uint8_t region_hash[HASH_SIZE];
+  if (crypto_generichash_final(&info->hash_state, region_hash, HASH_SIZE) < 0) {
+    return VE_CRYPTOERR;
+  }
 
-    uint8_t* to_write_data = malloc(len);
-    memcpy(to_write_data, entry, len);
-    *((uint64_t*)to_write_data) = m_time;
+  for (int i = 0; i < HASH_SIZE; ++i) {
+    info->file_mac[i] ^= region_hash[i];
+  }
+  return VE_SUCCESS;
+}
 
-    if (crypto_generichash(to_write_data + len - HASH_SIZE, HASH_SIZE,
-                           to_write_data, len - HASH_SIZE,
-                           info->decrypted_master, MASTER_KEY_SIZE) < 0) {
-      FPUTS("Could not generate entry hash\n", stderr);
-      free(to_write_data);
-      return VE_CRYPTOERR;
-    }
+/**
+   Merkle tree functions
 
-    if (write(info->user_fd, to_write_data, len) < 0) {
-      FPUTS("Could not write key-value pair to disk\n", stderr);
-      free(to_write_data);
-      sodium_mprotect_noaccess(info);
-      return VE_IOERR;
-    }
+   The following functions keep the tree of INTEGRITY_MERKLE vaults. The whole
+   tree is held in memory while the vault is open, laid out the same way as in
+   the file, with the leaves first and the root last. Writes mark the leaves
+   they touched, and the marked leaves and the nodes above them are rehashed
+   when the file is sealed.
+ */
 
-    loc_data[0] = STATE_ACTIVE;
-    loc_data[1] = file_loc;
-    loc_data[2] = key_len;
-    loc_data[3] = val_len;
-    lseek(info->user_fd, inode_loc, SEEK_SET);
+/**
+   function internal_tree_levels
 
-    if (write(info->user_fd, loc_data, LOC_SIZE) < 0) {
-      FPUTS("Could not write inode pair to disk\n", stderr);
-      free(to_write_data);
-      sodium_mprotect_noaccess(info);
-      return VE_IOERR;
-    }
+   Fills in where each level of a tree with the given number of leaves starts,
+   counted in nodes from the start of the tree, and how many nodes it has.
+   Each level has half as many nodes as the one below it, rounded up, and the
+   last level holds only the root.
 
-    uint8_t file_hash[HASH_SIZE];
-    internal_hash_file(info, (uint8_t*)&file_hash, 0);
-    lseek(info->user_fd, 0, SEEK_END);
-    if (write(info->user_fd, (uint8_t*)&file_hash, HASH_SIZE) < 0) {
-      FPUTS("Could not write hash to disk\n", stderr);
-      free(to_write_data);
-      sodium_mprotect_noaccess(info);
-      return VE_IOERR;
+   Returns the number of levels in the tree
+ */
+uint32_t internal_tree_levels(uint32_t leaves, uint32_t* offsets,
+                              uint32_t* counts) {
+  uint32_t levels = 0;
+  uint32_t offset = 0;
+  uint32_t count = leaves;
+  while (1) {
+    offsets[levels] = offset;
+    counts[levels] = count;
+    offset += count;
+    levels++;
+    if (count <= 1) {
+      return levels;
     }
+    count = (count + 1) / 2;
+  }
+}
 
-    struct key_info* current_info = malloc(sizeof(struct key_info));
-    current_info->inode_loc = inode_loc;
-    current_info->m_time = m_time;
-    current_info->type = type;
+uint32_t internal_tree_leaves(uint64_t data_end) {
+  return (data_end + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+}
 
-    add_entry(info->key_info, key, current_info);
-    free(to_write_data);
-    sodium_mprotect_noaccess(info);
+/**
+   function internal_tree_size
 
-    FPUTS("Added key\n", stderr);
-    return VE_SUCCESS;
+   Returns the number of bytes between the end of the data section and the
+   trailer, which is the tree and the stored end of the data section for
+   Merkle vaults and nothing otherwise.
+ */
+uint32_t internal_tree_size(struct vault_info* info) {
+  if (info->integrity != INTEGRITY_MERKLE) {
+    return 0;
   }
 
-  sodium_mprotect_noaccess(info);
-  return VE_NOSPACE;
+  uint32_t offsets[MAX_TREE_LEVELS];
+  uint32_t counts[MAX_TREE_LEVELS];
+  uint32_t levels = internal_tree_levels(internal_tree_leaves(info->data_end),
+                                         offsets, counts);
+  return (offsets[levels - 1] + 1) * HASH_SIZE + sizeof(uint64_t);
+}
+
+void internal_tree_free(struct vault_info* info) {
+  free(info->tree);
+  free(info->leaf_checked);
+  info->tree = NULL;
+  info->leaf_checked = NULL;
+  info->tree_leaves = 0;
+  info->num_dirty = 0;
 }
 
 /**
-   function internal_create_key_map
+   function internal_tree_hash_leaf
 
-   Given an open vault, construct the mapping of keys to their loc datas in the
-   file and assign it to the key_info field. The map is implemented as a hash
-   table with half the number of buckets as the length of the loc field. As this
-   is an internal function, it assumes that info is able to be read, as well as
-   the vault is opened and that key_info is not currently set to a map.
+   Reads a segment from the file and places its keyed hash into hash, which is
+   expected to be HASH_SIZE bytes. The last segment ends at the end of the
+   data section and may be shorter than SEGMENT_SIZE. The segment is read in
+   place or with pread and hashed with the given state, so workers can hash
+   segments at the same time.
 
-   Returns VE_SUCCESS if able to create the map
-   VE_IOERR if there were issues reading from disk
+   Returns VE_SUCCESS if the segment was hashed
+   VE_IOERR if the segment could not be read
+   VE_CRYPTOERR if the segment could not be hashed
  */
-int internal_create_key_map(struct vault_info* info) {
-  uint32_t loc_len;
-  if (lseek(info->user_fd, HEADER_SIZE - 4, SEEK_SET) < 0 ||
-      read(info->user_fd, &loc_len, 4) < 0) {
+int internal_tree_hash_leaf(struct vault_info* info,
+                            crypto_generichash_state* state, uint32_t leaf,
+                            uint8_t* hash) {
+  // Leaves are only checked during a transaction, against what is in the file
+  uint8_t buffer[SEGMENT_SIZE];
+  uint64_t data_end = info->txn_len > 0 ? info->txn_start : info->data_end;
+  uint64_t start = (uint64_t)leaf * SEGMENT_SIZE;
+  uint32_t len =
+      data_end - start < SEGMENT_SIZE ? data_end - start : SEGMENT_SIZE;
+  const uint8_t* segment = internal_read_at(info, start, len, buffer);
+  if (segment == NULL) {
     return VE_IOERR;
   }
-  uint32_t loc_data[LOC_SIZE / sizeof(uint32_t)];
-  info->key_info = init_map(loc_len / 2);
-  for (uint32_t next_loc = 0; next_loc < loc_len; ++next_loc) {
-    if (read(info->user_fd, &loc_data, LOC_SIZE) < 0) {
-      delete_map(info->key_info);
-      return VE_IOERR;
-    }
-
-    uint32_t is_active = STATE_ACTIVE == loc_data[0];
-    if (!is_active) {
-      continue;
-    }
-
-    uint32_t file_loc = loc_data[1];
-    uint32_t key_len = loc_data[2];
-    uint32_t inode_loc = HEADER_SIZE + next_loc * LOC_SIZE;
-    char key[key_len + 1];
-    struct key_info* current_info = malloc(sizeof(struct key_info));
-    current_info->inode_loc = inode_loc;
-
-    if (lseek(info->user_fd, file_loc, SEEK_SET) < 0 ||
-        read(info->user_fd, &(current_info->m_time), sizeof(uint64_t)) < 0 ||
-        read(info->user_fd, &(current_info->type), sizeof(uint8_t)) < 0 ||
-        read(info->user_fd, &key, key_len) < 0) {
-      delete_map(info->key_info);
-      return VE_IOERR;
-    }
-    key[key_len] = 0;
 
-    add_entry(info->key_info, key, current_info);
-    lseek(info->user_fd, HEADER_SIZE + (next_loc + 1) * LOC_SIZE, SEEK_SET);
+  if (internal_region_begin(info, state, REGION_SEGMENT, leaf) ||
+      crypto_generichash_update(state, segment, len) < 0 ||
+      crypto_generichash_final(state, hash, HASH_SIZE) < 0) {
+    return VE_CRYPTOERR;
   }
   return VE_SUCCESS;
 }
 
 /**
-   function condense_file
+   function internal_tree_hash_node
 
-   Given an open vault, remove all deleted entries, and double the size of the
-   loc field while realigning the active entries to be closest to the front of
-   the field. This function is used to clean up deletes and to increase the
-   amount of entries that can be stored. By using this slow function rarely,
-   most changes to the file are relatively fast, and the file size is still
-   kept relatively small. In the case that there are many changes made, there
-   is still more room made for the updates.
+   Hashes the children of a node into hash. The last node of a level may only
+   have a left child, in which case right is NULL. The level and index of the
+   node are hashed in so that nodes cannot be moved around the tree.
 
-   Returns VE_SUCCESS upon increasing the file size and moving entries
-   VE_VCLOSE if no vault is open
-   VE_MEMERR if memory cannot be opened
-   VE_IOERR if there are issues reading from or writing to memory
-*/
-int internal_condense_file(struct vault_info* info) {
-  if (sodium_mprotect_readwrite(info) < 0) {
-    FPUTS("Issues gaining access to memory\n", stderr);
-    return VE_MEMERR;
+   Returns VE_SUCCESS if the node was hashed
+   VE_CRYPTOERR if the node could not be hashed
+ */
+int internal_tree_hash_node(struct vault_info* info, uint32_t level,
+                            uint32_t index, const uint8_t* left,
+                            const uint8_t* right, uint8_t* hash) {
+  uint64_t position = ((uint64_t)level << 32) | index;
+  if (internal_mac_begin(info, REGION_NODE, position) ||
+      crypto_generichash_update(&info->hash_state, left, HASH_SIZE) < 0 ||
+      (right && crypto_generichash_update(&info->hash_state, right,
+                                          HASH_SIZE) < 0) ||
+      crypto_generichash_final(&info->hash_state, hash, HASH_SIZE) < 0) {
+    return VE_CRYPTOERR;
   }
+  return VE_SUCCESS;
+}
 
-  if (!info->is_open) {
-    FPUTS("Vault closed\n", stderr);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
-    }
-    return VE_VCLOSE;
+/**
+   function internal_tree_mark_leaves
+
+   Marks the leaves from first to last as written to, so they are rehashed on
+   the next seal. Once there are more than MAX_DIRTY_RANGES ranges the whole
+   tree is rebuilt instead.
+ */
+void internal_tree_mark_leaves(struct vault_info* info, uint32_t first,
+                               uint32_t last) {
+  if (info->num_dirty < MAX_DIRTY_RANGES) {
+    info->dirty_leaves[info->num_dirty][0] = first;
+    info->dirty_leaves[info->num_dirty][1] = last;
   }
+  info->num_dirty++;
+}
 
-  uint8_t header[HEADER_SIZE];
-  uint32_t loc_size;
-  uint32_t* loc_data;
-  uint8_t* box_data;
-  uint32_t box_len;
-  uint32_t current_file_size = lseek(info->user_fd, -1 * HASH_SIZE, SEEK_END);
-  uint32_t data_replacement_loc = 0;
-  uint32_t loc_replacement_index = 0;
+/**
+   function internal_tree_check_leaves
 
-  lseek(info->user_fd, 0, SEEK_SET);
-  READ(info->user_fd, &header, HEADER_SIZE, info);
-  loc_size = *((uint32_t*)(header + HEADER_SIZE - 4));
+   Checks the leaves from first to last that are in the tree and have not
+   been checked yet against their segments in the file. Leaves past the end
+   of the tree have no stored hash yet and are skipped.
 
-  uint32_t old_data_offset = (loc_size * LOC_SIZE) + HEADER_SIZE;
-  uint32_t new_data_offset = (loc_size * LOC_SIZE) + old_data_offset;
+   Returns VE_SUCCESS if the segments are intact
+   VE_FILE if a segment does not match its leaf
+   VE_IOERR if a segment could not be read
+ */
+int internal_tree_check_leaves(struct vault_info* info, uint32_t first,
+                               uint32_t last) {
+  uint8_t hash[HASH_SIZE];
+  for (uint32_t leaf = first; leaf <= last && leaf < info->tree_leaves;
+       ++leaf) {
+    if (info->leaf_checked[leaf / 8] & (1 << (leaf % 8))) {
+      continue;
+    }
 
-  loc_data = malloc(loc_size * LOC_SIZE);
-  if (read(info->user_fd, loc_data, loc_size * LOC_SIZE) < 0) {
-    FPUTS("Could not read loc from disk\n", stderr);
-    free(loc_data);
-    sodium_mprotect_noaccess(info);
-    return VE_IOERR;
+    if (internal_tree_hash_leaf(info, &info->hash_state, leaf, hash)) {
+      return VE_IOERR;
+    }
+    if (memcmp(hash, info->tree + leaf * HASH_SIZE, HASH_SIZE) != 0) {
+      FPUTS("SEGMENT HASH INVALID\n", stderr);
+      return VE_FILE;
+    }
+    info->leaf_checked[leaf / 8] |= 1 << (leaf % 8);
   }
+  return VE_SUCCESS;
+}
 
-  box_len = current_file_size - old_data_offset;
-  box_data = malloc(box_len);
-  if (read(info->user_fd, box_data, box_len) < 0) {
-    FPUTS("Could not read loc from disk\n", stderr);
-    variadic_free(2, loc_data, box_data);
-    sodium_mprotect_noaccess(info);
-    return VE_IOERR;
-  }
+/**
+   function internal_tree_update
+
+   Brings the tree up to date with the file after a write, and places the root
+   into the file mac. The leaves that were marked and the nodes above them are
+   rehashed, and only those nodes are written back to the file. If the data
+   section changed size the tree no longer sits in the same place, so the
+   whole tree is written after the new end of the data section instead. A
+   marked leaf that was never checked was not written to, and is checked
+   against its stored hash rather than rehashed, so that a segment changed
+   outside of the vault cannot make its way into the new root.
+
+   Returns VE_SUCCESS if the tree was updated
+   VE_FILE if a segment that was not written to does not match its leaf
+   VE_MEMERR if memory for a larger tree could not be allocated
+   VE_IOERR if the file could not be read from or written to
+   VE_CRYPTOERR if any hashing fails
+ */
+int internal_tree_update(struct vault_info* info) {
+  uint32_t offsets[MAX_TREE_LEVELS];
+  uint32_t counts[MAX_TREE_LEVELS];
+  uint32_t leaves = internal_tree_leaves(info->data_end);
+  uint32_t levels = internal_tree_levels(leaves, offsets, counts);
+  uint32_t tree_bytes = (offsets[levels - 1] + 1) * HASH_SIZE;
+  int rewrite = info->tree == NULL || leaves != info->tree_leaves ||
+                info->data_end != info->tree_written_at;
+  uint32_t stored = info->tree == NULL         ? 0
+                    : leaves < info->tree_leaves ? leaves
+                                                 : info->tree_leaves;
+
+  if (info->tree == NULL || leaves != info->tree_leaves) {
+    uint8_t* tree = malloc(tree_bytes);
+    uint8_t* checked = calloc((leaves + 7) / 8, 1);
+    if (tree == NULL || checked == NULL) {
+      variadic_free(2, tree, checked);
+      return VE_MEMERR;
+    }
 
-  for (uint32_t i = 0; i < loc_size; ++i) {
-    uint32_t* current_loc_data = loc_data + i * 4;
-    uint32_t current_box_len = current_loc_data[2] + current_loc_data[3] +
-                               ENTRY_HEADER_SIZE + MAC_SIZE + NONCE_SIZE +
-                               HASH_SIZE;
-    uint32_t current_loc = current_loc_data[1] - old_data_offset;
-    if (current_loc_data[0] == STATE_ACTIVE) {
-      if (loc_replacement_index == i) {
-        loc_replacement_index++;
-        continue;
+    if (info->tree) {
+      // Nodes left of the old and new last leaves keep their hashes
+      uint32_t old_offsets[MAX_TREE_LEVELS];
+      uint32_t old_counts[MAX_TREE_LEVELS];
+      uint32_t old_levels =
+          internal_tree_levels(info->tree_leaves, old_offsets, old_counts);
+      for (uint32_t l = 0; l < levels && l < old_levels; ++l) {
+        uint32_t kept = counts[l] < old_counts[l] ? counts[l] : old_counts[l];
+        memcpy(tree + offsets[l] * HASH_SIZE,
+               info->tree + old_offsets[l] * HASH_SIZE, kept * HASH_SIZE);
       }
+      uint32_t kept_leaves = leaves < info->tree_leaves ? leaves
+                                                        : info->tree_leaves;
+      memcpy(checked, info->leaf_checked, (kept_leaves + 7) / 8);
+      internal_tree_mark_leaves(info, kept_leaves - 1, leaves - 1);
+    } else {
+      info->num_dirty = MAX_DIRTY_RANGES + 1;
+    }
 
-      memmove(box_data + data_replacement_loc, box_data + current_loc,
-              current_box_len);
-      current_loc_data[1] = new_data_offset + data_replacement_loc;
-      data_replacement_loc += current_box_len;
+    variadic_free(2, info->tree, info->leaf_checked);
+    info->tree = tree;
+    info->leaf_checked = checked;
+    info->tree_leaves = leaves;
+  }
 
-      uint32_t* new_loc_placement = loc_data + loc_replacement_index * 4;
-      memmove(new_loc_placement, current_loc_data, LOC_SIZE);
-      loc_replacement_index++;
+  if (info->num_dirty > MAX_DIRTY_RANGES) {
+    info->num_dirty = 1;
+    info->dirty_leaves[0][0] = 0;
+    info->dirty_leaves[0][1] = leaves - 1;
+  }
 
+  for (uint32_t r = 0; r < info->num_dirty; ++r) {
+    uint32_t first = info->dirty_leaves[r][0];
+    uint32_t last = info->dirty_leaves[r][1];
+    if (last >= leaves) {
+      last = leaves - 1;
+    }
+    if (first > last) {
       continue;
-    } else if (current_loc_data[0] == STATE_UNUSED) {
-      break;
-    } else {
-      if (data_replacement_loc == 0) data_replacement_loc = current_loc;
     }
-  }
-
-  uint32_t new_data_size = data_replacement_loc;
-  uint32_t valid_loc_entries = loc_replacement_index;
-  uint32_t new_file_size = new_data_offset + new_data_size;
-  uint32_t new_loc_size = loc_size * 2;
 
-  lseek(info->user_fd, new_data_offset, SEEK_SET);
-  WRITE(info->user_fd, box_data, new_data_size, info);
-  lseek(info->user_fd, HEADER_SIZE - 4, SEEK_SET);
-  WRITE(info->user_fd, &new_loc_size, 4, info);
-  WRITE(info->user_fd, loc_data, valid_loc_entries * LOC_SIZE, info);
+    // Leaves are checked before they are written to, so one that was not
+    // checked still holds its stored hash, unless the segment was tampered
+    for (uint32_t leaf = first; leaf <= last; ++leaf) {
+      if (leaf < stored &&
+          !(info->leaf_checked[leaf / 8] & (1 << (leaf % 8)))) {
+        int result = internal_tree_check_leaves(info, leaf, leaf);
+        if (result) {
+          return result;
+        }
+        continue;
+      }
+      if (internal_tree_hash_leaf(info, &info->hash_state, leaf,
+                                  info->tree + leaf * HASH_SIZE)) {
+        return VE_IOERR;
+      }
+      info->leaf_checked[leaf / 8] |= 1 << (leaf % 8);
+    }
 
-  uint32_t num_zeros = (loc_size * 2 - valid_loc_entries) * LOC_SIZE;
-  uint8_t* zeros = malloc(num_zeros);
-  sodium_memzero(zeros, num_zeros);
-  WRITE(info->user_fd, zeros, num_zeros, info);
-  ftruncate(info->user_fd, new_file_size);
+    for (uint32_t l = 0; l < levels; ++l) {
+      if (l > 0) {
+        first /= 2;
+        last /= 2;
+        for (uint32_t node = first; node <= last; ++node) {
+          uint8_t* left = info->tree + (offsets[l - 1] + 2 * node) * HASH_SIZE;
+          uint8_t* right = 2 * node + 1 < counts[l - 1] ? left + HASH_SIZE
+                                                        : NULL;
+          if (internal_tree_hash_node(
+                  info, l, node, left, right,
+                  info->tree + (offsets[l] + node) * HASH_SIZE)) {
+            return VE_CRYPTOERR;
+          }
+        }
+      }
 
-  uint8_t file_hash[HASH_SIZE];
-  internal_hash_file(info, (uint8_t*)&file_hash, 0);
-  lseek(info->user_fd, 0, SEEK_END);
-  if (write(info->user_fd, &file_hash, HASH_SIZE) < 0) {
-    FPUTS("Could not write hash to disk\n", stderr);
-    variadic_free(3, loc_data, box_data, zeros);
-    sodium_mprotect_noaccess(info);
-    return VE_IOERR;
+      if (!rewrite) {
+        uint64_t node_loc = info->data_end + (offsets[l] + first) * HASH_SIZE;
+        ssize_t node_bytes = (last - first + 1) * HASH_SIZE;
+        if (pwrite(info->user_fd, info->tree + (offsets[l] + first) * HASH_SIZE,
+                   node_bytes, node_loc) != node_bytes) {
+          return VE_IOERR;
+        }
+      }
+    }
   }
 
-  delete_map(info->key_info);
-  internal_create_key_map(info);
+  if (rewrite) {
+    uint64_t data_end = info->data_end;
+    struct iovec parts[2] = {{info->tree, tree_bytes},
+                             {&data_end, sizeof(uint64_t)}};
+    if (pwritev(info->user_fd, parts, 2, info->data_end) !=
+        (ssize_t)(tree_bytes + sizeof(uint64_t))) {
+      return VE_IOERR;
+    }
+    info->tree_written_at = info->data_end;
+  }
 
-  variadic_free(3, loc_data, box_data, zeros);
-  sodium_mprotect_noaccess(info);
-  FPUTS("Condensed file and increased loc size\n", stderr);
+  info->num_dirty = 0;
+  memcpy(info->file_mac, info->tree + offsets[levels - 1] * HASH_SIZE,
+         HASH_SIZE);
   return VE_SUCCESS;
 }
 
 /**
-   function internal_initial_checks
+   function internal_tree_load
+
+   Reads the tree of a Merkle vault from the end of the file and checks that
+   every node matches its children, then places the root into the file mac.
+   The leaves themselves are not checked against the file here.
+
+   Returns VE_SUCCESS if the tree was loaded
+   VE_FILE if the tree does not fit the file or a node is invalid
+   VE_MEMERR if memory for the tree could not be allocated
+   VE_IOERR if the file could not be read
+   VE_CRYPTOERR if any hashing fails
  */
-int internal_initial_checks(struct vault_info* info) {
-  if (sodium_mprotect_readwrite(info) < 0) {
-    FPUTS("Issues gaining access to memory\n", stderr);
+int internal_tree_load(struct vault_info* info, off_t file_size) {
+  uint64_t data_end;
+  if (file_size < (off_t)(HEADER_SIZE + sizeof(uint64_t) + HASH_SIZE)) {
+    return VE_FILE;
+  }
+  if (lseek(info->user_fd, file_size - HASH_SIZE - sizeof(uint64_t),
+            SEEK_SET) < 0 ||
+      read(info->user_fd, &data_end, sizeof(uint64_t)) != sizeof(uint64_t)) {
+    return VE_IOERR;
+  }
+  if (data_end < HEADER_SIZE || data_end > (uint64_t)file_size) {
+    return VE_FILE;
+  }
+
+  uint32_t offsets[MAX_TREE_LEVELS];
+  uint32_t counts[MAX_TREE_LEVELS];
+  uint32_t leaves = internal_tree_leaves(data_end);
+  uint32_t levels = internal_tree_levels(leaves, offsets, counts);
+  uint32_t tree_bytes = (offsets[levels - 1] + 1) * HASH_SIZE;
+  if (data_end + tree_bytes + sizeof(uint64_t) + HASH_SIZE !=
+      (uint64_t)file_size) {
+    return VE_FILE;
+  }
+
+  info->data_end = data_end;
+  info->tree = malloc(tree_bytes);
+  info->leaf_checked = calloc((leaves + 7) / 8, 1);
+  info->tree_leaves = leaves;
+  info->tree_written_at = data_end;
+  info->num_dirty = 0;
+  if (info->tree == NULL || info->leaf_checked == NULL) {
+    internal_tree_free(info);
     return VE_MEMERR;
   }
 
-  if (!info->is_open) {
-    FPUTS("No vault opened\n", stderr);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
+  if (lseek(info->user_fd, data_end, SEEK_SET) < 0 ||
+      read(info->user_fd, info->tree, tree_bytes) != tree_bytes) {
+    internal_tree_free(info);
+    return VE_IOERR;
+  }
+
+  uint8_t hash[HASH_SIZE];
+  for (uint32_t l = 1; l < levels; ++l) {
+    for (uint32_t node = 0; node < counts[l]; ++node) {
+      uint8_t* left = info->tree + (offsets[l - 1] + 2 * node) * HASH_SIZE;
+      uint8_t* right = 2 * node + 1 < counts[l - 1] ? left + HASH_SIZE : NULL;
+      if (internal_tree_hash_node(info, l, node, left, right, hash)) {
+        internal_tree_free(info);
+        return VE_CRYPTOERR;
+      }
+      if (memcmp(hash, info->tree + (offsets[l] + node) * HASH_SIZE,
+                 HASH_SIZE) != 0) {
+        FPUTS("TREE NODE INVALID\n", stderr);
+        internal_tree_free(info);
+        return VE_FILE;
+      }
     }
-    return VE_VCLOSE;
   }
 
+  memcpy(info->file_mac, info->tree + offsets[levels - 1] * HASH_SIZE,
+         HASH_SIZE);
   return VE_SUCCESS;
 }
 
 /**
-   Vault initialization functions
-
-   The following functions are used to handle opening, closing, and creating
-   the vault files, as well as initializing and releasing the internal
-   information used to represent the currently opened vault.
- */
-
-/**
-   function init_vault
-
-   The function to be called at startup of the application, this ensures
-   that the vault is setup to safely load in files and run crypto operations
-   safely later on.
-
-   Core dumps are disabled to ensure that passwords in memory are not allowed
-   to be part of any core dumps later on. In addition, after libsodium is
-   initialized, the memory for the vault information that will be used is
-   placed in secure memory and locked to prevent access. While there are
-   places in code that gives the passwords to the application, all sensitive
-   data handled by the library will be within this secure memory. In addition,
-   as the decrypted master key is generated by the library and only ever
-   kept in the memory, it should never exist in a decrypted form on hard disk.
+   function internal_tree_check
 
-   If there is an error, a null pointer is returned.
+   Checks the segments holding the given range of the file against the leaves
+   of the tree, so the range can be trusted after it is read. Each segment is
+   only checked once while the vault is open. Does nothing unless the vault
+   uses INTEGRITY_MERKLE, or for entries still held by a write transaction.
 
-   Returns a pointer to the memory the vault info is being kept in.
+   Returns VE_SUCCESS if the range is intact
+   VE_FILE if a segment does not match its leaf or is outside of the tree
+   VE_IOERR if a segment could not be read
  */
-struct vault_info* init_vault() {
-  struct rlimit r;
-  r.rlim_cur = 0;
-  r.rlim_max = 0;
-
-  if (setrlimit(RLIMIT_CORE, &r) < 0) {
-    FPUTS("Could not decrease core limit", stderr);
-    return NULL;
+int internal_tree_check(struct vault_info* info, uint64_t start,
+                        uint32_t len) {
+  if (info->integrity != INTEGRITY_MERKLE || len == 0 ||
+      (info->txn_len > 0 && start >= info->txn_start)) {
+    return VE_SUCCESS;
   }
 
-  if (sodium_init() < 0) {
-    FPUTS("Could not init libsodium\n", stderr);
-    return NULL;
+  uint32_t last = (start + len - 1) / SEGMENT_SIZE;
+  if (last >= info->tree_leaves) {
+    return VE_FILE;
   }
+  return internal_tree_check_leaves(info, start / SEGMENT_SIZE, last);
+}
 
-  struct vault_info* info = sodium_malloc(sizeof(struct vault_info));
-  if (sodium_mlock(info, sizeof(struct vault_info))) {
-    FPUTS("Issues locking memory\n", stderr);
-    sodium_free(info);
-    return NULL;
+int internal_tree_leaf_worker(struct worker_job* job, uint32_t worker,
+                              uint32_t leaf) {
+  (void)worker;
+  if (job->info->leaf_checked[leaf / 8] & (1 << (leaf % 8))) {
+    return VE_SUCCESS;
   }
 
-  info->is_open = 0;
-  if (sodium_mprotect_noaccess(info) < 0) {
-    FPUTS("Issues preventing access to memory\n", stderr);
-    return NULL;
+  crypto_generichash_state state;
+  uint8_t hash[HASH_SIZE];
+  int result = internal_tree_hash_leaf(job->info, &state, leaf, hash);
+  if (result) {
+    return result;
   }
 
-  return info;
+  if (memcmp(hash, job->info->tree + leaf * HASH_SIZE, HASH_SIZE) != 0) {
+    FPUTS("SEGMENT HASH INVALID\n", stderr);
+    return VE_FILE;
+  }
+  return VE_SUCCESS;
 }
 
 /**
-   function release_vault
-
-   The function to be called at the end of using the vault, this releases
-   all the memory allocated for the vault information. As sodium_free will
-   handle zeroing the memory allocated for the vault_info structure, it does
-   not have to be manually done. However ensuring that all allocated memory
-   is freed is important, and done mainly in the key map.
+   function internal_tree_check_all
+
+   Checks every segment of the file against the leaves of the tree at once,
+   spread across the workers, instead of as entries are read. Segments that
+   were checked already are skipped. Used to verify Merkle vaults with
+   VERIFY_PARALLEL set when they are opened, and before a background
+   compaction copies the file.
+
+   Returns VE_SUCCESS if every segment is intact
+   VE_FILE if a segment does not match its leaf
+   VE_IOERR if a segment could not be read
+   VE_CRYPTOERR if a segment could not be hashed
+ */
+int internal_tree_check_all(struct vault_info* info) {
+  struct worker_job job = {info, internal_tree_leaf_worker, NULL,
+                           info->tree_leaves, 0, VE_SUCCESS};
+  int result = internal_run_workers(&job, info->workers);
+  if (!result) {
+    memset(info->leaf_checked, 0xff, (info->tree_leaves + 7) / 8);
+  }
+  return result;
+}
 
-   Returns VE_SUCCESS upon releasing all relevant memory
+/**
+   function internal_mac_region
+
+   Toggles a region held in memory in or out of the running file mac. For
+   Merkle vaults the leaves covering the region are marked to be rehashed
+   instead, and for whole file hashes nothing is done, so callers can call it
+   around every write without checking the mode themselves. The leaves of a
+   Merkle vault are checked against the file before they are marked, so it
+   must be called before the region is written.
+
+   Returns VE_SUCCESS if the mac was updated or does not need to be
+   VE_FILE if a segment the region is in does not match its leaf
+   VE_IOERR if a segment the region is in could not be read
+   VE_CRYPTOERR if the region could not be hashed
  */
-int release_vault(struct vault_info* info) {
-  sodium_mprotect_readwrite(info);
-  if (info->is_open) {
-    close(info->user_fd);
-    delete_map(info->key_info);
+int internal_mac_region(struct vault_info* info, uint8_t kind, uint64_t index,
+                        const uint8_t* data, uint32_t len) {
+  if (info->integrity == INTEGRITY_MERKLE && len > 0) {
+    uint64_t start = kind == REGION_LOC ? HEADER_SIZE + index * info->loc_size
+                                        : index;
+    uint32_t first = start / SEGMENT_SIZE;
+    uint32_t last = (start + len - 1) / SEGMENT_SIZE;
+    int result = internal_tree_check_leaves(info, first, last);
+    if (result) {
+      return result;
+    }
+    internal_tree_mark_leaves(info, first, last);
+    return VE_SUCCESS;
+  }
+  if (info->integrity != INTEGRITY_INCREMENTAL) {
+    return VE_SUCCESS;
+  }
+
+  if (internal_mac_begin(info, kind, index) ||
+      crypto_generichash_update(&info->hash_state, data, len) < 0 ||
+      internal_mac_end(info)) {
+    return VE_CRYPTOERR;
   }
-  sodium_munlock(info, sizeof(struct vault_info));
-  sodium_free(info);
   return VE_SUCCESS;
 }
 
-/**
-   function create_vault
+// A region of the file to be hashed into the incremental mac by a worker. For
+// loc slots the start is the number of the slot instead of a file offset.
+struct mac_region {
+  uint8_t kind;
+  uint64_t start;
+  uint64_t len;
+};
 
-   The function to be called that will initially set up a vault for a user.
-   Requires that a vault file for the given user in the given directory does
-   not already exist, and creates a USERNAME.vault file to represent the
-   vault on disk.
+struct mac_job {
+  struct mac_region* regions;
+  const uint32_t* loc_data;
+  uint8_t macs[MAX_WORKERS][HASH_SIZE];
+};
 
-   The password is derived using the Argon2id 1.3 password derivation algorithm
-   that is computationally and memory expensive to attempt to disuade brute
-   force attacks. Besides the password which is chosen by the user themselves,
-   the master nonce and password salt are chosen using libsodiums randombytes
-   function, and the key with crypto_secretbox_keygen.
+/**
+   function internal_mac_worker
 
-   As stated above, the file format consists of a header with file information,
-   a loc data field with locations of key value pairs in the file, and then the
-   key-value pairs. This is created in this file, and maintained throughout
-   the different functions. A file hash is appended to the end to prevent
-   tampering.
+   Hashes one region for internal_rebuild_mac and XORs it into the mac of the
+   worker. Loc slots are hashed from the loc data already in memory, while
+   entries and gaps are hashed in place if the file is mapped, or streamed
+   from the file through a 1 KB buffer otherwise.
 
-   Returns VE_SUCCESS upon successful creation of a file.
-   VE_PARAMERR if any of the inputs are null or their string lengths too long
-   VE_MEMERR if secure memory cannot be changed to read write mode
-   VE_SYSCALL if snprintf or open fails for a reason besides EEXIST and EACCES
-   VE_VOPEN if a vault is already open
-   VE_CRYPTOERR if the derived key or encrypted master cannot be generated
-   VE_IOERR if their were any issues writing to disk
+   Returns VE_SUCCESS if the region was hashed
+   VE_IOERR if the region could not be read
+   VE_CRYPTOERR if the region could not be hashed
  */
-int create_vault(char* directory, char* username, char* password,
-                 struct vault_info* info) {
-  if (directory == NULL || username == NULL || password == NULL ||
-      strnlen(directory, MAX_PATH_LEN + 1) > MAX_PATH_LEN ||
-      strnlen(username, MAX_USER_SIZE + 1) > MAX_USER_SIZE ||
-      strnlen(password, MAX_PASS_SIZE + 1) > MAX_PASS_SIZE) {
-    return VE_PARAMERR;
+int internal_mac_worker(struct worker_job* job, uint32_t worker,
+                        uint32_t item) {
+  struct mac_job* data = job->data;
+  struct mac_region* region = data->regions + item;
+  crypto_generichash_state state;
+  if (internal_region_begin(job->info, &state, region->kind, region->start)) {
+    return VE_CRYPTOERR;
   }
 
-  int max_size =
-      strnlen(directory, MAX_PATH_LEN) + strnlen(username, MAX_USER_SIZE) + 10;
-  char* pathname = malloc(max_size);
-  if (snprintf(pathname, max_size, filename_pattern, directory, username) < 0) {
-    free(pathname);
-    return VE_SYSCALL;
-  }
+  if (region->kind == REGION_LOC) {
+    if (crypto_generichash_update(
+            &state,
+            (const uint8_t*)LOC_SLOT(job->info, data->loc_data, region->start),
+            job->info->loc_size) < 0) {
+      return VE_CRYPTOERR;
+    }
+  } else {
+    uint8_t buffer[1024];
+    uint64_t done = 0;
+    const uint8_t* mapped =
+        region->len > UINT32_MAX
+            ? NULL
+            : internal_read_at(job->info, region->start, region->len, NULL);
+    if (mapped != NULL) {
+      if (crypto_generichash_update(&state, mapped, region->len) < 0) {
+        return VE_CRYPTOERR;
+      }
+      done = region->len;
+    }
 
-  if (sodium_mprotect_readwrite(info) < 0) {
-    FPUTS("Issues gaining access to memory\n", stderr);
-    free(pathname);
-    return VE_MEMERR;
-  }
+    while (done < region->len) {
+      uint32_t amount_at_once =
+          region->len - done > 1024 ? 1024 : region->len - done;
+      if (pread(job->info->user_fd, buffer, amount_at_once,
+                region->start + done) != amount_at_once) {
+        return VE_IOERR;
+      }
 
-  if (info->is_open) {
-    FPUTS("Already have a vault open\n", stderr);
-    free(pathname);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
+      if (crypto_generichash_update(&state, buffer, amount_at_once) < 0) {
+        return VE_CRYPTOERR;
+      }
+      done += amount_at_once;
     }
-    return VE_VOPEN;
   }
 
-  // Specify that the file must be created, and have access set as 0600
-  int open_results =
-      open(pathname, O_RDWR | O_CREAT | O_EXCL | O_DSYNC, S_IRUSR | S_IWUSR);
-  free(pathname);
-  if (open_results < 0) {
-    if (errno == EEXIST) {
-      return VE_EXIST;
-    } else if (errno == EACCES) {
-      return VE_ACCESS;
-    } else {
-      return VE_SYSCALL;
-    }
+  uint8_t region_hash[HASH_SIZE];
+  if (crypto_generichash_final(&state, region_hash, HASH_SIZE) < 0) {
+    return VE_CRYPTOERR;
   }
-
-  if (flock(open_results, LOCK_EX | LOCK_NB) < 0) {
-    close(open_results);
-    FPUTS("Could not get file lock\n", stderr);
-    return VE_SYSCALL;
+  for (int i = 0; i < HASH_SIZE; ++i) {
+    data->macs[worker][i] ^= region_hash[i];
   }
+  return VE_SUCCESS;
+}
 
-  info->user_fd = open_results;
-  crypto_secretbox_keygen(info->decrypted_master);
+// Used to sort the entries in the data section by where they are in the file
+struct entry_span {
+  uint64_t start;
+  uint32_t len;
+};
 
-  uint8_t salt[SALT_SIZE];
-  randombytes_buf(salt, sizeof salt);
-  if (PW_HASH(info->derived_key, password, strlen(password), salt) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    close(open_results);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
-    }
-    return VE_CRYPTOERR;
+int internal_compare_spans(const void* first, const void* second) {
+  uint64_t first_start = ((const struct entry_span*)first)->start;
+  uint64_t second_start = ((const struct entry_span*)second)->start;
+  return (first_start > second_start) - (first_start < second_start);
+}
+
+/**
+   function internal_rebuild_mac
+
+   Recomputes the incremental file mac from the contents of the file. Every
+   loc slot is a region, and every entry referenced by a loc slot is a region
+   sorted by where it sits in the data section, with any bytes between
+   entries as gaps. As a result every byte between the header and the
+   trailer belongs to exactly one region. Entries that overlap each other or
+   reach outside of the data section are rejected.
+
+   As the mac is an XOR of the region hashes, the regions can be hashed in any
+   order. Vaults with VERIFY_PARALLEL set spread them across the workers, and
+   the macs of each worker are combined at the end.
+
+   Assumes the vault uses INTEGRITY_INCREMENTAL and that data_end is set.
+
+   Returns VE_SUCCESS if the mac was rebuilt
+   VE_FILE if the loc data does not describe a valid data section
+   VE_MEMERR if memory for the loc data cannot be allocated
+   VE_IOERR if the file cannot be read
+   VE_CRYPTOERR if the regions could not be hashed
+ */
+int internal_rebuild_mac(struct vault_info* info) {
+  uint32_t loc_len;
+  uint8_t loc_len_buffer[4];
+  const uint8_t* loc_len_data =
+      internal_read_at(info, HEADER_SIZE - 4, 4, loc_len_buffer);
+  if (loc_len_data == NULL) {
+    return VE_IOERR;
   }
+  memcpy(&loc_len, loc_len_data, 4);
 
-  uint8_t encrypted_master[MASTER_KEY_SIZE + MAC_SIZE];
-  uint8_t master_nonce[NONCE_SIZE];
-  randombytes_buf(master_nonce, sizeof master_nonce);
-  if (crypto_secretbox_easy(encrypted_master, info->decrypted_master,
-                            MASTER_KEY_SIZE, master_nonce,
-                            info->derived_key) < 0) {
-    FPUTS("Could not encrypt master key\n", stderr);
-    close(open_results);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
-    }
-    return VE_CRYPTOERR;
+  uint64_t data_start = HEADER_SIZE + (uint64_t)loc_len * info->loc_size;
+  if (loc_len == 0 || loc_len > MAX_LOC_LEN(info) ||
+      loc_len > (info->data_end - HEADER_SIZE) / info->loc_size) {
+    return VE_FILE;
   }
 
-  uint32_t loc_len = INITIAL_SIZE;
-  uint8_t zeros[INITIAL_SIZE * LOC_SIZE] = {0};
-  uint8_t version = VERSION;
-  WRITE(info->user_fd, &version, 1, info);
-  WRITE(info->user_fd, &zeros, 7, info);
-  WRITE(info->user_fd, &salt, crypto_pwhash_SALTBYTES, info);
-  WRITE(info->user_fd, &encrypted_master, MASTER_KEY_SIZE + MAC_SIZE, info);
-  WRITE(info->user_fd, &master_nonce, NONCE_SIZE, info);
-  WRITE(info->user_fd, &zeros, 8, info);
-  WRITE(info->user_fd, &loc_len, sizeof(uint32_t), info);
-  WRITE(info->user_fd, &zeros, INITIAL_SIZE * LOC_SIZE, info);
+  // Each slot, each entry and a gap before each entry and at the end
+  uint32_t* loc_buffer = info->map ? NULL : malloc(loc_len * info->loc_size);
+  struct entry_span* spans = malloc(loc_len * sizeof(struct entry_span));
+  struct mac_region* regions =
+      malloc((3 * loc_len + 1) * sizeof(struct mac_region));
+  if ((info->map == NULL && loc_buffer == NULL) || spans == NULL ||
+      regions == NULL) {
+    variadic_free(3, loc_buffer, spans, regions);
+    return VE_MEMERR;
+  }
 
-  uint8_t file_hash[HASH_SIZE];
-  internal_hash_file(info, (uint8_t*)&file_hash, 0);
-  lseek(info->user_fd, 0, SEEK_END);
-  if (write(info->user_fd, &file_hash, HASH_SIZE) < 0) {
-    FPUTS("Could not write hash to disk\n", stderr);
-    sodium_mprotect_noaccess(info);
+  const uint32_t* loc_data = (const uint32_t*)internal_read_at(
+      info, HEADER_SIZE, loc_len * info->loc_size, (uint8_t*)loc_buffer);
+  if (loc_data == NULL) {
+    variadic_free(3, loc_buffer, spans, regions);
     return VE_IOERR;
   }
 
-  info->key_info = init_map(INITIAL_SIZE / 2);
-  info->current_box.key[0] = 0;
-  info->is_open = 1;
+  uint32_t num_regions = 0;
+  uint32_t num_spans = 0;
+  for (uint32_t i = 0; i < loc_len; ++i) {
+    const uint32_t* current_loc_data = LOC_SLOT(info, loc_data, i);
+    regions[num_regions].kind = REGION_LOC;
+    regions[num_regions].start = i;
+    regions[num_regions].len = info->loc_size;
+    num_regions++;
 
-  if (sodium_mprotect_noaccess(info) < 0) {
-    FPUTS("Issues preventing access to memory\n", stderr);
+    if (current_loc_data[0] == STATE_UNUSED) {
+      continue;
+    }
+
+    if (current_loc_data[2] >= BOX_KEY_SIZE ||
+        current_loc_data[3] > DATA_SIZE) {
+      variadic_free(3, loc_buffer, spans, regions);
+      return VE_FILE;
+    }
+    spans[num_spans].start = internal_slot_loc(info, current_loc_data);
+    spans[num_spans].len =
+        internal_entry_size(info->cipher, current_loc_data[2],
+                            current_loc_data[3]);
+    num_spans++;
   }
 
-  FPUTS("Created file successfully\n", stderr);
-  return VE_SUCCESS;
+  qsort(spans, num_spans, sizeof(struct entry_span), internal_compare_spans);
+
+  uint64_t current = data_start;
+  for (uint32_t i = 0; i < num_spans; ++i) {
+    if (spans[i].start < current ||
+        spans[i].start > info->data_end - spans[i].len) {
+      variadic_free(3, loc_buffer, spans, regions);
+      return VE_FILE;
+    }
+
+    if (spans[i].start > current) {
+      regions[num_regions].kind = REGION_GAP;
+      regions[num_regions].start = current;
+      regions[num_regions].len = spans[i].start - current;
+      num_regions++;
+    }
+    regions[num_regions].kind = REGION_ENTRY;
+    regions[num_regions].start = spans[i].start;
+    regions[num_regions].len = spans[i].len;
+    num_regions++;
+    current = spans[i].start + spans[i].len;
+  }
+
+  if (current < info->data_end) {
+    regions[num_regions].kind = REGION_GAP;
+    regions[num_regions].start = current;
+    regions[num_regions].len = info->data_end - current;
+    num_regions++;
+  }
+
+  struct mac_job mac_job;
+  mac_job.regions = regions;
+  mac_job.loc_data = loc_data;
+  sodium_memzero(mac_job.macs, sizeof(mac_job.macs));
+  struct worker_job job = {info, internal_mac_worker, &mac_job, num_regions,
+                           0, VE_SUCCESS};
+  int result = internal_run_workers(
+      &job, info->verify == VERIFY_PARALLEL ? info->workers : 1);
+
+  sodium_memzero(info->file_mac, HASH_SIZE);
+  for (uint32_t w = 0; w < MAX_WORKERS && !result; ++w) {
+    for (int i = 0; i < HASH_SIZE; ++i) {
+      info->file_mac[i] ^= mac_job.macs[w][i];
+    }
+  }
+
+  sodium_memzero(mac_job.macs, sizeof(mac_job.macs));
+  variadic_free(3, loc_buffer, spans, regions);
+  return result;
 }
 
 /**
-   function create_from_header
+   function internal_seal_tag
 
-   Create a vault for a given user given the header of a vault file downloaded
-   from the server and the password to unlock the header. The header is
-   encrypted using what is assumed to be the same password as is given to the
-   server, as all functions that update the server should also update the
-   validation sent. This function validates the header by decrypting the master
-   key, and then creates a default file. This default file can then have
-   encrypted entries added onto it.
+   Computes the tag stored in the trailer of an incremental vault from the
+   generation, the end of the data section, the header and the running mac.
+   The tag is placed in the tag parameter, expected to be SEAL_TAG_SIZE bytes.
 
-   Returns VE_SUCCESS upon successful creation of a file.
-   VE_WRONGPASS if the master key cannot be decrypted
-   VE_PARAMERR if any of the inputs are null or their string lengths too long
-   VE_MEMERR if secure memory cannot be changed to read write mode
-   VE_SYSCALL if snprintf or open fails for a reason besides EEXIST and EACCES
-   VE_VOPEN if a vault is already open
-   VE_CRYPTOERR if the derived key or encrypted master cannot be generated
-   VE_IOERR if their were any issues writing to disk
+   Returns VE_SUCCESS if the tag was computed
+   VE_CRYPTOERR if the hashing fails
  */
-int create_from_header(char* directory, char* username, char* password,
-                       uint8_t* header, struct vault_info* info) {
-  if (directory == NULL || username == NULL || password == NULL ||
-      strnlen(directory, MAX_PATH_LEN + 1) > MAX_PATH_LEN ||
-      strnlen(username, MAX_USER_SIZE + 1) > MAX_USER_SIZE ||
-      strnlen(password, MAX_PASS_SIZE + 1) > MAX_PASS_SIZE) {
-    return VE_PARAMERR;
+int internal_seal_tag(struct vault_info* info, const uint8_t* header,
+                      uint64_t generation, uint8_t* tag) {
+  uint64_t data_end = info->data_end;
+  if (crypto_generichash_init(&info->hash_state, info->decrypted_master,
+                              MASTER_KEY_SIZE, SEAL_TAG_SIZE) < 0 ||
+      crypto_generichash_update(&info->hash_state, (uint8_t*)&generation,
+                                sizeof(uint64_t)) < 0 ||
+      crypto_generichash_update(&info->hash_state, (uint8_t*)&data_end,
+                                sizeof(uint64_t)) < 0 ||
+      crypto_generichash_update(&info->hash_state, header, HEADER_SIZE) < 0 ||
+      crypto_generichash_update(&info->hash_state, info->file_mac, HASH_SIZE) <
+          0 ||
+      crypto_generichash_final(&info->hash_state, tag, SEAL_TAG_SIZE) < 0) {
+    return VE_CRYPTOERR;
   }
+  return VE_SUCCESS;
+}
 
-  int max_size = strlen(directory) + strlen(username) + 10;
-  char* pathname = malloc(max_size);
-  if (snprintf(pathname, max_size, filename_pattern, directory, username) < 0) {
-    free(pathname);
-    return VE_SYSCALL;
-  }
+/**
+   Write transactions
+
+   Between vault_begin and vault_commit, changes are queued in memory rather
+   than written to the file. Appended entries go into a buffer that starts
+   at the end of the data section as it was when the queue was last written,
+   wipes of values already in the file are kept as a list of ranges, and the
+   changed loc slots are kept as the smallest range covering them, since the
+   loc field itself is already in memory. The running mac and the marked
+   Merkle leaves are kept current as changes are queued, so the queue is
+   written out by internal_txn_flush in a handful of calls and sealed once.
+ */
 
-  if (sodium_mprotect_readwrite(info) < 0) {
-    FPUTS("Issues gaining access to memory\n", stderr);
-    free(pathname);
-    return VE_MEMERR;
-  }
+/**
+   function internal_txn_clear
 
-  if (info->is_open) {
-    FPUTS("Already have a vault open\n", stderr);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
-    }
-    free(pathname);
-    return VE_VOPEN;
-  }
+   Empties the queue of a write transaction without writing it, keeping the
+   buffers for reuse. The buffer starts again at the end of the data section.
+ */
+void internal_txn_clear(struct vault_info* info) {
+  info->txn_start = info->data_end;
+  info->txn_len = 0;
+  info->num_wipes = 0;
+  info->txn_loc_first = UINT32_MAX;
+  info->txn_loc_last = 0;
+}
 
-  if (PW_HASH(info->derived_key, password, strlen(password), header + 8) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
-    }
-    free(pathname);
-    return VE_CRYPTOERR;
-  }
+/**
+   function internal_txn_free
 
-  if (crypto_secretbox_open_easy(info->decrypted_master, header + SALT_SIZE + 8,
-                                 MASTER_KEY_SIZE + MAC_SIZE,
-                                 header + HEADER_SIZE - NONCE_SIZE - 12,
-                                 info->derived_key) < 0) {
-    FPUTS("Could not decrypt master key\n", stderr);
-    free(pathname);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
-    }
-    return VE_WRONGPASS;
-  }
+   Ends any write transaction, dropping its queue and freeing its buffers.
+ */
+void internal_txn_free(struct vault_info* info) {
+  if (info->txn_data != NULL) {
+    sodium_memzero(info->txn_data, info->txn_cap);
+  }
+  variadic_free(2, info->txn_data, info->txn_wipes);
+  info->txn_data = NULL;
+  info->txn_wipes = NULL;
+  info->txn_cap = 0;
+  info->wipes_cap = 0;
+  info->in_txn = 0;
+  internal_txn_clear(info);
+}
 
-  // Specify that the file must be created, and have access set as 0600
-  int open_results =
-      open(pathname, O_RDWR | O_CREAT | O_EXCL | O_DSYNC, S_IRUSR | S_IWUSR);
-  free(pathname);
-  if (open_results < 0) {
-    if (errno == EEXIST) {
-      return VE_EXIST;
-    } else if (errno == EACCES) {
-      return VE_ACCESS;
-    } else {
-      return VE_SYSCALL;
+/**
+   function internal_write_loc
+
+   Writes the loc slot at index from the copy of the loc field in memory, or
+   during a write transaction adds it to the range of slots to write.
+
+   Returns VE_SUCCESS if the slot was written or queued
+   VE_IOERR if the slot could not be written
+ */
+int internal_write_loc(struct vault_info* info, uint32_t index) {
+  if (info->in_txn) {
+    if (index < info->txn_loc_first) {
+      info->txn_loc_first = index;
     }
+    if (index > info->txn_loc_last) {
+      info->txn_loc_last = index;
+    }
+    return VE_SUCCESS;
   }
 
-  if (flock(open_results, LOCK_EX | LOCK_NB) < 0) {
-    FPUTS("Could not get file lock\n", stderr);
-    return VE_SYSCALL;
+  if (pwrite(info->user_fd, LOC_SLOT(info, info->locs, index), info->loc_size,
+             HEADER_SIZE + index * info->loc_size) != info->loc_size) {
+    return VE_IOERR;
   }
+  return VE_SUCCESS;
+}
 
-  info->user_fd = open_results;
+/**
+   function internal_wipe_value
 
-  uint32_t loc_len = INITIAL_SIZE;
-  uint8_t zeros[INITIAL_SIZE * LOC_SIZE] = {0};
-  WRITE(info->user_fd, header, HEADER_SIZE - 4, info);
-  WRITE(info->user_fd, &loc_len, sizeof(uint32_t), info);
-  WRITE(info->user_fd, &zeros, INITIAL_SIZE * LOC_SIZE, info);
+   Zeroes len bytes of the file at offset, which are expected to hold an
+   encrypted value and its mac. During a write transaction, values still in
+   the transaction buffer are zeroed there, and others are queued.
 
-  uint8_t file_hash[HASH_SIZE];
-  internal_hash_file(info, (uint8_t*)&file_hash, 0);
-  lseek(info->user_fd, 0, SEEK_END);
-  if (write(info->user_fd, &file_hash, HASH_SIZE) < 0) {
-    FPUTS("Could not write hash to disk\n", stderr);
-    sodium_mprotect_noaccess(info);
-    return VE_IOERR;
+   Returns VE_SUCCESS if the value was wiped or queued
+   VE_MEMERR if the queue could not grow
+   VE_IOERR if the value could not be written
+ */
+int internal_wipe_value(struct vault_info* info, uint64_t offset,
+                        uint32_t len) {
+  if (info->in_txn && info->txn_len > 0 && offset >= info->txn_start) {
+    sodium_memzero(info->txn_data + offset - info->txn_start, len);
+    return VE_SUCCESS;
   }
 
-  info->key_info = init_map(INITIAL_SIZE / 2);
-  info->current_box.key[0] = 0;
-  info->is_open = 1;
-
-  if (sodium_mprotect_noaccess(info) < 0) {
-    FPUTS("Issues preventing access to memory\n", stderr);
+  if (info->in_txn) {
+    if (info->num_wipes == info->wipes_cap) {
+      uint32_t cap = info->wipes_cap ? info->wipes_cap * 2 : 64;
+      void* wipes = realloc(info->txn_wipes, cap * sizeof(*info->txn_wipes));
+      if (wipes == NULL) {
+        return VE_MEMERR;
+      }
+      info->txn_wipes = wipes;
+      info->wipes_cap = cap;
+    }
+    info->txn_wipes[info->num_wipes][0] = offset;
+    info->txn_wipes[info->num_wipes][1] = len;
+    info->num_wipes++;
+    return VE_SUCCESS;
   }
 
-  FPUTS("Created file successfully\n", stderr);
+  uint8_t zeros[DATA_SIZE + MAC_SIZE] = {0};
+  if (pwrite(info->user_fd, zeros, len, offset) != len) {
+    return VE_IOERR;
+  }
   return VE_SUCCESS;
 }
 
 /**
-   function open_vault
-
-   Given the directory containing vaults, a username and password, attempts to
-   open the vault for a given user. The vault should be at the path
-   directory/username.vault and have only been modified by the functions within
-   this file. The decryption key is derived from the password and a salt that
-   is saved within the file and Argon2id 1.3. After the decryption key is
-   determined, the master key is decrypted using the nonce saved in the file,
-   as well as using the mac saved with it to check its integrity. Finally file
-   integrity is checked by evaluating the file hash appeneded to the file.
+   function internal_txn_reserve
 
-   Assuming all checks pass, the loc data area is processed to load all the
-   vault keys into memory along with pointers into the file for where the
-   relevant data to retrieve their values are.
+   Grows the transaction buffer so that len more bytes fit after the queued
+   entries.
 
-   Returns VE_SUCCESS upon opening the vault and creating a keymap for the vault
-   VE_WRONGPASS if the decryption key cannot be decrypted
-   VE_PARAMERR if parameters are null or exceed the maximum length for their
-   fields
-   VE_MEMERR if secure memory cannot be changed to read write mode
-   VE_SYSCALL if snprintf fails or open fails without ENOENT or EACCESS
-   VE_EXIST if open fails with ENOENT for the file not existing
-   VE_ACCESS if open fails from not having permisions to the file
-   VE_CRYPTOERR if the derived password could not be computed
-   VE_FILE if the master key cannot be decrypted or the file hash is invalid
+   Returns VE_SUCCESS if the bytes fit
+   VE_MEMERR if the buffer could not grow
  */
-int open_vault(char* directory, char* username, char* password,
-               struct vault_info* info) {
-  if (directory == NULL || username == NULL || password == NULL ||
-      strlen(directory) > MAX_PATH_LEN || strlen(username) > MAX_USER_SIZE ||
-      strlen(password) > MAX_PASS_SIZE) {
-    return VE_PARAMERR;
+int internal_txn_reserve(struct vault_info* info, uint32_t len) {
+  if (len > info->txn_cap - info->txn_len) {
+    uint32_t cap = info->txn_cap ? info->txn_cap : 64 * 1024;
+    while (len > cap - info->txn_len) {
+      cap *= 2;
+    }
+    uint8_t* data = malloc(cap);
+    if (data == NULL) {
+      return VE_MEMERR;
+    }
+    if (info->txn_data != NULL) {
+      memcpy(data, info->txn_data, info->txn_len);
+      sodium_memzero(info->txn_data, info->txn_cap);
+      free(info->txn_data);
+    }
+    info->txn_data = data;
+    info->txn_cap = cap;
   }
+  return VE_SUCCESS;
+}
 
-  int max_size = strlen(directory) + strlen(username) + 10;
-  char* pathname = malloc(max_size);
-  if (snprintf(pathname, max_size, filename_pattern, directory, username) < 0) {
-    free(pathname);
-    return VE_SYSCALL;
-  }
+/**
+   function internal_txn_flush
 
-  if (sodium_mprotect_readwrite(info) < 0) {
-    FPUTS("Issues gaining access to memory\n", stderr);
-    free(pathname);
-    return VE_MEMERR;
+   Writes out the queue of a write transaction: the buffered entries with one
+   pwrite at the old end of the data section, each queued wipe, and the range
+   of changed loc slots with one pwrite. The file must be sealed afterwards,
+   which internal_seal_file does. The transaction itself stays open.
+
+   Returns VE_SUCCESS if the queue was written
+   VE_IOERR if the file could not be written to
+ */
+int internal_txn_flush(struct vault_info* info) {
+  if (info->txn_len > 0 &&
+      pwrite(info->user_fd, info->txn_data, info->txn_len, info->txn_start) !=
+          info->txn_len) {
+    FPUTS("Could not write transaction to disk\n", stderr);
+    return VE_IOERR;
   }
 
-  if (info->is_open) {
-    FPUTS("Already have a vault open\n", stderr);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
+  uint8_t zeros[DATA_SIZE + MAC_SIZE] = {0};
+  for (uint32_t i = 0; i < info->num_wipes; ++i) {
+    uint32_t len = info->txn_wipes[i][1];
+    if (pwrite(info->user_fd, zeros, len, info->txn_wipes[i][0]) != len) {
+      FPUTS("Could not write transaction to disk\n", stderr);
+      return VE_IOERR;
     }
-    free(pathname);
-    return VE_VOPEN;
   }
 
-  int open_results = open(pathname, O_RDWR | O_NOFOLLOW);
-  free(pathname);
-  if (open_results < 0) {
-    if (errno == ENOENT) {
-      return VE_EXIST;
-    } else if (errno == EACCES) {
-      return VE_ACCESS;
-    } else {
-      return VE_SYSCALL;
+  if (info->txn_loc_first <= info->txn_loc_last) {
+    uint32_t len =
+        (info->txn_loc_last - info->txn_loc_first + 1) * info->loc_size;
+    if (pwrite(info->user_fd, LOC_SLOT(info, info->locs, info->txn_loc_first),
+               len, HEADER_SIZE + info->txn_loc_first * info->loc_size) !=
+        len) {
+      FPUTS("Could not write transaction to disk\n", stderr);
+      return VE_IOERR;
     }
   }
 
-  if (flock(open_results, LOCK_EX | LOCK_NB) < 0) {
-    close(open_results);
-    FPUTS("Could not get file lock\n", stderr);
-    return VE_SYSCALL;
+  if (info->txn_len > 0) {
+    sodium_memzero(info->txn_data, info->txn_len);
   }
+  internal_txn_clear(info);
+  return VE_SUCCESS;
+}
 
-  lseek(open_results, 8, SEEK_SET);
-  int open_info_length = SALT_SIZE + MAC_SIZE + MASTER_KEY_SIZE + NONCE_SIZE;
-  uint8_t open_info[open_info_length];
-  READ(open_results, open_info, open_info_length, info);
+/**
+   function internal_seal_trailer
+
+   Computes the trailer for the file after it has been changed, without
+   writing it, so that callers can write it together with other data. For
+   INTEGRITY_FILE vaults this rehashes the whole file, while for
+   INTEGRITY_INCREMENTAL vaults only the header is reread and the generation
+   bumped, as the running mac has been kept current by the writes themselves.
+   INTEGRITY_MERKLE vaults first rehash the segments that were written to and
+   write the changed part of the tree, so those writes must already be done.
+
+   The trailer is placed in the trailer parameter, expected to be HASH_SIZE
+   bytes, and belongs right after the tree, or after the data section if
+   there is no tree.
+
+   Returns VE_SUCCESS if the trailer was computed
+   VE_IOERR if the file cannot be read from or written to
+   VE_CRYPTOERR if the trailer could not be computed
+ */
+int internal_seal_trailer(struct vault_info* info, uint8_t* trailer) {
+  if (info->integrity == INTEGRITY_FILE) {
+    return internal_hash_file(info, trailer, info->data_end);
+  }
 
-  if (PW_HASH(info->derived_key, password, strlen(password), open_info) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    close(open_results);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
+  // The header is in the first leaf, so it is always rehashed
+  if (info->integrity == INTEGRITY_MERKLE) {
+    internal_tree_mark_leaves(info, 0, 0);
+    int result = internal_tree_update(info);
+    if (result) {
+      return result;
     }
-    return VE_CRYPTOERR;
   }
 
-  if (crypto_secretbox_open_easy(info->decrypted_master, open_info + SALT_SIZE,
-                                 MASTER_KEY_SIZE + MAC_SIZE,
-                                 open_info + open_info_length - NONCE_SIZE,
-                                 info->derived_key) < 0) {
-    FPUTS("Could not decrypt master key\n", stderr);
-    close(open_results);
-    sodium_memzero(info->derived_key, MASTER_KEY_SIZE);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
-    }
-    return VE_WRONGPASS;
+  uint8_t header_buffer[HEADER_SIZE];
+  const uint8_t* header =
+      internal_read_at(info, 0, HEADER_SIZE, header_buffer);
+  if (header == NULL) {
+    return VE_IOERR;
   }
 
-  info->user_fd = open_results;
-  char file_hash[HASH_SIZE];
-  char current_hash[HASH_SIZE];
-  internal_hash_file(info, (uint8_t*)&file_hash, HASH_SIZE);
-  lseek(open_results, -1 * HASH_SIZE, SEEK_END);
-  READ(open_results, &current_hash, HASH_SIZE, info);
-  if (memcmp((const char*)&file_hash, (const char*)&current_hash, HASH_SIZE) !=
-      0) {
-    FPUTS("FILE HASHES DO NOT MATCH\n", stderr);
-    sodium_mprotect_noaccess(info);
-    return VE_FILE;
+  uint64_t generation = info->generation + 1;
+  memcpy(trailer, &generation, sizeof(uint64_t));
+  if (internal_seal_tag(info, header, generation,
+                        trailer + sizeof(uint64_t))) {
+    return VE_CRYPTOERR;
   }
+  info->generation = generation;
+  return VE_SUCCESS;
+}
 
-  internal_create_key_map(info);
+/**
+   function internal_seal_file
+
+   Computes the trailer with internal_seal_trailer and writes it after the
+   data section and tree. Afterwards the mapping is updated for the new end
+   of the file. Any queued writes of an open transaction are written out
+   first, so that the trailer covers them. A key map snapshot left from when
+   the vault was opened no longer matches the file, so it is dropped from
+   the header and the file cut short after the new trailer.
+
+   Returns VE_SUCCESS if the trailer was written
+   VE_IOERR if the file cannot be read from or written to
+   VE_CRYPTOERR if the trailer could not be computed
+ */
+int internal_seal_file(struct vault_info* info) {
+  uint8_t trailer[HASH_SIZE];
+  int result = info->in_txn ? internal_txn_flush(info) : VE_SUCCESS;
+  if (result) {
+    return result;
+  }
 
-  info->current_box.key[0] = 0;
-  info->is_open = 1;
+  uint32_t dropped = info->snapshot_len;
+  if (dropped > 0) {
+    info->snapshot_len = 0;
+    if (pwrite(info->user_fd, &info->snapshot_len, sizeof(uint32_t),
+               SNAPSHOT_LEN_AT) != sizeof(uint32_t)) {
+      return VE_IOERR;
+    }
+  }
 
-  if (sodium_mprotect_noaccess(info) < 0) {
-    FPUTS("Issues preventing access to memory\n", stderr);
+  result = internal_seal_trailer(info, trailer);
+  if (result) {
+    return result;
   }
 
-  FPUTS("Opened the vault\n", stderr);
+  uint64_t trailer_loc = info->data_end + internal_tree_size(info);
+  if (pwrite(info->user_fd, trailer, HASH_SIZE, trailer_loc) != HASH_SIZE) {
+    FPUTS("Could not write hash to disk\n", stderr);
+    return VE_IOERR;
+  }
+
+  // Touching a mapping past the end of the file is fatal
+  if (dropped > 0) {
+    internal_unmap_file(info);
+    if (ftruncate(info->user_fd, trailer_loc + HASH_SIZE) < 0) {
+      return VE_IOERR;
+    }
+  }
+  internal_update_map(info, trailer_loc + HASH_SIZE);
+  info->txn_start = info->data_end;
   return VE_SUCCESS;
 }
 
 /**
-   function close_vault
+   function internal_verify_file
+
+   Checks the trailer of a freshly opened file against its contents, using
+   whichever integrity mode is set in the header. The size of the loc slots is
+   taken from the format version in the header, and the cipher suite and the
+   length of any key map snapshot before the trailer from the header too. The
+   snapshot is not covered by the trailer, and is checked on its own when it
+   is loaded. On success the integrity fields of the vault info are set up
+   for later writes. Merkle vaults only have their tree, header and loc field
+   checked here, and the segments holding each entry are checked when the
+   entry is first read, unless VERIFY_PARALLEL is set, in which case every
+   segment is checked up front.
+
+   Returns VE_SUCCESS if the file is intact
+   VE_FILE if the trailer does not match or the file is malformed
+   VE_IOERR if the file cannot be read
+   VE_CRYPTOERR if the cipher suite needs hardware this CPU does not have
+   Otherwise the error from rebuilding the mac
+ */
+int internal_verify_file(struct vault_info* info) {
+  off_t file_size = lseek(info->user_fd, 0, SEEK_END);
+  if (file_size < 0) {
+    return VE_IOERR;
+  }
+  if (file_size < HEADER_SIZE + HASH_SIZE) {
+    return VE_FILE;
+  }
+  internal_map_file(info, file_size);
 
-   Closes a currently open vault by closing the file descriptor, releasing
+  uint8_t header[HEADER_SIZE];
+  uint8_t trailer[HASH_SIZE];
+  if (lseek(info->user_fd, 0, SEEK_SET) < 0 ||
+      read(info->user_fd, header, HEADER_SIZE) != HEADER_SIZE ||
+      lseek(info->user_fd, file_size - HASH_SIZE, SEEK_SET) < 0 ||
+      read(info->user_fd, trailer, HASH_SIZE) != HASH_SIZE) {
+    internal_unmap_file(info);
+    return VE_IOERR;
+  }
+
+  // The snapshot sits right before the trailer and is checked on its own
+  memcpy(&info->snapshot_len, header + SNAPSHOT_LEN_AT, sizeof(uint32_t));
+  if (info->snapshot_len > file_size - HEADER_SIZE - HASH_SIZE) {
+    internal_unmap_file(info);
+    return VE_FILE;
+  }
+  file_size -= info->snapshot_len;
+  info->data_end = file_size - HASH_SIZE;
+
+  int result;
+  uint8_t expected[HASH_SIZE];
+  info->integrity = header[1];
+  info->verify = header[3];
+  if (header[0] != VERSION && header[0] != VERSION_NARROW_LOCS &&
+      header[0] != VERSION_NO_DIRECTORY) {
+    FPUTS("Unknown format version\n", stderr);
+    internal_unmap_file(info);
+    return VE_FILE;
+  }
+  info->loc_size = header[0] == VERSION                ? WIDE_LOC_SIZE
+                   : header[0] == VERSION_NARROW_LOCS ? DIR_LOC_SIZE
+                                                      : LOC_SIZE;
+  info->cipher = header[2];
+  if ((result = internal_check_cipher(info->cipher))) {
+    internal_unmap_file(info);
+    return result;
+  }
+  if (info->integrity == INTEGRITY_FILE) {
+    result = internal_hash_file(info, expected, info->data_end);
+  } else if (info->integrity == INTEGRITY_INCREMENTAL ||
+             info->integrity == INTEGRITY_MERKLE) {
+    memcpy(&info->generation, trailer, sizeof(uint64_t));
+    memcpy(expected, trailer, sizeof(uint64_t));
+    if (info->integrity == INTEGRITY_MERKLE) {
+      result = internal_tree_load(info, file_size);
+    } else {
+      result = internal_rebuild_mac(info);
+    }
+    if (!result) {
+      result = internal_seal_tag(info, header, info->generation,
+                                 expected + sizeof(uint64_t));
+    }
+  } else {
+    FPUTS("Unknown integrity mode\n", stderr);
+    internal_unmap_file(info);
+    return VE_FILE;
+  }
+
+  if (result) {
+    internal_tree_free(info);
+    internal_unmap_file(info);
+    return result;
+  }
+
+  if (memcmp(expected, trailer, HASH_SIZE) != 0) {
+    FPUTS("FILE HASHES DO NOT MATCH\n", stderr);
+    internal_tree_free(info);
+    internal_unmap_file(info);
+    return VE_FILE;
+  }
+
+  // The rest of the segments are checked as entries are read
+  if (info->integrity == INTEGRITY_MERKLE && info->verify == VERIFY_PARALLEL) {
+    if (internal_tree_check_all(info)) {
+      internal_tree_free(info);
+      internal_unmap_file(info);
+      return VE_FILE;
+    }
+  } else if (info->integrity == INTEGRITY_MERKLE) {
+    uint32_t loc_len;
+    memcpy(&loc_len, header + HEADER_SIZE - 4, sizeof(uint32_t));
+    if (loc_len > MAX_LOC_LEN(info) ||
+        loc_len > (info->data_end - HEADER_SIZE) / info->loc_size ||
+        internal_tree_check(info, 0, HEADER_SIZE + loc_len * info->loc_size)) {
+      internal_tree_free(info);
+      internal_unmap_file(info);
+      return VE_FILE;
+    }
+  }
+  return VE_SUCCESS;
+}
+
+/**
+   function internal_switch_integrity
+
+   Switches the vault to another integrity mode. The mode byte in the header
+   is updated, the mac or tree for the new mode is built once from the file,
+   and the file is resealed and cut down to its new length.
+
+   Returns VE_SUCCESS if the vault was switched
+   VE_IOERR if the file cannot be written to
+   Otherwise the error from rebuilding the mac or sealing the file
+ */
+int internal_switch_integrity(struct vault_info* info, uint8_t mode) {
+  if (pwrite(info->user_fd, &mode, 1, 1) != 1) {
+    return VE_IOERR;
+  }
+
+  // Merkle vaults build the whole tree when there is none on the next seal
+  internal_tree_free(info);
+  info->integrity = mode;
+  int result = VE_SUCCESS;
+  if (mode == INTEGRITY_INCREMENTAL) {
+    result = internal_rebuild_mac(info);
+  }
+  if (!result) {
+    result = internal_seal_file(info);
+  }
+  if (!result &&
+      ftruncate(info->user_fd,
+                info->data_end + internal_tree_size(info) + HASH_SIZE) < 0) {
+    result = VE_IOERR;
+  }
+  return result;
+}
+
+/**
+   function internal_fill_directory
+
+   Fills in the key directory of a loc slot from the start of its entry, for
+   vaults in a format with one. The key length must already be in the slot.
+ */
+void internal_fill_directory(const struct vault_info* info, uint32_t* loc_data,
+                             const uint8_t* entry) {
+  if (info->loc_size != LOC_SIZE) {
+    uint8_t* directory = (uint8_t*)loc_data + LOC_SIZE;
+    uint32_t len = ENTRY_HEADER_SIZE + loc_data[2];
+    memcpy(directory, entry, len);
+    memset(directory + len, 0, DIR_LOC_SIZE - LOC_SIZE - len);
+  }
+}
+
+/**
+   slot_undo - a loc slot and the integrity fields as they were before a
+   write that changes the slot, which are changed in memory ahead of the
+   write and put back if it fails
+ */
+struct slot_undo {
+  uint32_t* loc_data;
+  uint32_t slot[WIDE_LOC_SIZE / 4];
+  uint8_t file_mac[HASH_SIZE];
+  uint64_t data_end;
+  uint64_t generation;
+};
+
+void internal_save_slot(const struct vault_info* info, uint32_t* loc_data,
+                        struct slot_undo* undo) {
+  undo->loc_data = loc_data;
+  memcpy(undo->slot, loc_data, info->loc_size);
+  memcpy(undo->file_mac, info->file_mac, HASH_SIZE);
+  undo->data_end = info->data_end;
+  undo->generation = info->generation;
+}
+
+void internal_undo_slot(struct vault_info* info, const struct slot_undo* undo) {
+  memcpy(undo->loc_data, undo->slot, info->loc_size);
+  memcpy(info->file_mac, undo->file_mac, HASH_SIZE);
+  info->data_end = undo->data_end;
+  info->generation = undo->generation;
+}
+
+/**
+   function internal_reseal_file
+
+   Seals the file again after an append failed to write, as its entry may
+   have been written over the trailer, and the tree of a Merkle vault, at
+   the end of the data section. The tree is written out whole, and the file
+   cut short after the trailer. As a write already failed, this is only a
+   best effort, and the vault info is left as it was either way.
+ */
+void internal_reseal_file(struct vault_info* info) {
+  info->tree_written_at = UINT64_MAX;
+  if (internal_seal_file(info) == VE_SUCCESS &&
+      ftruncate(info->user_fd,
+                info->data_end + internal_tree_size(info) + HASH_SIZE) < 0) {
+    FPUTS("Could not cut the file short after a failed append\n", stderr);
+  }
+}
+
+/**
+   function internal_append_entry
+
+   Appends a finished entry, with its value encrypted and its hash in place,
+   to the end of the data section, and points the first free loc slot at it.
+   As the vault is append-only, the first free loc data field can be found
+   and used to represent the data that is appended to the file.
+
+   In the case that there are no free location data fields, the function
+   returns without appending the entry. The internal_condense_file function
+   can then be used to remove any deleted entries from the file and double
+   the location data size, after which this function can be called again.
+   The same goes for vaults in an older format about to grow past 4 GB, as
+   condensing them moves them to slots that can point that far.
+
+   The free slot is found from the copy of the loc field in memory, starting
+   at the lowest slot that may be unused, so no reads are needed. All I/O is
+   positioned, so the file offset is never used. For incremental vaults the
+   trailer is computed up front and written in the same pwritev as the
+   entry, as it directly follows the entry, and the loc slot, with its key
+   directory, is written with a single pwrite. With the file mapped an append
+   is those two calls. Merkle vaults have to hash the written segments, so
+   they seal afterwards, as does the first append to a vault opened with a
+   key map snapshot, which the entry is written over and which only
+   internal_seal_file drops from the header.
+   During a write transaction the entry and slot are only queued, and nothing
+   is written or sealed until the transaction is flushed. If the entry or
+   slot cannot be written, the slot, mac and end of the data section in
+   memory are put back as they were, so they still match the file, which is
+   sealed again with internal_reseal_file.
+   The key is added to the key map before anything is written, so running out
+   of memory leaves the file untouched, and taken out again if the entry or
+   slot cannot be written. Once both are in the file the key stays in the
+   map even if the seal then fails, as the slot is live and adding the key
+   again would give it a second one.
+
+   As this is an internal function, assumes the parameters have already been
+   checked by the caller and that the info field has been made writable.
+
+   Returns VE_SUCCESS if the entry was appended
+   VE_IOERR if the data cannot be read from or written to the file
+   VE_FILE if a segment of a Merkle vault written to does not match the tree
+   VE_MEMERR if the transaction buffer or key map could not grow
+   VE_NOSPACE if there is no more space in the loc data field, or the vault
+   has to move to the current format to grow any further
+ */
+int internal_append_entry(struct vault_info* info, uint8_t type,
+                          const char* key, const uint8_t* entry, uint32_t len,
+                          uint32_t val_len, uint64_t m_time) {
+  // Slots below the hint are in use, and it only moves back on a condense
+  uint32_t next_loc = info->next_free;
+  while (next_loc < info->loc_len && *LOC_SLOT(info, info->locs, next_loc)) {
+    next_loc++;
+  }
+  info->next_free = next_loc;
+  if (next_loc == info->loc_len ||
+      (info->loc_size != WIDE_LOC_SIZE && info->data_end > UINT32_MAX)) {
+    return VE_NOSPACE;
+  }
+  if (info->in_txn && internal_txn_reserve(info, len)) {
+    return VE_MEMERR;
+  }
+
+  uint64_t file_loc = info->data_end;
+  uint32_t inode_loc = HEADER_SIZE + next_loc * info->loc_size;
+  struct key_info current_info = {m_time, inode_loc, type};
+  if (add_entry(info->key_info, key, &current_info)) {
+    FPUTS("Could not add key to map\n", stderr);
+    return VE_MEMERR;
+  }
+  uint32_t* loc_data = LOC_SLOT(info, info->locs, next_loc);
+  struct slot_undo undo;
+  internal_save_slot(info, loc_data, &undo);
+  int result = internal_mac_region(info, REGION_LOC, next_loc,
+                                   (uint8_t*)loc_data, info->loc_size);
+  if (result) {
+    delete_entry(info->key_info, key);
+    return result;
+  }
+  loc_data[0] = STATE_ACTIVE;
+  internal_set_slot_loc(info, loc_data, file_loc);
+  loc_data[2] = strlen(key);
+  loc_data[3] = val_len;
+  internal_fill_directory(info, loc_data, entry);
+
+  if ((result = internal_mac_region(info, REGION_LOC, next_loc,
+                                    (uint8_t*)loc_data, info->loc_size)) ||
+      (result = internal_mac_region(info, REGION_ENTRY, file_loc, entry,
+                                    len))) {
+    internal_undo_slot(info, &undo);
+    delete_entry(info->key_info, key);
+    return result;
+  }
+  info->data_end += len;
+
+  if (info->in_txn) {
+    memcpy(info->txn_data + info->txn_len, entry, len);
+    info->txn_len += len;
+    internal_write_loc(info, next_loc);
+  } else if (info->integrity == INTEGRITY_INCREMENTAL &&
+             info->snapshot_len == 0) {
+    uint8_t trailer[HASH_SIZE];
+    struct iovec parts[2] = {{(void*)entry, len}, {trailer, HASH_SIZE}};
+    if (internal_seal_trailer(info, trailer)) {
+      result = VE_CRYPTOERR;
+    } else if (pwritev(info->user_fd, parts, 2, file_loc) != len + HASH_SIZE ||
+               pwrite(info->user_fd, loc_data, info->loc_size, inode_loc) !=
+                   info->loc_size) {
+      FPUTS("Could not write entry to disk\n", stderr);
+      result = VE_IOERR;
+    }
+    if (result) {
+      internal_undo_slot(info, &undo);
+      delete_entry(info->key_info, key);
+      if (result == VE_IOERR) {
+        internal_reseal_file(info);
+      }
+      return result;
+    }
+    internal_update_map(info, info->data_end + HASH_SIZE);
+  } else {
+    if (pwrite(info->user_fd, entry, len, file_loc) != len ||
+        internal_write_loc(info, next_loc)) {
+      FPUTS("Could not write entry to disk\n", stderr);
+      internal_undo_slot(info, &undo);
+      delete_entry(info->key_info, key);
+      internal_reseal_file(info);
+      return VE_IOERR;
+    }
+
+    // The entry and slot are in the file, so the vault info and key map keep
+    // them even if the seal fails, and a later seal covers them
+    result = internal_seal_file(info);
+  }
+
+  info->next_free = next_loc + 1;
+  info->live_slots++;
+  info->live_bytes += len;
+  if (info->tombstones) {
+    delete_entry(info->tombstones, key);
+  }
+  return result;
+}
+
+/**
+   function internal_seal_entry
+
+   Encrypts the value of val_len bytes into entry, whose time, type and key
+   of key_len bytes are already in place, with the cipher suite of the vault
+   and a fresh random nonce. CIPHER_SECRETBOX entries are then hashed with
+   the master key, while the AEAD suites authenticate the type and key as
+   associated data in the same pass that encrypts the value.
+
+   Returns VE_SUCCESS if the entry was sealed
+   VE_CRYPTOERR if the value could not be encrypted or the entry hashed
+ */
+int internal_seal_entry(struct vault_info* info, uint8_t* entry,
+                        uint32_t key_len, const uint8_t* value,
+                        uint32_t val_len) {
+  uint32_t entry_len = internal_entry_size(info->cipher, key_len, val_len);
+  uint8_t* val_data = entry + ENTRY_HEADER_SIZE + key_len;
+  uint8_t* val_nonce = val_data + val_len + MAC_SIZE;
+  uint8_t* ad = entry + ENTRY_HEADER_SIZE - 1;
+  int result;
+  if (info->cipher == CIPHER_AESGCM) {
+    randombytes_buf(val_nonce, GCM_NONCE_SIZE);
+    result = crypto_aead_aes256gcm_encrypt(val_data, NULL, value, val_len, ad,
+                                           key_len + 1, NULL, val_nonce,
+                                           info->decrypted_master);
+  } else if (info->cipher == CIPHER_XCHACHA) {
+    randombytes_buf(val_nonce, NONCE_SIZE);
+    result = crypto_aead_xchacha20poly1305_ietf_encrypt(
+        val_data, NULL, value, val_len, ad, key_len + 1, NULL, val_nonce,
+        info->decrypted_master);
+  } else {
+    randombytes_buf(val_nonce, NONCE_SIZE);
+    result = crypto_secretbox_easy(val_data, value, val_len, val_nonce,
+                                   info->decrypted_master);
+    if (result == 0) {
+      result = crypto_generichash(entry + entry_len - HASH_SIZE, HASH_SIZE,
+                                  entry, entry_len - HASH_SIZE,
+                                  info->decrypted_master, MASTER_KEY_SIZE);
+    }
+  }
+  return result < 0 ? VE_CRYPTOERR : VE_SUCCESS;
+}
+
+/**
+   function internal_append_key
+
+   Attempts to append a key-value pair to the end of the vault file. The
+   value is encrypted and the entry sealed with internal_seal_entry, and the
+   entry is then appended with internal_append_entry.
+
+   As this is an internal function, assumes the parameters have already been
+   checked by the caller and that the info field has been made writable.
+
+   Returns VE_SUCCESS if the key-value pair was appeneded
+   VE_CRYPTOERR if the value cannot be encrypted
+   VE_IOERR if the data cannot be written to the file
+   VE_NOSPACE if there is no more space in the loc data field
+ */
+int internal_append_key(struct vault_info* info, uint8_t type, const char* key,
+                        const char* value, uint64_t m_time, uint32_t val_len) {
+  uint32_t key_len = strlen(key);
+  uint8_t to_write_data[MAX_ENTRY_SIZE];
+  uint32_t input_len = internal_entry_size(info->cipher, key_len, val_len);
+  *((uint64_t*)to_write_data) = m_time;
+  to_write_data[ENTRY_HEADER_SIZE - 1] = type;
+  memcpy(to_write_data + ENTRY_HEADER_SIZE, key, key_len);
+
+  if (internal_seal_entry(info, to_write_data, key_len, (uint8_t*)value,
+                          val_len)) {
+    FPUTS("Could not encrypt value for key value pair\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_CRYPTOERR;
+  }
+
+  int result = internal_append_entry(info, type, key, to_write_data,
+                                     input_len, val_len, m_time);
+  sodium_mprotect_noaccess(info);
+  if (result == VE_SUCCESS) {
+    FPUTS("Added key\n", stderr);
+  }
+  return result;
+}
+
+/**
+   function internal_append_encrypted
+
+   Like internal_append_key, this function is used to append an entry to the
+   vault if there is space available in the loc data. The main difference is
+   this function takes an entire entry that has the encrypted value and hash
+   at the end and adds it to the vault. The hash at the end if verified to be
+   correct, and the entry is only appended if it is. This function allows the
+   entries to be sent to and from the server without the server being able to
+   decrypt the values, but preventing tampering using the keyed hash. Entries
+   of the AEAD suites have no hash, as the time they are given is not part of
+   what their tag authenticates.
+
+   The actual checking of the entry is in the function add_encrypted_value,
+   which may call this function more than once if there is no space.
+
+   Returns VE_SUCCESS if the entry was validated and added.
+   VE_IOERR if there were issues writing to or reading from disk
+   VE_CRYPTORR if the new entry hash could not be generated
+   VE_NOSPACE if none of the loc entries are open
+
+ */
+int internal_append_encrypted(struct vault_info* info, uint8_t type,
+                              const char* key, const char* entry, int len,
+                              uint64_t m_time) {
+  uint32_t key_len = strlen(key);
+  uint32_t val_len = len - internal_entry_size(info->cipher, key_len, 0);
+
+  uint8_t to_write_data[MAX_ENTRY_SIZE];
+  memcpy(to_write_data, entry, len);
+  *((uint64_t*)to_write_data) = m_time;
+
+  if (info->cipher == CIPHER_SECRETBOX &&
+      crypto_generichash(to_write_data + len - HASH_SIZE, HASH_SIZE,
+                         to_write_data, len - HASH_SIZE,
+                         info->decrypted_master, MASTER_KEY_SIZE) < 0) {
+    FPUTS("Could not generate entry hash\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_CRYPTOERR;
+  }
+
+  int result = internal_append_entry(info, type, key, to_write_data, len,
+                                     val_len, m_time);
+  sodium_mprotect_noaccess(info);
+  if (result == VE_SUCCESS) {
+    FPUTS("Added key\n", stderr);
+  }
+  return result;
+}
+
+/**
+   function internal_load_locs
+
+   Reads the loc field in one go, in place if the file is mapped, and keeps it
+   in memory as the locs of the vault info, replacing any earlier copy.
+
+   Returns VE_SUCCESS if the loc field was read
+   VE_FILE if the loc field is longer than a vault may have
+   VE_MEMERR if memory for the loc field cannot be allocated
+   VE_IOERR if there were issues reading from disk
+ */
+int internal_load_locs(struct vault_info* info) {
+  uint32_t loc_len;
+  uint8_t loc_len_buffer[4];
+  const uint8_t* loc_len_data =
+      internal_read_at(info, HEADER_SIZE - 4, 4, loc_len_buffer);
+  if (loc_len_data == NULL) {
+    return VE_IOERR;
+  }
+  memcpy(&loc_len, loc_len_data, 4);
+
+  free(info->locs);
+  info->loc_len = 0;
+  info->next_free = 0;
+  if (loc_len > MAX_LOC_LEN(info)) {
+    return VE_FILE;
+  }
+  info->locs = malloc(loc_len * info->loc_size);
+  if (info->locs == NULL) {
+    return VE_MEMERR;
+  }
+  const uint8_t* loc_bytes = internal_read_at(
+      info, HEADER_SIZE, loc_len * info->loc_size, (uint8_t*)info->locs);
+  if (loc_bytes == NULL) {
+    return VE_IOERR;
+  }
+  memmove(info->locs, loc_bytes, loc_len * info->loc_size);
+  info->loc_len = loc_len;
+  return VE_SUCCESS;
+}
+
+/**
+   function internal_add_loc_entry
+
+   Adds the active entry in the loc slot numbered slot to the key map, with
+   the time, type and key read from entry, which is laid out as the start of
+   an entry in the file, or as a key directory.
+ */
+void internal_add_loc_entry(struct vault_info* info, uint32_t slot,
+                            const uint8_t* entry) {
+  uint32_t key_len = LOC_SLOT(info, info->locs, slot)[2];
+  char key[BOX_KEY_SIZE];
+  memcpy(key, entry + ENTRY_HEADER_SIZE, key_len);
+  key[key_len] = 0;
+
+  struct key_info current_info;
+  current_info.inode_loc = HEADER_SIZE + slot * info->loc_size;
+  memcpy(&current_info.m_time, entry, sizeof(uint64_t));
+  current_info.type = entry[ENTRY_HEADER_SIZE - 1];
+  add_entry(info->key_info, key, &current_info);
+}
+
+/**
+   function internal_create_key_map
+
+   Given an open vault, construct the mapping of keys to their loc datas in the
+   file and assign it to the key_info field. The map is implemented as a hash
+   table sized for half the length of the loc field, which grows if more of the
+   loc field is active. As this is an internal function, it assumes that info
+   is able to be read, as well as the vault is opened and that key_info is not
+   currently set to a map.
+
+   The loc field is read with internal_load_locs. The key, time and type of
+   each active entry are taken from the key directory in its slot, or in
+   files from before the directory, read from the start of the entry. Those
+   reads are made in the order of the entries in the file rather than of
+   their slots, so that they move through the file, and the page cache, in
+   one direction. The active and deleted slots are counted for the compaction
+   policy.
+
+   Returns VE_SUCCESS if able to create the map
+   VE_FILE if a loc slot describes an invalid entry
+   VE_MEMERR if memory for the loc field or map cannot be allocated
+   VE_IOERR if there were issues reading from disk
+ */
+int internal_create_key_map(struct vault_info* info) {
+  int result = internal_load_locs(info);
+  if (result) {
+    return result;
+  }
+  uint32_t loc_len = info->loc_len;
+  info->live_slots = 0;
+  info->dead_slots = 0;
+  info->live_bytes = 0;
+
+  info->key_info = init_map(loc_len / 2);
+  if (info->key_info == NULL) {
+    return VE_MEMERR;
+  }
+  uint32_t num_spans = 0;
+  struct entry_span* spans = NULL;
+  if (info->loc_size == LOC_SIZE &&
+      !(spans = malloc(sizeof(struct entry_span) * (loc_len + 1)))) {
+    delete_map(info->key_info);
+    return VE_MEMERR;
+  }
+  for (uint32_t next_loc = 0; next_loc < loc_len; ++next_loc) {
+    const uint32_t* current_loc_data = LOC_SLOT(info, info->locs, next_loc);
+    uint32_t is_active = STATE_ACTIVE == current_loc_data[0];
+    if (!is_active) {
+      info->dead_slots += current_loc_data[0] == STATE_DELETED;
+      continue;
+    }
+    info->live_slots++;
+    info->live_bytes +=
+        internal_entry_size(info->cipher, current_loc_data[2],
+                            current_loc_data[3]);
+
+    if (current_loc_data[2] >= BOX_KEY_SIZE) {
+      free(spans);
+      delete_map(info->key_info);
+      return VE_FILE;
+    }
+
+    // Spans here hold the slot of each entry in place of its length
+    if (spans) {
+      spans[num_spans].start = internal_slot_loc(info, current_loc_data);
+      spans[num_spans++].len = next_loc;
+    } else {
+      internal_add_loc_entry(info, next_loc,
+                             (const uint8_t*)current_loc_data + LOC_SIZE);
+    }
+  }
+
+  if (spans) {
+    qsort(spans, num_spans, sizeof(struct entry_span), internal_compare_spans);
+  }
+  uint8_t entry_buffer[ENTRY_HEADER_SIZE + BOX_KEY_SIZE];
+  for (uint32_t i = 0; i < num_spans; ++i) {
+    uint64_t file_loc = spans[i].start;
+    uint32_t key_len = LOC_SLOT(info, info->locs, spans[i].len)[2];
+    const uint8_t* entry = internal_read_at(
+        info, file_loc, ENTRY_HEADER_SIZE + key_len, entry_buffer);
+    if (entry == NULL) {
+      free(spans);
+      delete_map(info->key_info);
+      return VE_IOERR;
+    }
+
+    if (internal_tree_check(info, file_loc, ENTRY_HEADER_SIZE + key_len)) {
+      free(spans);
+      delete_map(info->key_info);
+      return VE_FILE;
+    }
+    internal_add_loc_entry(info, spans[i].len, entry);
+  }
+
+  free(spans);
+  return VE_SUCCESS;
+}
+
+/**
+   function internal_snapshot_key
+
+   Derives the key that the key map snapshot is encrypted with from the master
+   key, keyed the same way as the region hashes so that it is not the key of
+   anything else. The key is placed in key, expected to be
+   crypto_secretbox_KEYBYTES bytes.
+
+   Returns VE_SUCCESS if the key was derived
+   VE_CRYPTOERR if the hashing fails
+ */
+int internal_snapshot_key(struct vault_info* info, uint8_t* key) {
+  crypto_generichash_state state;
+  if (internal_region_begin(info, &state, REGION_SNAPSHOT, 0) ||
+      crypto_generichash_final(&state, key, crypto_secretbox_KEYBYTES) < 0) {
+    return VE_CRYPTOERR;
+  }
+  return VE_SUCCESS;
+}
+
+/**
+   function internal_write_snapshot
+
+   Writes a snapshot of the key map before the trailer of a vault about to be
+   closed, and seals the file with its length in the header. The snapshot
+   records the generation and mac the file is sealed with, so it is stale as
+   soon as the file changes again. The tombstones of keys deleted so far go
+   into the snapshot after the map, so that the deletions are still reported
+   by keys_modified_since once the vault is opened again. Nothing is written
+   for INTEGRITY_FILE vaults, while writes are queued by a transaction, as
+   the map already holds them, if the snapshot the vault was opened with
+   still matches the file, along with the tombstones it was opened with, or
+   if the images are too large for the length field in the header.
+
+   Returns VE_SUCCESS if the snapshot was written or none was needed
+   VE_MEMERR if memory for the snapshot cannot be allocated
+   VE_IOERR if the file cannot be read from or written to
+   VE_CRYPTOERR if the snapshot could not be encrypted
+   Otherwise the error from sealing the file
+ */
+int internal_write_snapshot(struct vault_info* info) {
+  uint64_t map_len = map_image_size(info->key_info);
+  uint64_t tombstones_len =
+      info->tombstones ? map_image_size(info->tombstones) : 0;
+  if (info->integrity == INTEGRITY_FILE || info->in_txn ||
+      info->snapshot_len > 0 ||
+      map_len + tombstones_len > MAX_SNAPSHOT_MAP_SIZE) {
+    return VE_SUCCESS;
+  }
+
+  uint32_t plain_len = SNAPSHOT_FIELDS_SIZE + map_len + tombstones_len;
+  uint32_t snapshot_len = SNAPSHOT_BOX_SIZE + plain_len;
+  uint8_t* plain = malloc(plain_len);
+  uint8_t* snapshot = malloc(snapshot_len);
+  if (plain == NULL || snapshot == NULL) {
+    variadic_free(2, plain, snapshot);
+    return VE_MEMERR;
+  }
+
+  // The trailer covers the header with the snapshot length already in it
+  uint8_t trailer[HASH_SIZE];
+  int result = VE_SUCCESS;
+  if (pwrite(info->user_fd, &snapshot_len, sizeof(uint32_t),
+             SNAPSHOT_LEN_AT) != sizeof(uint32_t)) {
+    result = VE_IOERR;
+  }
+  if (!result) {
+    result = internal_seal_trailer(info, trailer);
+  }
+
+  uint8_t key[crypto_secretbox_KEYBYTES];
+  if (!result) {
+    uint64_t sizes[3] = {info->generation, info->data_end, info->live_bytes};
+    uint32_t counts[4] = {info->loc_len, info->live_slots, info->dead_slots,
+                          map_len};
+    memcpy(plain, sizes, sizeof(sizes));
+    memcpy(plain + sizeof(sizes), counts, sizeof(counts));
+    memcpy(plain + sizeof(sizes) + sizeof(counts), info->file_mac, HASH_SIZE);
+    save_map(info->key_info, plain + SNAPSHOT_FIELDS_SIZE);
+    if (info->tombstones) {
+      save_map(info->tombstones, plain + SNAPSHOT_FIELDS_SIZE + map_len);
+    }
+
+    randombytes_buf(snapshot, NONCE_SIZE);
+    if (internal_snapshot_key(info, key) ||
+        crypto_secretbox_easy(snapshot + NONCE_SIZE, plain, plain_len,
+                              snapshot, key) < 0) {
+      result = VE_CRYPTOERR;
+    }
+  }
+  sodium_memzero(key, sizeof key);
+  sodium_memzero(plain, plain_len);
+  free(plain);
+
+  if (!result) {
+    struct iovec parts[2] = {{snapshot, snapshot_len}, {trailer, HASH_SIZE}};
+    if (pwritev(info->user_fd, parts, 2,
+                info->data_end + internal_tree_size(info)) !=
+        (ssize_t)(snapshot_len + HASH_SIZE)) {
+      result = VE_IOERR;
+    } else {
+      info->snapshot_len = snapshot_len;
+    }
+  }
+  free(snapshot);
+  return result;
+}
+
+/**
+   function internal_load_snapshot
+
+   Loads the key map of a freshly verified vault from the snapshot before its
+   trailer, instead of building it from the loc field, which is still read
+   into memory with internal_load_locs. The snapshot is only used if it was
+   written with the generation, mac, data section and loc field the file was
+   just verified with. Any tombstones in the snapshot are loaded as well, and
+   like the map are simply left out if they cannot be.
+
+   Returns VE_SUCCESS if the map was loaded from the snapshot
+   VE_EXIST if there is no snapshot, or it is stale, so the map has to be
+   built from the loc field
+   VE_FILE if the snapshot cannot be decrypted
+   VE_MEMERR if memory for the snapshot or loc field cannot be allocated
+   VE_IOERR if the file cannot be read
+   VE_CRYPTOERR if the snapshot key could not be derived
+ */
+int internal_load_snapshot(struct vault_info* info) {
+  uint32_t snapshot_len = info->snapshot_len;
+  if (snapshot_len == 0) {
+    return VE_EXIST;
+  }
+  if (snapshot_len < SNAPSHOT_BOX_SIZE + SNAPSHOT_FIELDS_SIZE) {
+    return VE_FILE;
+  }
+
+  uint32_t plain_len = snapshot_len - SNAPSHOT_BOX_SIZE;
+  uint8_t* buffer = malloc((size_t)snapshot_len + plain_len);
+  if (buffer == NULL) {
+    return VE_MEMERR;
+  }
+  uint8_t* plain = buffer + snapshot_len;
+  uint8_t loc_len_buffer[4];
+  const uint8_t* loc_len_data =
+      internal_read_at(info, HEADER_SIZE - 4, 4, loc_len_buffer);
+  const uint8_t* snapshot =
+      internal_read_at(info, info->data_end + internal_tree_size(info),
+                       snapshot_len, buffer);
+  if (loc_len_data == NULL || snapshot == NULL) {
+    free(buffer);
+    return VE_IOERR;
+  }
+
+  uint8_t key[crypto_secretbox_KEYBYTES];
+  int result = internal_snapshot_key(info, key) ? VE_CRYPTOERR : VE_SUCCESS;
+  if (!result && crypto_secretbox_open_easy(plain, snapshot + NONCE_SIZE,
+                                            snapshot_len - NONCE_SIZE,
+                                            snapshot, key) < 0) {
+    FPUTS("SNAPSHOT INVALID\n", stderr);
+    result = VE_FILE;
+  }
+  sodium_memzero(key, sizeof key);
+
+  uint64_t sizes[3] = {0};
+  uint32_t counts[4] = {0};
+  if (!result) {
+    memcpy(sizes, plain, sizeof(sizes));
+    memcpy(counts, plain + sizeof(sizes), sizeof(counts));
+  }
+  if (!result &&
+      (sizes[0] != info->generation || sizes[1] != info->data_end ||
+       memcmp(&counts[0], loc_len_data, 4) != 0 ||
+       counts[3] > plain_len - SNAPSHOT_FIELDS_SIZE ||
+       sodium_memcmp(plain + sizeof(sizes) + sizeof(counts), info->file_mac,
+                     HASH_SIZE) != 0)) {
+    FPUTS("Snapshot is stale\n", stderr);
+    result = VE_EXIST;
+  }
+
+  if (!result) {
+    result = internal_load_locs(info);
+  }
+  if (!result) {
+    // A map that cannot be loaded is built from the loc field instead
+    info->key_info = load_map(plain + SNAPSHOT_FIELDS_SIZE, counts[3]);
+    result = info->key_info == NULL ? VE_EXIST : VE_SUCCESS;
+  }
+  if (!result) {
+    info->live_bytes = sizes[2];
+    info->live_slots = counts[1];
+    info->dead_slots = counts[2];
+    uint32_t tombstones_len = plain_len - SNAPSHOT_FIELDS_SIZE - counts[3];
+    if (tombstones_len > 0) {
+      info->tombstones = load_map(plain + SNAPSHOT_FIELDS_SIZE + counts[3],
+                                  tombstones_len);
+    }
+  }
+
+  sodium_memzero(plain, plain_len);
+  free(buffer);
+  return result;
+}
+
+/**
+   function internal_loc_target
+
+   Returns how many slots the loc field should have after a compaction: enough
+   for the active entries and one more to fill fill_percent of it, and never
+   fewer than INITIAL_SIZE or more than a loc field of the current format may
+   have.
+ */
+uint32_t internal_loc_target(struct vault_info* info) {
+  uint64_t target = (uint64_t)(info->live_slots + 1) * 100 / info->fill_percent;
+  uint32_t most = (UINT32_MAX - HEADER_SIZE) / WIDE_LOC_SIZE;
+  return target < INITIAL_SIZE ? INITIAL_SIZE : target > most ? most : target;
+}
+
+/**
+   function internal_needs_compaction
+
+   Returns whether the compaction policy calls for compacting the vault now,
+   which it does once garbage_percent of the data section is taken by deleted
+   entries, as long as that is at least COMPACT_MIN_GARBAGE bytes, or once
+   garbage_percent of the loc field is deleted slots. Never compacts during a
+   write transaction, or when garbage_percent is zero.
+ */
+int internal_needs_compaction(struct vault_info* info) {
+  if (info->garbage_percent == 0 || info->in_txn) {
+    return 0;
+  }
+
+  uint64_t data_bytes =
+      info->data_end - HEADER_SIZE - (uint64_t)info->loc_len * info->loc_size;
+  uint64_t dead_bytes = data_bytes - info->live_bytes;
+  return (dead_bytes >= COMPACT_MIN_GARBAGE &&
+          dead_bytes * 100 > data_bytes * info->garbage_percent) ||
+         (uint64_t)info->dead_slots * 100 >
+             (uint64_t)info->loc_len * info->garbage_percent;
+}
+
+/**
+   condense_out - buffered writer for the new file written by a condense
+
+   Bytes are gathered in a buffer of CONDENSE_BUFFER_SIZE bytes and written
+   with a single pwrite whenever it fills, at the offset the buffer starts at.
+ */
+struct condense_out {
+  int fd;
+  uint8_t* buffer;
+  uint32_t len;
+  uint64_t at;
+};
+
+/**
+   function internal_condense_flush
+
+   Writes out the bytes gathered in the buffer of a condense.
+
+   Returns VE_SUCCESS if the bytes were written
+   VE_IOERR if the new file could not be written to
+ */
+int internal_condense_flush(struct condense_out* out) {
+  if (out->len > 0 &&
+      pwrite(out->fd, out->buffer, out->len, out->at) != out->len) {
+    return VE_IOERR;
+  }
+  out->at += out->len;
+  out->len = 0;
+  return VE_SUCCESS;
+}
+
+/**
+   function internal_condense_write
+
+   Adds len bytes to the end of the new file written by a condense.
+
+   Returns VE_SUCCESS if the bytes were added
+   VE_IOERR if the new file could not be written to
+ */
+int internal_condense_write(struct condense_out* out, const uint8_t* bytes,
+                            uint32_t len) {
+  while (len > 0) {
+    uint32_t part = CONDENSE_BUFFER_SIZE - out->len < len
+                        ? CONDENSE_BUFFER_SIZE - out->len
+                        : len;
+    memcpy(out->buffer + out->len, bytes, part);
+    out->len += part;
+    bytes += part;
+    len -= part;
+    if (out->len == CONDENSE_BUFFER_SIZE && internal_condense_flush(out)) {
+      return VE_IOERR;
+    }
+  }
+  return VE_SUCCESS;
+}
+
+/**
+   function internal_condense_copy
+
+   Writes the condensed form of the vault to the new file: the header with a
+   loc field of new_loc_size slots, the active slots in their old order
+   followed by empty ones, and the active entries packed in the same order
+   right after the loc field. Entries are read one at a time from the old
+   file, so memory use does not grow with the vault. The running mac is
+   rebuilt for the new file as it is written, and the new end of the data
+   section is placed in data_end.
+
+   The new file is always in the current format, with the key directory and
+   the high half of the offset in each slot, so condensing a file in an older
+   format migrates it. Its directories are copied from the old slots, or for
+   files from before the directory read from the start of each entry. The new
+   loc field is built in new_locs, which must hold new_loc_size zeroed slots
+   of WIDE_LOC_SIZE bytes. The header gets integrity as its mode byte, so a
+   condense can also move the vault to another integrity mode.
+
+   Returns VE_SUCCESS if the new file was written
+   VE_FILE if the loc field points outside of the data section, or an entry
+   does not match the tree
+   VE_IOERR if either file could not be read from or written to
+   VE_CRYPTOERR if the mac of the new file could not be built
+ */
+int internal_condense_copy(struct vault_info* info, struct condense_out* out,
+                           uint8_t integrity, uint32_t new_loc_size,
+                           uint32_t* new_locs, uint64_t* data_end) {
+  uint8_t header_buffer[HEADER_SIZE];
+  const uint8_t* header = internal_read_at(info, 0, HEADER_SIZE, header_buffer);
+  if (header == NULL) {
+    return VE_IOERR;
+  }
+  memmove(header_buffer, header, HEADER_SIZE);
+  header_buffer[0] = VERSION;
+  header_buffer[1] = integrity;
+  memset(header_buffer + SNAPSHOT_LEN_AT, 0, sizeof(uint32_t));
+  memcpy(header_buffer + HEADER_SIZE - 4, &new_loc_size, 4);
+  if (internal_condense_write(out, header_buffer, HEADER_SIZE)) {
+    return VE_IOERR;
+  }
+
+  uint8_t entry_buffer[MAX_ENTRY_SIZE];
+  uint64_t old_data_offset = HEADER_SIZE + info->loc_len * info->loc_size;
+  uint64_t new_data_offset = HEADER_SIZE + new_loc_size * WIDE_LOC_SIZE;
+  uint64_t next_entry = new_data_offset;
+  uint32_t index = 0;
+  sodium_memzero(info->file_mac, HASH_SIZE);
+  for (uint32_t i = 0; i < info->loc_len; ++i) {
+    const uint32_t* loc_data = LOC_SLOT(info, info->locs, i);
+    if (loc_data[0] != STATE_ACTIVE) {
+      continue;
+    }
+
+    uint32_t entry_len =
+        internal_entry_size(info->cipher, loc_data[2], loc_data[3]);
+    uint64_t file_loc = internal_slot_loc(info, loc_data);
+    if (file_loc < old_data_offset || file_loc > info->data_end ||
+        entry_len > info->data_end - file_loc ||
+        loc_data[2] >= BOX_KEY_SIZE) {
+      FPUTS("Loc data points outside of the file\n", stderr);
+      return VE_FILE;
+    }
+
+    const uint8_t* directory = (const uint8_t*)loc_data + LOC_SIZE;
+    if (info->loc_size == LOC_SIZE) {
+      uint32_t len = ENTRY_HEADER_SIZE + loc_data[2];
+      directory = internal_read_at(info, file_loc, len, entry_buffer);
+      if (directory == NULL) {
+        return VE_IOERR;
+      }
+      if (internal_tree_check(info, file_loc, len)) {
+        return VE_FILE;
+      }
+    }
+
+    uint32_t* slot = new_locs + (size_t)index * (WIDE_LOC_SIZE / 4);
+    slot[0] = STATE_ACTIVE;
+    slot[1] = (uint32_t)next_entry;
+    slot[LOC_HIGH_WORD] = next_entry >> 32;
+    slot[2] = loc_data[2];
+    slot[3] = loc_data[3];
+    memcpy(slot + LOC_SIZE / 4, directory, ENTRY_HEADER_SIZE + loc_data[2]);
+    next_entry += entry_len;
+    index++;
+  }
+
+  for (index = 0; index < new_loc_size; ++index) {
+    uint8_t* slot = (uint8_t*)(new_locs + (size_t)index * (WIDE_LOC_SIZE / 4));
+    int result = internal_mac_region(info, REGION_LOC, index, slot,
+                                     WIDE_LOC_SIZE);
+    if (result) {
+      return result;
+    }
+  }
+  if (internal_condense_write(out, (uint8_t*)new_locs,
+                              new_loc_size * WIDE_LOC_SIZE)) {
+    return VE_IOERR;
+  }
+
+  next_entry = new_data_offset;
+  for (uint32_t i = 0; i < info->loc_len; ++i) {
+    const uint32_t* loc_data = LOC_SLOT(info, info->locs, i);
+    if (loc_data[0] != STATE_ACTIVE) {
+      continue;
+    }
+
+    uint32_t entry_len =
+        internal_entry_size(info->cipher, loc_data[2], loc_data[3]);
+    uint64_t file_loc = internal_slot_loc(info, loc_data);
+    const uint8_t* entry =
+        internal_read_at(info, file_loc, entry_len, entry_buffer);
+    if (entry == NULL) {
+      return VE_IOERR;
+    }
+    if (internal_tree_check(info, file_loc, entry_len)) {
+      return VE_FILE;
+    }
+
+    int result = internal_mac_region(info, REGION_ENTRY, next_entry, entry,
+                                     entry_len);
+    if (result) {
+      return result;
+    }
+    if (internal_condense_write(out, entry, entry_len)) {
+      return VE_IOERR;
+    }
+    next_entry += entry_len;
+  }
+
+  *data_end = next_entry;
+  return internal_condense_flush(out);
+}
+
+/**
+   function internal_sync_directory
+
+   Syncs the directory holding the file at pathname, so that a rename within
+   it is on disk.
+
+   Returns VE_SUCCESS if the directory was synced
+   VE_IOERR if it could not be opened or synced
+ */
+int internal_sync_directory(const char* pathname) {
+  char directory[MAX_PATH_LEN + 1];
+  const char* slash = strrchr(pathname, '/');
+  uint32_t len = slash == NULL ? 0 : slash - pathname;
+  if (len > MAX_PATH_LEN) {
+    return VE_IOERR;
+  }
+  memcpy(directory, pathname, len);
+  directory[len] = 0;
+
+  int fd = open(len == 0 ? "." : directory, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    return VE_IOERR;
+  }
+  int result = fsync(fd) < 0 ? VE_IOERR : VE_SUCCESS;
+  close(fd);
+  return result;
+}
+
+/**
+   function internal_condense_open
+
+   Creates the new file a condense writes into, next to the vault, placing
+   its path in temp_path, which must hold the path of the vault and four more
+   characters. A new file left behind by a crash during an earlier condense
+   is replaced. The new file is locked like the vault.
+
+   Returns the descriptor of the new file
+   -1 if it could not be created or locked
+ */
+int internal_condense_open(struct vault_info* info, char* temp_path) {
+  snprintf(temp_path, sizeof(info->pathname) + 4, "%s.tmp", info->pathname);
+  unlink(temp_path);
+  int new_fd = open(temp_path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW,
+                    S_IRUSR | S_IWUSR);
+  if (new_fd >= 0 && flock(new_fd, LOCK_EX | LOCK_NB) < 0) {
+    close(new_fd);
+    unlink(temp_path);
+    new_fd = -1;
+  }
+  if (new_fd < 0) {
+    FPUTS("Could not create file to condense into\n", stderr);
+  }
+  return new_fd;
+}
+
+/**
+   function internal_condense_finish
+
+   Seals the new file of a condense, which the vault info must already be
+   switched over to, syncs it and renames it over the vault.
+
+   Returns VE_SUCCESS if the new file is now the vault
+   VE_IOERR if it could not be written, synced or renamed
+   Otherwise the error from sealing the file
+ */
+int internal_condense_finish(struct vault_info* info, const char* temp_path) {
+  int result = internal_seal_file(info);
+  if (!result && (fdatasync(info->user_fd) < 0 ||
+                  rename(temp_path, info->pathname) < 0)) {
+    result = VE_IOERR;
+  }
+  return result;
+}
+
+/**
+   function internal_condense_restore
+
+   Goes back to the old file after a condense failed before its new file was
+   renamed over the vault. The new file is removed, and the old one verified
+   again to rebuild the integrity fields.
+
+   Returns VE_SUCCESS if the old file verified
+   VE_FILE if it did not
+ */
+int internal_condense_restore(struct vault_info* info, int old_fd,
+                              uint64_t old_data_end, int new_fd,
+                              const char* temp_path) {
+  FPUTS("Could not condense file, keeping the old one\n", stderr);
+  close(new_fd);
+  unlink(temp_path);
+  internal_unmap_file(info);
+  internal_tree_free(info);
+  info->user_fd = old_fd;
+  info->data_end = old_data_end;
+  int result = internal_verify_file(info) ? VE_FILE : VE_SUCCESS;
+  internal_txn_clear(info);
+  return result;
+}
+
+/**
+   function internal_cache_now
+
+   Returns the time on the monotonic clock in milliseconds, which the time to
+   live of cached values is measured against
+ */
+uint64_t internal_cache_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+   function internal_cache_expire
+
+   Wipes the values in the value cache that were decrypted longer ago than
+   its time to live, along with the open value if it is one of them. A time
+   to live of zero keeps values until they are pushed out or the vault is
+   closed. The cache is expected to have been made readable and writable by
+   the caller.
+ */
+void internal_cache_expire(struct vault_info* info) {
+  if (info->cache_ttl == 0) {
+    return;
+  }
+
+  uint64_t now = internal_cache_now();
+  for (uint32_t i = 0; i < info->cache_capacity; ++i) {
+    struct cached_value* cached = info->cache + i;
+    if (cached->box.key[0] == 0 ||
+        now - cached->opened_at < (uint64_t)info->cache_ttl * 1000) {
+      continue;
+    }
+    if (strncmp(cached->box.key, info->current_box.key, BOX_KEY_SIZE) == 0) {
+      sodium_memzero(&info->current_box, sizeof(struct vault_box));
+    }
+    sodium_memzero(cached, sizeof(struct cached_value));
+  }
+}
+
+/**
+   function internal_cache_find
+
+   Looks for key in the value cache once the expired values are wiped, and
+   if it is there makes it the open value and marks it as used.
+
+   Returns one if the value was found, or zero otherwise
+ */
+int internal_cache_find(struct vault_info* info, const char* key) {
+  if (info->cache == NULL || sodium_mprotect_readwrite(info->cache) < 0) {
+    return 0;
+  }
+
+  internal_cache_expire(info);
+  int found = 0;
+  for (uint32_t i = 0; i < info->cache_capacity && !found; ++i) {
+    struct cached_value* cached = info->cache + i;
+    if (cached->box.key[0] != 0 &&
+        strncmp(cached->box.key, key, BOX_KEY_SIZE) == 0) {
+      memcpy(&info->current_box, &cached->box, sizeof(struct vault_box));
+      cached->used_at = ++info->cache_tick;
+      found = 1;
+    }
+  }
+
+  sodium_mprotect_noaccess(info->cache);
+  return found;
+}
+
+/**
+   function internal_cache_store
+
+   Copies the open value into the value cache, in an empty place or else in
+   place of the least recently used value. The cache is allocated by the
+   first value stored in it. Failing to allocate or reach the cache only
+   means the value is decrypted again next time, so it is not an error.
+ */
+void internal_cache_store(struct vault_info* info) {
+  if (info->cache_capacity == 0) {
+    return;
+  }
+  if (info->cache == NULL) {
+    info->cache =
+        sodium_allocarray(info->cache_capacity, sizeof(struct cached_value));
+    if (info->cache == NULL) {
+      FPUTS("Could not allocate the value cache\n", stderr);
+      return;
+    }
+    sodium_memzero(info->cache,
+                   info->cache_capacity * sizeof(struct cached_value));
+  } else if (sodium_mprotect_readwrite(info->cache) < 0) {
+    return;
+  }
+
+  struct cached_value* replaced = info->cache;
+  for (uint32_t i = 0; i < info->cache_capacity; ++i) {
+    struct cached_value* cached = info->cache + i;
+    if (cached->box.key[0] == 0) {
+      replaced = cached;
+      break;
+    }
+    if (cached->used_at < replaced->used_at) {
+      replaced = cached;
+    }
+  }
+
+  memcpy(&replaced->box, &info->current_box, sizeof(struct vault_box));
+  replaced->opened_at = internal_cache_now();
+  replaced->used_at = ++info->cache_tick;
+  sodium_mprotect_noaccess(info->cache);
+}
+
+/**
+   function internal_cache_forget
+
+   Wipes the value of key from the value cache, if it is there, so that a
+   deleted or replaced value is not served again.
+ */
+void internal_cache_forget(struct vault_info* info, const char* key) {
+  if (info->cache == NULL || sodium_mprotect_readwrite(info->cache) < 0) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < info->cache_capacity; ++i) {
+    struct cached_value* cached = info->cache + i;
+    if (strncmp(cached->box.key, key, BOX_KEY_SIZE) == 0) {
+      sodium_memzero(cached, sizeof(struct cached_value));
+    }
+  }
+  sodium_mprotect_noaccess(info->cache);
+}
+
+/**
+   function internal_cache_clear
+
+   Wipes every value in the value cache, keeping its memory for the next
+   values opened.
+ */
+void internal_cache_clear(struct vault_info* info) {
+  if (info->cache == NULL || sodium_mprotect_readwrite(info->cache) < 0) {
+    return;
+  }
+
+  sodium_memzero(info->cache,
+                 info->cache_capacity * sizeof(struct cached_value));
+  sodium_mprotect_noaccess(info->cache);
+}
+
+/**
+   function internal_cache_free
+
+   Frees the value cache, which sodium_free wipes first.
+ */
+void internal_cache_free(struct vault_info* info) {
+  if (info->cache != NULL) {
+    sodium_free(info->cache);
+    info->cache = NULL;
+  }
+}
+
+/**
+   function internal_close_file
+
+   Closes the file of the open vault and releases everything held for it,
+   wiping the keys and marking the vault closed. Used by close_vault, and
+   when the vault cannot carry on after its file was swapped.
+ */
+void internal_close_file(struct vault_info* info) {
+  close(info->user_fd);
+  if (info->key_info) {
+    delete_map(info->key_info);
+    info->key_info = NULL;
+  }
+  if (info->tombstones) {
+    delete_map(info->tombstones);
+    info->tombstones = NULL;
+  }
+  internal_tree_free(info);
+  internal_unmap_file(info);
+  internal_txn_free(info);
+  free(info->locs);
+  info->locs = NULL;
+  info->loc_len = 0;
+  sodium_memzero(info->derived_key, MASTER_KEY_SIZE);
+  sodium_memzero(info->decrypted_master, MASTER_KEY_SIZE);
+  sodium_memzero(&info->current_box, sizeof(struct vault_box));
+  internal_cache_clear(info);
+  info->is_open = 0;
+}
+
+/**
+   function internal_condense_swapped
+
+   Finishes a condense once the new file has been renamed over the vault, by
+   syncing the directory, closing the old file and rebuilding the key map and
+   loc field from the new one. The old map is gone by then, so if the new one
+   cannot be built the vault is closed rather than left without a map.
+
+   Returns VE_SUCCESS if the key map was rebuilt
+   Otherwise the error from internal_create_key_map, with the vault closed
+ */
+int internal_condense_swapped(struct vault_info* info, int old_fd) {
+  if (internal_sync_directory(info->pathname)) {
+    FPUTS("Could not sync directory after condensing\n", stderr);
+  }
+  close(old_fd);
+
+  delete_map(info->key_info);
+  int result = internal_create_key_map(info);
+  if (result) {
+    FPUTS("Could not rebuild key map after condensing, closing vault\n",
+          stderr);
+    info->key_info = NULL;
+    internal_close_file(info);
+  }
+  return result;
+}
+
+/**
+   Background compaction
+
+   With background compaction on, a compaction called for by the policy runs
+   on a thread of its own. The thread works from a clone of the vault info
+   taken when it starts, with a copy of the loc field and its own descriptor
+   for the vault, and streams the condensed vault into a new file with
+   internal_condense_copy, while the vault keeps being read and written
+   through the old file. The clone holds the master key for the mac, but not
+   the derived key or the open value. Merkle entries may be wiped while they
+   are copied, so the thread does not check them against the tree. Every
+   segment not checked yet is checked before the thread starts instead, and
+   the thread builds the tree of the new file once it is written.
+
+   Once the thread is done, the next call on the vault installs the new file
+   with internal_compact_install, which replays the changes made since the
+   thread started onto it: deleted entries are wiped, entries added are
+   checked against the tree of the old file and appended, and the current
+   header is written, before the new file is
+   sealed and renamed over the vault. Only this replay and rebuilding the key
+   map happen on the calling thread.
+ */
+
+/**
+   compact_job - a compaction running on a background thread
+
+   Only done is read while the thread runs, and only after it is set does
+   anything else touch the job.
+ */
+struct compact_job {
+  pthread_t thread;
+  struct vault_info* clone;
+  int old_fd;
+  int new_fd;
+  char temp_path[MAX_PATH_LEN + MAX_USER_SIZE + 14];
+  uint8_t integrity;
+  uint32_t new_loc_size;
+  uint32_t* new_locs;
+  uint64_t new_data_end;
+  int result;
+  int done;
+};
+
+/**
+   function internal_compact_main
+
+   Body of the background compaction thread, which runs at the lowest
+   priority so that it does not hold up the calls made on the vault.
+ */
+void* internal_compact_main(void* arg) {
+  struct compact_job* job = arg;
+  struct vault_info* clone = job->clone;
+  setpriority(PRIO_PROCESS, 0, 19);
+
+  struct condense_out out = {job->new_fd, malloc(CONDENSE_BUFFER_SIZE), 0, 0};
+  clone->integrity =
+      job->integrity == INTEGRITY_MERKLE ? INTEGRITY_FILE : job->integrity;
+  int result = out.buffer == NULL
+                   ? VE_MEMERR
+                   : internal_condense_copy(clone, &out, job->integrity,
+                                            job->new_loc_size, job->new_locs,
+                                            &job->new_data_end);
+  free(out.buffer);
+
+  if (!result && job->integrity == INTEGRITY_MERKLE) {
+    clone->integrity = INTEGRITY_MERKLE;
+    clone->user_fd = job->new_fd;
+    clone->data_end = job->new_data_end;
+    result = internal_tree_update(clone);
+  }
+
+  job->result = result;
+  __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/**
+   function internal_compact_discard
+
+   Frees a finished job, closing and removing its new file unless it was
+   installed.
+ */
+void internal_compact_discard(struct compact_job* job) {
+  if (job->new_fd >= 0) {
+    close(job->new_fd);
+    unlink(job->temp_path);
+  }
+  if (job->old_fd >= 0) {
+    close(job->old_fd);
+  }
+  if (job->clone != NULL) {
+    variadic_free(3, job->clone->locs, job->clone->tree,
+                  job->clone->leaf_checked);
+    sodium_free(job->clone);
+  }
+  free(job->new_locs);
+  free(job);
+}
+
+/**
+   function internal_clone_info
+
+   Copies the vault info into secure memory of its own, for work on the vault
+   done away from it, such as a background compaction. The clone keeps the
+   master key, cipher suite and integrity fields, but not the derived key or
+   the open value, and none of the memory the vault info owns, and reads its
+   file with pread.
+
+   Returns the clone
+   NULL if memory for it cannot be allocated
+ */
+struct vault_info* internal_clone_info(struct vault_info* info) {
+  struct vault_info* clone = sodium_malloc(sizeof(struct vault_info));
+  if (clone == NULL) {
+    return NULL;
+  }
+
+  memcpy(clone, info, sizeof(struct vault_info));
+  sodium_memzero(clone->derived_key, MASTER_KEY_SIZE);
+  sodium_memzero(&clone->current_box, sizeof(struct vault_box));
+  clone->cache = NULL;
+  clone->locs = NULL;
+  clone->key_info = NULL;
+  clone->tombstones = NULL;
+  clone->tree = NULL;
+  clone->leaf_checked = NULL;
+  clone->tree_leaves = 0;
+  clone->num_dirty = 0;
+  clone->read_mode = READ_PREAD;
+  clone->map = NULL;
+  clone->map_len = 0;
+  clone->in_txn = 0;
+  clone->txn_data = NULL;
+  clone->txn_wipes = NULL;
+  clone->txn_len = 0;
+  clone->num_wipes = 0;
+  clone->compact_job = NULL;
+  return clone;
+}
+
+/**
+   function internal_compact_start
+
+   Starts a background compaction of the open vault. The segments of a Merkle
+   vault that have not been checked yet are checked first, as the thread
+   copies them as they are.
+
+   Returns VE_SUCCESS if the thread was started
+   VE_FILE if a segment does not match its leaf
+   VE_MEMERR if memory for the job cannot be allocated
+   VE_IOERR if the new file cannot be created, or a segment read
+   VE_SYSCALL if the thread cannot be started
+   VE_CRYPTOERR if a segment could not be hashed
+ */
+int internal_compact_start(struct vault_info* info) {
+  int result;
+  if (info->integrity == INTEGRITY_MERKLE &&
+      (result = internal_tree_check_all(info))) {
+    return result;
+  }
+
+  struct compact_job* job = calloc(1, sizeof(struct compact_job));
+  if (job == NULL) {
+    return VE_MEMERR;
+  }
+  job->old_fd = -1;
+  job->new_fd = -1;
+
+  job->new_loc_size = internal_loc_target(info);
+  job->new_locs = calloc(job->new_loc_size, WIDE_LOC_SIZE);
+  struct vault_info* clone = internal_clone_info(info);
+  uint32_t* locs = malloc(info->loc_len * info->loc_size);
+  if (clone == NULL || locs == NULL || job->new_locs == NULL) {
+    free(locs);
+    sodium_free(clone);
+    free(job->new_locs);
+    free(job);
+    return VE_MEMERR;
+  }
+
+  memcpy(locs, info->locs, info->loc_len * info->loc_size);
+  clone->locs = locs;
+  job->clone = clone;
+
+  job->integrity = info->integrity;
+  job->old_fd = clone->user_fd = dup(info->user_fd);
+  job->new_fd = internal_condense_open(info, job->temp_path);
+  if (job->old_fd < 0 || job->new_fd < 0) {
+    internal_compact_discard(job);
+    return VE_IOERR;
+  }
+
+  if (pthread_create(&job->thread, NULL, internal_compact_main, job)) {
+    internal_compact_discard(job);
+    return VE_SYSCALL;
+  }
+  info->compact_job = job;
+  return VE_SUCCESS;
+}
+
+/**
+   function internal_compact_replay
+
+   Applies the changes made to the vault since its background compaction
+   started to the new file, which the vault info has been switched over to
+   with the loc field the job wrote. Slots active when the job started and
+   since deleted are deleted in the new file, and entries added since are
+   copied from the old file and appended. The header of the old file is
+   copied too, as the password or server time may have changed, with the
+   version of the new file.
+
+   Returns VE_SUCCESS if the changes were applied
+   VE_NOSPACE if the new loc field is too small for the entries added
+   VE_IOERR if either file could not be read from or written to
+   VE_CRYPTOERR if the mac could not be updated for a change
+ */
+int internal_compact_replay(struct vault_info* info,
+                            const struct vault_info* clone,
+                            const uint32_t* old_locs, int old_fd,
+                            uint32_t copied) {
+  uint8_t header[HEADER_SIZE];
+  if (pread(old_fd, header, HEADER_SIZE, 0) != HEADER_SIZE) {
+    return VE_IOERR;
+  }
+  header[0] = VERSION;
+  memset(header + SNAPSHOT_LEN_AT, 0, sizeof(uint32_t));
+  memcpy(header + HEADER_SIZE - 4, &info->loc_len, 4);
+  if (pwrite(info->user_fd, header, HEADER_SIZE, 0) != HEADER_SIZE) {
+    return VE_IOERR;
+  }
+
+  uint8_t entry[MAX_ENTRY_SIZE];
+  uint32_t index = 0;
+  uint32_t next_slot = copied;
+  for (uint32_t i = 0; i < clone->loc_len; ++i) {
+    const uint32_t* started = LOC_SLOT(clone, clone->locs, i);
+    const uint32_t* current = LOC_SLOT(clone, old_locs, i);
+    if (started[0] == STATE_ACTIVE) {
+      uint32_t* loc_data = LOC_SLOT(info, info->locs, index);
+      if (current[0] == STATE_ACTIVE) {
+        index++;
+        continue;
+      }
+
+      uint32_t entry_len =
+          internal_entry_size(info->cipher, loc_data[2], loc_data[3]);
+      uint32_t value_len = loc_data[3] + MAC_SIZE;
+      uint64_t file_loc = internal_slot_loc(info, loc_data);
+      if (pread(info->user_fd, entry, entry_len, file_loc) != entry_len) {
+        return VE_IOERR;
+      }
+      int result =
+          internal_mac_region(info, REGION_ENTRY, file_loc, entry, entry_len);
+      sodium_memzero(entry + ENTRY_HEADER_SIZE + loc_data[2], value_len);
+      if (result || (result = internal_mac_region(info, REGION_ENTRY, file_loc,
+                                                  entry, entry_len)) ||
+          (result = internal_mac_region(info, REGION_LOC, index,
+                                        (uint8_t*)loc_data, info->loc_size))) {
+        return result;
+      }
+      loc_data[0] = STATE_DELETED;
+      if ((result = internal_mac_region(info, REGION_LOC, index,
+                                        (uint8_t*)loc_data, info->loc_size))) {
+        return result;
+      }
+      if (internal_write_loc(info, index) ||
+          internal_wipe_value(info, file_loc + ENTRY_HEADER_SIZE + loc_data[2],
+                              value_len)) {
+        return VE_IOERR;
+      }
+      index++;
+    } else if (current[0] == STATE_ACTIVE) {
+      if (next_slot == info->loc_len) {
+        return VE_NOSPACE;
+      }
+
+      uint32_t entry_len =
+          internal_entry_size(info->cipher, current[2], current[3]);
+      if (pread(old_fd, entry, entry_len, internal_slot_loc(clone, current)) !=
+              entry_len ||
+          pwrite(info->user_fd, entry, entry_len, info->data_end) !=
+              entry_len) {
+        return VE_IOERR;
+      }
+
+      uint32_t* loc_data = LOC_SLOT(info, info->locs, next_slot);
+      int result = internal_mac_region(info, REGION_LOC, next_slot,
+                                       (uint8_t*)loc_data, info->loc_size);
+      if (result) {
+        return result;
+      }
+      loc_data[0] = STATE_ACTIVE;
+      internal_set_slot_loc(info, loc_data, info->data_end);
+      loc_data[2] = current[2];
+      loc_data[3] = current[3];
+      internal_fill_directory(info, loc_data, entry);
+      if ((result = internal_mac_region(info, REGION_LOC, next_slot,
+                                        (uint8_t*)loc_data, info->loc_size)) ||
+          (result = internal_mac_region(info, REGION_ENTRY, info->data_end,
+                                        entry, entry_len))) {
+        return result;
+      }
+      info->data_end += entry_len;
+      if (internal_write_loc(info, next_slot++)) {
+        return VE_IOERR;
+      }
+    }
+  }
+  return VE_SUCCESS;
+}
+
+/**
+   function internal_compact_install
+
+   Waits for the background compaction of the vault to finish, and installs
+   its new file as the vault, replaying the changes made since it started.
+   The job is freed either way. A job whose integrity mode or loc field no
+   longer matches the vault, or that finishes while a transaction has writes
+   queued, is dropped, as is one whose replay would read an entry that does
+   not match the tree of the old file.
+
+   Returns VE_SUCCESS if the new file is now the vault
+   VE_FILE if the job was dropped, or the old file no longer verifies
+   Otherwise the error from the job, from replaying the changes, or from
+   rebuilding the key map, in which case the vault is closed
+ */
+int internal_compact_install(struct vault_info* info) {
+  struct compact_job* job = info->compact_job;
+  struct vault_info* clone = job->clone;
+  pthread_join(job->thread, NULL);
+  info->compact_job = NULL;
+
+  int result = job->result;
+  if (!result && (info->integrity != job->integrity ||
+                  info->loc_len != clone->loc_len || info->txn_len > 0 ||
+                  info->num_wipes > 0 ||
+                  info->txn_loc_first <= info->txn_loc_last)) {
+    result = VE_FILE;
+  }
+
+  // The replay reads the entries added since the job started from the old
+  // file, so they are checked while the vault info still holds its tree
+  for (uint32_t i = 0; i < clone->loc_len && !result; ++i) {
+    const uint32_t* started = LOC_SLOT(clone, clone->locs, i);
+    const uint32_t* current = LOC_SLOT(clone, info->locs, i);
+    if (started[0] != STATE_ACTIVE && current[0] == STATE_ACTIVE) {
+      result = internal_tree_check(
+          info, internal_slot_loc(clone, current),
+          internal_entry_size(info->cipher, current[2], current[3]));
+    }
+  }
+
+  if (result) {
+    FPUTS("Dropped background compaction\n", stderr);
+    internal_compact_discard(job);
+    return result;
+  }
+
+  // The job copied the slots active when it started, in order
+  uint32_t copied = 0;
+  for (uint32_t i = 0; i < clone->loc_len; ++i) {
+    copied += LOC_SLOT(clone, clone->locs, i)[0] == STATE_ACTIVE;
+  }
+
+  int old_fd = info->user_fd;
+  uint64_t old_data_end = info->data_end;
+  uint32_t* old_locs = info->locs;
+  uint32_t old_loc_len = info->loc_len;
+  internal_unmap_file(info);
+  internal_tree_free(info);
+  info->user_fd = job->new_fd;
+  info->data_end = job->new_data_end;
+  info->locs = job->new_locs;
+  info->loc_len = job->new_loc_size;
+  info->loc_size = WIDE_LOC_SIZE;
+  info->snapshot_len = 0;
+  job->new_locs = NULL;
+  memcpy(info->file_mac, clone->file_mac, HASH_SIZE);
+  if (job->integrity == INTEGRITY_MERKLE) {
+    info->tree = clone->tree;
+    info->leaf_checked = clone->leaf_checked;
+    info->tree_leaves = clone->tree_leaves;
+    info->tree_written_at = clone->tree_written_at;
+    info->num_dirty = 0;
+    clone->tree = NULL;
+    clone->leaf_checked = NULL;
+  }
+
+  result = internal_compact_replay(info, clone, old_locs, old_fd, copied);
+  if (!result) {
+    result = internal_condense_finish(info, job->temp_path);
+  }
+  if (result) {
+    free(info->locs);
+    info->locs = old_locs;
+    info->loc_len = old_loc_len;
+    internal_condense_restore(info, old_fd, old_data_end, job->new_fd,
+                              job->temp_path);
+    job->new_fd = -1;
+    internal_compact_discard(job);
+    return result;
+  }
+
+  free(old_locs);
+  job->new_fd = -1;
+  internal_compact_discard(job);
+  if ((result = internal_condense_swapped(info, old_fd))) {
+    return result;
+  }
+  FPUTS("Installed background compaction\n", stderr);
+  return VE_SUCCESS;
+}
+
+/**
+   function internal_compact_cancel
+
+   Waits for any background compaction of the vault to finish and drops it,
+   for when the vault is closed.
+ */
+void internal_compact_cancel(struct vault_info* info) {
+  if (info->compact_job != NULL) {
+    pthread_join(info->compact_job->thread, NULL);
+    internal_compact_discard(info->compact_job);
+    info->compact_job = NULL;
+  }
+}
+
+/**
+   function condense_file
+
+   Given an open vault, remove all deleted entries, and resize the loc field
+   while realigning the active entries to be closest to the front of the
+   field. This function is used to clean up deletes and to change the amount
+   of entries that can be stored. By using this slow function rarely, most
+   changes to the file are relatively fast, and the file size is still kept
+   relatively small. The new loc field is sized with internal_loc_target, so
+   it grows when it is mostly active entries and shrinks when most of it was
+   taken by deleted ones.
+
+   The condensed vault is streamed into a new file next to the vault through
+   a fixed size buffer, so memory use stays flat however large the vault is.
+   The new file is sealed and synced, and then renamed over the vault, so a
+   crash at any point leaves either the old vault or the new one whole. If
+   anything fails before the rename, the new file is removed and the vault
+   carries on with the old one, which is verified again. If a background
+   compaction is running, it is waited for and installed instead.
+
+   Returns VE_SUCCESS upon increasing the file size and moving entries
+   VE_VCLOSE if no vault is open
+   VE_MEMERR if memory cannot be opened
+   VE_IOERR if there are issues reading from or writing to memory
+   VE_FILE if the vault is malformed, or did not verify after a failure
+*/
+int internal_condense_file(struct vault_info* info) {
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    return VE_MEMERR;
+  }
+
+  if (!info->is_open) {
+    FPUTS("Vault closed\n", stderr);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    return VE_VCLOSE;
+  }
+
+  // Queued writes are sealed first, so the old file is whole on its own and
+  // its entries can be checked as they are copied
+  if (info->in_txn && internal_seal_file(info)) {
+    sodium_mprotect_noaccess(info);
+    return VE_IOERR;
+  }
+
+  // A background compaction already under way is finished instead, unless
+  // it was dropped
+  if (info->compact_job != NULL) {
+    int result = internal_compact_install(info);
+    if (!result || !info->is_open) {
+      sodium_mprotect_noaccess(info);
+      return result;
+    }
+  }
+
+  char temp_path[sizeof(info->pathname) + 4];
+  int new_fd = internal_condense_open(info, temp_path);
+  if (new_fd < 0) {
+    sodium_mprotect_noaccess(info);
+    return VE_IOERR;
+  }
+
+  struct condense_out out = {new_fd, malloc(CONDENSE_BUFFER_SIZE), 0, 0};
+  if (out.buffer == NULL) {
+    close(new_fd);
+    unlink(temp_path);
+    sodium_mprotect_noaccess(info);
+    return VE_MEMERR;
+  }
+
+  uint32_t new_loc_size = internal_loc_target(info);
+  uint32_t* new_locs = calloc(new_loc_size, WIDE_LOC_SIZE);
+  if (new_locs == NULL) {
+    free(out.buffer);
+    close(new_fd);
+    unlink(temp_path);
+    sodium_mprotect_noaccess(info);
+    return VE_MEMERR;
+  }
+
+  int old_fd = info->user_fd;
+  uint64_t old_data_end = info->data_end;
+  uint64_t new_data_end;
+  int result = internal_condense_copy(info, &out, info->integrity,
+                                      new_loc_size, new_locs, &new_data_end);
+  free(out.buffer);
+  free(new_locs);
+
+  // The new file is sealed through the vault info, as it will be the vault
+  if (!result) {
+    internal_unmap_file(info);
+    internal_tree_free(info);
+    info->user_fd = new_fd;
+    info->data_end = new_data_end;
+    info->loc_size = WIDE_LOC_SIZE;
+    info->snapshot_len = 0;
+    result = internal_condense_finish(info, temp_path);
+  }
+
+  if (result) {
+    if (internal_condense_restore(info, old_fd, old_data_end, new_fd,
+                                  temp_path)) {
+      result = VE_FILE;
+    }
+    sodium_mprotect_noaccess(info);
+    return result;
+  }
+
+  result = internal_condense_swapped(info, old_fd);
+  sodium_mprotect_noaccess(info);
+  if (!result) {
+    FPUTS("Condensed file\n", stderr);
+  }
+  return result;
+}
+
+/**
+   function internal_upgrade_integrity
+
+   Moves an open vault that was verified with a whole file hash over to the
+   incremental mac, so that later writes no longer rehash the file. Changing
+   the mode byte in place would leave a header and trailer that disagree if
+   the seal after it failed or never happened, so the vault is condensed
+   into a new file with the new mode byte and a mac built as it is written,
+   which is renamed over the vault. A crash at any point leaves either the
+   old vault or the upgraded one whole.
+
+   If the condense fails before the rename, the vault carries on with the old
+   file and the whole file hash. If the key map cannot be rebuilt afterwards
+   the vault is closed, as with any condense. The vault info is left
+   writable either way.
+
+   Returns VE_SUCCESS if the vault was upgraded or already incremental
+   VE_MEMERR if the vault info could not be made writable again
+   Otherwise the error from internal_condense_file
+ */
+int internal_upgrade_integrity(struct vault_info* info) {
+  if (info->integrity != INTEGRITY_FILE) {
+    return VE_SUCCESS;
+  }
+
+  uint64_t generation = info->generation;
+  info->integrity = INTEGRITY_INCREMENTAL;
+  info->generation = 0;
+  int result = internal_condense_file(info);
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    return VE_MEMERR;
+  }
+  if (result && info->is_open) {
+    info->integrity = INTEGRITY_FILE;
+    info->generation = generation;
+  }
+  return result;
+}
+
+/**
+   function internal_init_integrity
+
+   Sets up the integrity fields for a newly written file with an empty loc
+   field of loc_len slots and no entries, and writes the first trailer.
+
+   Returns VE_SUCCESS if the file was sealed
+   Otherwise the error from sealing the file
+ */
+int internal_init_integrity(struct vault_info* info, uint32_t loc_len) {
+  uint8_t empty_slot[WIDE_LOC_SIZE] = {0};
+  info->snapshot_len = 0;
+  info->integrity = INTEGRITY_INCREMENTAL;
+  info->verify = VERIFY_SERIAL;
+  info->generation = 0;
+  info->data_end = HEADER_SIZE + loc_len * info->loc_size;
+  sodium_memzero(info->file_mac, HASH_SIZE);
+  for (uint32_t i = 0; i < loc_len; ++i) {
+    if (internal_mac_region(info, REGION_LOC, i, empty_slot, info->loc_size)) {
+      return VE_CRYPTOERR;
+    }
+  }
+  return internal_seal_file(info);
+}
+
+/**
+   function internal_initial_checks
+
+   Makes the vault info readable and checks that a vault is open. A
+   background compaction that has finished is installed here, outside of
+   transactions, so that it is picked up by the next call on the vault.
+ */
+int internal_initial_checks(struct vault_info* info) {
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    return VE_MEMERR;
+  }
+
+  if (!info->is_open) {
+    FPUTS("No vault opened\n", stderr);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    return VE_VCLOSE;
+  }
+
+  if (info->compact_job != NULL && !info->in_txn &&
+      __atomic_load_n(&info->compact_job->done, __ATOMIC_ACQUIRE)) {
+    int result = internal_compact_install(info);
+    if (result && !info->is_open) {
+      sodium_mprotect_noaccess(info);
+      return result;
+    }
+  }
+  return VE_SUCCESS;
+}
+
+/**
+   function internal_auto_compact
+
+   Compacts the vault if the compaction policy calls for it, on a background
+   thread if background compaction is on and none is running yet, or else
+   straight away. The vault info is left readable either way.
+ */
+void internal_auto_compact(struct vault_info* info) {
+  if (!internal_needs_compaction(info)) {
+    return;
+  }
+  if (!info->background) {
+    internal_condense_file(info);
+    sodium_mprotect_readwrite(info);
+  } else if (info->compact_job == NULL) {
+    internal_compact_start(info);
+  }
+}
+
+/**
+   Vault initialization functions
+
+   The following functions are used to handle opening, closing, and creating
+   the vault files, as well as initializing and releasing the internal
+   information used to represent the currently opened vault.
+ */
+
+/**
+   function init_vault
+
+   The function to be called at startup of the application, this ensures
+   that the vault is setup to safely load in files and run crypto operations
+   safely later on.
+
+   Core dumps are disabled to ensure that passwords in memory are not allowed
+   to be part of any core dumps later on. In addition, after libsodium is
+   initialized, the memory for the vault information that will be used is
+   placed in secure memory and locked to prevent access. While there are
+   places in code that gives the passwords to the application, all sensitive
+   data handled by the library will be within this secure memory. In addition,
+   as the decrypted master key is generated by the library and only ever
+   kept in the memory, it should never exist in a decrypted form on hard disk.
+
+   If there is an error, a null pointer is returned.
+
+   Returns a pointer to the memory the vault info is being kept in.
+ */
+struct vault_info* init_vault() {
+  struct rlimit r;
+  r.rlim_cur = 0;
+  r.rlim_max = 0;
+
+  if (setrlimit(RLIMIT_CORE, &r) < 0) {
+    FPUTS("Could not decrease core limit", stderr);
+    return NULL;
+  }
+
+  if (sodium_init() < 0) {
+    FPUTS("Could not init libsodium\n", stderr);
+    return NULL;
+  }
+
+  struct vault_info* info = sodium_malloc(sizeof(struct vault_info));
+  if (sodium_mlock(info, sizeof(struct vault_info))) {
+    FPUTS("Issues locking memory\n", stderr);
+    sodium_free(info);
+    return NULL;
+  }
+
+  info->is_open = 0;
+  info->cache = NULL;
+  info->cache_capacity = DEFAULT_CACHE_VALUES;
+  info->cache_ttl = DEFAULT_CACHE_TTL;
+  info->cache_tick = 0;
+  info->cache_hits = 0;
+  info->cache_misses = 0;
+  info->tombstones = NULL;
+  info->cipher = CIPHER_SECRETBOX;
+  info->new_cipher = CIPHER_AUTO;
+  info->tree = NULL;
+  info->leaf_checked = NULL;
+  info->tree_leaves = 0;
+  info->num_dirty = 0;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  info->workers = cores < 1 ? 1 : cores > MAX_WORKERS ? MAX_WORKERS : cores;
+  info->read_mode = READ_MMAP;
+  info->map = NULL;
+  info->map_len = 0;
+  info->locs = NULL;
+  info->loc_len = 0;
+  info->loc_size = WIDE_LOC_SIZE;
+  info->snapshot_len = 0;
+  info->garbage_percent = DEFAULT_GARBAGE_PERCENT;
+  info->fill_percent = DEFAULT_FILL_PERCENT;
+  info->background = 0;
+  info->compact_job = NULL;
+  info->in_txn = 0;
+  info->txn_data = NULL;
+  info->txn_wipes = NULL;
+  info->txn_cap = 0;
+  info->wipes_cap = 0;
+  internal_txn_clear(info);
+  if (sodium_mprotect_noaccess(info) < 0) {
+    FPUTS("Issues preventing access to memory\n", stderr);
+    return NULL;
+  }
+
+  return info;
+}
+
+/**
+   function release_vault
+
+   The function to be called at the end of using the vault, this releases
+   all the memory allocated for the vault information. As sodium_free will
+   handle zeroing the memory allocated for the vault_info structure, it does
+   not have to be manually done. However ensuring that all allocated memory
+   is freed is important, and done mainly in the key map.
+
+   Returns VE_SUCCESS upon releasing all relevant memory
+ */
+int release_vault(struct vault_info* info) {
+  sodium_mprotect_readwrite(info);
+  if (info->is_open) {
+    internal_compact_cancel(info);
+    close(info->user_fd);
+    delete_map(info->key_info);
+    if (info->tombstones) {
+      delete_map(info->tombstones);
+    }
+    internal_tree_free(info);
+    internal_unmap_file(info);
+    internal_txn_free(info);
+    free(info->locs);
+  }
+  internal_cache_free(info);
+  sodium_munlock(info, sizeof(struct vault_info));
+  sodium_free(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function create_vault
+
+   The function to be called that will initially set up a vault for a user.
+   Requires that a vault file for the given user in the given directory does
+   not already exist, and creates a USERNAME.vault file to represent the
+   vault on disk.
+
+   The password is derived using the Argon2id 1.3 password derivation algorithm
+   that is computationally and memory expensive to attempt to disuade brute
+   force attacks. Besides the password which is chosen by the user themselves,
+   the master nonce and password salt are chosen using libsodiums randombytes
+   function, and the key with crypto_secretbox_keygen.
+
+   As stated above, the file format consists of a header with file information,
+   a loc data field with locations of key value pairs in the file, and then the
+   key-value pairs. This is created in this file, and maintained throughout
+   the different functions. A file hash is appended to the end to prevent
+   tampering. The values are encrypted with the cipher suite chosen with
+   set_cipher_suite, by default AES-256-GCM where the CPU has hardware AES
+   and XChaCha20-Poly1305 elsewhere.
+
+   Returns VE_SUCCESS upon successful creation of a file.
+   VE_PARAMERR if any of the inputs are null or their string lengths too long
+   VE_MEMERR if secure memory cannot be changed to read write mode
+   VE_SYSCALL if snprintf or open fails for a reason besides EEXIST and EACCES
+   VE_VOPEN if a vault is already open
+   VE_CRYPTOERR if the derived key or encrypted master cannot be generated
+   VE_IOERR if their were any issues writing to disk
+ */
+int create_vault(char* directory, char* username, char* password,
+                 struct vault_info* info) {
+  if (directory == NULL || username == NULL || password == NULL ||
+      strnlen(directory, MAX_PATH_LEN + 1) > MAX_PATH_LEN ||
+      strnlen(username, MAX_USER_SIZE + 1) > MAX_USER_SIZE ||
+      strnlen(password, MAX_PASS_SIZE + 1) > MAX_PASS_SIZE) {
+    return VE_PARAMERR;
+  }
+
+  int max_size =
+      strnlen(directory, MAX_PATH_LEN) + strnlen(username, MAX_USER_SIZE) + 10;
+  char* pathname = malloc(max_size);
+  if (snprintf(pathname, max_size, filename_pattern, directory, username) < 0) {
+    free(pathname);
+    return VE_SYSCALL;
+  }
+
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    free(pathname);
+    return VE_MEMERR;
+  }
+
+  if (info->is_open) {
+    FPUTS("Already have a vault open\n", stderr);
+    free(pathname);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    return VE_VOPEN;
+  }
+
+  // Specify that the file must be created, and have access set as 0600
+  int open_results =
+      open(pathname, O_RDWR | O_CREAT | O_EXCL | O_DSYNC, S_IRUSR | S_IWUSR);
+  free(pathname);
+  if (open_results < 0) {
+    if (errno == EEXIST) {
+      return VE_EXIST;
+    } else if (errno == EACCES) {
+      return VE_ACCESS;
+    } else {
+      return VE_SYSCALL;
+    }
+  }
+
+  if (flock(open_results, LOCK_EX | LOCK_NB) < 0) {
+    close(open_results);
+    FPUTS("Could not get file lock\n", stderr);
+    return VE_SYSCALL;
+  }
+
+  info->user_fd = open_results;
+  snprintf(info->pathname, sizeof(info->pathname), filename_pattern, directory,
+           username);
+  crypto_secretbox_keygen(info->decrypted_master);
+
+  uint8_t salt[SALT_SIZE];
+  randombytes_buf(salt, sizeof salt);
+  if (PW_HASH(info->derived_key, password, strlen(password), salt) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    close(open_results);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    return VE_CRYPTOERR;
+  }
+
+  uint8_t encrypted_master[MASTER_KEY_SIZE + MAC_SIZE];
+  uint8_t master_nonce[NONCE_SIZE];
+  randombytes_buf(master_nonce, sizeof master_nonce);
+  if (crypto_secretbox_easy(encrypted_master, info->decrypted_master,
+                            MASTER_KEY_SIZE, master_nonce,
+                            info->derived_key) < 0) {
+    FPUTS("Could not encrypt master key\n", stderr);
+    close(open_results);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    return VE_CRYPTOERR;
+  }
+
+  uint32_t loc_len = INITIAL_SIZE;
+  uint8_t zeros[INITIAL_SIZE * WIDE_LOC_SIZE] = {0};
+  info->loc_size = WIDE_LOC_SIZE;
+  info->cipher = internal_pick_cipher(info->new_cipher);
+  uint8_t version[3] = {VERSION, INTEGRITY_INCREMENTAL, info->cipher};
+  WRITE(info->user_fd, &version, 3, info);
+  WRITE(info->user_fd, &zeros, 5, info);
+  WRITE(info->user_fd, &salt, crypto_pwhash_SALTBYTES, info);
+  WRITE(info->user_fd, &encrypted_master, MASTER_KEY_SIZE + MAC_SIZE, info);
+  WRITE(info->user_fd, &master_nonce, NONCE_SIZE, info);
+  WRITE(info->user_fd, &zeros, 8, info);
+  WRITE(info->user_fd, &loc_len, sizeof(uint32_t), info);
+  WRITE(info->user_fd, &zeros, INITIAL_SIZE * WIDE_LOC_SIZE, info);
+
+  if (internal_init_integrity(info, INITIAL_SIZE)) {
+    sodium_mprotect_noaccess(info);
+    return VE_IOERR;
+  }
+
+  if (internal_create_key_map(info)) {
+    sodium_mprotect_noaccess(info);
+    return VE_IOERR;
+  }
+  info->current_box.key[0] = 0;
+  info->is_open = 1;
+
+  if (sodium_mprotect_noaccess(info) < 0) {
+    FPUTS("Issues preventing access to memory\n", stderr);
+  }
+
+  FPUTS("Created file successfully\n", stderr);
+  return VE_SUCCESS;
+}
+
+/**
+   function create_from_header
+
+   Create a vault for a given user given the header of a vault file downloaded
+   from the server and the password to unlock the header. The header is
+   encrypted using what is assumed to be the same password as is given to the
+   server, as all functions that update the server should also update the
+   validation sent. This function validates the header by decrypting the master
+   key, and then creates a default file. This default file can then have
+   encrypted entries added onto it.
+
+   Returns VE_SUCCESS upon successful creation of a file.
+   VE_WRONGPASS if the master key cannot be decrypted
+   VE_PARAMERR if any of the inputs are null or their string lengths too long
+   VE_MEMERR if secure memory cannot be changed to read write mode
+   VE_SYSCALL if snprintf or open fails for a reason besides EEXIST and EACCES
+   VE_VOPEN if a vault is already open
+   VE_CRYPTOERR if the derived key or encrypted master cannot be generated, or
+   the header is for AES-256-GCM and this CPU does not have hardware AES
+   VE_FILE if the header names an unknown cipher suite
+   VE_IOERR if their were any issues writing to disk
+ */
+int create_from_header(char* directory, char* username, char* password,
+                       uint8_t* header, struct vault_info* info) {
+  if (directory == NULL || username == NULL || password == NULL ||
+      strnlen(directory, MAX_PATH_LEN + 1) > MAX_PATH_LEN ||
+      strnlen(username, MAX_USER_SIZE + 1) > MAX_USER_SIZE ||
+      strnlen(password, MAX_PASS_SIZE + 1) > MAX_PASS_SIZE) {
+    return VE_PARAMERR;
+  }
+
+  int max_size = strlen(directory) + strlen(username) + 10;
+  char* pathname = malloc(max_size);
+  if (snprintf(pathname, max_size, filename_pattern, directory, username) < 0) {
+    free(pathname);
+    return VE_SYSCALL;
+  }
+
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    free(pathname);
+    return VE_MEMERR;
+  }
+
+  if (info->is_open) {
+    FPUTS("Already have a vault open\n", stderr);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    free(pathname);
+    return VE_VOPEN;
+  }
+
+  if (PW_HASH(info->derived_key, password, strlen(password), header + 8) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    free(pathname);
+    return VE_CRYPTOERR;
+  }
+
+  if (crypto_secretbox_open_easy(info->decrypted_master, header + SALT_SIZE + 8,
+                                 MASTER_KEY_SIZE + MAC_SIZE,
+                                 header + HEADER_SIZE - NONCE_SIZE - 12,
+                                 info->derived_key) < 0) {
+    FPUTS("Could not decrypt master key\n", stderr);
+    free(pathname);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    return VE_WRONGPASS;
+  }
+
+  // The entries from the server are encrypted with the suite in the header
+  int cipher_result = internal_check_cipher(header[2]);
+  if (cipher_result) {
+    sodium_mprotect_noaccess(info);
+    free(pathname);
+    return cipher_result;
+  }
+  info->cipher = header[2];
+
+  // Specify that the file must be created, and have access set as 0600
+  int open_results =
+      open(pathname, O_RDWR | O_CREAT | O_EXCL | O_DSYNC, S_IRUSR | S_IWUSR);
+  free(pathname);
+  if (open_results < 0) {
+    if (errno == EEXIST) {
+      return VE_EXIST;
+    } else if (errno == EACCES) {
+      return VE_ACCESS;
+    } else {
+      return VE_SYSCALL;
+    }
+  }
+
+  if (flock(open_results, LOCK_EX | LOCK_NB) < 0) {
+    FPUTS("Could not get file lock\n", stderr);
+    return VE_SYSCALL;
+  }
+
+  info->user_fd = open_results;
+  snprintf(info->pathname, sizeof(info->pathname), filename_pattern, directory,
+           username);
+
+  // The version, integrity and verify modes and the snapshot are local to
+  // this file, not what the server sent
+  uint32_t loc_len = INITIAL_SIZE;
+  uint8_t zeros[INITIAL_SIZE * WIDE_LOC_SIZE] = {0};
+  info->loc_size = WIDE_LOC_SIZE;
+  uint8_t modes[4] = {VERSION, INTEGRITY_INCREMENTAL, header[2], VERIFY_SERIAL};
+  WRITE(info->user_fd, modes, 4, info);
+  WRITE(info->user_fd, zeros, sizeof(uint32_t), info);
+  WRITE(info->user_fd, header + 8, HEADER_SIZE - 12, info);
+  WRITE(info->user_fd, &loc_len, sizeof(uint32_t), info);
+  WRITE(info->user_fd, &zeros, INITIAL_SIZE * WIDE_LOC_SIZE, info);
+
+  if (internal_init_integrity(info, INITIAL_SIZE)) {
+    sodium_mprotect_noaccess(info);
+    return VE_IOERR;
+  }
+
+  if (internal_create_key_map(info)) {
+    sodium_mprotect_noaccess(info);
+    return VE_IOERR;
+  }
+  info->current_box.key[0] = 0;
+  info->is_open = 1;
+
+  if (sodium_mprotect_noaccess(info) < 0) {
+    FPUTS("Issues preventing access to memory\n", stderr);
+  }
+
+  FPUTS("Created file successfully\n", stderr);
+  return VE_SUCCESS;
+}
+
+/**
+   function open_vault
+
+   Given the directory containing vaults, a username and password, attempts to
+   open the vault for a given user. The vault should be at the path
+   directory/username.vault and have only been modified by the functions within
+   this file. The decryption key is derived from the password and a salt that
+   is saved within the file and Argon2id 1.3. After the decryption key is
+   determined, the master key is decrypted using the nonce saved in the file,
+   as well as using the mac saved with it to check its integrity. Finally file
+   integrity is checked by evaluating the file hash appeneded to the file.
+
+   Assuming all checks pass, the loc data area is processed to load all the
+   vault keys into memory along with pointers into the file for where the
+   relevant data to retrieve their values are. If the vault was closed with a
+   snapshot of the key map that still matches the file, the map is loaded
+   from it instead, without going through the loc field. A vault from before
+   the key directory is condensed into the current format once it is open,
+   so later opens load the keys from the loc field alone. If that fails the
+   vault is left as it was and still used.
+
+   Returns VE_SUCCESS upon opening the vault and creating a keymap for the vault
+   VE_WRONGPASS if the decryption key cannot be decrypted
+   VE_PARAMERR if parameters are null or exceed the maximum length for their
+   fields
+   VE_MEMERR if secure memory cannot be changed to read write mode
+   VE_SYSCALL if snprintf fails or open fails without ENOENT or EACCESS
+   VE_EXIST if open fails with ENOENT for the file not existing
+   VE_ACCESS if open fails from not having permisions to the file
+   VE_CRYPTOERR if the derived password could not be computed, or the vault
+   uses AES-256-GCM and this CPU does not have hardware AES
+   VE_FILE if the master key cannot be decrypted, the file hash is invalid or
+   the key map snapshot does not decrypt
+ */
+int open_vault(char* directory, char* username, char* password,
+               struct vault_info* info) {
+  if (directory == NULL || username == NULL || password == NULL ||
+      strlen(directory) > MAX_PATH_LEN || strlen(username) > MAX_USER_SIZE ||
+      strlen(password) > MAX_PASS_SIZE) {
+    return VE_PARAMERR;
+  }
+
+  int max_size = strlen(directory) + strlen(username) + 10;
+  char* pathname = malloc(max_size);
+  if (snprintf(pathname, max_size, filename_pattern, directory, username) < 0) {
+    free(pathname);
+    return VE_SYSCALL;
+  }
+
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    free(pathname);
+    return VE_MEMERR;
+  }
+
+  if (info->is_open) {
+    FPUTS("Already have a vault open\n", stderr);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    free(pathname);
+    return VE_VOPEN;
+  }
+
+  int open_results = open(pathname, O_RDWR | O_NOFOLLOW);
+  free(pathname);
+  if (open_results < 0) {
+    if (errno == ENOENT) {
+      return VE_EXIST;
+    } else if (errno == EACCES) {
+      return VE_ACCESS;
+    } else {
+      return VE_SYSCALL;
+    }
+  }
+
+  if (flock(open_results, LOCK_EX | LOCK_NB) < 0) {
+    close(open_results);
+    FPUTS("Could not get file lock\n", stderr);
+    return VE_SYSCALL;
+  }
+
+  lseek(open_results, 8, SEEK_SET);
+  int open_info_length = SALT_SIZE + MAC_SIZE + MASTER_KEY_SIZE + NONCE_SIZE;
+  uint8_t open_info[open_info_length];
+  READ(open_results, open_info, open_info_length, info);
+
+  if (PW_HASH(info->derived_key, password, strlen(password), open_info) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    close(open_results);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    return VE_CRYPTOERR;
+  }
+
+  if (crypto_secretbox_open_easy(info->decrypted_master, open_info + SALT_SIZE,
+                                 MASTER_KEY_SIZE + MAC_SIZE,
+                                 open_info + open_info_length - NONCE_SIZE,
+                                 info->derived_key) < 0) {
+    FPUTS("Could not decrypt master key\n", stderr);
+    close(open_results);
+    sodium_memzero(info->derived_key, MASTER_KEY_SIZE);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    return VE_WRONGPASS;
+  }
+
+  info->user_fd = open_results;
+  snprintf(info->pathname, sizeof(info->pathname), filename_pattern, directory,
+           username);
+  int result = internal_verify_file(info);
+  if (result) {
+    close(open_results);
+    sodium_mprotect_noaccess(info);
+    return result == VE_CRYPTOERR ? VE_CRYPTOERR : VE_FILE;
+  }
+
+  result = internal_load_snapshot(info);
+  if (result == VE_EXIST) {
+    result = internal_create_key_map(info);
+  }
+  if (result) {
+    internal_unmap_file(info);
+    free(info->locs);
+    info->locs = NULL;
+    close(open_results);
+    internal_tree_free(info);
+    sodium_mprotect_noaccess(info);
+    return VE_FILE;
+  }
+
+  info->current_box.key[0] = 0;
+  info->is_open = 1;
+
+  // Upgrading condenses the vault, which also moves it to the current format
+  if ((result = internal_upgrade_integrity(info))) {
+    FPUTS("Could not upgrade vault, keeping the whole file hash\n", stderr);
+    if (!info->is_open) {
+      sodium_mprotect_noaccess(info);
+      return result;
+    }
+  }
+
+  if (info->loc_size == LOC_SIZE) {
+    if ((result = internal_condense_file(info))) {
+      FPUTS("Could not migrate vault, keeping the old format\n", stderr);
+    }
+    if (sodium_mprotect_readwrite(info) < 0) {
+      FPUTS("Issues gaining access to memory\n", stderr);
+      return VE_MEMERR;
+    }
+    if (!info->is_open) {
+      sodium_mprotect_noaccess(info);
+      return result;
+    }
+  }
+
+  if (sodium_mprotect_noaccess(info) < 0) {
+    FPUTS("Issues preventing access to memory\n", stderr);
+  }
+
+  FPUTS("Opened the vault\n", stderr);
+  return VE_SUCCESS;
+}
+
+/**
+   function close_vault
+
+   Closes a currently open vault by closing the file descriptor, releasing
    the memory associated with the key map on the heap, and finally zeroing
    the memory associated with the vault. Using sodium_memzero attempts to
    circumvent compiler optimizations that would prevent zeroing memory.
    While the memory is not released to the OS and can be reused by different
    vaults, this helps prevent potential issues if their are other issues in
-   the vault.
+   the vault. Writes queued by a transaction that was not committed are
+   dropped, as is a background compaction, once it has finished.
+
+   Returns VE_SUCCESS after releasing the key map, zeroing memory, and closing
+           the file descriptor associated with the current vault
+   VE_MEMERR if the secure memory cannot be read
+   VE_VCLOSE if there is no current vault opened
+ */
+int close_vault(struct vault_info* info) {
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    return VE_MEMERR;
+  }
+
+  if (!info->is_open) {
+    FPUTS("Already have a vault closed\n", stderr);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    return VE_VCLOSE;
+  }
+
+  internal_compact_cancel(info);
+  if (internal_write_snapshot(info)) {
+    FPUTS("Could not write key map snapshot\n", stderr);
+  }
+  internal_close_file(info);
+
+  if (sodium_mprotect_noaccess(info) < 0) {
+    FPUTS("Issues preventing access to memory\n", stderr);
+  }
+
+  FPUTS("Closed the vault\n", stderr);
+  return VE_SUCCESS;
+}
+
+/**
+   Server communication functions
+
+   The next series of functions are used to create information for the server.
+   This includes and initial function which creates data for the server upon
+   signup, specifically the double-derived key that the server can verify.
+   In addition, responses to recovery questions are used as keys to encrypt the
+   master key.
+ */
+
+/**
+   function create_data_for_server
+
+   Given an open vault and responses given to security questions, generate all
+   information that is necessary for registering with the server. Most of the
+   pointers are used as return values, and are done directly as byte pointers
+   to prevent having to declare a c struct in Python as well as C. Six salts
+   are sent to the server for the doubly-derived keys that are used for
+   validation, as well as encrypted responses, the password for the server, and
+   the result used for recovery that is encrypted with both responses.
+
+   Returns VE_SUCCESS upon filling in all byte strings with the necessary values
+   VE_MEMERR if memory cannot be locked
+   VE_CRYPTOERR if there are issues in password hashing or encryption
+   VE_IOERR if there are issues reading from disk
+ */
+int create_data_for_server(struct vault_info* info, uint8_t* response1,
+                           uint8_t* response2, uint8_t* first_pass_salt,
+                           uint8_t* second_pass_salt, uint8_t* recovery_result,
+                           uint8_t* dataencr1, uint8_t* dataencr2,
+                           uint8_t* data_salt_11, uint8_t* data_salt_12,
+                           uint8_t* data_salt_21, uint8_t* data_salt_22,
+                           uint8_t* server_pass) {
+  int check;
+  if (check = internal_initial_checks(info)) {
+    return check;
+  }
+
+  randombytes_buf(data_salt_11, SALT_SIZE);
+  randombytes_buf(data_salt_12, SALT_SIZE);
+  randombytes_buf(data_salt_21, SALT_SIZE);
+  randombytes_buf(data_salt_22, SALT_SIZE);
+  randombytes_buf(second_pass_salt, SALT_SIZE);
+
+  lseek(info->user_fd, 8, SEEK_SET);
+  READ(info->user_fd, first_pass_salt, SALT_SIZE, info);
+
+  if (PW_HASH(server_pass, info->derived_key, MASTER_KEY_SIZE,
+              second_pass_salt) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    return VE_CRYPTOERR;
+  }
+
+  uint8_t data1_master[MASTER_KEY_SIZE];
+  uint8_t data2_master[MASTER_KEY_SIZE];
+
+  if (PW_HASH(&data1_master, response1, strlen(response1), data_salt_11) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_CRYPTOERR;
+  }
+
+  if (PW_HASH(&data2_master, response2, strlen(response2), data_salt_21) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_CRYPTOERR;
+  }
+
+  uint8_t intermediate_result[MASTER_KEY_SIZE + MAC_SIZE];
+  randombytes_buf(recovery_result + MASTER_KEY_SIZE + 2 * MAC_SIZE, NONCE_SIZE);
+  randombytes_buf(recovery_result + MASTER_KEY_SIZE + 2 * MAC_SIZE + NONCE_SIZE,
+                  NONCE_SIZE);
+  if (crypto_secretbox_easy((uint8_t*)&intermediate_result,
+                            info->decrypted_master, MASTER_KEY_SIZE,
+                            recovery_result + MASTER_KEY_SIZE + 2 * MAC_SIZE,
+                            (uint8_t*)&data1_master) < 0) {
+    FPUTS("Could not encrypt master key\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_CRYPTOERR;
+  }
+
+  sodium_mprotect_noaccess(info);
+  if (crypto_secretbox_easy(
+          recovery_result, (uint8_t*)intermediate_result,
+          MASTER_KEY_SIZE + MAC_SIZE,
+          recovery_result + MASTER_KEY_SIZE + 2 * MAC_SIZE + NONCE_SIZE,
+          (uint8_t*)&data2_master) < 0) {
+    FPUTS("Could not encrypt master key\n", stderr);
+    return VE_CRYPTOERR;
+  }
+
+  if (PW_HASH(dataencr1, &data1_master, MASTER_KEY_SIZE, data_salt_12) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    return VE_CRYPTOERR;
+  }
+
+  if (PW_HASH(dataencr2, &data2_master, MASTER_KEY_SIZE, data_salt_22) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    return VE_CRYPTOERR;
+  }
+
+  return VE_SUCCESS;
+}
+
+/**
+   function create_password_for_server
+
+   Given a currently open vault and the second salt used to create the password
+   for the server, create the server password and place it into the provided
+   buffer. This function is to be used for checking and updating with the
+   server, while the make_passsword function below is for initially downloading
+   if the user does not have a vault on the computer.
+
+   Returns VE_SUCCESS if the password was created
+   VE_CRYPTOERR if there were any errors with the computation
+ */
+int create_password_for_server(struct vault_info* info, uint8_t* salt,
+                               uint8_t* server_pass) {
+  int check;
+  if (check = internal_initial_checks(info)) {
+    return check;
+  }
+
+  if (PW_HASH(server_pass, info->derived_key, MASTER_KEY_SIZE, salt) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_CRYPTOERR;
+  }
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function make_password_for_server
+
+   Given a password and two salts, generate a doubly-derived key using Argon2id
+   that will be used as a server password. This function should be used in the
+   case that a user wants to download their vault from the cloud.
+
+   Returns VE_SUCCESS if the password was created
+   VE_CRYPTOERR if there were any errors with the computation
+ */
+int make_password_for_server(const char* password, const uint8_t* first_salt,
+                             const uint8_t* second_salt, uint8_t* server_pass) {
+  uint8_t derived_key[MASTER_KEY_SIZE];
+
+  if (PW_HASH(&derived_key, password, strlen(password), first_salt) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    return VE_CRYPTOERR;
+  }
+
+  if (PW_HASH(server_pass, derived_key, MASTER_KEY_SIZE, second_salt) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    return VE_CRYPTOERR;
+  }
+
+  return VE_SUCCESS;
+}
+
+/**
+   function create_responses_for_server
+
+   Given the responses to security questions and salts from the server, create
+   two keys that will be sent to the server for verification. The use of
+   doubly deriving the keys is that the server is not able to invert Argon2id
+   with any known methods, preventing decryption of the recovery data.
+
+   Returns VE_SUCCESS if the two keys were created
+   VE_CRYPTOERR if there were any errors in derivation
+ */
+int create_responses_for_server(const uint8_t* response1,
+                                const uint8_t* response2,
+                                const uint8_t* data_salt_11,
+                                const uint8_t* data_salt_12,
+                                const uint8_t* data_salt_21,
+                                const uint8_t* data_salt_22, uint8_t* dataencr1,
+                                uint8_t* dataencr2) {
+  uint8_t data1_master[MASTER_KEY_SIZE];
+  uint8_t data2_master[MASTER_KEY_SIZE];
+
+  if (PW_HASH(&data1_master, response1, strlen(response1), data_salt_11) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    return VE_CRYPTOERR;
+  }
+
+  if (PW_HASH(&data2_master, response2, strlen(response2), data_salt_21) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    return VE_CRYPTOERR;
+  }
+
+  if (PW_HASH(dataencr1, &data1_master, MASTER_KEY_SIZE, data_salt_12) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    return VE_CRYPTOERR;
+  }
+
+  if (PW_HASH(dataencr2, &data2_master, MASTER_KEY_SIZE, data_salt_22) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    return VE_CRYPTOERR;
+  }
+
+  return VE_SUCCESS;
+}
+
+/**
+   function update_key_from_recovery
+
+   Given recovery responses, the location of a vault, and recovery data from the
+   server, decrypt the master key, create and add a new header to the vault with
+   the new password, and return the information necessary to update the server.
+
+   Returns VE_SUCCESS upon decryption and creation of new values
+   VE_WRONGPASS is either of the responses is wrong
+   VE_CRYPTOERR if issues with crypto
+   VE_MEMERR if issues with locking/unlocking memory
+   VE_VOPEN if a vault is already open
+   VE_SYSCALL if there are issues with system calls
+   VE_EXIST if no vault exists with the name
+   VE_ACCESS if there is no access to the given vault
+   VE_FILE if the vault file is invalid
+ */
+int update_key_from_recovery(struct vault_info* info, const char* directory,
+                             const char* username, const uint8_t* response1,
+                             const uint8_t* response2, const uint8_t* recovery,
+                             const uint8_t* data_salt_1,
+                             const uint8_t* data_salt_2,
+                             const uint8_t* new_password,
+                             uint8_t* new_first_salt, uint8_t* new_second_salt,
+                             uint8_t* new_server_pass, uint8_t* new_header) {
+  if (directory == NULL || username == NULL || new_password == NULL ||
+      strnlen(directory, MAX_PATH_LEN + 1) > MAX_PATH_LEN ||
+      strnlen(username, MAX_USER_SIZE + 1) > MAX_USER_SIZE ||
+      strnlen(new_password, MAX_PASS_SIZE + 1) > MAX_PASS_SIZE) {
+    return VE_PARAMERR;
+  }
+
+  uint8_t data1_master[MASTER_KEY_SIZE];
+  uint8_t data2_master[MASTER_KEY_SIZE];
+
+  if (PW_HASH(&data1_master, response1, strlen(response1), data_salt_1) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    return VE_CRYPTOERR;
+  }
+
+  if (PW_HASH(&data2_master, response2, strlen(response2), data_salt_2) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    return VE_CRYPTOERR;
+  }
+
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    return VE_MEMERR;
+  }
+
+  if (info->is_open) {
+    FPUTS("Already have a vault open\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_VOPEN;
+  }
+
+  uint8_t intermediate_result[MASTER_KEY_SIZE + MAC_SIZE * 2 + NONCE_SIZE];
+  if (crypto_secretbox_open_easy(
+          (uint8_t*)&intermediate_result, recovery,
+          MASTER_KEY_SIZE + MAC_SIZE * 2,
+          recovery + MASTER_KEY_SIZE + 2 * MAC_SIZE + NONCE_SIZE,
+          (uint8_t*)&data2_master) < 0) {
+    FPUTS("Could not decrypt master key first time\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_WRONGPASS;
+  }
+
+  if (crypto_secretbox_open_easy(
+          (uint8_t*)&info->decrypted_master, (uint8_t*)&intermediate_result,
+          MASTER_KEY_SIZE + MAC_SIZE, recovery + MASTER_KEY_SIZE + 2 * MAC_SIZE,
+          (uint8_t*)&data1_master) < 0) {
+    FPUTS("Could not decrypt master key second time\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_WRONGPASS;
+  }
+
+  // Check file hash to see if its exact
+  int max_size = strlen(directory) + strlen(username) + 10;
+  char* pathname = malloc(max_size);
+  if (snprintf(pathname, max_size, filename_pattern, directory, username) < 0) {
+    free(pathname);
+    return VE_SYSCALL;
+  }
+
+  int open_results = open(pathname, O_RDWR | O_NOFOLLOW);
+  free(pathname);
+  if (open_results < 0) {
+    if (errno == ENOENT) {
+      return VE_EXIST;
+    } else if (errno == EACCES) {
+      return VE_ACCESS;
+    } else {
+      return VE_SYSCALL;
+    }
+  }
+
+  if (flock(open_results, LOCK_EX | LOCK_NB) < 0) {
+    close(open_results);
+    FPUTS("Could not get file lock\n", stderr);
+    return VE_SYSCALL;
+  }
+
+  info->user_fd = open_results;
+  snprintf(info->pathname, sizeof(info->pathname), filename_pattern, directory,
+           username);
+  if (internal_verify_file(info)) {
+    close(open_results);
+    sodium_mprotect_noaccess(info);
+    return VE_FILE;
+  }
+
+  // Update the header
+  randombytes_buf(new_first_salt, SALT_SIZE);
+  if (PW_HASH(info->derived_key, new_password, strlen(new_password),
+              new_first_salt) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_CRYPTOERR;
+  }
+
+  uint8_t encrypted_master[MASTER_KEY_SIZE + MAC_SIZE];
+  uint8_t master_nonce[NONCE_SIZE];
+  randombytes_buf(master_nonce, sizeof master_nonce);
+  if (crypto_secretbox_easy(encrypted_master, info->decrypted_master,
+                            MASTER_KEY_SIZE, master_nonce,
+                            info->derived_key) < 0) {
+    FPUTS("Could not encrypt master key\n", stderr);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    return VE_CRYPTOERR;
+  }
+
+  lseek(info->user_fd, 8, SEEK_SET);
+  WRITE(info->user_fd, new_first_salt, crypto_pwhash_SALTBYTES, info);
+  WRITE(info->user_fd, &encrypted_master, MASTER_KEY_SIZE + MAC_SIZE, info);
+  WRITE(info->user_fd, &master_nonce, NONCE_SIZE, info);
+
+  if (internal_seal_file(info)) {
+    sodium_mprotect_noaccess(info);
+    return VE_IOERR;
+  }
+
+  internal_create_key_map(info);
+
+  info->current_box.key[0] = 0;
+  info->is_open = 1;
+
+  int result = internal_upgrade_integrity(info);
+  if (result) {
+    FPUTS("Could not upgrade vault, keeping the whole file hash\n", stderr);
+    if (!info->is_open) {
+      sodium_mprotect_noaccess(info);
+      return result;
+    }
+  }
+
+  // Create new result for the server w/ header and salt and password
+
+  lseek(info->user_fd, 0, SEEK_SET);
+  READ(info->user_fd, new_header, HEADER_SIZE - 4, info);
+
+  randombytes_buf(new_second_salt, SALT_SIZE);
+  if (PW_HASH(new_server_pass, info->derived_key, MASTER_KEY_SIZE,
+              new_second_salt) < 0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    return VE_CRYPTOERR;
+  }
+
+  if (sodium_mprotect_noaccess(info) < 0) {
+    FPUTS("Issues preventing access to memory\n", stderr);
+  }
+
+  FPUTS("Changed vault password from recovery\n", stderr);
+  return VE_SUCCESS;
+}
+
+/**
+   Vault modification functions
+
+   The following series of functions are used to directly modify the vault file.
+   As the vault is designed as append-only, that has a garbage collection phase
+   to remove unused data and condense its size, adding and deleting are quick
+   until the loc_data field runs out of space.
+ */
+
+/**
+   function internal_check_password
+
+   Checks a password against the open vault, by deriving a key from it with
+   the salt in the header, unwrapping the master key in the header with it,
+   and comparing that with the master key the vault was opened with.
+
+   Returns VE_SUCCESS if the password is the one of the vault
+   VE_WRONGPASS if it is not
+   VE_CRYPTOERR if the key could not be derived from it
+   VE_IOERR if the header could not be read
+ */
+int internal_check_password(struct vault_info* info, const char* password) {
+  int open_info_length = SALT_SIZE + MAC_SIZE + MASTER_KEY_SIZE + NONCE_SIZE;
+  uint8_t open_info[open_info_length];
+  if (pread(info->user_fd, open_info, open_info_length, 8) !=
+      open_info_length) {
+    return VE_IOERR;
+  }
+
+  uint8_t keypass[MASTER_KEY_SIZE];
+  if (PW_HASH((uint8_t*)&keypass, password, strlen(password), open_info) <
+      0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    return VE_CRYPTOERR;
+  }
+
+  int result = VE_SUCCESS;
+  uint8_t master[MASTER_KEY_SIZE];
+  if (crypto_secretbox_open_easy(
+          (uint8_t*)&master, open_info + SALT_SIZE, MASTER_KEY_SIZE + MAC_SIZE,
+          open_info + open_info_length - NONCE_SIZE, (uint8_t*)&keypass) < 0) {
+    FPUTS("Could not decrypt master key\n", stderr);
+    result = VE_WRONGPASS;
+  } else if (memcmp((uint8_t*)master, &info->decrypted_master,
+                    MASTER_KEY_SIZE) != 0) {
+    FPUTS("Wrong password\n", stderr);
+    result = VE_WRONGPASS;
+  }
+  sodium_memzero(&master, MASTER_KEY_SIZE);
+  sodium_memzero(&keypass, MASTER_KEY_SIZE);
+  return result;
+}
+
+/**
+   function change_password
+
+   Function used to change the password of the vault by decrypting the current
+   vault header to ensure the provided password is correct, and then
+   reencrypting it with the new password and salts/nonces. Updating the server
+   must be done with a separate call with the new password information.
+
+   Returns VE_SUCCESS upon changing the password
+   VE_PARAMERR if either password is too long
+   VE_MEMERR if there are issues with memory
+   VE_CRYPTOERR if there are issues with hashing or encryption
+   VE_IOERR if there are issues communicating with the file
+   VE_WRONGPASS if the old password is incorrect
+ */
+int change_password(struct vault_info* info, const char* old_password,
+                    const char* new_password) {
+  if (strnlen(old_password, MAX_PASS_SIZE + 1) > MAX_PASS_SIZE ||
+      strnlen(new_password, MAX_PASS_SIZE + 1) > MAX_PASS_SIZE) {
+    return VE_PARAMERR;
+  }
+
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  if ((result = internal_check_password(info, old_password))) {
+    sodium_mprotect_noaccess(info);
+    return result;
+  }
+
+  uint8_t salt[SALT_SIZE];
+  randombytes_buf(salt, sizeof salt);
+  if (PW_HASH(info->derived_key, new_password, strlen(new_password), salt) <
+      0) {
+    FPUTS("Could not dervie password key\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_CRYPTOERR;
+  }
+
+  uint8_t encrypted_master[MASTER_KEY_SIZE + MAC_SIZE];
+  uint8_t master_nonce[NONCE_SIZE];
+  randombytes_buf(master_nonce, sizeof master_nonce);
+  if (crypto_secretbox_easy(encrypted_master, info->decrypted_master,
+                            MASTER_KEY_SIZE, master_nonce,
+                            info->derived_key) < 0) {
+    FPUTS("Could not encrypt master key\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_CRYPTOERR;
+  }
+
+  lseek(info->user_fd, 8, SEEK_SET);
+  WRITE(info->user_fd, &salt, crypto_pwhash_SALTBYTES, info);
+  WRITE(info->user_fd, &encrypted_master, MASTER_KEY_SIZE + MAC_SIZE, info);
+  WRITE(info->user_fd, &master_nonce, NONCE_SIZE, info);
+
+  if (internal_seal_file(info)) {
+    sodium_mprotect_noaccess(info);
+    return VE_IOERR;
+  }
+
+  if (sodium_mprotect_noaccess(info) < 0) {
+    FPUTS("Issues preventing access to memory\n", stderr);
+  }
+
+  FPUTS("Changed vault password\n", stderr);
+  return VE_SUCCESS;
+}
+
+/**
+   function add_key
+
+   Function to add a new key to the vault. Validates that a current vault is
+   opened and that the key does not already exist in the vault, and then
+   attempts to append the key to the vault. If the key cannot be appended
+   because there is no space in the file, the file is extended and the
+   appending retried.
+
+   Returns VE_SUCCESS upon adding the new entry
+   VE_PARAMERR if the key or value is too long
+   VE_KEYEXIST if the key already exists in the file
+   VE_MEMERR if there are issues reading memory
+   VE_CLOSE if the vault is currently closed
+   VE_CRYPTOERR if there are issues with libsodium
+   VE_IOERR if there are issues writing to disk
+ */
+int add_key(struct vault_info* info, uint8_t type, const char* key,
+            const char* value, uint64_t m_time, uint32_t len) {
+  if (info == NULL || key == NULL || value == NULL || len > DATA_SIZE ||
+      strnlen(key, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
+    return VE_PARAMERR;
+  }
 
-   Returns VE_SUCCESS after releasing the key map, zeroing memory, and closing
-           the file descriptor associated with the current vault
-   VE_MEMERR if the secure memory cannot be read
-   VE_VCLOSE if there is no current vault opened
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  if (get_info(info->key_info, key)) {
+    FPUTS("Key already in map; use update\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_KEYEXIST;
+  }
+
+  int res = internal_append_key(info, type, key, value, m_time, len);
+  if (res == VE_NOSPACE) {
+    internal_condense_file(info);
+    sodium_mprotect_readwrite(info);
+    return internal_append_key(info, type, key, value, m_time, len);
+  }
+
+  return res;
+}
+
+/**
+   function get_vault_keys
+
+   Fills in the results field with the keys in the vault. Take the keys returned
+   by the hash map and copy them into the results field, assuming that the
+   results field has been correctly initialized to have buffers that are at
+   least BOX_KEY_SIZE. The keys returned from the hashmap are freed and the
+   function returns.
+
+   Returns VE_SUCCESS on filling in the results field
+   VE_MEMERR if memory cannot be made read/write
+   VE_CLOSE if there is no vault opened
+ */
+int get_vault_keys(struct vault_info* info, char** results) {
+  int check;
+  if ((check = internal_initial_checks(info))) {
+    return check;
+  }
+
+  char** result = get_keys(info->key_info);
+  if (result == NULL) {
+    sodium_mprotect_noaccess(info);
+    return VE_MEMERR;
+  }
+  uint32_t keynum = num_keys(info->key_info);
+  for (int i = 0; i < keynum; ++i) {
+    strcpy(results[i], result[i]);
+  }
+  free(result);
+
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function num_vault_keys
+
+   Returns the number of keys in the vault, kept as the hash table size
+ */
+uint32_t num_vault_keys(struct vault_info* info) {
+  int check;
+  if ((check = internal_initial_checks(info))) {
+    return check;
+  }
+
+  uint32_t result = num_keys(info->key_info);
+  sodium_mprotect_noaccess(info);
+  return result;
+}
+
+/**
+   function internal_copy_ordered
+
+   Copies up to max_results keys from position first of the ordered index,
+   taken in the given order, into the results buffers, which must each hold
+   BOX_KEY_SIZE bytes, and sets num_results to count, the number of matches,
+   which may be more than were copied.
+
+   Returns VE_SUCCESS
+ */
+int internal_copy_ordered(struct vault_info* info, uint32_t first,
+                          uint32_t count, uint8_t order, char** results,
+                          uint32_t max_results, uint32_t* num_results) {
+  uint32_t copied = count < max_results ? count : max_results;
+  for (uint32_t i = 0; i < copied; ++i) {
+    strcpy(results[i], ordered_key(info->key_info, first + i, order, NULL));
+  }
+  *num_results = count;
+  return VE_SUCCESS;
+}
+
+/**
+   function get_keys_with_prefix
+
+   Fills in the results field with the keys starting with prefix, in order,
+   from the sorted index kept next to the hash map, so nothing is read from
+   the file or decrypted. At most max_results keys are copied, into buffers
+   of at least BOX_KEY_SIZE, and num_results is set to the number of keys
+   matching, so a caller can tell when its buffers were too few. The index
+   is built the first time any ordered query is made on an open vault, and
+   queries after that only binary search it.
+
+   Returns VE_SUCCESS on filling in the results field
+   VE_PARAMERR if a parameter is missing or the prefix is too long
+   VE_MEMERR if the index cannot be built
+   VE_VCLOSE if there is no vault opened
+ */
+int get_keys_with_prefix(struct vault_info* info, const char* prefix,
+                         char** results, uint32_t max_results,
+                         uint32_t* num_results) {
+  if (info == NULL || prefix == NULL || num_results == NULL ||
+      (results == NULL && max_results) ||
+      strnlen(prefix, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
+    return VE_PARAMERR;
+  }
+
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  uint32_t first;
+  uint32_t count;
+  if (find_prefix(info->key_info, prefix, &first, &count)) {
+    FPUTS("Could not build the key index\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_MEMERR;
+  }
+  result = internal_copy_ordered(info, first, count, ORDER_KEY, results,
+                                 max_results, num_results);
+
+  sodium_mprotect_noaccess(info);
+  return result;
+}
+
+/**
+   function get_keys_with_suffix
+
+   Fills in the results field with the keys ending with suffix, such as all
+   of the subdomains of a domain when given ".example.com". Works as
+   get_keys_with_prefix, except that the keys are ordered by their text read
+   backwards, so keys under the same subdomain come together.
+
+   Returns VE_SUCCESS on filling in the results field
+   VE_PARAMERR if a parameter is missing or the suffix is too long
+   VE_MEMERR if the index cannot be built
+   VE_VCLOSE if there is no vault opened
+ */
+int get_keys_with_suffix(struct vault_info* info, const char* suffix,
+                         char** results, uint32_t max_results,
+                         uint32_t* num_results) {
+  if (info == NULL || suffix == NULL || num_results == NULL ||
+      (results == NULL && max_results) ||
+      strnlen(suffix, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
+    return VE_PARAMERR;
+  }
+
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  uint32_t first;
+  uint32_t count;
+  if (find_suffix(info->key_info, suffix, &first, &count)) {
+    FPUTS("Could not build the key index\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_MEMERR;
+  }
+  result = internal_copy_ordered(info, first, count, ORDER_SUFFIX, results,
+                                 max_results, num_results);
+
+  sodium_mprotect_noaccess(info);
+  return result;
+}
+
+/**
+   function get_keys_in_range
+
+   Fills in the results field with the keys from first up to, but not
+   including, last, in order. Either bound can be NULL to leave that end of
+   the range open, so that passing the last key of one call as first of the
+   next pages through the whole vault in order. Otherwise works as
+   get_keys_with_prefix.
+
+   Returns VE_SUCCESS on filling in the results field
+   VE_PARAMERR if a parameter is missing or a bound is too long
+   VE_MEMERR if the index cannot be built
+   VE_VCLOSE if there is no vault opened
+ */
+int get_keys_in_range(struct vault_info* info, const char* first,
+                      const char* last, char** results, uint32_t max_results,
+                      uint32_t* num_results) {
+  if (info == NULL || num_results == NULL ||
+      (results == NULL && max_results) ||
+      (first && strnlen(first, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) ||
+      (last && strnlen(last, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1)) {
+    return VE_PARAMERR;
+  }
+
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  uint32_t position;
+  uint32_t count;
+  if (find_range(info->key_info, first, last, &position, &count)) {
+    FPUTS("Could not build the key index\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_MEMERR;
+  }
+  result = internal_copy_ordered(info, position, count, ORDER_KEY, results,
+                                 max_results, num_results);
+
+  sodium_mprotect_noaccess(info);
+  return result;
+}
+
+/**
+   function match_domain_key
+
+   Finds the key to autofill a site with, the domain itself if it is a key
+   and otherwise the closest parent domain that is, so that a credential
+   saved for example.com is found for login.example.com. Parents are tried
+   by dropping one label at a time, stopping before the last one so a bare
+   top level domain is never matched. Each try is a single lookup in the
+   hash map, so the whole chain takes no more than one lookup per label and
+   needs no index. The key found is copied into result, which must hold
+   BOX_KEY_SIZE bytes.
+
+   Returns VE_SUCCESS on finding a key
+   VE_PARAMERR if a parameter is missing or the domain is too long
+   VE_KEYEXIST if neither the domain nor any parent of it is a key
+   VE_VCLOSE if there is no vault opened
+ */
+int match_domain_key(struct vault_info* info, const char* domain,
+                     char* result) {
+  if (info == NULL || domain == NULL || result == NULL ||
+      strnlen(domain, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
+    return VE_PARAMERR;
+  }
+
+  int check;
+  if ((check = internal_initial_checks(info))) {
+    return check;
+  }
+
+  const char* candidate = domain;
+  while (candidate != NULL && get_info(info->key_info, candidate) == NULL) {
+    const char* dot = strchr(candidate, '.');
+    candidate = dot && strchr(dot + 1, '.') ? dot + 1 : NULL;
+  }
+  if (candidate == NULL) {
+    sodium_mprotect_noaccess(info);
+    return VE_KEYEXIST;
+  }
+  strcpy(result, candidate);
+
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   vault_cursor - position of a listing of the keys, in key order
+
+   A cursor holds no pointers into the map, only the key it has reached, so
+   it stays valid across changes to the vault, compactions and aborts. Each
+   page looks the key up again in the ordered index and carries on after it,
+   which costs a binary search per page rather than anything per key. A
+   cursor listing only the keys of one type does the same in the index
+   ordered by type, where the keys of each type are in key order.
+ */
+struct vault_cursor {
+  uint8_t started;          // Whether last has been returned already
+  uint8_t order;            // ORDER_KEY, or ORDER_TYPE to list only type
+  uint8_t type;             // Type listed when ordered by type
+  char last[BOX_KEY_SIZE];  // Key the next page starts at, or after
+};
+
+/**
+   function internal_cursor_find
+
+   Sets first to the position in the cursor's order of the first key it
+   lists not before start, and count to how many keys it lists from there,
+   building the index for the order if it has not been built.
+
+   Returns VE_SUCCESS if the keys were found
+   VE_MEMERR if the index cannot be built
+ */
+int internal_cursor_find(struct vault_info* info, uint8_t order, uint8_t type,
+                         const char* start, uint32_t* first,
+                         uint32_t* count) {
+  uint8_t failed =
+      order == ORDER_TYPE
+          ? find_type(info->key_info, type, start, first, count)
+          : find_range(info->key_info, start, NULL, first, count);
+  if (failed) {
+    FPUTS("Could not build the key index\n", stderr);
+    return VE_MEMERR;
+  }
+  return VE_SUCCESS;
+}
+
+/**
+   function internal_open_cursor
+
+   Starts a listing of the keys in the given order, of only type when that
+   is ORDER_TYPE, from the first key not before start, or from the first key
+   if start is NULL. The cursor is kept in secure memory, as it holds a key.
+
+   Returns VE_SUCCESS on setting cursor
+   VE_PARAMERR if cursor is NULL or start is too long
+   VE_MEMERR if the cursor or the index cannot be allocated
+   VE_VCLOSE if there is no vault opened
+ */
+int internal_open_cursor(struct vault_info* info, const char* start,
+                         uint8_t order, uint8_t type,
+                         struct vault_cursor** cursor) {
+  if (info == NULL || cursor == NULL ||
+      (start && strnlen(start, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1)) {
+    return VE_PARAMERR;
+  }
+
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  uint32_t first;
+  uint32_t count;
+  result = internal_cursor_find(info, order, type, NULL, &first, &count);
+  sodium_mprotect_noaccess(info);
+  if (result) {
+    return result;
+  }
+
+  struct vault_cursor* opened = sodium_malloc(sizeof(struct vault_cursor));
+  if (opened == NULL) {
+    FPUTS("Could not allocate the cursor\n", stderr);
+    return VE_MEMERR;
+  }
+  sodium_memzero(opened, sizeof(struct vault_cursor));
+  opened->order = order;
+  opened->type = type;
+  if (start) {
+    strcpy(opened->last, start);
+  }
+  *cursor = opened;
+  return VE_SUCCESS;
+}
+
+/**
+   function open_cursor
+
+   Starts a listing of the keys in the vault, in key order, from the first
+   key not before start, or from the first key if start is NULL. The cursor
+   must be freed with close_cursor. The ordered index is built here if no
+   query has built it.
+
+   Returns as internal_open_cursor
+ */
+int open_cursor(struct vault_info* info, const char* start,
+                struct vault_cursor** cursor) {
+  return internal_open_cursor(info, start, ORDER_KEY, 0, cursor);
+}
+
+/**
+   function open_type_cursor
+
+   Starts a listing of only the keys of type, such as only the credentials,
+   in key order from the first key not before start, or from the first key
+   of the type if start is NULL. Each page then costs a binary search in the
+   index ordered by type plus the keys it returns, however many keys of
+   other types the vault holds. The cursor must be freed with close_cursor.
+
+   Returns as internal_open_cursor
+ */
+int open_type_cursor(struct vault_info* info, uint8_t type, const char* start,
+                     struct vault_cursor** cursor) {
+  return internal_open_cursor(info, start, ORDER_TYPE, type, cursor);
+}
+
+/**
+   function count_keys_of_type
+
+   Sets count to the number of keys of type in the vault, which the key map
+   keeps as keys are added and deleted, so no index is needed.
+
+   Returns VE_SUCCESS on setting count
+   VE_PARAMERR if count is NULL
+   VE_VCLOSE if there is no vault opened
+ */
+int count_keys_of_type(struct vault_info* info, uint8_t type,
+                       uint32_t* count) {
+  if (info == NULL || count == NULL) {
+    return VE_PARAMERR;
+  }
+
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  *count = count_type(info->key_info, type);
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function cursor_next
+
+   Fills in up to max_entries entries with the next keys of the listing and
+   sets num_entries to how many were filled, zero once every key has been
+   listed. The entries point straight at the keys and their info in the key
+   map, so nothing is copied or allocated for any key, and the pointers are
+   only valid until the vault is next changed or closed. Keys added after
+   the cursor has passed where they sort are not returned, and keys deleted
+   before it reaches them are not either.
+
+   Returns VE_SUCCESS on filling in the entries
+   VE_PARAMERR if a parameter is missing
+   VE_MEMERR if the index cannot be built
+   VE_VCLOSE if there is no vault opened
+ */
+int cursor_next(struct vault_info* info, struct vault_cursor* cursor,
+                struct vault_entry* entries, uint32_t max_entries,
+                uint32_t* num_entries) {
+  if (info == NULL || cursor == NULL || num_entries == NULL ||
+      (entries == NULL && max_entries)) {
+    return VE_PARAMERR;
+  }
+
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  uint32_t first;
+  uint32_t count;
+  if ((result = internal_cursor_find(info, cursor->order, cursor->type,
+                                     cursor->last, &first, &count))) {
+    sodium_mprotect_noaccess(info);
+    return result;
+  }
+  if (cursor->started && count &&
+      strcmp(ordered_key(info->key_info, first, cursor->order, NULL),
+             cursor->last) == 0) {
+    first++;
+    count--;
+  }
+
+  uint32_t filled = count < max_entries ? count : max_entries;
+  for (uint32_t i = 0; i < filled; ++i) {
+    const struct key_info* current_info;
+    const char* key =
+        ordered_key(info->key_info, first + i, cursor->order, &current_info);
+    entries[i].key = key;
+    entries[i].m_time = current_info->m_time;
+    entries[i].key_len = strlen(key);
+    entries[i].type = current_info->type;
+    entries[i].deleted = 0;
+  }
+  if (filled) {
+    memcpy(cursor->last, entries[filled - 1].key,
+           entries[filled - 1].key_len + 1);
+    cursor->started = 1;
+  }
+  *num_entries = filled;
+
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function close_cursor
+
+   Frees a cursor from open_cursor, wiping the key it held.
+
+   Returns VE_SUCCESS on freeing the cursor
+   VE_PARAMERR if cursor is NULL
+ */
+int close_cursor(struct vault_cursor* cursor) {
+  if (cursor == NULL) {
+    return VE_PARAMERR;
+  }
+  sodium_free(cursor);
+  return VE_SUCCESS;
+}
+
+/**
+   function keys_modified_since
+
+   Fills in up to max_entries entries with the keys added or updated at or
+   after since, along with the keys deleted since then, marked as deleted and
+   with the time of the deletion. Entries come in order of time and then of
+   key, and point into the maps as cursor_next's do, valid until the vault
+   next changes. num_changes is set to the number of changes, which may be
+   more than were filled in. Both maps keep an index ordered by time, built
+   by the first call, so each call costs a binary search and then only the
+   changes it returns. Deletions are kept as tombstones in the key map
+   snapshot written when the vault is closed, so they are still known once it
+   is opened again, unless it had to rebuild its map from the loc field. A
+   tombstone is dropped once its key is added again.
+
+   Returns VE_SUCCESS on filling in the entries
+   VE_PARAMERR if a parameter is missing
+   VE_MEMERR if an index cannot be built
+   VE_VCLOSE if there is no vault opened
  */
-int close_vault(struct vault_info* info) {
-  if (sodium_mprotect_readwrite(info) < 0) {
-    FPUTS("Issues gaining access to memory\n", stderr);
+int keys_modified_since(struct vault_info* info, uint64_t since,
+                        struct vault_entry* entries, uint32_t max_entries,
+                        uint32_t* num_changes) {
+  if (info == NULL || num_changes == NULL ||
+      (entries == NULL && max_entries)) {
+    return VE_PARAMERR;
+  }
+
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  uint32_t first;
+  uint32_t count;
+  uint32_t first_deleted = 0;
+  uint32_t deleted = 0;
+  if (find_modified(info->key_info, since, &first, &count) ||
+      (info->tombstones && find_modified(info->tombstones, since,
+                                         &first_deleted, &deleted))) {
+    FPUTS("Could not build the time index\n", stderr);
+    sodium_mprotect_noaccess(info);
     return VE_MEMERR;
   }
 
-  if (!info->is_open) {
-    FPUTS("Already have a vault closed\n", stderr);
+  // Merges the two runs in time order, skipping the tombstones of keys that
+  // are back in the vault after an aborted transaction restored them
+  uint32_t changes = 0;
+  const struct key_info* live_info = NULL;
+  const struct key_info* dead_info = NULL;
+  const char* live = ordered_key(info->key_info, first, ORDER_TIME, &live_info);
+  const char* dead = NULL;
+  while (count || deleted) {
+    if (dead == NULL && deleted) {
+      dead = ordered_key(info->tombstones, first_deleted, ORDER_TIME,
+                         &dead_info);
+      if (get_info(info->key_info, dead)) {
+        dead = NULL;
+        first_deleted++;
+        deleted--;
+        continue;
+      }
+    }
+    uint8_t take_dead =
+        dead && (!count || dead_info->m_time < live_info->m_time ||
+                 (dead_info->m_time == live_info->m_time &&
+                  strcmp(dead, live) < 0));
+    if (changes < max_entries) {
+      const struct key_info* taken = take_dead ? dead_info : live_info;
+      entries[changes].key = take_dead ? dead : live;
+      entries[changes].m_time = taken->m_time;
+      entries[changes].key_len = strlen(entries[changes].key);
+      entries[changes].type = take_dead ? 0 : taken->type;
+      entries[changes].deleted = take_dead;
+    }
+    changes++;
+    if (take_dead) {
+      dead = NULL;
+      first_deleted++;
+      deleted--;
+    } else {
+      live = ordered_key(info->key_info, ++first, ORDER_TIME, &live_info);
+      count--;
+    }
+  }
+  *num_changes = changes;
+
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function last_modified_time
+
+   Returns the last time a key was modified, or an error code.
+   Assumes that the time will never overflow, or be less than the number of
+   error codes
+ */
+uint64_t last_modified_time(struct vault_info* info, const char* key) {
+  if (info == NULL || key == NULL ||
+      strnlen(key, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
+    return VE_PARAMERR;
+  }
+
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  const struct key_info* current_info;
+  if (!(current_info = get_info(info->key_info, key))) {
+    FPUTS("Key not in map\n", stderr);
     if (sodium_mprotect_noaccess(info) < 0) {
       FPUTS("Issues preventing access to memory\n", stderr);
     }
-    return VE_VCLOSE;
+    return VE_KEYEXIST;
   }
 
-  close(info->user_fd);
-  delete_map(info->key_info);
-  sodium_memzero(info->derived_key, MASTER_KEY_SIZE);
-  sodium_memzero(info->decrypted_master, MASTER_KEY_SIZE);
-  sodium_memzero(&info->current_box, sizeof(struct vault_box));
-  info->is_open = 0;
+  sodium_mprotect_noaccess(info);
+  return current_info->m_time;
+}
 
-  if (sodium_mprotect_noaccess(info) < 0) {
-    FPUTS("Issues preventing access to memory\n", stderr);
-  }
+/**
+   function internal_check_hash
 
-  FPUTS("Closed the vault\n", stderr);
+   Checks the keyed hash at the end of the CIPHER_SECRETBOX entry in box,
+   which is box_len bytes long.
+
+   Returns VE_SUCCESS if the hash matches
+   VE_CRYPTOERR if it does not
+ */
+int internal_check_hash(struct vault_info* info, const uint8_t* box,
+                        uint32_t box_len) {
+  uint8_t hash[HASH_SIZE];
+  crypto_generichash((uint8_t*)&hash, HASH_SIZE, box, box_len - HASH_SIZE,
+                     info->decrypted_master, MASTER_KEY_SIZE);
+
+  if (memcmp((char*)&hash, box + box_len - HASH_SIZE, HASH_SIZE) != 0) {
+    FPUTS("ENTRY HASH INVALID\n", stderr);
+    return VE_CRYPTOERR;
+  }
   return VE_SUCCESS;
 }
 
 /**
-   Server communication functions
+   function internal_open_entry
 
-   The next series of functions are used to create information for the server.
-   This includes and initial function which creates data for the server upon
-   signup, specifically the double-derived key that the server can verify.
-   In addition, responses to recovery questions are used as keys to encrypt the
-   master key.
+   Authenticates the entry read into box, whose key and value are key_len
+   and val_len bytes long, and decrypts its value into value, which must
+   hold at least val_len bytes. CIPHER_SECRETBOX entries have their keyed
+   hash checked first, while the AEAD suites check their tag over the type,
+   key and value as they decrypt.
+
+   Returns VE_SUCCESS upon decrypting the value
+   VE_CRYPTOERR if the entry is not authentic or the value does not decrypt
  */
+int internal_open_entry(struct vault_info* info, const uint8_t* box,
+                        uint32_t key_len, uint32_t val_len, uint8_t* value) {
+  uint32_t box_len = internal_entry_size(info->cipher, key_len, val_len);
+  const uint8_t* val_data = box + ENTRY_HEADER_SIZE + key_len;
+  const uint8_t* val_nonce = val_data + val_len + MAC_SIZE;
+  const uint8_t* ad = box + ENTRY_HEADER_SIZE - 1;
+  int result;
+  if (info->cipher == CIPHER_AESGCM) {
+    result = crypto_aead_aes256gcm_decrypt(
+        value, NULL, NULL, val_data, val_len + MAC_SIZE, ad, key_len + 1,
+        val_nonce, info->decrypted_master);
+  } else if (info->cipher == CIPHER_XCHACHA) {
+    result = crypto_aead_xchacha20poly1305_ietf_decrypt(
+        value, NULL, NULL, val_data, val_len + MAC_SIZE, ad, key_len + 1,
+        val_nonce, info->decrypted_master);
+  } else {
+    if (internal_check_hash(info, box, box_len)) {
+      return VE_CRYPTOERR;
+    }
+    result = crypto_secretbox_open_easy(value, val_data, val_len + MAC_SIZE,
+                                        val_nonce, info->decrypted_master);
+  }
+
+  if (result < 0) {
+    FPUTS("Could not decrypt value\n", stderr);
+    return VE_CRYPTOERR;
+  }
+  return VE_SUCCESS;
+}
 
 /**
-   function create_data_for_server
+   function internal_check_entry
 
-   Given an open vault and responses given to security questions, generate all
-   information that is necessary for registering with the server. Most of the
-   pointers are used as return values, and are done directly as byte pointers
-   to prevent having to declare a c struct in Python as well as C. Six salts
-   are sent to the server for the doubly-derived keys that are used for
-   validation, as well as encrypted responses, the password for the server, and
-   the result used for recovery that is encrypted with both responses.
+   Checks that the entry in box, box_len bytes long with a key of key_len
+   bytes, was sealed with the master key, without keeping its value. The
+   AEAD suites can only check their tag by decrypting, so the value is
+   decrypted into secure memory that is wiped and freed straight after.
 
-   Returns VE_SUCCESS upon filling in all byte strings with the necessary values
-   VE_MEMERR if memory cannot be locked
-   VE_CRYPTOERR if there are issues in password hashing or encryption
-   VE_IOERR if there are issues reading from disk
+   Returns VE_SUCCESS if the entry is authentic
+   VE_CRYPTOERR if it is not
+   VE_MEMERR if there is no memory to decrypt into
  */
-int create_data_for_server(struct vault_info* info, uint8_t* response1,
-                           uint8_t* response2, uint8_t* first_pass_salt,
-                           uint8_t* second_pass_salt, uint8_t* recovery_result,
-                           uint8_t* dataencr1, uint8_t* dataencr2,
-                           uint8_t* data_salt_11, uint8_t* data_salt_12,
-                           uint8_t* data_salt_21, uint8_t* data_salt_22,
-                           uint8_t* server_pass) {
-  int check;
-  if (check = internal_initial_checks(info)) {
-    return check;
+int internal_check_entry(struct vault_info* info, const uint8_t* box,
+                         uint32_t box_len, uint32_t key_len) {
+  if (info->cipher == CIPHER_SECRETBOX) {
+    return internal_check_hash(info, box, box_len);
   }
 
-  randombytes_buf(data_salt_11, SALT_SIZE);
-  randombytes_buf(data_salt_12, SALT_SIZE);
-  randombytes_buf(data_salt_21, SALT_SIZE);
-  randombytes_buf(data_salt_22, SALT_SIZE);
-  randombytes_buf(second_pass_salt, SALT_SIZE);
+  uint32_t val_len = box_len - internal_entry_size(info->cipher, key_len, 0);
+  uint8_t* value = sodium_malloc(val_len + 1);
+  if (value == NULL) {
+    return VE_MEMERR;
+  }
+  int result = internal_open_entry(info, box, key_len, val_len, value);
+  sodium_free(value);
+  return result;
+}
 
-  lseek(info->user_fd, 8, SEEK_SET);
-  READ(info->user_fd, first_pass_salt, SALT_SIZE, info);
+/**
+   function open_key
 
-  if (PW_HASH(server_pass, info->derived_key, MASTER_KEY_SIZE,
-              second_pass_salt) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
+   Given a key, attempt to open it and place the decrypted value into secure
+   memory. Allows only a single value to be open at once, and attempts
+   to decrease the amount of time that decrypted values appear in memory at
+   all. Values opened recently are taken from the value cache instead of
+   being read and decrypted again, and values decrypted are added to it,
+   after expired values are wiped from it.
+
+   Returns VE_SUCCESS upon decrypting the value
+   VE_PARAMERR if the key is too long
+   VE_MEMERR if memory cannot be read
+   VE_KEYEXIST if the key does not exist
+   VE_IOERR if the file cannot be read from
+   VE_CRYPTOERR if there are issues decrypting the value
+ */
+int open_key(struct vault_info* info, const char* key) {
+  if (info == NULL || key == NULL ||
+      strnlen(key, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
+    return VE_PARAMERR;
+  }
+
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  const struct key_info* current_info;
+  if (!(current_info = get_info(info->key_info, key))) {
+    FPUTS("Key not in map\n", stderr);
     if (sodium_mprotect_noaccess(info) < 0) {
       FPUTS("Issues preventing access to memory\n", stderr);
     }
-    return VE_CRYPTOERR;
+    return VE_KEYEXIST;
   }
 
-  uint8_t data1_master[MASTER_KEY_SIZE];
-  uint8_t data2_master[MASTER_KEY_SIZE];
+  if (info->current_box.key[0] != 0 &&
+      strncmp(key, (char*)&(info->current_box.key), BOX_KEY_SIZE) == 0) {
+    info->cache_hits++;
+    sodium_mprotect_noaccess(info);
+    return VE_SUCCESS;
+  }
 
-  if (PW_HASH(&data1_master, response1, strlen(response1), data_salt_11) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
+  if (internal_cache_find(info, key)) {
+    info->cache_hits++;
     sodium_mprotect_noaccess(info);
-    return VE_CRYPTOERR;
+    return VE_SUCCESS;
   }
+  info->cache_misses++;
 
-  if (PW_HASH(&data2_master, response2, strlen(response2), data_salt_21) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
+  // The entry is used in place if the file is mapped
+  const uint32_t* loc_data =
+      LOC_SLOT(info, info->locs,
+               (current_info->inode_loc - HEADER_SIZE) / info->loc_size);
+  uint64_t file_loc = internal_slot_loc(info, loc_data);
+  uint32_t key_len = loc_data[2];
+  uint32_t val_len = loc_data[3];
+  if (key_len >= BOX_KEY_SIZE || val_len > DATA_SIZE) {
     sodium_mprotect_noaccess(info);
-    return VE_CRYPTOERR;
+    return VE_FILE;
   }
 
-  uint8_t intermediate_result[MASTER_KEY_SIZE + MAC_SIZE];
-  randombytes_buf(recovery_result + MASTER_KEY_SIZE + 2 * MAC_SIZE, NONCE_SIZE);
-  randombytes_buf(recovery_result + MASTER_KEY_SIZE + 2 * MAC_SIZE + NONCE_SIZE,
-                  NONCE_SIZE);
-  if (crypto_secretbox_easy((uint8_t*)&intermediate_result,
-                            info->decrypted_master, MASTER_KEY_SIZE,
-                            recovery_result + MASTER_KEY_SIZE + 2 * MAC_SIZE,
-                            (uint8_t*)&data1_master) < 0) {
-    FPUTS("Could not encrypt master key\n", stderr);
+  // Checking segments can map the file again, so it is done before the read
+  uint8_t box_buffer[MAX_ENTRY_SIZE];
+  int box_len = internal_entry_size(info->cipher, key_len, val_len);
+  if (internal_tree_check(info, file_loc, box_len)) {
+    sodium_mprotect_noaccess(info);
+    return VE_FILE;
+  }
+
+  const uint8_t* box = internal_read_at(info, file_loc, box_len, box_buffer);
+  if (box == NULL) {
+    FPUTS("Issues with reading from file\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_IOERR;
+  }
+
+  if ((result = internal_open_entry(info, box, key_len, val_len,
+                                    (uint8_t*)&info->current_box.value))) {
+    sodium_mprotect_noaccess(info);
+    return result;
+  }
+
+  strncpy((char*)&(info->current_box.key), key, BOX_KEY_SIZE);
+  info->current_box.type = box[ENTRY_HEADER_SIZE - 1];
+  info->current_box.val_len = val_len;
+  internal_cache_store(info);
+  sodium_mprotect_noaccess(info);
+
+  FPUTS("Opened a key\n", stderr);
+  return VE_SUCCESS;
+}
+
+/**
+   function internal_add_tombstone
+
+   Records that key was deleted at m_time, replacing any earlier tombstone of
+   it. The map of tombstones is only made by the first deletion. Losing a
+   tombstone to a lack of memory only leaves a deletion out of the changes
+   reported, so it is not treated as an error.
+ */
+void internal_add_tombstone(struct vault_info* info, const char* key,
+                            uint64_t m_time) {
+  if (info->tombstones == NULL && !(info->tombstones = init_map(0))) {
+    FPUTS("Could not make the tombstone map\n", stderr);
+    return;
+  }
+  struct key_info tombstone = {m_time, 0, 0};
+  delete_entry(info->tombstones, key);
+  if (add_entry(info->tombstones, key, &tombstone)) {
+    FPUTS("Could not add a tombstone\n", stderr);
+  }
+}
+
+/**
+   function delete_key_at
+
+   Removes a key from the vault by marking the inode deleted, zeroing out the
+   memory associated with the value in the file, and removing the key from the
+   hash map. A tombstone is left with m_time as the time of the deletion, for
+   keys_modified_since, until the key is added again or the vault is closed.
+   During a write transaction the writes are queued, and the file is sealed
+   when the transaction is committed. If the slot or wipe cannot be written,
+   the key is left in the vault, with the slot and mac as they were.
+   Afterwards the file is compacted if the compaction policy calls for it.
+
+   Returns VE_SUCCESS upon decrypting the value
+   VE_PARAMERR if the key is too long
+   VE_MEMERR if memory cannot be read
+   VE_KEYEXIST if the key does not exist
+   VE_IOERR if the file cannot be written to or read from
+   VE_FILE if a segment of a Merkle vault written to does not match the tree
+   VE_MEMERR if the queue of a write transaction could not grow
+ */
+int delete_key_at(struct vault_info* info, const char* key, uint64_t m_time) {
+  if (info == NULL || key == NULL ||
+      strnlen(key, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
+    return VE_PARAMERR;
+  }
+
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  const struct key_info* current_info;
+  if (!(current_info = get_info(info->key_info, key))) {
+    FPUTS("Key not in map\n", stderr);
+    if (sodium_mprotect_noaccess(info) < 0) {
+      FPUTS("Issues preventing access to memory\n", stderr);
+    }
+    return VE_KEYEXIST;
+  }
+
+  uint32_t* loc_data =
+      LOC_SLOT(info, info->locs,
+               (current_info->inode_loc - HEADER_SIZE) / info->loc_size);
+  uint64_t file_loc = internal_slot_loc(info, loc_data);
+  uint32_t key_len = loc_data[2];
+  uint32_t val_len = loc_data[3];
+
+  uint32_t inode_loc = current_info->inode_loc;
+  int size = val_len + MAC_SIZE;
+  struct slot_undo undo;
+  internal_save_slot(info, loc_data, &undo);
+
+  // The old entry is hashed out of the mac and the wiped one hashed back in
+  if (info->integrity == INTEGRITY_INCREMENTAL) {
+    uint32_t box_len = internal_entry_size(info->cipher, key_len, val_len);
+    uint8_t* box = malloc(box_len);
+    const uint8_t* entry =
+        box == NULL ? NULL : internal_read_at(info, file_loc, box_len, box);
+    if (entry == NULL) {
+      free(box);
+      sodium_mprotect_noaccess(info);
+      return VE_IOERR;
+    }
+    memmove(box, entry, box_len);
+
+    result = internal_mac_region(info, REGION_ENTRY, file_loc, box, box_len);
+    sodium_memzero(box + ENTRY_HEADER_SIZE + key_len, size);
+    if (!result) {
+      result = internal_mac_region(info, REGION_ENTRY, file_loc, box, box_len);
+    }
+    free(box);
+    if (result) {
+      internal_undo_slot(info, &undo);
+      sodium_mprotect_noaccess(info);
+      return result;
+    }
+  } else if ((result = internal_mac_region(
+                  info, REGION_ENTRY, file_loc + ENTRY_HEADER_SIZE + key_len,
+                  NULL, size))) {
+    sodium_mprotect_noaccess(info);
+    return result;
+  }
+
+  uint32_t loc_index = (inode_loc - HEADER_SIZE) / info->loc_size;
+  if ((result = internal_mac_region(info, REGION_LOC, loc_index,
+                                    (uint8_t*)loc_data, info->loc_size))) {
+    internal_undo_slot(info, &undo);
     sodium_mprotect_noaccess(info);
-    return VE_CRYPTOERR;
+    return result;
+  }
+  loc_data[0] = STATE_DELETED;
+  if ((result = internal_mac_region(info, REGION_LOC, loc_index,
+                                    (uint8_t*)loc_data, info->loc_size))) {
+    internal_undo_slot(info, &undo);
+    sodium_mprotect_noaccess(info);
+    return result;
   }
 
-  sodium_mprotect_noaccess(info);
-  if (crypto_secretbox_easy(
-          recovery_result, (uint8_t*)intermediate_result,
-          MASTER_KEY_SIZE + MAC_SIZE,
-          recovery_result + MASTER_KEY_SIZE + 2 * MAC_SIZE + NONCE_SIZE,
-          (uint8_t*)&data2_master) < 0) {
-    FPUTS("Could not encrypt master key\n", stderr);
-    return VE_CRYPTOERR;
+  // Nothing else changes until the slot and wipe are written or queued
+  result = internal_write_loc(info, loc_index);
+  if (!result && (result = internal_wipe_value(
+                      info, file_loc + ENTRY_HEADER_SIZE + key_len, size))) {
+    internal_undo_slot(info, &undo);
+    internal_write_loc(info, loc_index);
   }
+  if (result) {
+    internal_undo_slot(info, &undo);
+    sodium_mprotect_noaccess(info);
+    return result;
+  }
+  info->live_slots--;
+  info->dead_slots++;
+  info->live_bytes -= internal_entry_size(info->cipher, key_len, val_len);
 
-  if (PW_HASH(dataencr1, &data1_master, MASTER_KEY_SIZE, data_salt_12) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    return VE_CRYPTOERR;
+  // An opened value must not outlive its key, or an update would read it
+  if (strncmp(key, (char*)&(info->current_box.key), BOX_KEY_SIZE) == 0) {
+    sodium_memzero(&info->current_box, sizeof(struct vault_box));
   }
+  internal_cache_forget(info, key);
 
-  if (PW_HASH(dataencr2, &data2_master, MASTER_KEY_SIZE, data_salt_22) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    return VE_CRYPTOERR;
+  delete_entry(info->key_info, key);
+  internal_add_tombstone(info, key, m_time);
+  if (!info->in_txn && internal_seal_file(info)) {
+    sodium_mprotect_noaccess(info);
+    return VE_IOERR;
   }
 
+  // The key is gone either way, so a failed compaction is not an error here
+  internal_auto_compact(info);
+
+  sodium_mprotect_noaccess(info);
+  FPUTS("Deleted key\n", stderr);
   return VE_SUCCESS;
 }
 
 /**
-   function create_password_for_server
+   function delete_key
 
-   Given a currently open vault and the second salt used to create the password
-   for the server, create the server password and place it into the provided
-   buffer. This function is to be used for checking and updating with the
-   server, while the make_passsword function below is for initially downloading
-   if the user does not have a vault on the computer.
+   Deletes a key as delete_key_at does, taking the current time in seconds
+   as the time of the deletion.
 
-   Returns VE_SUCCESS if the password was created
-   VE_CRYPTOERR if there were any errors with the computation
+   Returns as delete_key_at
  */
-int create_password_for_server(struct vault_info* info, uint8_t* salt,
-                               uint8_t* server_pass) {
-  int check;
-  if (check = internal_initial_checks(info)) {
-    return check;
+int delete_key(struct vault_info* info, const char* key) {
+  return delete_key_at(info, key, (uint64_t)time(NULL));
+}
+
+/**
+   function update_key
+
+   Updates the value of a key by deleting it in the file, and then adding it
+   again by appending it to the end of the file, which also clears the
+   tombstone the delete leaves. This is done to prevent
+   having to reorder inodes and do file copying, leaving this to one expensive
+   condense file operation that is done periodically to remove the deleted
+   entries.
+
+   Returns VE_SUCCESS upon succeeding to update the key
+   VE_PARAMERR if either the data or key is too long
+   Otherwise returns either delete_key or add_key error
+ */
+int update_key(struct vault_info* info, uint8_t type, const char* key,
+               const char* value, uint64_t m_time, uint32_t len) {
+  if (info == NULL || key == NULL || value == NULL ||
+      strnlen(value, DATA_SIZE + 1) > DATA_SIZE ||
+      strnlen(key, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
+    return VE_PARAMERR;
   }
 
-  if (PW_HASH(server_pass, info->derived_key, MASTER_KEY_SIZE, salt) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    sodium_mprotect_noaccess(info);
-    return VE_CRYPTOERR;
+  int result = delete_key_at(info, key, m_time);
+  if (result != VE_SUCCESS) {
+    return result;
   }
-  sodium_mprotect_noaccess(info);
-  return VE_SUCCESS;
+  return add_key(info, type, key, value, m_time, len);
 }
 
 /**
-   function make_password_for_server
+   function vault_begin
 
-   Given a password and two salts, generate a doubly-derived key using Argon2id
-   that will be used as a server password. This function should be used in the
-   case that a user wants to download their vault from the cloud.
+   Starts a write transaction on the open vault. Until vault_commit, the
+   writes made by adding, updating and deleting keys are queued in memory
+   instead of being made one at a time, and the file is not sealed after each
+   of them. Reads see the queued changes. Calls that seal the file for other
+   reasons, such as changing the password or condensing the file when the loc
+   field is full, write out what has been queued so far first.
 
-   Returns VE_SUCCESS if the password was created
-   VE_CRYPTOERR if there were any errors with the computation
+   Returns VE_SUCCESS upon starting the transaction
+   VE_PARAMERR if a transaction is already open
+   VE_MEMERR if memory cannot be read
+   VE_VCLOSE if the vault is closed
  */
-int make_password_for_server(const char* password, const uint8_t* first_salt,
-                             const uint8_t* second_salt, uint8_t* server_pass) {
-  uint8_t derived_key[MASTER_KEY_SIZE];
+int vault_begin(struct vault_info* info) {
+  if (info == NULL) {
+    return VE_PARAMERR;
+  }
 
-  if (PW_HASH(&derived_key, password, strlen(password), first_salt) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    return VE_CRYPTOERR;
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
   }
 
-  if (PW_HASH(server_pass, derived_key, MASTER_KEY_SIZE, second_salt) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    return VE_CRYPTOERR;
+  if (info->in_txn) {
+    FPUTS("Transaction already open\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_PARAMERR;
   }
 
+  internal_txn_clear(info);
+  info->in_txn = 1;
+  sodium_mprotect_noaccess(info);
   return VE_SUCCESS;
 }
 
 /**
-   function create_responses_for_server
+   function vault_commit
 
-   Given the responses to security questions and salts from the server, create
-   two keys that will be sent to the server for verification. The use of
-   doubly deriving the keys is that the server is not able to invert Argon2id
-   with any known methods, preventing decryption of the recovery data.
+   Ends the open write transaction by writing out everything it queued and
+   sealing the file once. The queued entries are written with one write, the
+   changed loc slots with another, and each queued wipe with its own, and
+   the file is then synced to disk once. Afterwards the file is compacted if
+   the compaction policy calls for it.
 
-   Returns VE_SUCCESS if the two keys were created
-   VE_CRYPTOERR if there were any errors in derivation
+   Returns VE_SUCCESS upon committing the transaction
+   VE_PARAMERR if no transaction is open
+   VE_MEMERR if memory cannot be read
+   VE_VCLOSE if the vault is closed
+   VE_IOERR if the file cannot be written to
+   VE_FILE if a segment of a Merkle vault does not match the tree
+   VE_CRYPTOERR if the file could not be sealed
  */
-int create_responses_for_server(const uint8_t* response1,
-                                const uint8_t* response2,
-                                const uint8_t* data_salt_11,
-                                const uint8_t* data_salt_12,
-                                const uint8_t* data_salt_21,
-                                const uint8_t* data_salt_22, uint8_t* dataencr1,
-                                uint8_t* dataencr2) {
-  uint8_t data1_master[MASTER_KEY_SIZE];
-  uint8_t data2_master[MASTER_KEY_SIZE];
-
-  if (PW_HASH(&data1_master, response1, strlen(response1), data_salt_11) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    return VE_CRYPTOERR;
+int vault_commit(struct vault_info* info) {
+  if (info == NULL) {
+    return VE_PARAMERR;
   }
 
-  if (PW_HASH(&data2_master, response2, strlen(response2), data_salt_21) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    return VE_CRYPTOERR;
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
   }
 
-  if (PW_HASH(dataencr1, &data1_master, MASTER_KEY_SIZE, data_salt_12) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    return VE_CRYPTOERR;
+  if (!info->in_txn) {
+    FPUTS("No transaction open\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_PARAMERR;
   }
 
-  if (PW_HASH(dataencr2, &data2_master, MASTER_KEY_SIZE, data_salt_22) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    return VE_CRYPTOERR;
+  result = internal_seal_file(info);
+  internal_txn_free(info);
+  if (!result && fdatasync(info->user_fd) < 0) {
+    result = VE_IOERR;
+  }
+  if (!result) {
+    internal_auto_compact(info);
   }
 
-  return VE_SUCCESS;
+  sodium_mprotect_noaccess(info);
+  return result;
 }
 
 /**
-   function update_key_from_recovery
+   function vault_abort
 
-   Given recovery responses, the location of a vault, and recovery data from the
-   server, decrypt the master key, create and add a new header to the vault with
-   the new password, and return the information necessary to update the server.
+   Ends the open write transaction without writing out what it queued. As
+   the key map, loc field and integrity state in memory already include the
+   queued changes, they are rebuilt from the file, which is verified again.
+   Anything written out before the abort, by a call that had to seal the
+   file during the transaction, stays in the vault.
 
-   Returns VE_SUCCESS upon decryption and creation of new values
-   VE_WRONGPASS is either of the responses is wrong
-   VE_CRYPTOERR if issues with crypto
-   VE_MEMERR if issues with locking/unlocking memory
-   VE_VOPEN if a vault is already open
-   VE_SYSCALL if there are issues with system calls
-   VE_EXIST if no vault exists with the name
-   VE_ACCESS if there is no access to the given vault
-   VE_FILE if the vault file is invalid
+   Returns VE_SUCCESS upon dropping the transaction
+   VE_PARAMERR if no transaction is open
+   VE_MEMERR if memory cannot be read
+   VE_VCLOSE if the vault is closed
+   VE_FILE if the file no longer verifies, in which case the vault is closed
  */
-int update_key_from_recovery(struct vault_info* info, const char* directory,
-                             const char* username, const uint8_t* response1,
-                             const uint8_t* response2, const uint8_t* recovery,
-                             const uint8_t* data_salt_1,
-                             const uint8_t* data_salt_2,
-                             const uint8_t* new_password,
-                             uint8_t* new_first_salt, uint8_t* new_second_salt,
-                             uint8_t* new_server_pass, uint8_t* new_header) {
-  if (directory == NULL || username == NULL || new_password == NULL ||
-      strnlen(directory, MAX_PATH_LEN + 1) > MAX_PATH_LEN ||
-      strnlen(username, MAX_USER_SIZE + 1) > MAX_USER_SIZE ||
-      strnlen(new_password, MAX_PASS_SIZE + 1) > MAX_PASS_SIZE) {
+int vault_abort(struct vault_info* info) {
+  if (info == NULL) {
     return VE_PARAMERR;
   }
 
-  uint8_t data1_master[MASTER_KEY_SIZE];
-  uint8_t data2_master[MASTER_KEY_SIZE];
-
-  if (PW_HASH(&data1_master, response1, strlen(response1), data_salt_1) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    return VE_CRYPTOERR;
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
   }
 
-  if (PW_HASH(&data2_master, response2, strlen(response2), data_salt_2) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    return VE_CRYPTOERR;
+  if (!info->in_txn) {
+    FPUTS("No transaction open\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_PARAMERR;
   }
 
-  if (sodium_mprotect_readwrite(info) < 0) {
-    FPUTS("Issues gaining access to memory\n", stderr);
-    return VE_MEMERR;
-  }
+  internal_txn_free(info);
+  sodium_memzero(&info->current_box, sizeof(struct vault_box));
+  internal_cache_clear(info);
+  internal_tree_free(info);
 
-  if (info->is_open) {
-    FPUTS("Already have a vault open\n", stderr);
+  struct vault_map* old_map = info->key_info;
+  if (internal_verify_file(info) || internal_create_key_map(info)) {
+    FPUTS("Vault did not verify after abort\n", stderr);
+    info->key_info = old_map;
     sodium_mprotect_noaccess(info);
-    return VE_VOPEN;
+    close_vault(info);
+    return VE_FILE;
   }
+  delete_map(old_map);
 
-  uint8_t intermediate_result[MASTER_KEY_SIZE + MAC_SIZE * 2 + NONCE_SIZE];
-  if (crypto_secretbox_open_easy(
-          (uint8_t*)&intermediate_result, recovery,
-          MASTER_KEY_SIZE + MAC_SIZE * 2,
-          recovery + MASTER_KEY_SIZE + 2 * MAC_SIZE + NONCE_SIZE,
-          (uint8_t*)&data2_master) < 0) {
-    FPUTS("Could not decrypt master key first time\n", stderr);
-    sodium_mprotect_noaccess(info);
-    return VE_WRONGPASS;
-  }
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
 
-  if (crypto_secretbox_open_easy(
-          (uint8_t*)&info->decrypted_master, (uint8_t*)&intermediate_result,
-          MASTER_KEY_SIZE + MAC_SIZE, recovery + MASTER_KEY_SIZE + 2 * MAC_SIZE,
-          (uint8_t*)&data1_master) < 0) {
-    FPUTS("Could not decrypt master key second time\n", stderr);
-    sodium_mprotect_noaccess(info);
-    return VE_WRONGPASS;
+/**
+   function place_open_value
+
+   Copies the current open value into the result buffer passed in, which is
+   assumed to be at least DATA_SIZE bytes.
+
+   Returns VE_SUCCESS upon copying val_len bytes
+   VE_MEMERR if the box cannot be read
+   VE_VCLOSE if the vault is closed
+ */
+int place_open_value(struct vault_info* info, char* result, int* len,
+                     char* type) {
+  int check;
+  if ((check = internal_initial_checks(info))) {
+    return check;
   }
 
-  // Check file hash to see if its exact
-  int max_size = strlen(directory) + strlen(username) + 10;
-  char* pathname = malloc(max_size);
-  if (snprintf(pathname, max_size, filename_pattern, directory, username) < 0) {
-    free(pathname);
-    return VE_SYSCALL;
+  memcpy(result, (char*)&info->current_box.value, info->current_box.val_len);
+  *len = info->current_box.val_len;
+  *type = info->current_box.type;
+  result[info->current_box.val_len] = 0;
+
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+// An entry to open in a batch, sorted by where it is in the file
+struct batch_entry {
+  struct entry_span span;
+  uint32_t index;
+};
+
+/**
+   function internal_open_run
+
+   Opens the entries of the batch from first up to but not including last,
+   which are sorted by where they are in the file, after reading all of them
+   at once into chunk, which holds BATCH_READ_SIZE bytes, unless they are
+   mapped. Each value is placed in buffer where values says, followed by a
+   terminator, and the result of each key is set.
+ */
+void internal_open_run(struct vault_info* info, struct batch_entry* first,
+                       struct batch_entry* last, char* buffer,
+                       struct vault_value* values, uint8_t* chunk) {
+  uint64_t start = first->span.start;
+  uint64_t end = start;
+  for (struct batch_entry* entry = first; entry < last; ++entry) {
+    uint64_t entry_end = entry->span.start + entry->span.len;
+    end = entry_end > end ? entry_end : end;
+  }
+
+  // Checking segments can map the file again, so it is done before the read
+  for (struct batch_entry* entry = first; entry < last; ++entry) {
+    if (internal_tree_check(info, entry->span.start, entry->span.len)) {
+      values[entry->index].result = VE_FILE;
+    }
   }
 
-  int open_results = open(pathname, O_RDWR | O_NOFOLLOW);
-  free(pathname);
-  if (open_results < 0) {
-    if (errno == ENOENT) {
-      return VE_EXIST;
-    } else if (errno == EACCES) {
-      return VE_ACCESS;
-    } else {
-      return VE_SYSCALL;
+  const uint8_t* run = internal_read_at(info, start, end - start, chunk);
+  for (struct batch_entry* entry = first; entry < last; ++entry) {
+    struct vault_value* value = values + entry->index;
+    const uint8_t* box = run + (entry->span.start - start);
+    uint32_t key_len =
+        entry->span.len - internal_entry_size(info->cipher, 0, value->len);
+    if (run == NULL) {
+      value->result = VE_IOERR;
+    } else if (value->result == VE_SUCCESS) {
+      value->type = box[ENTRY_HEADER_SIZE - 1];
+      value->result =
+          internal_open_entry(info, box, key_len, value->len,
+                              (uint8_t*)buffer + value->offset);
     }
+    buffer[value->offset + value->len] = 0;
   }
+}
 
-  if (flock(open_results, LOCK_EX | LOCK_NB) < 0) {
-    close(open_results);
-    FPUTS("Could not get file lock\n", stderr);
-    return VE_SYSCALL;
+/**
+   function open_keys
+
+   Decrypts the values of num_keys keys at once into buffer, which the caller
+   should keep in secure memory, such as from alloc_secure_buffer. The values
+   are packed one after another, each followed by a terminator, and values,
+   which has a place for each key, is filled in with where each value went,
+   its length and type, and whether it could be opened. The space the values
+   need is placed in needed, and if buffer_len is less than that nothing is
+   decrypted, so a first call with no buffer finds the size to allocate.
+
+   Unlike opening the keys one at a time, the vault info is only made
+   readable once for the whole batch, and the entries are read in the order
+   they are in the file, with entries close together read at once when they
+   are not mapped. The open value and the value cache are left as they were.
+
+   Returns VE_SUCCESS upon opening every key
+   VE_PARAMERR if keys, values or needed is NULL
+   VE_MEMERR if memory cannot be read or allocated
+   VE_VCLOSE if the vault is closed
+   VE_NOSPACE if the values need more than buffer_len bytes
+   Otherwise the result of the first key that could not be opened, which is
+   VE_PARAMERR if the key is too long, VE_KEYEXIST if it does not exist,
+   VE_IOERR or VE_FILE if its entry could not be read or checked, or
+   VE_CRYPTOERR if its value did not decrypt
+ */
+int open_keys(struct vault_info* info, const char** keys, uint32_t num_keys,
+              char* buffer, uint64_t buffer_len, struct vault_value* values,
+              uint64_t* needed) {
+  if (info == NULL || keys == NULL || values == NULL || needed == NULL) {
+    return VE_PARAMERR;
   }
 
-  info->user_fd = open_results;
-  uint8_t file_hash[HASH_SIZE];
-  char current_hash[HASH_SIZE];
-  internal_hash_file(info, (uint8_t*)&file_hash, HASH_SIZE);
-  READ(open_results, &current_hash, HASH_SIZE, info);
-  if (memcmp((const char*)&file_hash, (const char*)&current_hash, HASH_SIZE) !=
-      0) {
-    FPUTS("FILE HASHES DO NOT MATCH\n", stderr);
-    sodium_mprotect_noaccess(info);
-    return VE_FILE;
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
   }
 
-  // Update the header
-  randombytes_buf(new_first_salt, SALT_SIZE);
-  if (PW_HASH(info->derived_key, new_password, strlen(new_password),
-              new_first_salt) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
+  struct batch_entry* entries = malloc(num_keys * sizeof(struct batch_entry));
+  uint8_t* chunk = malloc(BATCH_READ_SIZE);
+  if ((entries == NULL && num_keys > 0) || chunk == NULL) {
+    variadic_free(2, entries, chunk);
     sodium_mprotect_noaccess(info);
-    return VE_CRYPTOERR;
+    return VE_MEMERR;
   }
 
-  uint8_t encrypted_master[MASTER_KEY_SIZE + MAC_SIZE];
-  uint8_t master_nonce[NONCE_SIZE];
-  randombytes_buf(master_nonce, sizeof master_nonce);
-  if (crypto_secretbox_easy(encrypted_master, info->decrypted_master,
-                            MASTER_KEY_SIZE, master_nonce,
-                            info->derived_key) < 0) {
-    FPUTS("Could not encrypt master key\n", stderr);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
+  uint32_t num_entries = 0;
+  *needed = 0;
+  for (uint32_t i = 0; i < num_keys; ++i) {
+    struct vault_value* value = values + i;
+    const struct key_info* current_info = NULL;
+    value->offset = *needed;
+    value->len = 0;
+    value->type = 0;
+    value->result = VE_SUCCESS;
+    if (keys[i] == NULL || strnlen(keys[i], BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
+      value->result = VE_PARAMERR;
+    } else if (!(current_info = get_info(info->key_info, keys[i]))) {
+      value->result = VE_KEYEXIST;
     }
-    return VE_CRYPTOERR;
-  }
 
-  lseek(info->user_fd, 8, SEEK_SET);
-  WRITE(info->user_fd, new_first_salt, crypto_pwhash_SALTBYTES, info);
-  WRITE(info->user_fd, &encrypted_master, MASTER_KEY_SIZE + MAC_SIZE, info);
-  WRITE(info->user_fd, &master_nonce, NONCE_SIZE, info);
+    if (current_info != NULL) {
+      const uint32_t* loc_data =
+          LOC_SLOT(info, info->locs,
+                   (current_info->inode_loc - HEADER_SIZE) / info->loc_size);
+      if (loc_data[2] >= BOX_KEY_SIZE || loc_data[3] > DATA_SIZE) {
+        value->result = VE_FILE;
+      } else {
+        value->len = loc_data[3];
+        entries[num_entries].span.start = internal_slot_loc(info, loc_data);
+        entries[num_entries].span.len =
+            internal_entry_size(info->cipher, loc_data[2], loc_data[3]);
+        entries[num_entries++].index = i;
+      }
+    }
+    *needed += value->len + 1;
+  }
 
-  internal_hash_file(info, (uint8_t*)&file_hash, HASH_SIZE);
-  lseek(info->user_fd, -1 * HASH_SIZE, SEEK_END);
-  if (write(info->user_fd, &file_hash, HASH_SIZE) < 0) {
-    FPUTS("Could not write hash to disk\n", stderr);
+  if (*needed > buffer_len || (buffer == NULL && num_keys > 0)) {
+    variadic_free(2, entries, chunk);
     sodium_mprotect_noaccess(info);
-    return VE_IOERR;
+    return VE_NOSPACE;
+  }
+
+  for (uint32_t i = 0; i < num_keys; ++i) {
+    buffer[values[i].offset] = 0;
+  }
+
+  // Entries close enough together are read as one run, which never crosses
+  // into the entries held by a write transaction
+  qsort(entries, num_entries, sizeof(struct batch_entry),
+        internal_compare_spans);
+  uint32_t first = 0;
+  while (first < num_entries) {
+    uint64_t start = entries[first].span.start;
+    uint64_t end = start + entries[first].span.len;
+    int in_txn = info->txn_len > 0 && start >= info->txn_start;
+    uint32_t last = first + 1;
+    for (; last < num_entries; ++last) {
+      uint64_t next_start = entries[last].span.start;
+      uint64_t next_end = next_start + entries[last].span.len;
+      if (next_start > end + BATCH_READ_GAP ||
+          next_end - start > BATCH_READ_SIZE ||
+          in_txn != (info->txn_len > 0 && next_start >= info->txn_start)) {
+        break;
+      }
+      end = next_end > end ? next_end : end;
+    }
+    internal_open_run(info, entries + first, entries + last, buffer, values,
+                      chunk);
+    first = last;
   }
+  variadic_free(2, entries, chunk);
 
-  internal_create_key_map(info);
+  for (uint32_t i = 0; i < num_keys && !result; ++i) {
+    result = values[i].result;
+  }
+  sodium_mprotect_noaccess(info);
+  return result;
+}
 
-  info->current_box.key[0] = 0;
-  info->is_open = 1;
+/**
+   function alloc_secure_buffer
 
-  // Create new result for the server w/ header and salt and password
+   Allocates len bytes of secure memory, which is locked into memory and
+   guarded, for callers that do not have their own, such as to hold the
+   values from open_keys.
 
-  lseek(info->user_fd, 0, SEEK_SET);
-  READ(info->user_fd, new_header, HEADER_SIZE - 4, info);
+   Returns a pointer to the memory, or NULL if it could not be allocated
+ */
+char* alloc_secure_buffer(uint64_t len) {
+  if (sodium_init() < 0) {
+    return NULL;
+  }
+  return sodium_malloc(len > 0 ? len : 1);
+}
 
-  randombytes_buf(new_second_salt, SALT_SIZE);
-  if (PW_HASH(new_server_pass, info->derived_key, MASTER_KEY_SIZE,
-              new_second_salt) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
+/**
+   function free_secure_buffer
+
+   Wipes and frees memory from alloc_secure_buffer.
+ */
+void free_secure_buffer(char* buffer) { sodium_free(buffer); }
+
+// Bytes of the keyed hash the audit compares passwords by
+#define AUDIT_HASH_SIZE 16
+// Marks an audited value that is not a password the audit can check
+#define AUDIT_SKIPPED 0xff
+
+// Rows of a keyboard, unshifted and shifted, for finding keys next to each
+// other, as in PasswordVerifier of the application
+const char* keyboard_rows[8] = {
+    "`1234567890-=", "~!@#$%^&*()_+", "qwertyuiop[]\\", "QWERTYUIOP{}|",
+    "asdfghjkl;'",   "ASDFGHJKL:\"",  "zxcvbnm,./",     "ZXCVBNM<>?"};
+
+/**
+   function internal_keyboard_place
+
+   Finds where character is on the keyboard, placing its column in column.
+
+   Returns the row, counting shifted keys as the same row, or -1 if the
+   character is not on the keyboard
+ */
+int internal_keyboard_place(char character, int* column) {
+  for (int row = 0; row < 8 && character != 0; ++row) {
+    const char* place = strchr(keyboard_rows[row], character);
+    if (place != NULL) {
+      *column = place - keyboard_rows[row];
+      return row / 2;
     }
-    return VE_CRYPTOERR;
   }
+  return -1;
+}
 
-  if (sodium_mprotect_noaccess(info) < 0) {
-    FPUTS("Issues preventing access to memory\n", stderr);
+/**
+   function internal_password_weaknesses
+
+   Checks a password of len bytes against the rules the application gives
+   when a password is chosen: its length, how many classes of character it
+   mixes, whether its digits are interleaved with the rest, how many of its
+   characters are unique, and how much of it is keys next to each other.
+
+   Returns the AUDIT_ flags of the checks the password failed
+ */
+uint8_t internal_password_weaknesses(const char* password, uint32_t len) {
+  uint8_t classes[5] = {0};
+  uint8_t seen[256] = {0};
+  uint32_t unique = 0;
+  uint32_t digit_runs = 0;
+  uint32_t adjacent = 0;
+  int last_row = -1;
+  int last_column = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    uint8_t character = password[i];
+    int is_digit = character >= '0' && character <= '9';
+    classes[character >= 128                       ? 4
+            : is_digit                             ? 0
+            : character >= 'a' && character <= 'z' ? 1
+            : character >= 'A' && character <= 'Z' ? 2
+                                                   : 3] = 1;
+    unique += !seen[character];
+    seen[character] = 1;
+    if (is_digit &&
+        (i == 0 || password[i - 1] < '0' || password[i - 1] > '9')) {
+      digit_runs++;
+    }
+
+    int column = 0;
+    int row = internal_keyboard_place(character, &column);
+    if (row >= 0 && row == last_row &&
+        (column == last_column + 1 || column == last_column - 1)) {
+      adjacent++;
+    }
+    last_row = row;
+    last_column = column;
   }
 
-  FPUTS("Changed vault password from recovery\n", stderr);
-  return VE_SUCCESS;
+  uint8_t weaknesses = 0;
+  if (len < AUDIT_MIN_LENGTH) {
+    weaknesses |= AUDIT_SHORT;
+  }
+  if (classes[0] + classes[1] + classes[2] + classes[3] + classes[4] < 3) {
+    weaknesses |= AUDIT_FEW_CLASSES;
+  }
+  if (digit_runs <= 1) {
+    weaknesses |= AUDIT_NOT_INTERLEAVED;
+  }
+  if (unique * 2 <= len) {
+    weaknesses |= AUDIT_REPEATED;
+  }
+  if (len > 1 && adjacent * 2 >= len - 1) {
+    weaknesses |= AUDIT_KEYBOARD;
+  }
+  return weaknesses;
 }
 
 /**
-   Vault modification functions
+   audit_hash - the keyed hash of a password, with which audited key it is
+   the password of, so that equal passwords can be sorted next to each other
+ */
+struct audit_hash {
+  uint8_t hash[AUDIT_HASH_SIZE];
+  uint32_t item;
+};
 
-   The following series of functions are used to directly modify the vault file.
-   As the vault is designed as append-only, that has a garbage collection phase
-   to remove unused data and condense its size, adding and deleting are quick
-   until the loc_data field runs out of space.
+/**
+   audit_secrets - the secure memory an audit decrypts values into, one
+   value for each worker, and the key of the hashes it compares them by
  */
+struct audit_secrets {
+  uint8_t hash_key[crypto_generichash_KEYBYTES];
+  uint8_t values[MAX_WORKERS][DATA_SIZE];
+};
+
+struct audit_job {
+  const uint32_t* slots;
+  struct audit_hash* hashes;
+  uint8_t* weaknesses;
+  struct audit_secrets* secrets;
+};
+
+int internal_compare_audit_hashes(const void* first, const void* second) {
+  const struct audit_hash* first_hash = first;
+  const struct audit_hash* second_hash = second;
+  int order = memcmp(first_hash->hash, second_hash->hash, AUDIT_HASH_SIZE);
+  return order ? order
+               : (first_hash->item > second_hash->item) -
+                     (first_hash->item < second_hash->item);
+}
 
 /**
-   function change_password
+   function internal_audit_worker
+
+   Decrypts the value of one audited key into the secure memory of the
+   worker, takes the password out of it, hashes it with the key of the audit
+   and checks its strength, and then wipes the value. Values that are not
+   laid out as their type says are marked AUDIT_SKIPPED. The entries are
+   expected to have been checked against the tree of Merkle vaults, and to
+   be mapped if the file is, so that reading them never maps the file again.
+
+   Returns VE_SUCCESS if the value was audited or skipped
+   VE_FILE if its loc slot is invalid
+   VE_IOERR if its entry could not be read
+   VE_CRYPTOERR if its value did not decrypt
+ */
+int internal_audit_worker(struct worker_job* job, uint32_t worker,
+                          uint32_t item) {
+  struct vault_info* info = job->info;
+  struct audit_job* data = job->data;
+  const uint32_t* loc_data = LOC_SLOT(info, info->locs, data->slots[item]);
+  uint32_t key_len = loc_data[2];
+  uint32_t val_len = loc_data[3];
+  if (key_len >= BOX_KEY_SIZE || val_len > DATA_SIZE) {
+    return VE_FILE;
+  }
 
-   Function used to change the password of the vault by decrypting the current
-   vault header to ensure the provided password is correct, and then
-   reencrypting it with the new password and salts/nonces. Updating the server
-   must be done with a separate call with the new password information.
+  uint8_t entry_buffer[MAX_ENTRY_SIZE];
+  const uint8_t* box = internal_read_at(
+      info, internal_slot_loc(info, loc_data),
+      internal_entry_size(info->cipher, key_len, val_len), entry_buffer);
+  uint8_t* value = data->secrets->values[worker];
+  if (box == NULL) {
+    return VE_IOERR;
+  }
+  int result = internal_open_entry(info, box, key_len, val_len, value);
+  if (result) {
+    return result;
+  }
 
-   Returns VE_SUCCESS upon changing the password
-   VE_PARAMERR if either password is too long
-   VE_MEMERR if there are issues with memory
-   VE_CRYPTOERR if there are issues with hashing or encryption
-   VE_IOERR if there are issues communicating with the file
-   VE_WRONGPASS if the old password is incorrect
+  const char* password = (const char*)value;
+  uint32_t len = strnlen(password, val_len);
+  if (box[ENTRY_HEADER_SIZE - 1] == TYPE_CREDENTIAL) {
+    int32_t user_len = -1;
+    if (val_len >= sizeof(int32_t)) {
+      memcpy(&user_len, value, sizeof(int32_t));
+    }
+    if (user_len < 0 || (uint32_t)user_len > val_len - sizeof(int32_t)) {
+      data->weaknesses[item] = AUDIT_SKIPPED;
+      sodium_memzero(value, val_len);
+      return VE_SUCCESS;
+    }
+    password += sizeof(int32_t) + user_len;
+    len = val_len - sizeof(int32_t) - user_len;
+  }
+
+  data->hashes[item].item = item;
+  data->weaknesses[item] = internal_password_weaknesses(password, len);
+  result = crypto_generichash(data->hashes[item].hash, AUDIT_HASH_SIZE,
+                              (const uint8_t*)password, len,
+                              data->secrets->hash_key,
+                              crypto_generichash_KEYBYTES) < 0
+               ? VE_CRYPTOERR
+               : VE_SUCCESS;
+  sodium_memzero(value, val_len);
+  return result;
+}
+
+/**
+   function audit_vault
+
+   Checks every password in the open vault for reuse and strength, without
+   any of them leaving the library. Values of TYPE_CREDENTIAL have their
+   password taken from after the username, and values of TYPE_PASSWORD are
+   the password, while values of other types are skipped. The values are
+   decrypted across the workers into secure memory, one at a time for each
+   worker, and wiped once the password is scored and hashed with a key made
+   for the audit, so that reused passwords are found by comparing hashes
+   rather than the passwords. Merkle vaults check the whole file against the
+   tree first, across the workers.
+
+   The keys failing any strength check or sharing their password are placed
+   in results in key order, up to max_results of them, and how many there
+   are in num_results, so a larger results can be passed if it was too
+   small. Each has its score, the checks it failed, and a group numbered in
+   key order shared with the other keys of the same password. The totals are
+   placed in report.
+
+   Returns VE_SUCCESS upon auditing the vault
+   VE_PARAMERR if num_results or report is NULL
+   VE_MEMERR if memory cannot be read or allocated
+   VE_VCLOSE if the vault is closed
+   VE_FILE if the file does not match its tree, or a loc slot is invalid
+   VE_IOERR if an entry could not be read
+   VE_CRYPTOERR if a value did not decrypt
  */
-int change_password(struct vault_info* info, const char* old_password,
-                    const char* new_password) {
-  if (strnlen(old_password, MAX_PASS_SIZE + 1) > MAX_PASS_SIZE ||
-      strnlen(new_password, MAX_PASS_SIZE + 1) > MAX_PASS_SIZE) {
+int audit_vault(struct vault_info* info, struct audit_result* results,
+                uint32_t max_results, uint32_t* num_results,
+                struct audit_report* report) {
+  if (info == NULL || num_results == NULL || report == NULL ||
+      (results == NULL && max_results)) {
     return VE_PARAMERR;
   }
 
@@ -1567,420 +6601,761 @@ int change_password(struct vault_info* info, const char* old_password,
     return result;
   }
 
-  int open_info_length = SALT_SIZE + MAC_SIZE + MASTER_KEY_SIZE + NONCE_SIZE;
-  uint8_t open_info[open_info_length];
-  if (lseek(info->user_fd, 8, SEEK_SET) < 0 ||
-      read(info->user_fd, open_info, open_info_length) < 0) {
+  uint32_t first;
+  uint32_t count;
+  if (find_range(info->key_info, NULL, NULL, &first, &count)) {
+    FPUTS("Could not build the key index\n", stderr);
     sodium_mprotect_noaccess(info);
-    return VE_IOERR;
+    return VE_MEMERR;
   }
 
-  uint8_t keypass[MASTER_KEY_SIZE];
-  if (PW_HASH((uint8_t*)&keypass, old_password, strlen(old_password),
-              open_info) < 0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
+  const char** keys = malloc((count + 1) * sizeof(char*));
+  uint32_t* slots = malloc((count + 1) * sizeof(uint32_t));
+  struct audit_hash* hashes = malloc((count + 1) * sizeof(struct audit_hash));
+  uint8_t* weaknesses = malloc(count + 1);
+  uint32_t* groups = malloc((count + 1) * sizeof(uint32_t));
+  struct audit_secrets* secrets = sodium_malloc(sizeof(struct audit_secrets));
+  if (keys == NULL || slots == NULL || hashes == NULL || weaknesses == NULL ||
+      groups == NULL || secrets == NULL) {
+    variadic_free(5, keys, slots, hashes, weaknesses, groups);
+    if (secrets != NULL) {
+      sodium_free(secrets);
     }
-    return VE_CRYPTOERR;
-  }
-
-  uint8_t master[MASTER_KEY_SIZE];
-  if (crypto_secretbox_open_easy(
-          (uint8_t*)&master, open_info + SALT_SIZE, MASTER_KEY_SIZE + MAC_SIZE,
-          open_info + open_info_length - NONCE_SIZE, (uint8_t*)&keypass) < 0) {
-    FPUTS("Could not decrypt master key\n", stderr);
     sodium_mprotect_noaccess(info);
-    return VE_WRONGPASS;
+    return VE_MEMERR;
   }
 
-  if (memcmp((uint8_t*)master, &info->decrypted_master, MASTER_KEY_SIZE) != 0) {
-    FPUTS("Wrong password\n", stderr);
-    sodium_mprotect_noaccess(info);
-    return VE_WRONGPASS;
+  memset(report, 0, sizeof(struct audit_report));
+  uint32_t items = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    const struct key_info* key_info;
+    const char* key = ordered_key(info->key_info, first + i, ORDER_KEY,
+                                  &key_info);
+    if (key_info->type != TYPE_CREDENTIAL && key_info->type != TYPE_PASSWORD) {
+      report->skipped++;
+      continue;
+    }
+    keys[items] = key;
+    slots[items++] = (key_info->inode_loc - HEADER_SIZE) / info->loc_size;
   }
-  sodium_memzero(&master, MASTER_KEY_SIZE);
-  sodium_memzero(&keypass, MASTER_KEY_SIZE);
 
-  uint8_t salt[SALT_SIZE];
-  randombytes_buf(salt, sizeof salt);
-  if (PW_HASH(info->derived_key, new_password, strlen(new_password), salt) <
-      0) {
-    FPUTS("Could not dervie password key\n", stderr);
-    sodium_mprotect_noaccess(info);
-    return VE_CRYPTOERR;
+  // Workers must not map the file again, nor check segments themselves
+  uint64_t data_end = info->txn_len > 0 ? info->txn_start : info->data_end;
+  if (info->map != NULL && info->map_len < data_end) {
+    internal_map_file(info, data_end);
   }
-
-  uint8_t encrypted_master[MASTER_KEY_SIZE + MAC_SIZE];
-  uint8_t master_nonce[NONCE_SIZE];
-  randombytes_buf(master_nonce, sizeof master_nonce);
-  if (crypto_secretbox_easy(encrypted_master, info->decrypted_master,
-                            MASTER_KEY_SIZE, master_nonce,
-                            info->derived_key) < 0) {
-    FPUTS("Could not encrypt master key\n", stderr);
-    sodium_mprotect_noaccess(info);
-    return VE_CRYPTOERR;
+  if (info->integrity == INTEGRITY_MERKLE && items > 0) {
+    result = internal_tree_check_all(info);
   }
 
-  lseek(info->user_fd, 8, SEEK_SET);
-  WRITE(info->user_fd, &salt, crypto_pwhash_SALTBYTES, info);
-  WRITE(info->user_fd, &encrypted_master, MASTER_KEY_SIZE + MAC_SIZE, info);
-  WRITE(info->user_fd, &master_nonce, NONCE_SIZE, info);
+  randombytes_buf(secrets->hash_key, crypto_generichash_KEYBYTES);
+  struct audit_job data = {slots, hashes, weaknesses, secrets};
+  struct worker_job job = {info, internal_audit_worker, &data, items, 0,
+                           VE_SUCCESS};
+  if (!result) {
+    result = internal_run_workers(&job, info->workers);
+  }
+  sodium_free(secrets);
 
-  uint8_t file_hash[HASH_SIZE];
-  internal_hash_file(info, (uint8_t*)&file_hash, HASH_SIZE);
-  lseek(info->user_fd, -1 * HASH_SIZE, SEEK_END);
-  if (write(info->user_fd, &file_hash, HASH_SIZE) < 0) {
-    FPUTS("Could not write hash to disk\n", stderr);
-    sodium_mprotect_noaccess(info);
-    return VE_IOERR;
+  // Equal passwords sort next to each other, and each run of them is
+  // numbered by the first of its keys in key order
+  uint32_t hashed = 0;
+  for (uint32_t i = 0; i < items && !result; ++i) {
+    groups[i] = 0;
+    if (weaknesses[i] != AUDIT_SKIPPED) {
+      hashes[hashed++] = hashes[i];
+    }
+  }
+  qsort(hashes, hashed, sizeof(struct audit_hash),
+        internal_compare_audit_hashes);
+  for (uint32_t i = 0; i < hashed && !result; ++i) {
+    uint32_t run = i;
+    while (run + 1 < hashed && memcmp(hashes[run + 1].hash, hashes[i].hash,
+                                      AUDIT_HASH_SIZE) == 0) {
+      run++;
+    }
+    for (uint32_t j = i; j <= run && run > i; ++j) {
+      groups[hashes[j].item] = hashes[i].item + 1;
+    }
+    i = run;
   }
 
-  if (sodium_mprotect_noaccess(info) < 0) {
-    FPUTS("Issues preventing access to memory\n", stderr);
+  uint32_t found = 0;
+  for (uint32_t i = 0; i < items && !result; ++i) {
+    if (weaknesses[i] == AUDIT_SKIPPED) {
+      report->skipped++;
+      continue;
+    }
+    report->audited++;
+    report->weak += weaknesses[i] != 0;
+    report->reused += groups[i] != 0;
+    if (groups[i] == i + 1) {
+      groups[i] = ++report->groups;
+    } else if (groups[i] != 0) {
+      groups[i] = groups[groups[i] - 1];
+    }
+    if (weaknesses[i] == 0 && groups[i] == 0) {
+      continue;
+    }
+
+    if (found < max_results) {
+      uint8_t failed = 0;
+      for (uint8_t flag = AUDIT_SHORT; flag <= AUDIT_KEYBOARD; flag <<= 1) {
+        failed += (weaknesses[i] & flag) != 0;
+      }
+      results[found].key = keys[i];
+      results[found].group = groups[i];
+      results[found].score = AUDIT_CHECKS - failed;
+      results[found].weaknesses = weaknesses[i];
+    }
+    found++;
   }
+  *num_results = found;
 
-  FPUTS("Changed vault password\n", stderr);
-  return VE_SUCCESS;
+  variadic_free(5, keys, slots, hashes, weaknesses, groups);
+  sodium_mprotect_noaccess(info);
+  return result;
 }
 
 /**
-   function add_key
+   Rekeying
+
+   rekey_vault replaces the master key of the vault, which change_password
+   leaves as it is, by streaming the vault into a new file next to it with
+   every value encrypted under a new master key. The new file is laid out
+   the way a condense lays it out, with the active entries packed in order
+   after a loc field sized with internal_loc_target, so where every new
+   entry goes is known before any of them is sealed. The entries are worked
+   on in batches of up to REKEY_BATCH_SIZE bytes of the new file. The
+   workers each open entries of the batch from the old file into secure
+   memory of their own, seal them again with the new key into the batch
+   buffer, and hash them into a mac of their own for the new file, after
+   which the batch is written with a single pwrite. Apart from the loc field,
+   memory use is bounded by the batch however large the vault is.
+
+   Every REKEY_SYNC_BATCHES batches the new file is synced, and a checkpoint
+   of how many entries are written and the mac of them is written and synced
+   where the trailer of the new file goes. The checkpoint is tagged with the
+   new master key along with a digest of the vault being copied, and the new
+   master key is wrapped in the header of the new file with the key derived
+   from the password, like the one of the vault. A rekey that is interrupted
+   or fails leaves its new file behind, and the next rekey of the vault with
+   the same password and cipher suite picks up from the last checkpoint, as
+   long as the vault has not changed since. The entries it picked up are
+   read back and checked against the mac before the new file is used.
+ */
 
-   Function to add a new key to the vault. Validates that a current vault is
-   opened and that the key does not already exist in the vault, and then
-   attempts to append the key to the vault. If the key cannot be appended
-   because there is no space in the file, the file is extended and the
-   appending retried.
+/**
+   rekey_job - the state of a rekey shared with its workers. The entries of
+   the new file are numbered in order, and each has the old slot it is copied
+   from in sources and its new slot in new_locs. The target is a clone of
+   the vault info with the new master key and cipher suite, set up for the
+   new file. Each batch starts at the entry first, which is at batch_at in
+   the new file.
+ */
+struct rekey_job {
+  struct vault_info* target;
+  uint32_t* sources;
+  uint32_t* new_locs;
+  uint8_t* batch;
+  uint8_t (*values)[DATA_SIZE];
+  uint64_t batch_at;
+  uint32_t first;
+  uint8_t macs[MAX_WORKERS][HASH_SIZE];
+};
 
-   Returns VE_SUCCESS upon adding the new entry
-   VE_PARAMERR if the key or value is too long
-   VE_KEYEXIST if the key already exists in the file
-   VE_MEMERR if there are issues reading memory
-   VE_CLOSE if the vault is currently closed
-   VE_CRYPTOERR if there are issues with libsodium
-   VE_IOERR if there are issues writing to disk
+/**
+   function internal_rekey_free
+
+   Frees the memory of a rekey, including its target.
  */
-int add_key(struct vault_info* info, uint8_t type, const char* key,
-            const char* value, uint64_t m_time, uint32_t len) {
-  if (info == NULL || key == NULL || value == NULL || len > DATA_SIZE ||
-      strnlen(key, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
-    return VE_PARAMERR;
+void internal_rekey_free(struct rekey_job* data) {
+  variadic_free(3, data->sources, data->new_locs, data->batch);
+  sodium_free(data->values);
+  sodium_free(data->target);
+}
+
+/**
+   function internal_rekey_worker
+
+   Opens one entry of a batch of a rekey from the old file into the secure
+   memory of the worker, seals it again with the master key and cipher suite
+   of the target into its place in the batch, and XORs the hash of it as a
+   region of the new file into the mac of the worker. The value is wiped
+   straight after. Like the audit, the entries are expected to have been
+   checked against the tree of Merkle vaults, and to be mapped if the file
+   is, so that reading them never maps the file again.
+
+   Returns VE_SUCCESS if the entry was sealed again
+   VE_IOERR if the entry could not be read
+   VE_CRYPTOERR if the entry did not open, or could not be sealed or hashed
+ */
+int internal_rekey_worker(struct worker_job* job, uint32_t worker,
+                          uint32_t item) {
+  struct vault_info* info = job->info;
+  struct rekey_job* data = job->data;
+  uint32_t entry = data->first + item;
+  const uint32_t* loc_data = LOC_SLOT(info, info->locs, data->sources[entry]);
+  const uint32_t* new_loc =
+      data->new_locs + (size_t)entry * (WIDE_LOC_SIZE / 4);
+  uint32_t key_len = loc_data[2];
+  uint32_t val_len = loc_data[3];
+  uint64_t new_at = internal_slot_loc(data->target, new_loc);
+  uint32_t new_len =
+      internal_entry_size(data->target->cipher, key_len, val_len);
+  uint8_t* sealed = data->batch + (new_at - data->batch_at);
+
+  uint8_t entry_buffer[MAX_ENTRY_SIZE];
+  const uint8_t* box = internal_read_at(
+      info, internal_slot_loc(info, loc_data),
+      internal_entry_size(info->cipher, key_len, val_len), entry_buffer);
+  if (box == NULL) {
+    return VE_IOERR;
   }
 
-  int result;
-  if ((result = internal_initial_checks(info))) {
-    return result;
+  uint8_t* value = data->values[worker];
+  int result = internal_open_entry(info, box, key_len, val_len, value);
+  if (!result) {
+    memcpy(sealed, box, ENTRY_HEADER_SIZE + key_len);
+    result = internal_seal_entry(data->target, sealed, key_len, value,
+                                 val_len);
+  }
+  sodium_memzero(value, val_len);
+  if (result) {
+    return VE_CRYPTOERR;
+  }
+
+  crypto_generichash_state state;
+  uint8_t region_hash[HASH_SIZE];
+  if (internal_region_begin(data->target, &state, REGION_ENTRY, new_at) ||
+      crypto_generichash_update(&state, sealed, new_len) < 0 ||
+      crypto_generichash_final(&state, region_hash, HASH_SIZE) < 0) {
+    return VE_CRYPTOERR;
+  }
+  for (int i = 0; i < HASH_SIZE; ++i) {
+    data->macs[worker][i] ^= region_hash[i];
   }
+  return VE_SUCCESS;
+}
+
+/**
+   function internal_rekey_plan
+
+   Lays out the new file of a rekey in the new loc field of new_loc_len
+   slots, which must be zeroed, the same way internal_condense_copy does but
+   with the entry sizes of the cipher suite of the target. The number of
+   entries is placed in count, and the end of the new data section in the
+   data_end of the target. The key directories are copied from the old
+   slots, or for files from before the directory read from the start of
+   each entry.
+
+   Returns VE_SUCCESS if the new file was laid out
+   VE_FILE if the loc field points outside of the data section, or an entry
+   does not match the tree
+   VE_IOERR if the start of an entry could not be read
+ */
+int internal_rekey_plan(struct vault_info* info, struct rekey_job* data,
+                        uint32_t new_loc_len, uint32_t* count) {
+  struct vault_info* target = data->target;
+  uint8_t entry_buffer[ENTRY_HEADER_SIZE + BOX_KEY_SIZE];
+  uint64_t old_data_offset = HEADER_SIZE + info->loc_len * info->loc_size;
+  uint64_t next_entry = HEADER_SIZE + new_loc_len * WIDE_LOC_SIZE;
+  uint32_t index = 0;
+  for (uint32_t i = 0; i < info->loc_len; ++i) {
+    const uint32_t* loc_data = LOC_SLOT(info, info->locs, i);
+    if (loc_data[0] != STATE_ACTIVE) {
+      continue;
+    }
+
+    uint32_t entry_len =
+        internal_entry_size(info->cipher, loc_data[2], loc_data[3]);
+    uint64_t file_loc = internal_slot_loc(info, loc_data);
+    if (index == new_loc_len || loc_data[2] >= BOX_KEY_SIZE ||
+        loc_data[3] > DATA_SIZE || file_loc < old_data_offset ||
+        file_loc > info->data_end || entry_len > info->data_end - file_loc) {
+      FPUTS("Loc data points outside of the file\n", stderr);
+      return VE_FILE;
+    }
 
-  if (get_info(info->key_info, key)) {
-    FPUTS("Key already in map; use update\n", stderr);
-    sodium_mprotect_noaccess(info);
-    return VE_KEYEXIST;
-  }
+    const uint8_t* directory = (const uint8_t*)loc_data + LOC_SIZE;
+    if (info->loc_size == LOC_SIZE) {
+      uint32_t len = ENTRY_HEADER_SIZE + loc_data[2];
+      directory = internal_read_at(info, file_loc, len, entry_buffer);
+      if (directory == NULL) {
+        return VE_IOERR;
+      }
+      if (internal_tree_check(info, file_loc, len)) {
+        return VE_FILE;
+      }
+    }
 
-  int res = internal_append_key(info, type, key, value, m_time, len);
-  if (res == VE_NOSPACE) {
-    internal_condense_file(info);
-    sodium_mprotect_readwrite(info);
-    return internal_append_key(info, type, key, value, m_time, len);
+    uint32_t* slot = data->new_locs + (size_t)index * (WIDE_LOC_SIZE / 4);
+    slot[0] = STATE_ACTIVE;
+    internal_set_slot_loc(target, slot, next_entry);
+    slot[2] = loc_data[2];
+    slot[3] = loc_data[3];
+    memcpy(slot + LOC_SIZE / 4, directory, ENTRY_HEADER_SIZE + loc_data[2]);
+    data->sources[index++] = i;
+    next_entry += internal_entry_size(target->cipher, loc_data[2], loc_data[3]);
   }
 
-  return res;
+  *count = index;
+  target->data_end = next_entry;
+  return VE_SUCCESS;
 }
 
 /**
-   function get_vault_keys
+   function internal_rekey_source
 
-   Fills in the results field with the keys in the vault. Take the keys returned
-   by the hash map and copy them into the results field, assuming that the
-   results field has been correctly initialized to have buffers that are at
-   least BOX_KEY_SIZE. The returned values from the hashmap are freed and the
-   function returns.
+   Digests what a rekey copies from the vault, the loc field and the end of
+   the data section along with the cipher suite, keyed with the master key
+   of the vault, into source, expected to be HASH_SIZE bytes. As the vault is
+   append only, and values are only wiped along with a change to their slot,
+   the entries of the vault are the same for as long as the digest is.
 
-   Returns VE_SUCCESS on filling in the results field
-   VE_MEMERR if memory cannot be made read/write
-   VE_CLOSE if there is no vault opened
+   Returns VE_SUCCESS if the vault was digested
+   VE_CRYPTOERR if the hashing fails
  */
-int get_vault_keys(struct vault_info* info, char** results) {
-  int check;
-  if ((check = internal_initial_checks(info))) {
-    return check;
+int internal_rekey_source(struct vault_info* info, uint8_t* source) {
+  crypto_generichash_state state;
+  if (internal_region_begin(info, &state, REGION_REKEY, info->data_end) ||
+      crypto_generichash_update(&state, &info->cipher, 1) < 0 ||
+      crypto_generichash_update(&state, (const uint8_t*)info->locs,
+                                (uint64_t)info->loc_len * info->loc_size) <
+          0 ||
+      crypto_generichash_final(&state, source, HASH_SIZE) < 0) {
+    return VE_CRYPTOERR;
   }
+  return VE_SUCCESS;
+}
 
-  char** result = get_keys(info->key_info);
-  uint32_t keynum = num_keys(info->key_info);
-  for (int i = 0; i < keynum; ++i) {
-    strcpy(results[i], result[i]);
-    free(result[i]);
-  }
-  free(result);
+/**
+   function internal_rekey_tag
 
-  sodium_mprotect_noaccess(info);
+   Computes the tag of a rekey checkpoint, which is the number of entries
+   done followed by the mac of them, over both and the digest of the vault
+   being copied, keyed with the new master key of the target. The tag is
+   placed in tag, expected to be HASH_SIZE bytes.
+
+   Returns VE_SUCCESS if the tag was computed
+   VE_CRYPTOERR if the hashing fails
+ */
+int internal_rekey_tag(struct vault_info* target, const uint8_t* source,
+                       const uint8_t* checkpoint, uint8_t* tag) {
+  uint64_t done;
+  memcpy(&done, checkpoint, sizeof(uint64_t));
+  crypto_generichash_state state;
+  if (internal_region_begin(target, &state, REGION_REKEY, done) ||
+      crypto_generichash_update(&state, checkpoint + sizeof(uint64_t),
+                                HASH_SIZE) < 0 ||
+      crypto_generichash_update(&state, source, HASH_SIZE) < 0 ||
+      crypto_generichash_final(&state, tag, HASH_SIZE) < 0) {
+    return VE_CRYPTOERR;
+  }
   return VE_SUCCESS;
 }
 
 /**
-   function num_vault_keys
+   function internal_rekey_checkpoint
 
-   Returns the number of keys in the vault, kept as the hash table size
+   Syncs the entries a rekey has written to its new file, and then writes a
+   checkpoint that the first done of them are written, with the mac of them
+   from the target, at the end of the new data section, and syncs that too.
+   The entries are synced first so that no checkpoint is ever on disk
+   without the entries it counts.
+
+   Returns VE_SUCCESS if the checkpoint is on disk
+   VE_IOERR if the new file could not be written or synced
+   VE_CRYPTOERR if the checkpoint could not be tagged
  */
-uint32_t num_vault_keys(struct vault_info* info) {
-  int check;
-  if ((check = internal_initial_checks(info))) {
-    return check;
+int internal_rekey_checkpoint(struct vault_info* target, const uint8_t* source,
+                              uint64_t done) {
+  uint8_t checkpoint[REKEY_CHECKPOINT_SIZE];
+  memcpy(checkpoint, &done, sizeof(uint64_t));
+  memcpy(checkpoint + sizeof(uint64_t), target->file_mac, HASH_SIZE);
+  if (internal_rekey_tag(target, source, checkpoint,
+                         checkpoint + sizeof(uint64_t) + HASH_SIZE)) {
+    return VE_CRYPTOERR;
   }
 
-  uint32_t result = num_keys(info->key_info);
-  sodium_mprotect_noaccess(info);
-  return result;
+  if (fdatasync(target->user_fd) < 0 ||
+      pwrite(target->user_fd, checkpoint, REKEY_CHECKPOINT_SIZE,
+             target->data_end) != REKEY_CHECKPOINT_SIZE ||
+      fdatasync(target->user_fd) < 0) {
+    FPUTS("Could not write rekey checkpoint\n", stderr);
+    return VE_IOERR;
+  }
+  return VE_SUCCESS;
 }
 
 /**
-   function last_modified_time
-
-   Returns the last time a key was modified, or an error code.
-   Assumes that the time will never overflow, or be less than the number of
-   error codes
+   function internal_rekey_resume
+
+   Checks whether the new file of the target, left behind by an earlier
+   rekey, can be picked up from. It can if its header is for the same cipher
+   suite and loc field length, its master key unwraps with the key derived
+   from the password, and the checkpoint after the new data section has a
+   valid tag for the vault as it is now and no more than count entries done.
+   The new master key is then placed in the target, with the mac of the
+   checkpoint, the number of entries done in done, and the wrapped master
+   key and its nonce in header.
+
+   Returns whether the earlier rekey can be picked up from
  */
-uint64_t last_modified_time(struct vault_info* info, const char* key) {
-  if (info == NULL || key == NULL ||
-      strnlen(key, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
-    return VE_PARAMERR;
+int internal_rekey_resume(struct vault_info* info, struct vault_info* target,
+                          const uint8_t* source, uint32_t count,
+                          uint8_t* header, uint64_t* done) {
+  uint8_t new_header[HEADER_SIZE];
+  uint8_t checkpoint[REKEY_CHECKPOINT_SIZE];
+  uint8_t tag[HASH_SIZE];
+  if (pread(target->user_fd, new_header, HEADER_SIZE, 0) != HEADER_SIZE ||
+      pread(target->user_fd, checkpoint, REKEY_CHECKPOINT_SIZE,
+            target->data_end) != REKEY_CHECKPOINT_SIZE) {
+    return 0;
   }
 
-  int result;
-  if ((result = internal_initial_checks(info))) {
-    return result;
+  uint32_t loc_len;
+  uint8_t* wrapped = new_header + 8 + SALT_SIZE;
+  memcpy(&loc_len, new_header + HEADER_SIZE - 4, sizeof(uint32_t));
+  if (new_header[0] != VERSION || new_header[2] != target->cipher ||
+      loc_len != target->loc_len ||
+      crypto_secretbox_open_easy(target->decrypted_master, wrapped,
+                                 MASTER_KEY_SIZE + MAC_SIZE,
+                                 wrapped + MASTER_KEY_SIZE + MAC_SIZE,
+                                 info->derived_key) < 0) {
+    return 0;
   }
 
-  const struct key_info* current_info;
-  if (!(current_info = get_info(info->key_info, key))) {
-    FPUTS("Key not in map\n", stderr);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
-    }
-    return VE_KEYEXIST;
+  memcpy(done, checkpoint, sizeof(uint64_t));
+  if (*done > count || internal_rekey_tag(target, source, checkpoint, tag) ||
+      sodium_memcmp(tag, checkpoint + sizeof(uint64_t) + HASH_SIZE,
+                    HASH_SIZE) != 0) {
+    return 0;
   }
 
-  sodium_mprotect_noaccess(info);
-  return current_info->m_time;
+  memcpy(target->file_mac, checkpoint + sizeof(uint64_t), HASH_SIZE);
+  memcpy(header + 8 + SALT_SIZE, wrapped,
+         MASTER_KEY_SIZE + MAC_SIZE + NONCE_SIZE);
+  return 1;
 }
 
 /**
-   function open_key
-
-   Given a key, attempt to open it and place the decrypted value into secure
-   memory. Allows only a single value to be decrypted at once, and attempts
-   to decrease the amount of time that decrypted values appear in memory at
-   all.
-
-   Returns VE_SUCCESS upon decrypting the value
-   VE_PARAMERR if the key is too long
-   VE_MEMERR if memory cannot be read
-   VE_KEYEXIST if the key does not exist
-   VE_IOERR if the file cannot be read from
-   VE_CRYPTOERR if there are issues decrypting the value
+   function internal_rekey_copy
+
+   Writes the new file of a rekey, whose descriptor, cipher suite and loc
+   field length are already set in the target, picking up from an earlier
+   rekey if internal_rekey_resume allows it, or otherwise starting over with
+   a new master key. The header is copied from the vault with the format
+   version, integrity mode and cipher suite of the new file and the new
+   master key, and written along with the loc field each time, as neither is
+   covered by the checkpoints. On success the new file is cut down to the
+   end of its data section, and the running mac of it is in the target.
+
+   Returns VE_SUCCESS if the new file was written
+   VE_FILE if the vault is malformed, or the entries picked up from an
+   earlier rekey do not match the checkpoint
+   VE_IOERR if either file could not be read from or written to
+   VE_CRYPTOERR if an entry did not open or could not be sealed again
  */
-int open_key(struct vault_info* info, const char* key) {
-  if (info == NULL || key == NULL ||
-      strnlen(key, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
-    return VE_PARAMERR;
-  }
+int internal_rekey_copy(struct vault_info* info, struct rekey_job* data) {
+  struct vault_info* target = data->target;
 
-  int result;
-  if ((result = internal_initial_checks(info))) {
-    return result;
+  // Workers must not map the file again, nor check segments themselves
+  if (info->map != NULL && info->map_len < info->data_end) {
+    internal_map_file(info, info->data_end);
   }
+  int result = info->integrity == INTEGRITY_MERKLE
+                   ? internal_tree_check_all(info)
+                   : VE_SUCCESS;
 
-  const struct key_info* current_info;
-  if (!(current_info = get_info(info->key_info, key))) {
-    FPUTS("Key not in map\n", stderr);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
+  uint32_t count = 0;
+  uint8_t source[HASH_SIZE];
+  uint8_t header[HEADER_SIZE];
+  const uint8_t* current = internal_read_at(info, 0, HEADER_SIZE, header);
+  if (!result && current == NULL) {
+    result = VE_IOERR;
+  }
+  if (!result) {
+    memmove(header, current, HEADER_SIZE);
+    header[0] = VERSION;
+    header[1] = INTEGRITY_INCREMENTAL;
+    header[2] = target->cipher;
+    memset(header + SNAPSHOT_LEN_AT, 0, sizeof(uint32_t));
+    memcpy(header + HEADER_SIZE - 4, &target->loc_len, sizeof(uint32_t));
+    result = internal_rekey_plan(info, data, target->loc_len, &count);
+  }
+  if (!result) {
+    result = internal_rekey_source(info, source);
+  }
+
+  uint64_t done = 0;
+  int resumed = !result && internal_rekey_resume(info, target, source, count,
+                                                 header, &done);
+  if (!result && !resumed) {
+    uint8_t* wrapped = header + 8 + SALT_SIZE;
+    uint8_t* nonce = wrapped + MASTER_KEY_SIZE + MAC_SIZE;
+    done = 0;
+    sodium_memzero(target->file_mac, HASH_SIZE);
+    crypto_secretbox_keygen(target->decrypted_master);
+    randombytes_buf(nonce, NONCE_SIZE);
+    if (crypto_secretbox_easy(wrapped, target->decrypted_master,
+                              MASTER_KEY_SIZE, nonce, info->derived_key) < 0) {
+      result = VE_CRYPTOERR;
+    } else if (ftruncate(target->user_fd, 0) < 0) {
+      result = VE_IOERR;
+    }
+  } else if (resumed) {
+    FPUTS("Picking up an earlier rekey\n", stderr);
+  }
+
+  struct condense_out out = {target->user_fd, data->batch, 0, 0};
+  if (!result &&
+      (internal_condense_write(&out, header, HEADER_SIZE) ||
+       internal_condense_write(&out, (uint8_t*)data->new_locs,
+                               target->loc_len * WIDE_LOC_SIZE) ||
+       internal_condense_flush(&out))) {
+    result = VE_IOERR;
+  }
+
+  // Each batch takes the entries that fit in REKEY_BATCH_SIZE bytes
+  uint32_t batches = 0;
+  while (!result && done < count) {
+    uint32_t last = done;
+    uint64_t batch_end = internal_slot_loc(
+        target, data->new_locs + (size_t)done * (WIDE_LOC_SIZE / 4));
+    data->batch_at = batch_end;
+    data->first = done;
+    while (last < count) {
+      const uint32_t* slot =
+          data->new_locs + (size_t)last * (WIDE_LOC_SIZE / 4);
+      uint32_t entry_len = internal_entry_size(target->cipher, slot[2],
+                                               slot[3]);
+      if (batch_end + entry_len - data->batch_at > REKEY_BATCH_SIZE) {
+        break;
+      }
+      batch_end += entry_len;
+      last++;
     }
-    return VE_KEYEXIST;
-  }
-
-  if (info->current_box.key[0] != 0 &&
-      strncmp(key, (char*)&(info->current_box.key), BOX_KEY_SIZE) == 0) {
-    sodium_mprotect_noaccess(info);
-    return VE_SUCCESS;
-  }
 
-  lseek(info->user_fd, current_info->inode_loc, SEEK_SET);
-  uint32_t loc_data[LOC_SIZE / sizeof(uint32_t)];
-  READ(info->user_fd, loc_data, LOC_SIZE, info);
-  uint32_t file_loc = loc_data[1];
-  uint32_t key_len = loc_data[2];
-  uint32_t val_len = loc_data[3];
+    sodium_memzero(data->macs, sizeof(data->macs));
+    struct worker_job job = {info, internal_rekey_worker, data, last - done,
+                             0, VE_SUCCESS};
+    result = internal_run_workers(&job, info->workers);
+    uint32_t len = batch_end - data->batch_at;
+    if (!result &&
+        pwrite(target->user_fd, data->batch, len, data->batch_at) != len) {
+      result = VE_IOERR;
+    }
+    for (uint32_t w = 0; w < MAX_WORKERS && !result; ++w) {
+      for (int i = 0; i < HASH_SIZE; ++i) {
+        target->file_mac[i] ^= data->macs[w][i];
+      }
+    }
 
-  int box_len =
-      ENTRY_HEADER_SIZE + key_len + val_len + MAC_SIZE + NONCE_SIZE + HASH_SIZE;
-  uint8_t* box = malloc(box_len);
-  if (lseek(info->user_fd, file_loc, SEEK_SET) < 0 ||
-      read(info->user_fd, box, box_len) < 0) {
-    FPUTS("Issues with reading from file\n", stderr);
-    free(box);
-    sodium_mprotect_noaccess(info);
-    return VE_IOERR;
+    done = last;
+    if (!result && ++batches % REKEY_SYNC_BATCHES == 0 && done < count) {
+      result = internal_rekey_checkpoint(target, source, done);
+    }
   }
+  sodium_memzero(data->macs, sizeof(data->macs));
 
-  uint8_t hash[HASH_SIZE];
-  crypto_generichash((uint8_t*)&hash, HASH_SIZE, box, box_len - HASH_SIZE,
-                     info->decrypted_master, MASTER_KEY_SIZE);
-
-  if (memcmp((char*)&hash, box + box_len - HASH_SIZE, HASH_SIZE) != 0) {
-    FPUTS("ENTRY HASH INVALID\n", stderr);
-    free(box);
-    sodium_mprotect_noaccess(info);
-    return VE_CRYPTOERR;
+  // The loc slots are only hashed in now, as the checkpoints leave them out
+  for (uint32_t i = 0; i < target->loc_len && !result; ++i) {
+    result = internal_mac_region(
+        target, REGION_LOC, i,
+        (uint8_t*)(data->new_locs + (size_t)i * (WIDE_LOC_SIZE / 4)),
+        WIDE_LOC_SIZE);
   }
-
-  uint32_t val_loc = ENTRY_HEADER_SIZE + key_len;
-  if (crypto_secretbox_open_easy((uint8_t*)&(info->current_box.value),
-                                 box + val_loc, val_len + MAC_SIZE,
-                                 box + box_len - HASH_SIZE - NONCE_SIZE,
-                                 (uint8_t*)&info->decrypted_master) < 0) {
-    FPUTS("Could not decrypt value\n", stderr);
-    free(box);
-    sodium_mprotect_noaccess(info);
-    return VE_CRYPTOERR;
+  if (!result && ftruncate(target->user_fd, target->data_end) < 0) {
+    result = VE_IOERR;
   }
 
-  strncpy((char*)&(info->current_box.key), key, BOX_KEY_SIZE);
-  info->current_box.type = box[ENTRY_HEADER_SIZE - 1];
-  info->current_box.val_len = val_len;
-  free(box);
-  sodium_mprotect_noaccess(info);
-
-  FPUTS("Opened a key\n", stderr);
-  return VE_SUCCESS;
+  // Entries written before the rekey was picked up are checked by reading
+  // the whole new file back, as the checkpoint only vouches for their mac
+  if (!result && resumed) {
+    uint8_t expected[HASH_SIZE];
+    memcpy(expected, target->file_mac, HASH_SIZE);
+    if (internal_rebuild_mac(target) ||
+        sodium_memcmp(expected, target->file_mac, HASH_SIZE) != 0) {
+      FPUTS("Rekeyed file does not match its checkpoint\n", stderr);
+      result = VE_FILE;
+    }
+  }
+  return result;
 }
 
 /**
-   function delete_key
+   function internal_swap_master
 
-   Removes a key from the vault by marking the inode deleted, zeroing out the
-   memory associated with the value in the file, and removing the key from the
-   hash map.
+   Swaps the master keys of the vault info and the target of a rekey.
+ */
+void internal_swap_master(struct vault_info* info, struct vault_info* target) {
+  for (int i = 0; i < MASTER_KEY_SIZE; ++i) {
+    uint8_t byte = info->decrypted_master[i];
+    info->decrypted_master[i] = target->decrypted_master[i];
+    target->decrypted_master[i] = byte;
+  }
+}
 
-   Returns VE_SUCCESS upon decrypting the value
-   VE_PARAMERR if the key is too long
-   VE_MEMERR if memory cannot be read
-   VE_KEYEXIST if the key does not exist
-   VE_IOERR if the file cannot be written to or read from
+/**
+   function rekey_vault
+
+   Replaces the master key of the open vault with a new random one, and
+   encrypts every value again under it with the given cipher suite, which
+   can be the suite the vault already uses, another one, or CIPHER_AUTO to
+   pick one as when creating a vault. change_password only wraps the same
+   master key with a new password, which is no help once the master key
+   itself may have leaked. The password must be the current one, and the
+   vault must not be in a transaction.
+
+   The vault is streamed into a new file named after it with .rekey on the
+   end, across the workers, and the new file is sealed, synced and renamed
+   over the vault, so that a crash leaves either the old vault or the new
+   one whole. A rekey that fails before the rename can be picked up from its
+   last checkpoint by calling this again, and a new file that does not match
+   its checkpoint is removed, so that the next call starts over. Deleted
+   entries are dropped and the loc field resized along the way, as with a
+   compaction. The new file uses INTEGRITY_INCREMENTAL, and vaults using
+   INTEGRITY_MERKLE have their tree built once it is in place.
+
+   As the header and every entry change, they have to be sent to the server
+   again afterwards, and the recovery data made again with
+   create_data_for_server, as it holds the old master key.
+
+   Returns VE_SUCCESS upon rekeying the vault
+   VE_PARAMERR if the password is too long, the suite is unknown, or a
+   transaction is open
+   VE_WRONGPASS if the password is incorrect
+   VE_CRYPTOERR if the suite needs hardware AES this CPU does not have, or a
+   value did not decrypt or could not be encrypted
+   VE_MEMERR if memory cannot be read or allocated
+   VE_VCLOSE if no vault is open
+   VE_IOERR if either file could not be read from or written to
+   VE_FILE if the vault is malformed, or the new file of an earlier rekey did
+   not match its checkpoint
  */
-int delete_key(struct vault_info* info, const char* key) {
-  if (info == NULL || key == NULL ||
-      strnlen(key, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
+int rekey_vault(struct vault_info* info, const char* password, uint8_t suite) {
+  if (info == NULL || password == NULL ||
+      strnlen(password, MAX_PASS_SIZE + 1) > MAX_PASS_SIZE ||
+      (suite != CIPHER_AUTO && internal_check_cipher(suite) == VE_FILE)) {
     return VE_PARAMERR;
   }
+  if (suite != CIPHER_AUTO && internal_check_cipher(suite)) {
+    return VE_CRYPTOERR;
+  }
 
   int result;
   if ((result = internal_initial_checks(info))) {
     return result;
   }
 
-  const struct key_info* current_info;
-  if (!(current_info = get_info(info->key_info, key))) {
-    FPUTS("Key not in map\n", stderr);
-    if (sodium_mprotect_noaccess(info) < 0) {
-      FPUTS("Issues preventing access to memory\n", stderr);
-    }
-    return VE_KEYEXIST;
+  if (info->in_txn) {
+    FPUTS("Cannot rekey during a transaction\n", stderr);
+    sodium_mprotect_noaccess(info);
+    return VE_PARAMERR;
   }
 
-  lseek(info->user_fd, current_info->inode_loc, SEEK_SET);
-  uint32_t loc_data[LOC_SIZE / sizeof(uint32_t)];
-  READ(info->user_fd, loc_data, LOC_SIZE, info);
-  uint32_t file_loc = loc_data[1];
-  uint32_t key_len = loc_data[2];
-  uint32_t val_len = loc_data[3];
+  if ((result = internal_check_password(info, password))) {
+    sodium_mprotect_noaccess(info);
+    return result;
+  }
 
-  lseek(info->user_fd, current_info->inode_loc, SEEK_SET);
-  delete_entry(info->key_info, key);
-  uint32_t state_update = 1;
-  WRITE(info->user_fd, &state_update, sizeof(uint32_t), info);
-  int size = val_len + MAC_SIZE;
-  char* zeros = malloc(size);
-  sodium_memzero(zeros, size);
+  // The rekey copies the file the vault uses once a compaction is in place
+  if (info->compact_job != NULL && (result = internal_compact_install(info)) &&
+      !info->is_open) {
+    sodium_mprotect_noaccess(info);
+    return result;
+  }
 
-  lseek(info->user_fd, file_loc + ENTRY_HEADER_SIZE + key_len, SEEK_SET);
-  if (write(info->user_fd, zeros, size) < 0) {
-    free(zeros);
+  uint32_t new_loc_len = internal_loc_target(info);
+  struct rekey_job data;
+  data.target = internal_clone_info(info);
+  data.sources = malloc(new_loc_len * sizeof(uint32_t));
+  data.new_locs = calloc(new_loc_len, WIDE_LOC_SIZE);
+  data.batch = malloc(REKEY_BATCH_SIZE);
+  data.values = sodium_malloc(MAX_WORKERS * DATA_SIZE);
+  if (data.target == NULL || data.sources == NULL || data.new_locs == NULL ||
+      data.batch == NULL || data.values == NULL) {
+    internal_rekey_free(&data);
     sodium_mprotect_noaccess(info);
-    return VE_IOERR;
+    return VE_MEMERR;
   }
 
-  uint8_t file_hash[HASH_SIZE];
-  internal_hash_file(info, (uint8_t*)&file_hash, 0);
-  lseek(info->user_fd, 0, SEEK_END);
-  if (write(info->user_fd, &file_hash, HASH_SIZE) < 0) {
-    FPUTS("Could not write hash to disk\n", stderr);
-    free(zeros);
+  char temp_path[sizeof(info->pathname) + 6];
+  snprintf(temp_path, sizeof(temp_path), "%s.rekey", info->pathname);
+  int new_fd =
+      open(temp_path, O_RDWR | O_CREAT | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+  if (new_fd >= 0 && flock(new_fd, LOCK_EX | LOCK_NB) < 0) {
+    close(new_fd);
+    new_fd = -1;
+  }
+  if (new_fd < 0) {
+    FPUTS("Could not create file to rekey into\n", stderr);
+    internal_rekey_free(&data);
     sodium_mprotect_noaccess(info);
     return VE_IOERR;
   }
 
-  free(zeros);
-  sodium_mprotect_noaccess(info);
-  FPUTS("Deleted key\n", stderr);
-  return VE_SUCCESS;
-}
-
-/**
-   function update_key
-
-   Updates the value of a key by deleting it in the file, and then adding it
-   again by appending it to the end of the file. This is done to prevent
-   having to reorder inodes and do file copying, leaving this to one expensive
-   condense file operation that is done periodically to remove the deleted
-   entries.
-
-   Returns VE_SUCCESS upon succeeding to update the key
-   VE_PARAMERR if either the data or key is too long
-   Otherwise returns either delete_key or add_key error
- */
-int update_key(struct vault_info* info, uint8_t type, const char* key,
-               const char* value, uint64_t m_time, uint32_t len) {
-  if (info == NULL || key == NULL || value == NULL ||
-      strnlen(value, DATA_SIZE + 1) > DATA_SIZE ||
-      strnlen(key, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
-    return VE_PARAMERR;
+  struct vault_info* target = data.target;
+  target->user_fd = new_fd;
+  target->cipher = internal_pick_cipher(suite);
+  target->integrity = INTEGRITY_INCREMENTAL;
+  target->loc_len = new_loc_len;
+  target->loc_size = WIDE_LOC_SIZE;
+  target->snapshot_len = 0;
+  result = internal_rekey_copy(info, &data);
+
+  // The new file is kept to be picked up from, unless it did not match
+  if (result) {
+    close(new_fd);
+    if (result == VE_FILE) {
+      unlink(temp_path);
+    }
+    internal_rekey_free(&data);
+    sodium_mprotect_noaccess(info);
+    return result;
   }
 
-  int result = delete_key(info, key);
-  if (result != VE_SUCCESS) {
+  // The new file is sealed through the vault info, as it will be the vault
+  int old_fd = info->user_fd;
+  uint64_t old_data_end = info->data_end;
+  uint8_t old_integrity = info->integrity;
+  uint8_t old_cipher = info->cipher;
+  internal_unmap_file(info);
+  internal_tree_free(info);
+  internal_swap_master(info, target);
+  info->user_fd = new_fd;
+  info->data_end = target->data_end;
+  info->loc_size = WIDE_LOC_SIZE;
+  info->integrity = INTEGRITY_INCREMENTAL;
+  info->cipher = target->cipher;
+  info->generation = 0;
+  info->snapshot_len = 0;
+  memcpy(info->file_mac, target->file_mac, HASH_SIZE);
+  result = internal_condense_finish(info, temp_path);
+
+  if (result) {
+    internal_swap_master(info, target);
+    info->integrity = old_integrity;
+    info->cipher = old_cipher;
+    if (internal_condense_restore(info, old_fd, old_data_end, new_fd,
+                                  temp_path)) {
+      result = VE_FILE;
+    }
+    internal_rekey_free(&data);
+    sodium_mprotect_noaccess(info);
     return result;
   }
-  return add_key(info, type, key, value, m_time, len);
-}
-
-/**
-   function place_open_value
-
-   Copies the current open value into the result buffer passed in, which is
-   assumed to be at least DATA_SIZE bytes.
 
-   Returns VE_SUCCESS upon copying val_len bytes
-   VE_MEMERR if the box cannot be read
-   VE_VCLOSE if the vault is closed
- */
-int place_open_value(struct vault_info* info, char* result, int* len,
-                     char* type) {
-  int check;
-  if ((check = internal_initial_checks(info))) {
-    return check;
+  internal_rekey_free(&data);
+  result = internal_condense_swapped(info, old_fd);
+  if (!result && old_integrity == INTEGRITY_MERKLE) {
+    result = internal_switch_integrity(info, INTEGRITY_MERKLE);
   }
 
-  memcpy(result, (char*)&info->current_box.value, info->current_box.val_len);
-  *len = info->current_box.val_len;
-  *type = info->current_box.type;
-  result[info->current_box.val_len] = 0;
-
   sodium_mprotect_noaccess(info);
-  return VE_SUCCESS;
+  FPUTS("Rekeyed vault\n", stderr);
+  return result;
 }
 
 /**
@@ -1988,12 +7363,15 @@ int place_open_value(struct vault_info* info, char* result, int* len,
 
    Given an encrypted blob from the server, add it back to the vault if the hash
    is valid. This is used to prevent the server from decrypting any of the
-   key value pairs that are sent to it while still validating them.
+   key value pairs that are sent to it while still validating them. Vaults
+   with an AEAD cipher suite check the tag of the entry instead, which means
+   decrypting it into secure memory that is wiped straight away.
 
    Returns VE_SUCCESS if the key was correctly validated and added
-   VE_PARAMERR if the key name is too long
+   VE_PARAMERR if the key name is too long, or the length does not fit an
+   entry of the vault's cipher suite
    VE_KEYEXIST if the key already exists
-   VE_FILE if the entry hash is invalid
+   VE_FILE if the entry hash or tag is invalid
    VE_VCLOSE if there is no open vault
    VE_MEMERR if the vault information cannot be read
    VE_IOERR if there are issues with the file
@@ -2002,7 +7380,7 @@ int place_open_value(struct vault_info* info, char* result, int* len,
 int add_encrypted_value(struct vault_info* info, const char* key,
                         const char* value, int len, uint8_t type,
                         uint64_t m_time) {
-  if (info == NULL || key == NULL ||
+  if (info == NULL || key == NULL || value == NULL ||
       strnlen(key, BOX_KEY_SIZE) > BOX_KEY_SIZE - 1) {
     return VE_PARAMERR;
   }
@@ -2012,6 +7390,14 @@ int add_encrypted_value(struct vault_info* info, const char* key,
     return result;
   }
 
+  // The entry sizes depend on the cipher suite, kept in the vault info
+  uint32_t key_len = strlen(key);
+  if (len < (int)internal_entry_size(info->cipher, key_len, 0) ||
+      len > (int)internal_entry_size(info->cipher, key_len, DATA_SIZE)) {
+    sodium_mprotect_noaccess(info);
+    return VE_PARAMERR;
+  }
+
   const struct key_info* current_info;
   if ((current_info = get_info(info->key_info, key))) {
     FPUTS("Key in map\n", stderr);
@@ -2021,14 +7407,9 @@ int add_encrypted_value(struct vault_info* info, const char* key,
     return VE_KEYEXIST;
   }
 
-  uint8_t hash[HASH_SIZE];
-  crypto_generichash((uint8_t*)&hash, HASH_SIZE, value, len - HASH_SIZE,
-                     info->decrypted_master, MASTER_KEY_SIZE);
-
-  if (memcmp((char*)&hash, value + len - HASH_SIZE, HASH_SIZE) != 0) {
-    FPUTS("ENTRY HASH INVALID\n", stderr);
+  if ((result = internal_check_entry(info, (uint8_t*)value, len, key_len))) {
     sodium_mprotect_noaccess(info);
-    return VE_FILE;
+    return result == VE_MEMERR ? VE_MEMERR : VE_FILE;
   }
 
   if (internal_append_encrypted(info, type, key, value, len, m_time) !=
@@ -2056,7 +7437,7 @@ int add_encrypted_value(struct vault_info* info, const char* key,
    VE_VCLOSE if there is no open vault
    VE_MEMERR if the vault information cannot be read
    VE_IOERR if there are issues with the file
-   VE_CRYPTOERR if the entry hash is invalid
+   VE_CRYPTOERR if the entry hash or tag is invalid
 */
 int get_encrypted_value(struct vault_info* info, const char* key, char* result,
                         int* len, uint8_t* type) {
@@ -2079,24 +7460,30 @@ int get_encrypted_value(struct vault_info* info, const char* key, char* result,
     return VE_KEYEXIST;
   }
 
-  lseek(info->user_fd, current_info->inode_loc, SEEK_SET);
-  uint32_t loc_data[LOC_SIZE / sizeof(uint32_t)];
-  READ(info->user_fd, loc_data, LOC_SIZE, info);
-  uint32_t file_loc = loc_data[1];
+  const uint32_t* loc_data =
+      LOC_SLOT(info, info->locs,
+               (current_info->inode_loc - HEADER_SIZE) / info->loc_size);
+  uint64_t file_loc = internal_slot_loc(info, loc_data);
   uint32_t key_len = loc_data[2];
   uint32_t val_len = loc_data[3];
 
-  int box_len =
-      ENTRY_HEADER_SIZE + key_len + val_len + MAC_SIZE + NONCE_SIZE + HASH_SIZE;
-  lseek(info->user_fd, file_loc, SEEK_SET);
-  READ(info->user_fd, result, box_len, info);
+  int box_len = internal_entry_size(info->cipher, key_len, val_len);
+  const uint8_t* box =
+      internal_read_at(info, file_loc, box_len, (uint8_t*)result);
+  if (box == NULL) {
+    sodium_mprotect_noaccess(info);
+    return VE_IOERR;
+  }
+  if (box != (uint8_t*)result) {
+    memcpy(result, box, box_len);
+  }
 
-  uint8_t hash[HASH_SIZE];
-  crypto_generichash((uint8_t*)&hash, HASH_SIZE, result, box_len - HASH_SIZE,
-                     info->decrypted_master, MASTER_KEY_SIZE);
+  if (internal_tree_check(info, file_loc, box_len)) {
+    sodium_mprotect_noaccess(info);
+    return VE_FILE;
+  }
 
-  if (memcmp((char*)&hash, result + box_len - HASH_SIZE, HASH_SIZE) != 0) {
-    FPUTS("ENTRY HASH INVALID\n", stderr);
+  if (internal_check_entry(info, (uint8_t*)result, box_len, key_len)) {
     sodium_mprotect_noaccess(info);
     return VE_CRYPTOERR;
   }
@@ -2173,11 +7560,79 @@ int set_last_server_time(struct vault_info* info, uint64_t timestamp) {
   lseek(info->user_fd, HEADER_SIZE - 12, SEEK_SET);
   WRITE(info->user_fd, &timestamp, 8, info);
 
-  uint8_t file_hash[HASH_SIZE];
-  internal_hash_file(info, (uint8_t*)&file_hash, HASH_SIZE);
-  lseek(info->user_fd, -1 * HASH_SIZE, SEEK_END);
-  if (write(info->user_fd, &file_hash, HASH_SIZE) < 0) {
-    FPUTS("Could not write hash to disk\n", stderr);
+  if (internal_seal_file(info)) {
+    sodium_mprotect_noaccess(info);
+    return VE_IOERR;
+  }
+
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function set_integrity_mode
+
+   Switches an open vault between INTEGRITY_INCREMENTAL and INTEGRITY_MERKLE
+   with internal_switch_integrity.
+
+   Returns VE_SUCCESS upon switching the mode
+   VE_PARAMERR if the mode is not one of the two above
+   VE_MEMERR if the vault info cannot be read
+   VE_VCLOSE if no vault is open
+   VE_IOERR if there are issues with the file
+   VE_FILE if the loc data does not describe a valid data section
+ */
+int set_integrity_mode(struct vault_info* info, uint8_t mode) {
+  if (info == NULL ||
+      (mode != INTEGRITY_INCREMENTAL && mode != INTEGRITY_MERKLE)) {
+    return VE_PARAMERR;
+  }
+
+  int check;
+  if ((check = internal_initial_checks(info))) {
+    return check;
+  }
+
+  if (info->integrity == mode) {
+    sodium_mprotect_noaccess(info);
+    return VE_SUCCESS;
+  }
+
+  int result = internal_switch_integrity(info, mode);
+  sodium_mprotect_noaccess(info);
+  return result;
+}
+
+/**
+   function set_verify_mode
+
+   Sets whether the vault is verified on one thread or across the workers
+   when it is opened, which is stored in the header so it stays with the
+   vault. For INTEGRITY_INCREMENTAL vaults the regions of the file are hashed
+   by the workers, and for INTEGRITY_MERKLE vaults every segment is checked
+   up front by the workers instead of as entries are read.
+
+   Returns VE_SUCCESS upon setting the mode
+   VE_PARAMERR if the mode is not VERIFY_SERIAL or VERIFY_PARALLEL
+   VE_MEMERR if the vault info cannot be read
+   VE_VCLOSE if no vault is open
+   VE_IOERR if there are issues with the file
+ */
+int set_verify_mode(struct vault_info* info, uint8_t mode) {
+  if (info == NULL || (mode != VERIFY_SERIAL && mode != VERIFY_PARALLEL)) {
+    return VE_PARAMERR;
+  }
+
+  int check;
+  if ((check = internal_initial_checks(info))) {
+    return check;
+  }
+
+  lseek(info->user_fd, 3, SEEK_SET);
+  WRITE(info->user_fd, &mode, 1, info);
+  info->verify = mode;
+
+  if (internal_seal_file(info)) {
     sodium_mprotect_noaccess(info);
     return VE_IOERR;
   }
@@ -2185,3 +7640,347 @@ int set_last_server_time(struct vault_info* info, uint64_t timestamp) {
   sodium_mprotect_noaccess(info);
   return VE_SUCCESS;
 }
+
+/**
+   function set_worker_count
+
+   Sets how many threads parallel work is spread across, which defaults to
+   the number of cores online. Can be called whether or not a vault is open.
+
+   Returns VE_SUCCESS upon setting the count
+   VE_PARAMERR if the count is zero or above MAX_WORKERS
+   VE_MEMERR if the vault info cannot be read
+ */
+int set_worker_count(struct vault_info* info, uint32_t count) {
+  if (info == NULL || count == 0 || count > MAX_WORKERS) {
+    return VE_PARAMERR;
+  }
+
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    return VE_MEMERR;
+  }
+
+  info->workers = count;
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function set_read_mode
+
+   Sets whether an open vault is read through a read only mapping of the
+   file, READ_MMAP, or with pread, READ_PREAD. Mapped reads use the loc field
+   and entries in place without copying them. Can be called whether or not a
+   vault is open, and a vault opened later uses the same mode.
+
+   Returns VE_SUCCESS upon setting the mode
+   VE_PARAMERR if the mode is not READ_PREAD or READ_MMAP
+   VE_MEMERR if the vault info cannot be read
+ */
+int set_read_mode(struct vault_info* info, uint8_t mode) {
+  if (info == NULL || (mode != READ_PREAD && mode != READ_MMAP)) {
+    return VE_PARAMERR;
+  }
+
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    return VE_MEMERR;
+  }
+
+  info->read_mode = mode;
+  if (info->is_open) {
+    uint64_t map_len = info->data_end + internal_tree_size(info) + HASH_SIZE;
+    internal_unmap_file(info);
+    internal_map_file(info, map_len);
+  }
+
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function set_cipher_suite
+
+   Sets the cipher suite the values of vaults created afterwards are
+   encrypted with, CIPHER_SECRETBOX, CIPHER_XCHACHA, CIPHER_AESGCM or
+   CIPHER_AUTO, which picks AES-256-GCM on CPUs with hardware AES and
+   XChaCha20-Poly1305 otherwise. The suite is stored in the header, so
+   vaults opened or created from a server header keep the suite they were
+   made with, and an open vault is not changed. A vault using AES-256-GCM
+   can only be opened on CPUs with hardware AES, so CIPHER_XCHACHA is the
+   choice for vaults shared between machines that may not have it.
+
+   Returns VE_SUCCESS upon setting the suite
+   VE_PARAMERR if the suite is not one of the above
+   VE_CRYPTOERR if the suite is CIPHER_AESGCM and this CPU does not have
+   hardware AES
+   VE_MEMERR if the vault info cannot be read
+ */
+int set_cipher_suite(struct vault_info* info, uint8_t suite) {
+  if (info == NULL ||
+      (suite != CIPHER_AUTO && internal_check_cipher(suite) == VE_FILE)) {
+    return VE_PARAMERR;
+  }
+  if (suite != CIPHER_AUTO && internal_check_cipher(suite)) {
+    return VE_CRYPTOERR;
+  }
+
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    return VE_MEMERR;
+  }
+
+  info->new_cipher = suite;
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function get_cipher_suite
+
+   Gets the cipher suite the values of the open vault are encrypted with.
+
+   Returns VE_SUCCESS upon placing the suite in suite
+   VE_PARAMERR if suite is null
+   VE_MEMERR if the vault info cannot be read
+   VE_VCLOSE if there is no open vault
+ */
+int get_cipher_suite(struct vault_info* info, uint8_t* suite) {
+  if (info == NULL || suite == NULL) {
+    return VE_PARAMERR;
+  }
+
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  *suite = info->cipher;
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function set_compaction_policy
+
+   Sets when an open or later opened vault is compacted, and how large its loc
+   field is made when it is. Deleting keys or committing a transaction
+   compacts the vault once garbage_percent of its data section, or of its loc
+   field, is taken by deleted entries, and zero turns this off, leaving only
+   the compaction made when the loc field is full. Compacting sizes the loc
+   field so the active entries fill fill_percent of it.
+
+   Returns VE_SUCCESS upon setting the policy
+   VE_PARAMERR if either percentage is over 100, or fill_percent is zero
+   VE_MEMERR if the vault info cannot be read
+ */
+int set_compaction_policy(struct vault_info* info, uint8_t garbage_percent,
+                          uint8_t fill_percent) {
+  if (info == NULL || garbage_percent > 100 || fill_percent == 0 ||
+      fill_percent > 100) {
+    return VE_PARAMERR;
+  }
+
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    return VE_MEMERR;
+  }
+
+  info->garbage_percent = garbage_percent;
+  info->fill_percent = fill_percent;
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function get_vault_stats
+
+   Fills in stats with how much of the open vault is taken by active and by
+   deleted entries, in both loc slots and bytes of the data section.
+
+   Returns VE_SUCCESS upon filling in the stats
+   VE_PARAMERR if stats is NULL
+   VE_MEMERR if the vault info cannot be read
+   VE_VCLOSE if the vault is closed
+ */
+int get_vault_stats(struct vault_info* info, struct vault_stats* stats) {
+  if (info == NULL || stats == NULL) {
+    return VE_PARAMERR;
+  }
+
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  uint64_t data_start = HEADER_SIZE + info->loc_len * info->loc_size;
+  stats->loc_slots = info->loc_len;
+  stats->live_slots = info->live_slots;
+  stats->dead_slots = info->dead_slots;
+  stats->compacting = info->compact_job != NULL;
+  stats->live_bytes = info->live_bytes;
+  stats->dead_bytes = info->data_end - data_start - info->live_bytes;
+  stats->file_bytes = info->data_end + internal_tree_size(info) +
+                      info->snapshot_len + HASH_SIZE;
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function compact_vault
+
+   Compacts the open vault whatever the compaction policy says, removing
+   deleted entries and resizing the loc field. With background compaction on,
+   this starts a compaction on its own thread, unless one is already
+   running, and returns without waiting for it.
+
+   Returns VE_SUCCESS upon compacting the vault or starting to
+   Otherwise the error from internal_condense_file or from starting the thread
+ */
+int compact_vault(struct vault_info* info) {
+  if (info == NULL) {
+    return VE_PARAMERR;
+  }
+
+  int result;
+  if ((result = internal_initial_checks(info))) {
+    return result;
+  }
+
+  if (!info->background) {
+    return internal_condense_file(info);
+  }
+  if (info->compact_job == NULL) {
+    result = internal_compact_start(info);
+  }
+  sodium_mprotect_noaccess(info);
+  return result;
+}
+
+/**
+   function set_background_compaction
+
+   Sets whether compactions called for by the compaction policy, or asked for
+   with compact_vault, run on a background thread while the vault stays in
+   use. Turning it off does not stop a compaction already running. Can be
+   called whether or not a vault is open.
+
+   Returns VE_SUCCESS upon setting the mode
+   VE_MEMERR if the vault info cannot be read
+ */
+int set_background_compaction(struct vault_info* info, uint8_t enabled) {
+  if (info == NULL) {
+    return VE_PARAMERR;
+  }
+
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    return VE_MEMERR;
+  }
+
+  info->background = enabled != 0;
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function set_value_cache
+
+   Sets how many decrypted values the value cache keeps, and for how many
+   seconds after they were decrypted, with zero keeping them until they are
+   pushed out or the vault is closed. A capacity of zero turns the cache off,
+   leaving only the open value. The values already cached are wiped and the
+   counts of hits and misses start again. Can be called whether or not a
+   vault is open.
+
+   Returns VE_SUCCESS upon setting up the cache
+   VE_PARAMERR if the capacity is above MAX_CACHE_VALUES
+   VE_MEMERR if the vault info cannot be read
+ */
+int set_value_cache(struct vault_info* info, uint32_t capacity, uint32_t ttl) {
+  if (info == NULL || capacity > MAX_CACHE_VALUES) {
+    return VE_PARAMERR;
+  }
+
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    return VE_MEMERR;
+  }
+
+  internal_cache_free(info);
+  info->cache_capacity = capacity;
+  info->cache_ttl = ttl;
+  info->cache_tick = 0;
+  info->cache_hits = 0;
+  info->cache_misses = 0;
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function get_cache_stats
+
+   Fills in stats with how many opens the value cache served and how many
+   had to decrypt since it was set up, along with how many values it holds
+   once the expired ones are wiped. Can be called whether or not a vault is
+   open.
+
+   Returns VE_SUCCESS upon filling in the stats
+   VE_PARAMERR if stats is NULL
+   VE_MEMERR if the vault info cannot be read
+ */
+int get_cache_stats(struct vault_info* info, struct cache_stats* stats) {
+  if (info == NULL || stats == NULL) {
+    return VE_PARAMERR;
+  }
+
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    return VE_MEMERR;
+  }
+
+  stats->hits = info->cache_hits;
+  stats->misses = info->cache_misses;
+  stats->cached = 0;
+  stats->capacity = info->cache_capacity;
+  if (info->cache != NULL && sodium_mprotect_readwrite(info->cache) == 0) {
+    internal_cache_expire(info);
+    for (uint32_t i = 0; i < info->cache_capacity; ++i) {
+      stats->cached += info->cache[i].box.key[0] != 0;
+    }
+    sodium_mprotect_noaccess(info->cache);
+  }
+
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
+
+/**
+   function expire_cached_values
+
+   Wipes the values in the value cache that have outlived its time to live,
+   which otherwise only happens as keys are opened, so that a caller can
+   wipe them on a timer while the vault sits idle.
+
+   Returns VE_SUCCESS upon wiping the expired values
+   VE_MEMERR if the vault info cannot be read
+ */
+int expire_cached_values(struct vault_info* info) {
+  if (info == NULL) {
+    return VE_PARAMERR;
+  }
+
+  if (sodium_mprotect_readwrite(info) < 0) {
+    FPUTS("Issues gaining access to memory\n", stderr);
+    return VE_MEMERR;
+  }
+
+  if (info->cache != NULL && sodium_mprotect_readwrite(info->cache) == 0) {
+    internal_cache_expire(info);
+    sodium_mprotect_noaccess(info->cache);
+  }
+
+  sodium_mprotect_noaccess(info);
+  return VE_SUCCESS;
+}
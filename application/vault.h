@@ -22,15 +22,116 @@
 #define SALT_SIZE 16        // 128-bit salt for Argon2id
 #define MAC_SIZE 16         // 128-bit mac from Poly1305
 #define NONCE_SIZE 24       // 192-bit nonce for XSalsa 20
-#define HEADER_SIZE 8 + MASTER_KEY_SIZE + SALT_SIZE + MAC_SIZE + NONCE_SIZE + 12
+#define HEADER_SIZE \
+  (8 + MASTER_KEY_SIZE + SALT_SIZE + MAC_SIZE + NONCE_SIZE + 12)
 #define LOC_SIZE 16          // Number of bytes each entry is in the loc field
+#define DIR_LOC_SIZE 144     // Loc slot with its key directory, from version 2
+#define WIDE_LOC_SIZE 148    // With the high half of its offset, from version 3
 #define ENTRY_HEADER_SIZE 9  // One for type, eight for time
 #define INITIAL_SIZE 100     // Initial amount of key locs before extension
 #define DATA_SIZE 4096       // Maximum data size
 #define MAX_PASS_SIZE 120    // Maximum password length
 
+#define INTEGRITY_FILE 0         // Trailer is a keyed hash of the whole file
+#define INTEGRITY_INCREMENTAL 1  // Trailer seals a mac updated per region
+#define INTEGRITY_MERKLE 2       // Trailer seals a tree over file segments
+#define SEAL_TAG_SIZE 24         // Tag after the generation in the trailer
+#define SEGMENT_SIZE 4096        // Bytes covered by each leaf of the tree
+#define VERIFY_SERIAL 0          // Open verifies on the calling thread
+#define VERIFY_PARALLEL 1        // Open spreads verification across workers
+#define MAX_WORKERS 64           // Most threads a single job is split across
+#define READ_PREAD 0             // Reads copy from the file with pread
+#define READ_MMAP 1              // Reads use a read only mapping of the file
+#define CIPHER_SECRETBOX 0       // XSalsa20-Poly1305 and a keyed entry hash
+#define CIPHER_XCHACHA 1         // XChaCha20-Poly1305 AEAD over each entry
+#define CIPHER_AESGCM 2          // AES-256-GCM AEAD, needs hardware AES
+#define CIPHER_AUTO 255          // AES-256-GCM if the CPU has it, or XChaCha20
+#define DEFAULT_GARBAGE_PERCENT 50  // Garbage that triggers a compaction
+#define DEFAULT_FILL_PERCENT 50     // Active share of loc field compacted to
+#define DEFAULT_CACHE_VALUES 16     // Decrypted values the value cache keeps
+#define DEFAULT_CACHE_TTL 60        // Seconds a value stays in the cache
+#define MAX_CACHE_VALUES 256        // Most values the cache can be sized for
+
+#define TYPE_CREDENTIAL 0        // Username length, username and password
+#define TYPE_PASSWORD 1          // Terminated password on its own
+#define AUDIT_MIN_LENGTH 8       // Shortest password the audit accepts
+#define AUDIT_CHECKS 5           // Strength checks each password is scored on
+#define AUDIT_SHORT 1            // Shorter than AUDIT_MIN_LENGTH
+#define AUDIT_FEW_CLASSES 2      // Fewer than three classes of character
+#define AUDIT_NOT_INTERLEAVED 4  // Digits in at most a single run
+#define AUDIT_REPEATED 8         // At most half the characters are unique
+#define AUDIT_KEYBOARD 16        // Mostly runs of keys next to each other
+
 struct vault_info;
 
+struct vault_cursor;
+
+/**
+   vault_stats - how much of an open vault is active and how much is garbage
+ */
+struct vault_stats {
+  uint32_t loc_slots;   // Slots in the loc field
+  uint32_t live_slots;  // Slots of active entries
+  uint32_t dead_slots;  // Slots of deleted entries, freed by compaction
+  uint32_t compacting;  // Whether a background compaction is running
+  uint64_t live_bytes;  // Bytes of active entries in the data section
+  uint64_t dead_bytes;  // Bytes of deleted entries in the data section
+  uint64_t file_bytes;  // Size of the whole vault file
+};
+
+/**
+   cache_stats - how often opening a key was served by the value cache
+ */
+struct cache_stats {
+  uint64_t hits;      // Opens served without reading or decrypting
+  uint64_t misses;    // Opens that read and decrypted the entry
+  uint32_t cached;    // Values in the cache
+  uint32_t capacity;  // Most values the cache keeps
+};
+
+/**
+   vault_value - where open_keys placed the value of one of its keys
+ */
+struct vault_value {
+  uint64_t offset;  // Where the value starts in the buffer
+  uint32_t len;     // Length of the value, which is followed by a terminator
+  int32_t result;   // VE_SUCCESS, or why the key could not be opened
+  uint8_t type;     // Type of the value
+};
+
+/**
+   audit_result - a key whose password the audit found weak or reused
+ */
+struct audit_result {
+  const char* key;     // Terminated, valid until the vault next changes
+  uint32_t group;      // Keys sharing a password share a group from 1, or 0
+  uint8_t score;       // Strength checks passed, out of AUDIT_CHECKS
+  uint8_t weaknesses;  // AUDIT_ flags of the strength checks failed
+};
+
+/**
+   audit_report - totals over every password the audit checked
+ */
+struct audit_report {
+  uint32_t audited;  // Passwords checked
+  uint32_t weak;     // Passwords failing any strength check
+  uint32_t reused;   // Passwords also used by another key
+  uint32_t groups;   // Distinct passwords used by more than one key
+  uint32_t skipped;  // Values of other types, or not laid out as credentials
+};
+
+/**
+   vault_entry - a key returned by a cursor or a query for changes, pointing
+   into the key map
+ */
+struct vault_entry {
+  const char* key;   // Terminated, valid until the vault next changes
+  uint64_t m_time;   // Last time the key was modified, or was deleted
+  uint32_t key_len;  // Length of the key, without the terminator
+  uint8_t type;      // Type of the value
+  uint8_t deleted;   // Whether this is the tombstone of a deleted key
+};
+
 struct vault_info* init_vault();
 
 int max_value_size();
@@ -86,20 +187,76 @@ int get_vault_keys(struct vault_info* info, char** results);
 
 uint32_t num_vault_keys(struct vault_info* info);
 
+int get_keys_with_prefix(struct vault_info* info, const char* prefix,
+                         char** results, uint32_t max_results,
+                         uint32_t* num_results);
+
+int get_keys_with_suffix(struct vault_info* info, const char* suffix,
+                         char** results, uint32_t max_results,
+                         uint32_t* num_results);
+
+int get_keys_in_range(struct vault_info* info, const char* first,
+                      const char* last, char** results, uint32_t max_results,
+                      uint32_t* num_results);
+
+int match_domain_key(struct vault_info* info, const char* domain,
+                     char* result);
+
+int open_cursor(struct vault_info* info, const char* start,
+                struct vault_cursor** cursor);
+
+int open_type_cursor(struct vault_info* info, uint8_t type, const char* start,
+                     struct vault_cursor** cursor);
+
+int count_keys_of_type(struct vault_info* info, uint8_t type,
+                       uint32_t* count);
+
+int cursor_next(struct vault_info* info, struct vault_cursor* cursor,
+                struct vault_entry* entries, uint32_t max_entries,
+                uint32_t* num_entries);
+
+int close_cursor(struct vault_cursor* cursor);
+
 uint64_t last_modified_time(struct vault_info* info, const char* key);
 
 int open_key(struct vault_info* info, const char* key);
 
 int delete_key(struct vault_info* info, const char* key);
 
+int delete_key_at(struct vault_info* info, const char* key, uint64_t m_time);
+
+int keys_modified_since(struct vault_info* info, uint64_t since,
+                        struct vault_entry* entries, uint32_t max_entries,
+                        uint32_t* num_changes);
+
 int update_key(struct vault_info* info, uint8_t type, const char* key,
                const char* vaule, uint64_t m_time, uint32_t len);
 
+int vault_begin(struct vault_info* info);
+
+int vault_commit(struct vault_info* info);
+
+int vault_abort(struct vault_info* info);
+
 int change_password(struct vault_info* info, const char* old_password,
                     const char* new_password);
 
+int rekey_vault(struct vault_info* info, const char* password, uint8_t suite);
+
 int place_open_value(struct vault_info*, char*, int*, char*);
 
+int open_keys(struct vault_info* info, const char** keys, uint32_t num_keys,
+              char* buffer, uint64_t buffer_len, struct vault_value* values,
+              uint64_t* needed);
+
+char* alloc_secure_buffer(uint64_t len);
+
+void free_secure_buffer(char* buffer);
+
+int audit_vault(struct vault_info* info, struct audit_result* results,
+                uint32_t max_results, uint32_t* num_results,
+                struct audit_report* report);
+
 int add_encrypted_value(struct vault_info* info, const char* key,
                         const char* value, int len, uint8_t type, uint64_t m_time);
 
@@ -112,4 +269,31 @@ uint64_t get_last_server_time(struct vault_info* info);
 
 int set_last_server_time(struct vault_info* info, uint64_t timestamp);
 
+int set_integrity_mode(struct vault_info* info, uint8_t mode);
+
+int set_verify_mode(struct vault_info* info, uint8_t mode);
+
+int set_worker_count(struct vault_info* info, uint32_t count);
+
+int set_read_mode(struct vault_info* info, uint8_t mode);
+
+int set_cipher_suite(struct vault_info* info, uint8_t suite);
+
+int get_cipher_suite(struct vault_info* info, uint8_t* suite);
+
+int set_compaction_policy(struct vault_info* info, uint8_t garbage_percent,
+                          uint8_t fill_percent);
+
+int get_vault_stats(struct vault_info* info, struct vault_stats* stats);
+
+int compact_vault(struct vault_info* info);
+
+int set_background_compaction(struct vault_info* info, uint8_t enabled);
+
+int set_value_cache(struct vault_info* info, uint32_t capacity, uint32_t ttl);
+
+int get_cache_stats(struct vault_info* info, struct cache_stats* stats);
+
+int expire_cached_values(struct vault_info* info);
+
 #endif
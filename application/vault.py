@@ -13,6 +13,7 @@ returns results.
 
 from abc import *
 from base64 import *
+from contextlib import contextmanager
 from ctypes import *
 import os
 import time
@@ -64,9 +65,9 @@ class Vault_intf(ABC):
     def update_value(self, value_type, key, value):
         raise NotImplementedError
 
-    # Method for deleting a key value pair in the vault
+    # Method for deleting a key value pair in the vault, at m_time in seconds
     @abstractmethod
-    def delete_value(self, key):
+    def delete_value(self, key, m_time=None):
         raise NotImplementedError
 
     # Method for checking what the last update time of a key was
@@ -91,6 +92,23 @@ class Vault_intf(ABC):
     def add_encrypted_value(self, type_, key, encrypted_value):
         raise NotImplementedError
 
+    # Returns the key to look a site up under, the domain itself or its
+    # closest parent domain that is a key; vaults without the lookup only
+    # ever match the domain exactly
+    def match_domain(self, domain):
+        return domain
+
+    # Returns (key, m_time, type, deleted) for the keys changed since a time;
+    # vaults without a change index leave the caller to track changes itself
+    def keys_modified_since(self, since):
+        return []
+
+    # Groups the changes made inside it; vaults without transactions simply
+    # make each change as it comes
+    @contextmanager
+    def transaction(self):
+        yield self
+
 
 class GenericVaultException(Exception):
     pass
@@ -140,6 +158,42 @@ Type 0 is bytes, Type 1 is ascii
 """
 
 
+class VaultStats(Structure):
+    _fields_ = [('loc_slots', c_uint), ('live_slots', c_uint),
+                ('dead_slots', c_uint), ('compacting', c_uint),
+                ('live_bytes', c_ulonglong), ('dead_bytes', c_ulonglong),
+                ('file_bytes', c_ulonglong)]
+
+
+class CacheStats(Structure):
+    _fields_ = [('hits', c_ulonglong), ('misses', c_ulonglong),
+                ('cached', c_uint), ('capacity', c_uint)]
+
+
+class VaultValue(Structure):
+    _fields_ = [('offset', c_ulonglong), ('len', c_uint), ('result', c_int),
+                ('type', c_ubyte)]
+
+
+class AuditResult(Structure):
+    _fields_ = [('key', POINTER(c_char)), ('group', c_uint),
+                ('score', c_ubyte), ('weaknesses', c_ubyte)]
+
+
+class AuditReport(Structure):
+    _fields_ = [('audited', c_uint), ('weak', c_uint), ('reused', c_uint),
+                ('groups', c_uint), ('skipped', c_uint)]
+
+
+class VaultEntry(Structure):
+    _fields_ = [('key', POINTER(c_char)), ('m_time', c_ulonglong),
+                ('key_len', c_uint), ('type', c_ubyte), ('deleted', c_ubyte)]
+
+
+# Entries fetched from a cursor at a time when listing keys
+CURSOR_PAGE_SIZE = 256
+
+
 class Vault(Vault_intf):
 
     def __init__(self):
@@ -176,6 +230,88 @@ class Vault(Vault_intf):
         self.vault_lib.last_modified_time.argtypes = [
             POINTER(c_ulonglong), c_char_p
         ]
+        self.vault_lib.set_integrity_mode.argtypes = [
+            POINTER(c_ulonglong), c_ubyte
+        ]
+        self.vault_lib.set_verify_mode.argtypes = [
+            POINTER(c_ulonglong), c_ubyte
+        ]
+        self.vault_lib.set_worker_count.argtypes = [
+            POINTER(c_ulonglong), c_uint
+        ]
+        self.vault_lib.set_read_mode.argtypes = [
+            POINTER(c_ulonglong), c_ubyte
+        ]
+        self.vault_lib.set_cipher_suite.argtypes = [
+            POINTER(c_ulonglong), c_ubyte
+        ]
+        self.vault_lib.get_cipher_suite.argtypes = [
+            POINTER(c_ulonglong), POINTER(c_ubyte)
+        ]
+        self.vault_lib.rekey_vault.argtypes = [
+            POINTER(c_ulonglong), c_char_p, c_ubyte
+        ]
+        self.vault_lib.set_compaction_policy.argtypes = [
+            POINTER(c_ulonglong), c_ubyte, c_ubyte
+        ]
+        self.vault_lib.set_background_compaction.argtypes = [
+            POINTER(c_ulonglong), c_ubyte
+        ]
+        self.vault_lib.get_vault_stats.argtypes = [
+            POINTER(c_ulonglong), POINTER(VaultStats)
+        ]
+        self.vault_lib.set_value_cache.argtypes = [
+            POINTER(c_ulonglong), c_uint, c_uint
+        ]
+        self.vault_lib.get_cache_stats.argtypes = [
+            POINTER(c_ulonglong), POINTER(CacheStats)
+        ]
+        self.vault_lib.expire_cached_values.argtypes = [POINTER(c_ulonglong)]
+        self.vault_lib.open_keys.argtypes = [
+            POINTER(c_ulonglong), POINTER(c_char_p), c_uint, c_void_p,
+            c_ulonglong, POINTER(VaultValue), POINTER(c_ulonglong)
+        ]
+        self.vault_lib.alloc_secure_buffer.restype = c_void_p
+        self.vault_lib.alloc_secure_buffer.argtypes = [c_ulonglong]
+        self.vault_lib.free_secure_buffer.argtypes = [c_void_p]
+        self.vault_lib.audit_vault.argtypes = [
+            POINTER(c_ulonglong), POINTER(AuditResult), c_uint,
+            POINTER(c_uint), POINTER(AuditReport)
+        ]
+        for query in (self.vault_lib.get_keys_with_prefix,
+                      self.vault_lib.get_keys_with_suffix):
+            query.argtypes = [
+                POINTER(c_ulonglong), c_char_p, c_void_p, c_uint,
+                POINTER(c_uint)
+            ]
+        self.vault_lib.get_keys_in_range.argtypes = [
+            POINTER(c_ulonglong), c_char_p, c_char_p, c_void_p, c_uint,
+            POINTER(c_uint)
+        ]
+        self.vault_lib.match_domain_key.argtypes = [
+            POINTER(c_ulonglong), c_char_p, c_char_p
+        ]
+        self.vault_lib.open_cursor.argtypes = [
+            POINTER(c_ulonglong), c_char_p, POINTER(c_void_p)
+        ]
+        self.vault_lib.cursor_next.argtypes = [
+            POINTER(c_ulonglong), c_void_p, POINTER(VaultEntry), c_uint,
+            POINTER(c_uint)
+        ]
+        self.vault_lib.open_type_cursor.argtypes = [
+            POINTER(c_ulonglong), c_ubyte, c_char_p, POINTER(c_void_p)
+        ]
+        self.vault_lib.count_keys_of_type.argtypes = [
+            POINTER(c_ulonglong), c_ubyte, POINTER(c_uint)
+        ]
+        self.vault_lib.close_cursor.argtypes = [c_void_p]
+        self.vault_lib.delete_key_at.argtypes = [
+            POINTER(c_ulonglong), c_char_p, c_ulonglong
+        ]
+        self.vault_lib.keys_modified_since.argtypes = [
+            POINTER(c_ulonglong), c_ulonglong, POINTER(VaultEntry), c_uint,
+            POINTER(c_uint)
+        ]
         self.vault = self.vault_lib.init_vault()
         if self.vault == 0:
             raise InternalVaultException()
@@ -276,6 +412,48 @@ class Vault(Vault_intf):
         else:
             raise InternalVaultException()
 
+    # Returns (type, value) for each of keys as get_value does, or None for
+    # the keys not in the vault, decrypting them all in one call into secure
+    # memory that is wiped once they are copied out
+    def get_values(self, keys):
+        key_params = (c_char_p * len(keys))(*[key.encode('ascii')
+                                              for key in keys])
+        values = (VaultValue * len(keys))()
+        needed = c_ulonglong(0)
+        res = self.vault_lib.open_keys(self.vault, key_params, len(keys), None,
+                                       0, values, byref(needed))
+        if res == 6:
+            raise VaultClosedException()
+        elif res != 12 and res != 0 and res != 10:
+            raise InternalVaultException()
+        buffer = self.vault_lib.alloc_secure_buffer(needed.value)
+        if not buffer:
+            raise InternalVaultException()
+        try:
+            res = self.vault_lib.open_keys(self.vault, key_params, len(keys),
+                                           buffer, needed.value, values,
+                                           byref(needed))
+            if res == 6:
+                raise VaultClosedException()
+            elif res != 0 and res != 10:
+                raise InternalVaultException()
+            ret_val = []
+            for value in values:
+                if value.result == 10:
+                    ret_val.append(None)
+                elif value.result != 0:
+                    raise InternalVaultException()
+                elif value.type == 1:
+                    ret_val.append((1, string_at(buffer + value.offset,
+                                                 value.len).split(b'\0')[0]
+                                    .decode('ascii')))
+                else:
+                    ret_val.append((value.type, string_at(
+                        buffer + value.offset, value.len)))
+            return ret_val
+        finally:
+            self.vault_lib.free_secure_buffer(buffer)
+
     def update_value(self, value_type, key, value, m_time):
         key_param = key.encode('ascii')
         if value_type == 1:
@@ -296,9 +474,15 @@ class Vault(Vault_intf):
         else:
             raise InternalVaultException()
 
-    def delete_value(self, key):
+    # The deletion is recorded at m_time, in seconds like every other time,
+    # or at the current time on the local clock if None. The bank passes its
+    # own time, which follows the server clock
+    def delete_value(self, key, m_time=None):
         key_param = key.encode('ascii')
-        res = self.vault_lib.delete_key(self.vault, key_param)
+        if m_time is None:
+            res = self.vault_lib.delete_key(self.vault, key_param)
+        else:
+            res = self.vault_lib.delete_key_at(self.vault, key_param, m_time)
         if res == 0:
             return True
         elif res == 6:
@@ -350,21 +534,148 @@ class Vault(Vault_intf):
         else:
             raise InternalVaultException()
 
-    def get_vault_keys(self):
+    # Yields (key, m_time, type) for each key in order from start, or only
+    # for the keys of type_ if given, reading them a page at a time through a
+    # cursor straight out of the key map
+    def iter_vault_entries(self, start=None, type_=None):
+        cursor = c_void_p(0)
+        start_param = start.encode('ascii') if start is not None else None
+        if type_ is None:
+            res = self.vault_lib.open_cursor(self.vault, start_param,
+                                             byref(cursor))
+        else:
+            res = self.vault_lib.open_type_cursor(self.vault, type_,
+                                                  start_param, byref(cursor))
+        if res == 6:
+            raise VaultClosedException()
+        elif res != 0:
+            raise InternalVaultException()
+        try:
+            page = (VaultEntry * CURSOR_PAGE_SIZE)()
+            filled = c_uint(0)
+            while True:
+                res = self.vault_lib.cursor_next(self.vault, cursor, page,
+                                                 CURSOR_PAGE_SIZE,
+                                                 byref(filled))
+                if res == 6:
+                    raise VaultClosedException()
+                elif res != 0:
+                    raise InternalVaultException()
+                if filled.value == 0:
+                    return
+                # The page points into the map, so it is read before the
+                # caller can change the vault
+                entries = [(string_at(entry.key,
+                                      entry.key_len).decode('ascii'),
+                            entry.m_time, entry.type)
+                           for entry in page[:filled.value]]
+                yield from entries
+        finally:
+            self.vault_lib.close_cursor(cursor)
+
+    def get_vault_keys(self, type_=None):
+        return [key for key, _, _ in self.iter_vault_entries(type_=type_)]
+
+    def count_keys_of_type(self, type_):
+        count = c_uint(0)
+        res = self.vault_lib.count_keys_of_type(self.vault, type_,
+                                                byref(count))
+        if res == 0:
+            return count.value
+        elif res == 6:
+            raise VaultClosedException()
+        else:
+            raise InternalVaultException()
+
+    # Returns (key, m_time, type, deleted) for each key changed at or after
+    # since, in time order, deletions included
+    def keys_modified_since(self, since):
+        size = CURSOR_PAGE_SIZE
+        while True:
+            page = (VaultEntry * size)()
+            changes = c_uint(0)
+            res = self.vault_lib.keys_modified_since(self.vault, since, page,
+                                                     size, byref(changes))
+            if res == 6:
+                raise VaultClosedException()
+            elif res != 0:
+                raise InternalVaultException()
+            if changes.value <= size:
+                return [(string_at(entry.key, entry.key_len).decode('ascii'),
+                         entry.m_time, entry.type, bool(entry.deleted))
+                        for entry in page[:changes.value]]
+            size = changes.value
+
+    # Audits every password in the vault without decrypting any of them in
+    # Python, returning the totals and (key, score, weaknesses, group) for
+    # each key whose password is weak or shared with other keys
+    def audit(self):
+        size = CURSOR_PAGE_SIZE
+        report = AuditReport()
+        while True:
+            results = (AuditResult * size)()
+            found = c_uint(0)
+            res = self.vault_lib.audit_vault(self.vault, results, size,
+                                             byref(found), byref(report))
+            if res == 6:
+                raise VaultClosedException()
+            elif res == 11:
+                raise FileInvalidException()
+            elif res != 0:
+                raise InternalVaultException()
+            if found.value <= size:
+                totals = {name: getattr(report, name)
+                          for name, _ in report._fields_}
+                return (totals, [(string_at(result.key).decode('ascii'),
+                                  result.score, result.weaknesses,
+                                  result.group)
+                                 for result in results[:found.value]])
+            size = found.value
+
+    # Calls one of the ordered key queries with room for every key in the
+    # vault, returning the matching keys in order
+    def _ordered_keys(self, query, *bounds):
         num_keys = self.vault_lib.num_vault_keys(self.vault)
         ret_type = POINTER(c_char) * num_keys
         ret_val = ret_type()
         for i in range(num_keys):
             ret_val[i] = create_string_buffer(130)
-        res = self.vault_lib.get_vault_keys(self.vault, ret_val)
+        num_results = c_uint(0)
+        res = query(self.vault, *bounds, ret_val, num_keys, byref(num_results))
         if res == 6:
             raise VaultClosedException()
-        elif res == 2:
+        elif res != 0:
+            raise InternalVaultException()
+        count = min(num_results.value, num_keys)
+        return [string_at(ret_val[i]).decode('ascii') for i in range(count)]
+
+    def get_keys_with_prefix(self, prefix):
+        return self._ordered_keys(self.vault_lib.get_keys_with_prefix,
+                                  prefix.encode('ascii'))
+
+    def get_keys_with_suffix(self, suffix):
+        return self._ordered_keys(self.vault_lib.get_keys_with_suffix,
+                                  suffix.encode('ascii'))
+
+    # Keys from first up to but not including last, either may be None
+    def get_keys_in_range(self, first=None, last=None):
+        return self._ordered_keys(
+            self.vault_lib.get_keys_in_range,
+            first.encode('ascii') if first is not None else None,
+            last.encode('ascii') if last is not None else None)
+
+    def match_domain(self, domain):
+        result = create_string_buffer(130)
+        res = self.vault_lib.match_domain_key(self.vault,
+                                              domain.encode('ascii'), result)
+        if res == 0:
+            return result.value.decode('ascii')
+        elif res == 10:
+            return domain
+        elif res == 6:
+            raise VaultClosedException()
+        else:
             raise InternalVaultException()
-        python_strings = []
-        for i in range(num_keys):
-            python_strings.append(string_at(ret_val[i]).decode('ascii'))
-        return python_strings
 
     def add_encrypted_value(self, type_, key, encrypted_value, m_time):
         key_param = key.encode('ascii')
@@ -401,6 +712,174 @@ class Vault(Vault_intf):
         else:
             raise InternalVaultException()
 
+    def set_integrity_mode(self, mode):
+        res = self.vault_lib.set_integrity_mode(self.vault, mode)
+        if res == 6:
+            raise VaultClosedException()
+        elif res == 0:
+            return True
+        elif res == 11:
+            raise FileInvalidException()
+        else:
+            raise InternalVaultException()
+
+    def set_verify_mode(self, mode):
+        res = self.vault_lib.set_verify_mode(self.vault, mode)
+        if res == 6:
+            raise VaultClosedException()
+        elif res == 0:
+            return True
+        else:
+            raise InternalVaultException()
+
+    def set_worker_count(self, count):
+        res = self.vault_lib.set_worker_count(self.vault, count)
+        if res == 0:
+            return True
+        else:
+            raise InternalVaultException()
+
+    def set_read_mode(self, mode):
+        res = self.vault_lib.set_read_mode(self.vault, mode)
+        if res == 0:
+            return True
+        else:
+            raise InternalVaultException()
+
+    def set_cipher_suite(self, suite):
+        res = self.vault_lib.set_cipher_suite(self.vault, suite)
+        if res == 0:
+            return True
+        else:
+            raise InternalVaultException()
+
+    def get_cipher_suite(self):
+        suite = c_ubyte(0)
+        res = self.vault_lib.get_cipher_suite(self.vault, byref(suite))
+        if res == 0:
+            return suite.value
+        elif res == 6:
+            raise VaultClosedException()
+        else:
+            raise InternalVaultException()
+
+    # Replaces the master key, keeping the cipher suite unless one is given
+    def rekey(self, password, suite=None):
+        if suite is None:
+            suite = self.get_cipher_suite()
+        res = self.vault_lib.rekey_vault(self.vault, password.encode('ascii'),
+                                         suite)
+        if res == 0:
+            return True
+        elif res == 13:
+            raise WrongPasswordException()
+        elif res == 6:
+            raise VaultClosedException()
+        elif res == 11:
+            raise FileInvalidException()
+        else:
+            raise InternalVaultException()
+
+    def set_compaction_policy(self, garbage_percent, fill_percent):
+        res = self.vault_lib.set_compaction_policy(self.vault, garbage_percent,
+                                                   fill_percent)
+        if res == 0:
+            return True
+        else:
+            raise InternalVaultException()
+
+    def set_background_compaction(self, enabled):
+        res = self.vault_lib.set_background_compaction(self.vault, enabled)
+        if res == 0:
+            return True
+        else:
+            raise InternalVaultException()
+
+    def get_stats(self):
+        stats = VaultStats()
+        res = self.vault_lib.get_vault_stats(self.vault, byref(stats))
+        if res == 0:
+            return {name: getattr(stats, name) for name, _ in stats._fields_}
+        elif res == 6:
+            raise VaultClosedException()
+        else:
+            raise InternalVaultException()
+
+    # Keeps up to capacity decrypted values for ttl seconds, zero for no limit
+    def set_value_cache(self, capacity, ttl):
+        res = self.vault_lib.set_value_cache(self.vault, capacity, ttl)
+        if res == 0:
+            return True
+        else:
+            raise InternalVaultException()
+
+    def get_cache_stats(self):
+        stats = CacheStats()
+        res = self.vault_lib.get_cache_stats(self.vault, byref(stats))
+        if res == 0:
+            return {name: getattr(stats, name) for name, _ in stats._fields_}
+        else:
+            raise InternalVaultException()
+
+    def expire_cached_values(self):
+        res = self.vault_lib.expire_cached_values(self.vault)
+        if res == 0:
+            return True
+        else:
+            raise InternalVaultException()
+
+    def compact(self):
+        res = self.vault_lib.compact_vault(self.vault)
+        if res == 0:
+            return True
+        elif res == 6:
+            raise VaultClosedException()
+        elif res == 11:
+            raise FileInvalidException()
+        else:
+            raise InternalVaultException()
+
+    def begin_transaction(self):
+        res = self.vault_lib.vault_begin(self.vault)
+        if res == 0:
+            return True
+        elif res == 6:
+            raise VaultClosedException()
+        else:
+            raise InternalVaultException()
+
+    def commit_transaction(self):
+        res = self.vault_lib.vault_commit(self.vault)
+        if res == 0:
+            return True
+        elif res == 6:
+            raise VaultClosedException()
+        else:
+            raise InternalVaultException()
+
+    def abort_transaction(self):
+        res = self.vault_lib.vault_abort(self.vault)
+        if res == 0:
+            return True
+        elif res == 6:
+            raise VaultClosedException()
+        elif res == 11:
+            raise FileInvalidException()
+        else:
+            raise InternalVaultException()
+
+    # Queues the changes made inside it and writes them all at once on
+    # leaving, or drops them if an exception is raised
+    @contextmanager
+    def transaction(self):
+        self.begin_transaction()
+        try:
+            yield self
+        except BaseException:
+            self.abort_transaction()
+            raise
+        self.commit_transaction()
+
     def get_vault_header(self):
         ret_val = create_string_buffer(104)
         res = self.vault_lib.get_header(self.vault, ret_val)
@@ -631,4 +1110,34 @@ if __name__ == "__main__":
     except WrongPasswordException:
         pass
     assert v.open_vault("./", "test2", "str0nk3stp@ssw0rd") == True
+    v.set_integrity_mode(2)
+    v.set_verify_mode(1)
+    v.add_key(1, "merkle", "treepass", 123)
+    v.close_vault()
+    assert v.open_vault("./", "test2", "str0nk3stp@ssw0rd") == True
+    assert v.get_value("merkle") == (1, "treepass")
+    assert v.get_value("google") == (1, "newpass")
+    with v.transaction():
+        v.delete_value("merkle")
+        v.update_value(1, "google", "txnpass", 124)
+        for i in range(50):
+            v.add_key(1, "txn" + str(i), "txnpass", 124)
+        assert v.get_value("txn7") == (1, "txnpass")
+    try:
+        with v.transaction():
+            v.add_key(1, "aborted", "abortpass", 124)
+            raise KeyException()
+    except KeyException:
+        pass
+    v.close_vault()
+    assert v.open_vault("./", "test2", "str0nk3stp@ssw0rd") == True
+    assert v.get_value("google") == (1, "txnpass")
+    assert v.get_value("txn49") == (1, "txnpass")
+    assert "merkle" not in v.get_vault_keys()
+    assert "aborted" not in v.get_vault_keys()
+    stats = v.get_stats()
+    assert stats['live_slots'] == len(v.get_vault_keys())
+    v.compact()
+    assert v.get_stats()['dead_bytes'] == 0
+    assert v.get_value("txn49") == (1, "txnpass")
     v.close_vault()
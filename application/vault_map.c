@@ -5,148 +5,837 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct node {
-  struct node* next_node;
-  char key[BOX_KEY_SIZE];
-  struct key_info* info;
+// The map is an open addressing hash table using Robin Hood probing, where
+// an entry being placed takes the bucket of any entry closer to its own home
+// bucket, and deleting shifts the entries after it back. Buckets hold the hash
+// and probe distance next to a pointer to the record, so probing only touches
+// the table, and keys are compared only on a matching hash. Keys are hashed
+// with SipHash, keyed randomly for each map, so the layout cannot be
+// predicted from them.
+//
+// Records hold the key info and the key, taking only the key's length, and
+// are carved out of chunks of guarded memory from sodium_malloc. Records of a
+// deleted key are kept on a free list for their size class and reused by the
+// next key of that size, and the chunks are all freed when the map is.
+//
+// A map can be saved as an image holding its hash key, its size and each
+// entry with the bucket it is in, so that loading the image puts every entry
+// straight back into its bucket without hashing any keys. The image is
+//
+// HASH_KEY | SIZE | ENTRIES | INDEX | HASH | M_TIME | LOC | TYPE | KLEN | KEY
+//    16       4       4        4       4       8       4     1      1   KLEN
+//
+// with the fields from the index on repeated for each entry, in bucket order.
+//
+// Keys can also be found in order, by prefix, by suffix or by range, through
+// two sorted arrays of pointers to the records, one in key order and one in
+// the order of the keys read backwards so that keys sharing a suffix, such as
+// the subdomains of a domain, are next to each other. The arrays are only
+// built by the first ordered query, so opening a vault and exact lookups pay
+// nothing for them, and from then on are kept sorted as keys are added and
+// deleted. Should they not be able to grow they are dropped and built again.
+// Arrays ordered by modification time, and by type, and then by key, are each
+// built the same way by the first query that needs them, and a count of the
+// keys of each type is always kept.
+
+#define MIN_CAPACITY 16
+#define MAX_LOAD_PERCENT 50  // Table doubles once this full
+
+#define CLASS_SIZE 16  // Records are rounded up to a multiple of this
+#define NUM_CLASSES (record_class(BOX_KEY_SIZE - 1) + 1)
+#define MIN_CHUNK_SIZE 16384
+#define MAX_CHUNK_SIZE (4 * 1024 * 1024)
+#define EXPECTED_RECORD_SIZE 48  // Used to size the first chunk
+
+#define IMAGE_HEADER_SIZE (crypto_shorthash_KEYBYTES + 8)
+#define IMAGE_ENTRY_SIZE 22  // Bytes of each entry in an image besides the key
+
+struct record {
+  union {
+    struct key_info info;
+    struct record* next_free;
+  };
+  char key[];
+};
+
+// Size class of a record holding a key of key_length and its terminator
+#define record_class(key_length) \
+  ((sizeof(struct record) + (key_length) + CLASS_SIZE) / CLASS_SIZE)
+
+struct bucket {
+  uint32_t hash;
+  uint32_t distance;  // One more than the distance from home, zero if empty
+  struct record* record;
 };
 
+struct chunk {
+  struct chunk* next;
+  size_t size;
+  size_t used;
+};
+
+// An array of the records ordered by one of their values and then by key
+struct value_index {
+  struct record** records;  // NULL until the index is built
+  uint32_t capacity;
+};
+
+#define NUM_VALUE_ORDERS 2  // Orders from ORDER_TIME on use value indexes
+#define VALUE_INDEX(map, order) (&(map)->by_value[(order) - ORDER_TIME])
+
 struct vault_map {
-  uint32_t size;
+  uint32_t size;  // Always a power of two
   uint32_t num_entries;
-  struct node** node_table;
+  size_t key_bytes;  // Total length of the keys, with their terminators
+  uint8_t hash_key[crypto_shorthash_KEYBYTES];
+  struct bucket* buckets;
+  struct chunk* chunks;
+  struct record* free_lists[NUM_CLASSES];
+  struct record** by_key;     // NULL until the ordered index is built
+  struct record** by_suffix;  // Ordered by the keys read backwards
+  uint32_t index_capacity;
+  struct value_index by_value[NUM_VALUE_ORDERS];
+  uint32_t type_counts[256];  // Keys of each type, kept without any index
 };
 
-struct vault_map* init_map(uint32_t size) {
-  struct vault_map* map = malloc(sizeof(struct vault_map));
+typedef int (*key_compare)(const char*, const char*, size_t);
+
+uint32_t map_capacity(uint32_t entries) {
+  uint64_t needed = (uint64_t)entries * 100 / MAX_LOAD_PERCENT + 1;
+  uint32_t size = MIN_CAPACITY;
+  while (size < needed && size < (1u << 31)) {
+    size <<= 1;
+  }
+  return size;
+}
+
+// Adds a chunk of at least size bytes, kept a multiple of the page size so
+// that sodium_malloc returns it aligned
+uint8_t map_add_chunk(struct vault_map* map, size_t size) {
+  size_t page = 4096;
+  size = (size + sizeof(struct chunk) + page - 1) / page * page;
+  struct chunk* chunk = sodium_malloc(size);
+  if (chunk == NULL) {
+    return 1;
+  }
+  chunk->next = map->chunks;
+  chunk->size = size;
+  chunk->used = (sizeof(struct chunk) + CLASS_SIZE - 1) / CLASS_SIZE *
+                CLASS_SIZE;
+  map->chunks = chunk;
+  return 0;
+}
+
+// Returns a record for a key of key_length, or NULL if out of memory
+struct record* map_alloc_record(struct vault_map* map, size_t key_length) {
+  size_t class = record_class(key_length);
+  struct record* record = map->free_lists[class];
+  if (record != NULL) {
+    map->free_lists[class] = record->next_free;
+    return record;
+  }
+
+  size_t size = class * CLASS_SIZE;
+  struct chunk* chunk = map->chunks;
+  if (chunk == NULL || chunk->size - chunk->used < size) {
+    // Chunks grow with the map so large vaults take few of them
+    size_t grow = chunk == NULL ? MIN_CHUNK_SIZE : chunk->size * 2;
+    if (map_add_chunk(map, grow < MAX_CHUNK_SIZE ? grow : MAX_CHUNK_SIZE)) {
+      return NULL;
+    }
+    chunk = map->chunks;
+  }
+  record = (struct record*)((uint8_t*)chunk + chunk->used);
+  chunk->used += size;
+  return record;
+}
+
+// Expects size to be a power of two
+uint8_t map_alloc_buckets(struct vault_map* map, uint32_t size) {
+  struct bucket* buckets = calloc(size, sizeof(struct bucket));
+  if (buckets == NULL) {
+    return 1;
+  }
   map->size = size;
-  map->num_entries = 0;
-  map->node_table = malloc(sizeof(struct node) * size);
-  for (uint32_t i = 0; i < size; ++i) {
-    map->node_table[i] = NULL;
+  map->buckets = buckets;
+  return 0;
+}
+
+// Size is the number of keys the map is expected to hold, it grows past this
+struct vault_map* init_map(uint32_t size) {
+  struct vault_map* map = calloc(1, sizeof(struct vault_map));
+  if (map == NULL) {
+    return NULL;
   }
+  size_t records = (size_t)size * EXPECTED_RECORD_SIZE;
+  if (map_alloc_buckets(map, map_capacity(size)) ||
+      map_add_chunk(map, records < MIN_CHUNK_SIZE ? MIN_CHUNK_SIZE : records)) {
+    free(map->buckets);
+    free(map);
+    return NULL;
+  }
+  randombytes_buf(map->hash_key, sizeof map->hash_key);
   return map;
 }
 
 void delete_map(struct vault_map* map) {
-  for (uint32_t i = 0; i < map->size; ++i) {
-    if (!map->node_table[i]) {
-      continue;
+  struct chunk* chunk = map->chunks;
+  while (chunk) {
+    struct chunk* next = chunk->next;
+    sodium_free(chunk);
+    chunk = next;
+  }
+  free(map->buckets);
+  free(map->by_key);
+  free(map->by_suffix);
+  for (int i = 0; i < NUM_VALUE_ORDERS; ++i) {
+    free(map->by_value[i].records);
+  }
+  sodium_memzero(map, sizeof(struct vault_map));
+  free(map);
+}
+
+uint32_t hash_func(const struct vault_map* map, const char* key,
+                   size_t key_length) {
+  uint8_t hash[crypto_shorthash_BYTES];
+  crypto_shorthash(hash, (const uint8_t*)key, key_length, map->hash_key);
+
+  uint32_t converted_hash;
+  memcpy(&converted_hash, hash, sizeof converted_hash);
+  return converted_hash;
+}
+
+// Places a record known not to be in the map, which must have a free bucket
+void map_place(struct vault_map* map, uint32_t hash, struct record* record) {
+  uint32_t mask = map->size - 1;
+  struct bucket carried = {hash, 1, record};
+  uint32_t index = hash & mask;
+  while (map->buckets[index].distance) {
+    if (map->buckets[index].distance < carried.distance) {
+      struct bucket swapped = map->buckets[index];
+      map->buckets[index] = carried;
+      carried = swapped;
     }
+    index = (index + 1) & mask;
+    carried.distance++;
+  }
+  map->buckets[index] = carried;
+}
 
-    struct node* bucket = map->node_table[i];
-    while (bucket) {
-      free(bucket->info);
-      struct node* temp = bucket->next_node;
-      free(bucket);
-      bucket = temp;
+// Returns the bucket holding key, or size if it is not in the map
+uint32_t map_find(const struct vault_map* map, const char* key,
+                  size_t key_length) {
+  uint32_t mask = map->size - 1;
+  uint32_t hash = hash_func(map, key, key_length);
+  uint32_t index = hash & mask;
+  for (uint32_t distance = 1;; ++distance) {
+    const struct bucket* bucket = &map->buckets[index];
+    // Robin Hood order means the key would have been placed before this
+    if (bucket->distance < distance) {
+      return map->size;
     }
+    if (bucket->hash == hash &&
+        strncmp(bucket->record->key, key, BOX_KEY_SIZE) == 0) {
+      return index;
+    }
+    index = (index + 1) & mask;
   }
-  free(map->node_table);
-  free(map);
 }
 
-// https://crypto.stackexchange.com/questions/2043/
-uint32_t hash_func(const char* key, uint32_t size) {
-  uint8_t hash[HASH_SIZE];
+uint8_t map_grow(struct vault_map* map) {
+  uint32_t old_size = map->size;
+  struct bucket* old_buckets = map->buckets;
+  if (old_size >= (1u << 31) || map_alloc_buckets(map, old_size << 1)) {
+    return 1;
+  }
+  for (uint32_t i = 0; i < old_size; ++i) {
+    if (old_buckets[i].distance) {
+      map_place(map, old_buckets[i].hash, old_buckets[i].record);
+    }
+  }
+  free(old_buckets);
+  return 0;
+}
+
+// Compares at most limit characters from the ends of key and target, so a
+// key ending in target compares equal to it when limit is its length
+int suffix_compare(const char* key, const char* target, size_t limit) {
   size_t key_length = strlen(key);
-  if (key_length > BOX_KEY_SIZE) {
-    exit(1);
+  size_t target_length = strlen(target);
+  for (size_t i = 0; i < limit; ++i) {
+    if (i == key_length || i == target_length) {
+      return (i < key_length) - (i < target_length);
+    }
+    uint8_t a = key[key_length - 1 - i];
+    uint8_t b = target[target_length - 1 - i];
+    if (a != b) {
+      return a < b ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+int record_compare(const void* a, const void* b) {
+  return strcmp((*(struct record* const*)a)->key,
+                (*(struct record* const*)b)->key);
+}
+
+int record_suffix_compare(const void* a, const void* b) {
+  return suffix_compare((*(struct record* const*)a)->key,
+                        (*(struct record* const*)b)->key, BOX_KEY_SIZE);
+}
+
+// Returns the first position in index whose key compares at least equal to
+// target, or greater than it if after is set
+uint32_t index_search(struct record** index, uint32_t count,
+                      key_compare compare, const char* target, size_t limit,
+                      uint8_t after) {
+  uint32_t low = 0;
+  uint32_t high = count;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    int order = compare(index[middle]->key, target, limit);
+    if (order < 0 || (after && order == 0)) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+// Returns the value a value index orders the record by, before its key
+uint64_t record_value(const struct record* record, uint8_t order) {
+  return order == ORDER_TIME ? record->info.m_time : record->info.type;
+}
+
+// Compares the record with value and key in the given order, by value and
+// then by key, with a NULL key coming before every key of its value
+int value_compare(const struct record* record, uint8_t order, uint64_t value,
+                  const char* key) {
+  uint64_t record_at = record_value(record, order);
+  if (record_at != value) {
+    return record_at < value ? -1 : 1;
+  }
+  return key ? strcmp(record->key, key) : 1;
+}
+
+int record_time_compare(const void* a, const void* b) {
+  const struct record* second = *(struct record* const*)b;
+  return value_compare(*(struct record* const*)a, ORDER_TIME,
+                       second->info.m_time, second->key);
+}
+
+int record_type_compare(const void* a, const void* b) {
+  const struct record* second = *(struct record* const*)b;
+  return value_compare(*(struct record* const*)a, ORDER_TYPE,
+                       second->info.type, second->key);
+}
+
+// Returns the first position in a value index not before value and key
+uint32_t value_search(struct record** index, uint32_t count, uint8_t order,
+                      uint64_t value, const char* key) {
+  uint32_t low = 0;
+  uint32_t high = count;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (value_compare(index[middle], order, value, key) < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+// Returns the array with room for one more record than count, or NULL if it
+// could not grow, in which case the array is left as it was
+struct record** index_reserve(struct record** index, uint32_t count,
+                              uint32_t* capacity) {
+  if (count < *capacity) {
+    return index;
+  }
+  struct record** grown =
+      realloc(index, sizeof(struct record*) * *capacity * 2);
+  if (grown != NULL) {
+    *capacity *= 2;
+  }
+  return grown;
+}
+
+void map_drop_index(struct vault_map* map) {
+  free(map->by_key);
+  free(map->by_suffix);
+  map->by_key = NULL;
+  map->by_suffix = NULL;
+  map->index_capacity = 0;
+}
+
+uint8_t map_build_index(struct vault_map* map) {
+  if (map->by_key != NULL) {
+    return 0;
   }
-  crypto_generichash(hash, sizeof hash, (uint8_t*)key, key_length, NULL, 0);
+  uint32_t capacity = map->num_entries < MIN_CAPACITY ? MIN_CAPACITY
+                                                      : map->num_entries;
+  map->by_key = malloc(sizeof(struct record*) * capacity);
+  map->by_suffix = malloc(sizeof(struct record*) * capacity);
+  if (map->by_key == NULL || map->by_suffix == NULL) {
+    map_drop_index(map);
+    return 1;
+  }
+  map->index_capacity = capacity;
 
-  // This is safe as the entire hash is distributed equally
-  // Creates a slightly higher probablity of collision
-  // Okay because its used in a hash table
-  uint64_t* converted_hash = (uint64_t*)&hash;
-  return (*converted_hash) % size;
+  uint32_t count = 0;
+  for (uint32_t index = 0; index < map->size; ++index) {
+    if (map->buckets[index].distance) {
+      map->by_key[count++] = map->buckets[index].record;
+    }
+  }
+  qsort(map->by_key, count, sizeof(struct record*), record_compare);
+  memcpy(map->by_suffix, map->by_key, sizeof(struct record*) * count);
+  qsort(map->by_suffix, count, sizeof(struct record*), record_suffix_compare);
+  return 0;
 }
 
-// Expects that info is malloced
+uint8_t map_build_values(struct vault_map* map, uint8_t order) {
+  struct value_index* index = VALUE_INDEX(map, order);
+  if (index->records != NULL) {
+    return 0;
+  }
+  uint32_t capacity = map->num_entries < MIN_CAPACITY ? MIN_CAPACITY
+                                                      : map->num_entries;
+  index->records = malloc(sizeof(struct record*) * capacity);
+  if (index->records == NULL) {
+    return 1;
+  }
+  index->capacity = capacity;
+
+  uint32_t count = 0;
+  for (uint32_t bucket = 0; bucket < map->size; ++bucket) {
+    if (map->buckets[bucket].distance) {
+      index->records[count++] = map->buckets[bucket].record;
+    }
+  }
+  qsort(index->records, count, sizeof(struct record*),
+        order == ORDER_TIME ? record_time_compare : record_type_compare);
+  return 0;
+}
+
+// Inserts a record not yet counted in num_entries into the indexes built
+void map_index_insert(struct vault_map* map, struct record* record) {
+  uint32_t count = map->num_entries;
+  if (map->by_key != NULL) {
+    uint32_t key_capacity = map->index_capacity;
+    uint32_t suffix_capacity = map->index_capacity;
+    struct record** by_key = index_reserve(map->by_key, count, &key_capacity);
+    if (by_key != NULL) {
+      map->by_key = by_key;
+    }
+    struct record** by_suffix =
+        by_key ? index_reserve(map->by_suffix, count, &suffix_capacity)
+               : NULL;
+    if (by_suffix == NULL) {
+      map_drop_index(map);
+    } else {
+      map->by_suffix = by_suffix;
+      map->index_capacity = key_capacity;
+    }
+  }
+  if (map->by_key != NULL) {
+    uint32_t position = index_search(map->by_key, count, strncmp, record->key,
+                                     BOX_KEY_SIZE, 0);
+    memmove(map->by_key + position + 1, map->by_key + position,
+            sizeof(struct record*) * (count - position));
+    map->by_key[position] = record;
+    position = index_search(map->by_suffix, count, suffix_compare,
+                            record->key, BOX_KEY_SIZE, 0);
+    memmove(map->by_suffix + position + 1, map->by_suffix + position,
+            sizeof(struct record*) * (count - position));
+    map->by_suffix[position] = record;
+  }
+
+  for (uint8_t order = ORDER_TIME; order < ORDER_TIME + NUM_VALUE_ORDERS;
+       ++order) {
+    struct value_index* index = VALUE_INDEX(map, order);
+    if (index->records == NULL) {
+      continue;
+    }
+    struct record** records =
+        index_reserve(index->records, count, &index->capacity);
+    if (records == NULL) {
+      free(index->records);
+      index->records = NULL;
+      index->capacity = 0;
+      continue;
+    }
+    index->records = records;
+    uint32_t position = value_search(records, count, order,
+                                     record_value(record, order), record->key);
+    memmove(records + position + 1, records + position,
+            sizeof(struct record*) * (count - position));
+    records[position] = record;
+  }
+}
+
+// Removes a record still counted in num_entries from the indexes built
+void map_index_remove(struct vault_map* map, const struct record* record) {
+  uint32_t count = map->num_entries;
+  if (map->by_key != NULL) {
+    uint32_t position = index_search(map->by_key, count, strncmp, record->key,
+                                     BOX_KEY_SIZE, 0);
+    memmove(map->by_key + position, map->by_key + position + 1,
+            sizeof(struct record*) * (count - position - 1));
+    position = index_search(map->by_suffix, count, suffix_compare,
+                            record->key, BOX_KEY_SIZE, 0);
+    memmove(map->by_suffix + position, map->by_suffix + position + 1,
+            sizeof(struct record*) * (count - position - 1));
+  }
+  for (uint8_t order = ORDER_TIME; order < ORDER_TIME + NUM_VALUE_ORDERS;
+       ++order) {
+    struct record** records = VALUE_INDEX(map, order)->records;
+    if (records == NULL) {
+      continue;
+    }
+    uint32_t position = value_search(records, count, order,
+                                     record_value(record, order), record->key);
+    memmove(records + position, records + position + 1,
+            sizeof(struct record*) * (count - position - 1));
+  }
+}
+
+// The key info is copied into the map
 uint8_t add_entry(struct vault_map* map, const char* key,
-                  struct key_info* info) {
+                  const struct key_info* info) {
   if (map == NULL || key == NULL || info == NULL) {
     return 1;
   }
-  if (strlen(key) > BOX_KEY_SIZE) {
+  size_t key_length = strnlen(key, BOX_KEY_SIZE);
+  if (key_length == BOX_KEY_SIZE) {
     return 2;
   }
-  uint32_t bucket_num = hash_func(key, map->size);
-  struct node** where_to_place = &(map->node_table[bucket_num]);
-  struct node* bucket = map->node_table[bucket_num];
-  while (bucket) {
-    if (strncmp(bucket->key, key, BOX_KEY_SIZE) == 0) {
-      return 3;
-    }
-    where_to_place = &bucket->next_node;
-    bucket = bucket->next_node;
-  }
-  bucket = malloc(sizeof(struct node));
-  bucket->next_node = NULL;
-  strncpy(bucket->key, key, BOX_KEY_SIZE);
-  bucket->info = info;
-  *where_to_place = bucket;
+  if (map_find(map, key, key_length) != map->size) {
+    return 3;
+  }
+  if ((uint64_t)(map->num_entries + 1) * 100 >
+          (uint64_t)map->size * MAX_LOAD_PERCENT &&
+      map_grow(map)) {
+    return 4;
+  }
+
+  struct record* record = map_alloc_record(map, key_length);
+  if (record == NULL) {
+    return 4;
+  }
+  record->info = *info;
+  memcpy(record->key, key, key_length + 1);
+  map_place(map, hash_func(map, key, key_length), record);
+  map_index_insert(map, record);
   (map->num_entries)++;
+  map->type_counts[info->type]++;
+  map->key_bytes += key_length + 1;
   return 0;
 }
+
 // Do not delete result, shared pointer
 struct key_info* get_info(struct vault_map* map, const char* key) {
   if (map == NULL || key == NULL) {
     return NULL;
   }
-  if (strlen(key) > BOX_KEY_SIZE) {
+  size_t key_length = strnlen(key, BOX_KEY_SIZE);
+  if (key_length == BOX_KEY_SIZE) {
     return NULL;
   }
-  uint32_t bucket_num = hash_func(key, map->size);
-  struct node* bucket = map->node_table[bucket_num];
-  while (bucket) {
-    if (strncmp(bucket->key, key, BOX_KEY_SIZE) == 0) {
-      return bucket->info;
-    }
-    bucket = bucket->next_node;
-  }
-  return NULL;
+  uint32_t index = map_find(map, key, key_length);
+  return index == map->size ? NULL : &map->buckets[index].record->info;
 }
 
 uint8_t delete_entry(struct vault_map* map, const char* key) {
   if (map == NULL || key == NULL) {
     return 1;
   }
-  if (strlen(key) > BOX_KEY_SIZE) {
+  size_t key_length = strnlen(key, BOX_KEY_SIZE);
+  if (key_length == BOX_KEY_SIZE) {
     return 2;
   }
-  uint32_t bucket_num = hash_func(key, map->size);
-  struct node** where_to_place = &(map->node_table[bucket_num]);
-  struct node* bucket = map->node_table[bucket_num];
-  while (bucket) {
-    if (strncmp(bucket->key, key, BOX_KEY_SIZE) == 0) {
-      *where_to_place = bucket->next_node;
-      free(bucket->info);
-      free(bucket);
-      (map->num_entries)--;
-      return 0;
-    }
-    where_to_place = &bucket->next_node;
-    bucket = bucket->next_node;
+  uint32_t index = map_find(map, key, key_length);
+  if (index == map->size) {
+    return 0;
+  }
+
+  struct record* record = map->buckets[index].record;
+  map_index_remove(map, record);
+  map->type_counts[record->info.type]--;
+  size_t class = record_class(key_length);
+  sodium_memzero(record, class * CLASS_SIZE);
+  record->next_free = map->free_lists[class];
+  map->free_lists[class] = record;
+
+  // Entries after the deleted one are shifted back until one is at home
+  uint32_t mask = map->size - 1;
+  uint32_t next = (index + 1) & mask;
+  while (map->buckets[next].distance > 1) {
+    map->buckets[index] = map->buckets[next];
+    map->buckets[index].distance--;
+    index = next;
+    next = (next + 1) & mask;
   }
+  map->buckets[index].distance = 0;
+  map->buckets[index].record = NULL;
+  (map->num_entries)--;
+  map->key_bytes -= key_length + 1;
   return 0;
 }
 
+// The keys are returned in one allocation, with the strings after the
+// pointers to them, so freeing the result frees them all
 char** get_keys(struct vault_map* map) {
   if (map == NULL) {
     return NULL;
   }
-  char** keys = malloc(sizeof(char*) * (map->num_entries));
+  char** keys = malloc(sizeof(char*) * map->num_entries + map->key_bytes);
+  if (keys == NULL) {
+    return NULL;
+  }
+  char* next_key = (char*)(keys + map->num_entries);
   uint32_t key_index = 0;
   for (uint32_t bucket_index = 0; bucket_index < map->size; ++bucket_index) {
-    struct node* bucket = map->node_table[bucket_index];
-    while (bucket) {
-      keys[key_index] = malloc((strlen(bucket->key) + 1) * sizeof(char));
-      strcpy(keys[key_index++], bucket->key);
-      bucket = bucket->next_node;
+    if (map->buckets[bucket_index].distance) {
+      const char* key = map->buckets[bucket_index].record->key;
+      size_t key_size = strlen(key) + 1;
+      memcpy(next_key, key, key_size);
+      keys[key_index++] = next_key;
+      next_key += key_size;
     }
   }
   return keys;
 }
 
 uint32_t num_keys(struct vault_map* map) { return map->num_entries; }
+
+// Sets first to the position in key order of the first key starting with
+// prefix and count to how many keys do
+uint8_t find_prefix(struct vault_map* map, const char* prefix,
+                    uint32_t* first, uint32_t* count) {
+  if (map == NULL || prefix == NULL || first == NULL || count == NULL) {
+    return 1;
+  }
+  if (map_build_index(map)) {
+    return 4;
+  }
+  size_t length = strnlen(prefix, BOX_KEY_SIZE);
+  *first = index_search(map->by_key, map->num_entries, strncmp, prefix,
+                        length, 0);
+  *count = index_search(map->by_key, map->num_entries, strncmp, prefix,
+                        length, 1) - *first;
+  return 0;
+}
+
+// Sets first to the position in suffix order of the first key ending with
+// suffix and count to how many keys do
+uint8_t find_suffix(struct vault_map* map, const char* suffix,
+                    uint32_t* first, uint32_t* count) {
+  if (map == NULL || suffix == NULL || first == NULL || count == NULL) {
+    return 1;
+  }
+  if (map_build_index(map)) {
+    return 4;
+  }
+  size_t length = strnlen(suffix, BOX_KEY_SIZE);
+  *first = index_search(map->by_suffix, map->num_entries, suffix_compare,
+                        suffix, length, 0);
+  *count = index_search(map->by_suffix, map->num_entries, suffix_compare,
+                        suffix, length, 1) - *first;
+  return 0;
+}
+
+// Sets first to the position in key order of the first key not before low
+// and count to how many keys there are from it up to, but not including,
+// high. Either bound can be NULL to leave that end of the range open
+uint8_t find_range(struct vault_map* map, const char* low, const char* high,
+                   uint32_t* first, uint32_t* count) {
+  if (map == NULL || first == NULL || count == NULL) {
+    return 1;
+  }
+  if (map_build_index(map)) {
+    return 4;
+  }
+  uint32_t end = map->num_entries;
+  *first = low ? index_search(map->by_key, end, strncmp, low, BOX_KEY_SIZE, 0)
+               : 0;
+  if (high) {
+    end = index_search(map->by_key, end, strncmp, high, BOX_KEY_SIZE, 0);
+  }
+  *count = end > *first ? end - *first : 0;
+  return 0;
+}
+
+// Sets first to the position in time order of the first key modified at or
+// after since and count to how many keys were
+uint8_t find_modified(struct vault_map* map, uint64_t since, uint32_t* first,
+                      uint32_t* count) {
+  if (map == NULL || first == NULL || count == NULL) {
+    return 1;
+  }
+  if (map_build_values(map, ORDER_TIME)) {
+    return 4;
+  }
+  *first = value_search(VALUE_INDEX(map, ORDER_TIME)->records,
+                        map->num_entries, ORDER_TIME, since, NULL);
+  *count = map->num_entries - *first;
+  return 0;
+}
+
+// Sets first to the position in type order of the first key of type not
+// before start, or the first key of type if start is NULL, and count to how
+// many keys of type there are from it on
+uint8_t find_type(struct vault_map* map, uint8_t type, const char* start,
+                  uint32_t* first, uint32_t* count) {
+  if (map == NULL || first == NULL || count == NULL) {
+    return 1;
+  }
+  if (map_build_values(map, ORDER_TYPE)) {
+    return 4;
+  }
+  struct record** records = VALUE_INDEX(map, ORDER_TYPE)->records;
+  *first = value_search(records, map->num_entries, ORDER_TYPE, type, start);
+  *count = value_search(records, map->num_entries, ORDER_TYPE,
+                        (uint64_t)type + 1, NULL) -
+           *first;
+  return 0;
+}
+
+// Returns how many keys of type the map holds, which needs no index
+uint32_t count_type(struct vault_map* map, uint8_t type) {
+  return map->type_counts[type];
+}
+
+// Returns the key at position in the given order, or NULL if the index for it
+// has not been built by a find. When info is not NULL it is pointed at the
+// key's info. Do not delete result or info, shared pointers that are only
+// valid until the map next changes
+const char* ordered_key(struct vault_map* map, uint32_t position,
+                        uint8_t order, const struct key_info** info) {
+  if (map == NULL || position >= map->num_entries) {
+    return NULL;
+  }
+  struct record** index = map->by_key;
+  if (order == ORDER_SUFFIX) {
+    index = map->by_suffix;
+  } else if (order >= ORDER_TIME) {
+    index = VALUE_INDEX(map, order)->records;
+  }
+  if (index == NULL) {
+    return NULL;
+  }
+  const struct record* record = index[position];
+  if (info != NULL) {
+    *info = &record->info;
+  }
+  return record->key;
+}
+
+uint64_t map_image_size(struct vault_map* map) {
+  // Key bytes count the terminators, which the image leaves out
+  return IMAGE_HEADER_SIZE +
+         (uint64_t)map->num_entries * (IMAGE_ENTRY_SIZE - 1) + map->key_bytes;
+}
+
+// Image must hold map_image_size bytes
+void save_map(struct vault_map* map, uint8_t* image) {
+  memcpy(image, map->hash_key, crypto_shorthash_KEYBYTES);
+  image += crypto_shorthash_KEYBYTES;
+  memcpy(image, &map->size, 4);
+  memcpy(image + 4, &map->num_entries, 4);
+  image += 8;
+  for (uint32_t index = 0; index < map->size; ++index) {
+    const struct bucket* bucket = &map->buckets[index];
+    if (bucket->distance == 0) {
+      continue;
+    }
+    const struct record* record = bucket->record;
+    uint8_t key_length = strlen(record->key);
+    memcpy(image, &index, 4);
+    memcpy(image + 4, &bucket->hash, 4);
+    memcpy(image + 8, &record->info.m_time, 8);
+    memcpy(image + 16, &record->info.inode_loc, 4);
+    image[20] = record->info.type;
+    image[21] = key_length;
+    memcpy(image + IMAGE_ENTRY_SIZE, record->key, key_length);
+    image += IMAGE_ENTRY_SIZE + key_length;
+  }
+}
+
+// Returns NULL if the image is malformed or out of memory
+struct vault_map* load_map(const uint8_t* image, uint32_t len) {
+  uint32_t size;
+  uint32_t entries;
+  if (image == NULL || len < IMAGE_HEADER_SIZE) {
+    return NULL;
+  }
+  memcpy(&size, image + crypto_shorthash_KEYBYTES, 4);
+  memcpy(&entries, image + crypto_shorthash_KEYBYTES + 4, 4);
+  if (size < MIN_CAPACITY || size > (1u << 31) || (size & (size - 1)) ||
+      entries >= size) {
+    return NULL;
+  }
+
+  struct vault_map* map = calloc(1, sizeof(struct vault_map));
+  if (map == NULL) {
+    return NULL;
+  }
+  // Every record fits in one chunk, as none are larger than their entry in
+  // the image plus a record header and the rounding of its class
+  size_t records = (size_t)entries * (sizeof(struct record) + CLASS_SIZE) + len;
+  if (map_alloc_buckets(map, size) || map_add_chunk(map, records)) {
+    delete_map(map);
+    return NULL;
+  }
+  memcpy(map->hash_key, image, crypto_shorthash_KEYBYTES);
+
+  uint32_t mask = size - 1;
+  uint32_t offset = IMAGE_HEADER_SIZE;
+  for (uint32_t i = 0; i < entries; ++i) {
+    if (len - offset < IMAGE_ENTRY_SIZE) {
+      delete_map(map);
+      return NULL;
+    }
+    const uint8_t* entry = image + offset;
+    uint32_t index;
+    uint32_t hash;
+    uint8_t key_length = entry[21];
+    memcpy(&index, entry, 4);
+    memcpy(&hash, entry + 4, 4);
+    if (index >= size || map->buckets[index].distance ||
+        key_length >= BOX_KEY_SIZE ||
+        len - offset - IMAGE_ENTRY_SIZE < key_length) {
+      delete_map(map);
+      return NULL;
+    }
+
+    struct record* record = map_alloc_record(map, key_length);
+    if (record == NULL) {
+      delete_map(map);
+      return NULL;
+    }
+    memcpy(&record->info.m_time, entry + 8, 8);
+    memcpy(&record->info.inode_loc, entry + 16, 4);
+    record->info.type = entry[20];
+    memcpy(record->key, entry + IMAGE_ENTRY_SIZE, key_length);
+    record->key[key_length] = 0;
+
+    struct bucket* bucket = &map->buckets[index];
+    bucket->hash = hash;
+    bucket->distance = ((index - (hash & mask)) & mask) + 1;
+    bucket->record = record;
+    map->num_entries++;
+    map->type_counts[record->info.type]++;
+    map->key_bytes += key_length + 1;
+    offset += IMAGE_ENTRY_SIZE + key_length;
+  }
+
+  if (offset != len) {
+    delete_map(map);
+    return NULL;
+  }
+  return map;
+}
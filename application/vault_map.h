@@ -3,13 +3,20 @@
 
 #include <stdint.h>
 
-#define VERSION 1
+#define VERSION 3
+#define VERSION_NARROW_LOCS 2   // Loc slots with only 32-bit entry offsets
+#define VERSION_NO_DIRECTORY 1  // Loc slots without the key directory
 #define HASH_SIZE 32       // Okay to use small hash size as only for hash table
 #define MAX_PATH_LEN 4096  // Max path length for finding files
 #define BOX_KEY_SIZE 120   // Max length of key in vault
 #define MAX_USER_SIZE 80   // Max username size
 #define ENTRY_HEADER_SIZE 9
 
+#define ORDER_KEY 0     // Ordered index of the keys
+#define ORDER_SUFFIX 1  // Ordered by the keys read backwards
+#define ORDER_TIME 2    // Ordered by modification time and then key
+#define ORDER_TYPE 3    // Ordered by type and then key
+
 #define STATE_UNUSED 0
 #define STATE_ACTIVE ((1 << 16) | 1)
 #define STATE_DELETED 1
@@ -34,7 +41,7 @@ struct vault_map* init_map(uint32_t);
 
 void delete_map(struct vault_map*);
 
-uint8_t add_entry(struct vault_map*, const char*, struct key_info*);
+uint8_t add_entry(struct vault_map*, const char*, const struct key_info*);
 
 struct key_info* get_info(struct vault_map*, const char*);
 
@@ -44,4 +51,27 @@ char** get_keys(struct vault_map*);
 
 uint32_t num_keys(struct vault_map*);
 
+uint8_t find_prefix(struct vault_map*, const char*, uint32_t*, uint32_t*);
+
+uint8_t find_suffix(struct vault_map*, const char*, uint32_t*, uint32_t*);
+
+uint8_t find_range(struct vault_map*, const char*, const char*, uint32_t*,
+                   uint32_t*);
+
+uint8_t find_modified(struct vault_map*, uint64_t, uint32_t*, uint32_t*);
+
+uint8_t find_type(struct vault_map*, uint8_t, const char*, uint32_t*,
+                  uint32_t*);
+
+uint32_t count_type(struct vault_map*, uint8_t);
+
+const char* ordered_key(struct vault_map*, uint32_t, uint8_t,
+                        const struct key_info**);
+
+uint64_t map_image_size(struct vault_map*);
+
+void save_map(struct vault_map*, uint8_t*);
+
+struct vault_map* load_map(const uint8_t*, uint32_t);
+
 #endif